@@ -6,8 +6,15 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
-
-#include <sys/stat.h>
+#include "jobs.h"
+
+#include <sys/stat.h>
+
+//the sampling of the tracks uses SSE like the matrix functions of framework.cpp (define FRAMEWORK_NO_SIMD to disable it)
+#if !defined(FRAMEWORK_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define ANIMATION_SSE
+	#include <emmintrin.h>
+#endif
 
 Skeleton::Skeleton()
 {
@@ -40,7 +47,6 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, M
 	updateGlobalMatrices();
 
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
 	for (int i = 0; i < mesh->bones_info.size(); ++i)
 	{
 		BoneInfo& bone_info = mesh->bones_info[i];
@@ -48,6 +54,17 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, M
 	}
 }
 
+void Skeleton::computeMeshBoneIndices(Mesh* mesh, std::vector<int>& indices)
+{
+	assert(mesh);
+	indices.resize(mesh->bones_info.size());
+	for (int i = 0; i < (int)mesh->bones_info.size(); ++i)
+	{
+		auto it = bones_by_name.find(mesh->bones_info[i].name);
+		indices[i] = it == bones_by_name.end() ? -1 : it->second;
+	}
+}
+
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer)
 {
 	assert(a && b && result && "skeleton cannot be NULL");
@@ -79,7 +96,6 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	}
 
 	//blend bones locally
-	#pragma omp for  
 	for (int i = 0; i < result->num_bones; ++i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
@@ -87,7 +103,6 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
 			continue;
-		#pragma omp for  
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
 	}
@@ -161,24 +176,316 @@ void Skeleton::assignLayer( Bone* bone, uint8 layer )
 	}
 }
 
+float Animation::rotation_tolerance = 0.001f;
+float Animation::translation_tolerance = 0.01f;
+float Animation::scale_tolerance = 0.001f;
+
+namespace {
+
+	//splits a local matrix (scale, then rotation, then translation) in its parts
+	void decomposeMatrix(const Matrix44& m, Quaternion& q, Vector3& translation, Vector3& scale)
+	{
+		Vector3 rows[3] = { Vector3(m.m[0], m.m[1], m.m[2]), Vector3(m.m[4], m.m[5], m.m[6]), Vector3(m.m[8], m.m[9], m.m[10]) };
+		scale.set(rows[0].length(), rows[1].length(), rows[2].length());
+		if (rows[0].dot(rows[1].cross(rows[2])) < 0) //mirrored
+			scale.x = -scale.x;
+		float r[9];
+		for (int i = 0; i < 3; ++i)
+		{
+			Vector3 row = scale.v[i] != 0.0f ? rows[i] * (1.0f / scale.v[i]) : Vector3(i == 0, i == 1, i == 2);
+			r[i * 3] = row.x; r[i * 3 + 1] = row.y; r[i * 3 + 2] = row.z;
+		}
+		translation.set(m.m[12], m.m[13], m.m[14]);
+
+		//inverse of Quaternion::toMatrix
+		float trace = r[0] + r[4] + r[8];
+		if (trace > 0)
+		{
+			float root = sqrtf(trace + 1.0f);
+			q.w = 0.5f * root;
+			root = 0.5f / root;
+			q.x = (r[5] - r[7]) * root;
+			q.y = (r[6] - r[2]) * root;
+			q.z = (r[1] - r[3]) * root;
+		}
+		else
+		{
+			int i = 0;
+			if (r[4] > r[0]) i = 1;
+			if (r[8] > r[i * 3 + i]) i = 2;
+			int j = (i + 1) % 3;
+			int k = (i + 2) % 3;
+			float root = sqrtf(r[i * 3 + i] - r[j * 3 + j] - r[k * 3 + k] + 1.0f);
+			q.q[i] = 0.5f * root;
+			root = 0.5f / root;
+			q.w = (r[j * 3 + k] - r[k * 3 + j]) * root;
+			q.q[j] = (r[j * 3 + i] + r[i * 3 + j]) * root;
+			q.q[k] = (r[k * 3 + i] + r[i * 3 + k]) * root;
+		}
+		q.normalize();
+	}
+
+	const float SMALLEST_THREE_RANGE = 0.70710678f; //the three smallest components are in [-1/sqrt(2), 1/sqrt(2)]
+
+	uint16 quantizeUnit(float v) { return (uint16)clamp(floorf(v * 65535.0f + 0.5f), 0.0f, 65535.0f); }
+	float dequantizeUnit(uint16 v) { return v * (1.0f / 65535.0f); }
+
+	//smallest three: the largest component is dropped and rebuilt from the others (it is made positive, q and -q are the same rotation)
+	void encodeRotation(Quaternion q, sAnimKey& key)
+	{
+		int largest = 0;
+		for (int i = 1; i < 4; ++i)
+			if (fabsf(q.q[i]) > fabsf(q.q[largest]))
+				largest = i;
+		if (q.q[largest] < 0)
+			q = q * -1.0f;
+		for (int i = 0, j = 0; i < 4; ++i)
+			if (i != largest)
+				key.value[j++] = quantizeUnit((q.q[i] / SMALLEST_THREE_RANGE) * 0.5f + 0.5f);
+		key.frame = (key.frame & ANIM_KEY_FRAME_MASK) | (largest << 14);
+	}
+
+	inline void decodeRotation(const sAnimKey& key, float* q)
+	{
+		const float scale = 2.0f * SMALLEST_THREE_RANGE / 65535.0f;
+		float a = key.value[0] * scale - SMALLEST_THREE_RANGE;
+		float b = key.value[1] * scale - SMALLEST_THREE_RANGE;
+		float c = key.value[2] * scale - SMALLEST_THREE_RANGE;
+		float largest = sqrtf(std::max(0.0f, 1.0f - a * a - b * b - c * c));
+		switch (key.frame >> 14)
+		{
+			case 0: q[0] = largest; q[1] = a; q[2] = b; q[3] = c; break;
+			case 1: q[0] = a; q[1] = largest; q[2] = b; q[3] = c; break;
+			case 2: q[0] = a; q[1] = b; q[2] = largest; q[3] = c; break;
+			default: q[0] = a; q[1] = b; q[2] = c; q[3] = largest; break;
+		}
+	}
+
+	void encodeVector(const Vector3& v, const Vector3& min, const Vector3& size, sAnimKey& key)
+	{
+		for (int i = 0; i < 3; ++i)
+			key.value[i] = size.v[i] > 0 ? quantizeUnit((v.v[i] - min.v[i]) / size.v[i]) : 0;
+	}
+
+	inline Vector3 decodeVector(const sAnimKey& key, const Vector3& min, const Vector3& size)
+	{
+		return Vector3(min.x + dequantizeUnit(key.value[0]) * size.x, min.y + dequantizeUnit(key.value[1]) * size.y, min.z + dequantizeUnit(key.value[2]) * size.z);
+	}
+
+	//interpolates between the keys a and b of a translation or scale track
+	inline Vector3 sampleVector(const sAnimKey& a, const sAnimKey& b, float f, const Vector3& min, const Vector3& size)
+	{
+		if (&a == &b) //constant track
+			return decodeVector(a, min, size);
+		Vector3 va = decodeVector(a, min, size);
+		Vector3 vb = decodeVector(b, min, size);
+		return Vector3(va.x + (vb.x - va.x) * f, va.y + (vb.y - va.y) * f, va.z + (vb.z - va.z) * f);
+	}
+
+	//normalized lerp taking the shortest path
+	inline void nlerp(const float* a, const float* b, float f, float* result)
+	{
+		float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+		float fb = dot < 0 ? -f : f;
+		float fa = 1.0f - f;
+		float length = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			result[i] = a[i] * fa + b[i] * fb;
+			length += result[i] * result[i];
+		}
+		float inv_length = 1.0f / sqrtf(length);
+		for (int i = 0; i < 4; ++i)
+			result[i] *= inv_length;
+	}
+
+	bool rotationFits(const float* a, const float* b)
+	{
+		return fabsf(a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3]) >= cosf(Animation::rotation_tolerance * 0.5f);
+	}
+
+	bool vectorFits(const Vector3& a, const Vector3& b, float tolerance)
+	{
+		return fabsf(a.x - b.x) <= tolerance && fabsf(a.y - b.y) <= tolerance && fabsf(a.z - b.z) <= tolerance;
+	}
+
+	//picks the samples that must be keys: from every key it jumps to the furthest sample that still
+	//reconstructs the samples in between within the tolerance. fits(a, b, j) checks sample j interpolated from keys a and b
+	template<typename F> void reduceTrack(int num_samples, bool constant, F fits, std::vector<int>& result)
+	{
+		result.clear();
+		result.push_back(0);
+		if (constant)
+			return;
+		int a = 0;
+		while (a < num_samples - 1)
+		{
+			int b = a + 1;
+			while (b + 1 < num_samples)
+			{
+				bool ok = true;
+				for (int j = a + 1; j <= b && ok; ++j)
+					ok = fits(a, b + 1, j);
+				if (!ok)
+					break;
+				b++;
+			}
+			result.push_back(b);
+			a = b;
+		}
+	}
+
+#ifdef ANIMATION_SSE
+	//the key of every track of a bone at the sample and the next one (the first one after the last): result[track] and result[4 + track]
+	//from their entries in a row of the key index, sample_mask has the bits of the samples of the row up to the sample
+	inline void findKeys(const sAnimBoneTracks& track, const uint32* entries, __m128i sample_mask, uint32* result)
+	{
+		__m128i entry = _mm_loadu_si128((const __m128i*)entries); //the 4th one is not used
+		__m128i row_bits = _mm_set1_epi32(0xFE);
+		__m128i one = _mm_set1_epi32(1);
+
+		//the keys in the samples of the row up to the sample, bit count of 8 bits
+		__m128i bits = _mm_and_si128(_mm_and_si128(entry, sample_mask), row_bits);
+		bits = _mm_sub_epi32(bits, _mm_and_si128(_mm_srli_epi32(bits, 1), _mm_set1_epi32(0x55)));
+		bits = _mm_add_epi32(_mm_and_si128(bits, _mm_set1_epi32(0x33)), _mm_and_si128(_mm_srli_epi32(bits, 2), _mm_set1_epi32(0x33)));
+		bits = _mm_and_si128(_mm_add_epi32(bits, _mm_srli_epi32(bits, 4)), _mm_set1_epi32(0x0F));
+		__m128i key = _mm_add_epi32(_mm_srli_epi32(entry, 8), bits);
+
+		//the last key of the track: no keys after the row nor in the rest of it
+		__m128i after = _mm_and_si128(_mm_andnot_si128(sample_mask, entry), row_bits);
+		__m128i last = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(entry, one), one), _mm_cmpeq_epi32(after, _mm_setzero_si128()));
+		__m128i first = _mm_loadu_si128((const __m128i*)track.first_key); //first_key and num_keys, only the first 3 are used
+		__m128i next = _mm_or_si128(_mm_and_si128(last, first), _mm_andnot_si128(last, _mm_add_epi32(key, one)));
+		_mm_storeu_si128((__m128i*)result, key);
+		_mm_storeu_si128((__m128i*)(result + 4), next);
+	}
+
+	//the same key of 4 bones transposed, every register has one field of the 4 keys
+	inline void loadKeys(const sAnimKey* keys, const uint32* bone_keys, __m128i& frame, __m128* values)
+	{
+		__m128 k01 = _mm_castsi128_ps(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(keys + bone_keys[0])), _mm_loadl_epi64((const __m128i*)(keys + bone_keys[8]))));
+		__m128 k23 = _mm_castsi128_ps(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(keys + bone_keys[16])), _mm_loadl_epi64((const __m128i*)(keys + bone_keys[24]))));
+		__m128i frame_x = _mm_castps_si128(_mm_shuffle_ps(k01, k23, _MM_SHUFFLE(2, 0, 2, 0))); //the 16 bit fields in pairs
+		__m128i yz = _mm_castps_si128(_mm_shuffle_ps(k01, k23, _MM_SHUFFLE(3, 1, 3, 1)));
+		__m128i low = _mm_set1_epi32(0xFFFF);
+		frame = _mm_and_si128(frame_x, low);
+		values[0] = _mm_cvtepi32_ps(_mm_srli_epi32(frame_x, 16));
+		values[1] = _mm_cvtepi32_ps(_mm_and_si128(yz, low));
+		values[2] = _mm_cvtepi32_ps(_mm_srli_epi32(yz, 16));
+	}
+
+	inline __m128 select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+	//same as decodeRotation with 4 keys
+	inline void decodeRotations(__m128i frame, const __m128* values, __m128* q)
+	{
+		__m128 scale = _mm_set1_ps(2.0f * SMALLEST_THREE_RANGE / 65535.0f);
+		__m128 range = _mm_set1_ps(SMALLEST_THREE_RANGE);
+		__m128 a = _mm_sub_ps(_mm_mul_ps(values[0], scale), range);
+		__m128 b = _mm_sub_ps(_mm_mul_ps(values[1], scale), range);
+		__m128 c = _mm_sub_ps(_mm_mul_ps(values[2], scale), range);
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)), _mm_mul_ps(c, c));
+		__m128 largest = _mm_sqrt_ps(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_set1_ps(1.0f), length2)));
+		__m128i dropped = _mm_srli_epi32(frame, 14);
+		__m128 is0 = _mm_castsi128_ps(_mm_cmpeq_epi32(dropped, _mm_setzero_si128()));
+		__m128 is1 = _mm_castsi128_ps(_mm_cmpeq_epi32(dropped, _mm_set1_epi32(1)));
+		__m128 is2 = _mm_castsi128_ps(_mm_cmpeq_epi32(dropped, _mm_set1_epi32(2)));
+		__m128 is3 = _mm_castsi128_ps(_mm_cmpeq_epi32(dropped, _mm_set1_epi32(3)));
+		q[0] = select(is0, largest, a);
+		q[1] = select(is0, a, select(is1, largest, b));
+		q[2] = select(is2, largest, select(is3, c, b));
+		q[3] = select(is3, largest, c);
+	}
+
+	//from the keys a to the keys b of 4 tracks, b is before a when it is the first key after the last one
+	inline __m128 keyFactor(__m128i frame_a, __m128i frame_b, __m128 frame, __m128i num_samples)
+	{
+		__m128i mask = _mm_set1_epi32(ANIM_KEY_FRAME_MASK);
+		frame_a = _mm_and_si128(frame_a, mask);
+		frame_b = _mm_and_si128(frame_b, mask);
+		__m128i after = _mm_cmpgt_epi32(frame_b, frame_a);
+		frame_b = _mm_or_si128(_mm_and_si128(after, frame_b), _mm_andnot_si128(after, num_samples));
+		__m128 a = _mm_cvtepi32_ps(frame_a);
+		return _mm_div_ps(_mm_sub_ps(frame, a), _mm_sub_ps(_mm_cvtepi32_ps(frame_b), a));
+	}
+
+	//one row of the 4 matrices, the registers have one column of the 4 bones
+	inline void storeRow(__m128 x, __m128 y, __m128 z, __m128 w, Matrix44* const* models, int row)
+	{
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_storeu_ps(models[0]->m + row * 4, x);
+		_mm_storeu_ps(models[1]->m + row * 4, y);
+		_mm_storeu_ps(models[2]->m + row * 4, z);
+		_mm_storeu_ps(models[3]->m + row * 4, w);
+	}
+#else
+	inline uint32 countBits8(uint32 v)
+	{
+		v = v - ((v >> 1) & 0x55);
+		v = (v & 0x33) + ((v >> 2) & 0x33);
+		return (v + (v >> 4)) & 0x0F;
+	}
+
+	//same as the SSE one
+	inline void findKeys(const sAnimBoneTracks& track, const uint32* entries, uint32 sample_mask, uint32* result)
+	{
+		for (int type = sAnimBoneTracks::ROTATION; type <= sAnimBoneTracks::SCALE; ++type)
+		{
+			uint32 entry = entries[type];
+			result[type] = (entry >> 8) + countBits8(entry & sample_mask & 0xFE);
+			bool last = (entry & 1) && !(entry & ~sample_mask & 0xFE);
+			result[4 + type] = last ? track.first_key[type] : result[type] + 1;
+		}
+	}
+
+	inline float keyFactor(const sAnimKey& a, const sAnimKey& b, float frame, int num_samples)
+	{
+		int frame_a = a.frame & ANIM_KEY_FRAME_MASK;
+		int frame_b = b.frame & ANIM_KEY_FRAME_MASK;
+		if (frame_b <= frame_a) //the first key after the last one
+			frame_b = num_samples;
+		return (frame - frame_a) / (frame_b - frame_a);
+	}
+
+	//same as Quaternion::toMatrix with the scale and translation, the normalization of q goes in the factor 2 / length^2
+	inline void composeMatrix(const float* q, const float* translation, const float* scale, Matrix44& m)
+	{
+		float s = 2.0f / (q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		float x2 = q[0] * s, y2 = q[1] * s, z2 = q[2] * s;
+		float xx = q[0] * x2, xy = q[0] * y2, xz = q[0] * z2;
+		float yy = q[1] * y2, yz = q[1] * z2, zz = q[2] * z2;
+		float wx = q[3] * x2, wy = q[3] * y2, wz = q[3] * z2;
+		m.m[0] = (1 - yy - zz) * scale[0]; m.m[1] = (xy + wz) * scale[0]; m.m[2] = (xz - wy) * scale[0]; m.m[3] = 0;
+		m.m[4] = (xy - wz) * scale[1]; m.m[5] = (1 - xx - zz) * scale[1]; m.m[6] = (yz + wx) * scale[1]; m.m[7] = 0;
+		m.m[8] = (xz + wy) * scale[2]; m.m[9] = (yz - wx) * scale[2]; m.m[10] = (1 - xx - yy) * scale[2]; m.m[11] = 0;
+		m.m[12] = translation[0]; m.m[13] = translation[1]; m.m[14] = translation[2]; m.m[15] = 1;
+	}
+#endif
+}
+
 Animation::Animation()
 {
 	duration = 0.0f;
-	keyframes = NULL;
+	tracks = NULL;
+	keys = NULL;
+	key_index = NULL;
+	num_keys = 0;
 	num_keyframes = 0;
 	num_animated_bones = 0;
 }
 
 Animation::~Animation()
 {
-	if (keyframes)
-		delete[] keyframes;
+	if (tracks)
+		delete[] tracks;
+	if (keys)
+		delete[] keys;
+	if (key_index)
+		delete[] key_index;
 }
 
-void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
+float Animation::getFrame(float t, bool loop, bool interpolate) const
 {
-	assert(keyframes && skeleton.num_bones);
-
 	if (loop)
 	{
 		t = fmod(t, duration);
@@ -187,36 +494,426 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	}
 	else
 		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
-	float v = samples_per_second * t;
-	int index = clamp(floor(v), 0, num_keyframes - 1);
-	int index2 = index + 1;
-	if (index2 >= num_keyframes)
-		index2 = 0;
-	float f = v - floor(v);
-
-	Matrix44* k = keyframes + index * num_animated_bones;
-	Matrix44* k2 = keyframes + index2 * num_animated_bones;
-
-	//compute local bones
-	#pragma omp for  
+	float v = clamp(samples_per_second * t, 0.0f, num_keyframes - 0.0001f);
+	if (!interpolate)
+		v = floor(v);
+	return v;
+}
+
+void Animation::sampleBones(const sAnimBoneTracks* const* bone_tracks, const uint32* bone_keys, float v, Matrix44* const* models) const
+{
+#ifdef ANIMATION_SSE
+	__m128 frame = _mm_set1_ps(v);
+	__m128i num_samples = _mm_set1_epi32(num_keyframes);
+	__m128i frame_a, frame_b;
+	__m128 values[3], next[3];
+
+	//nlerp by the shortest path, normalized below
+	__m128 qa[4], qb[4], q[4];
+	loadKeys(keys, bone_keys + sAnimBoneTracks::ROTATION, frame_a, values);
+	decodeRotations(frame_a, values, qa);
+	loadKeys(keys, bone_keys + 4 + sAnimBoneTracks::ROTATION, frame_b, values);
+	decodeRotations(frame_b, values, qb);
+	__m128 f = keyFactor(frame_a, frame_b, frame, num_samples);
+	__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qa[0], qb[0]), _mm_mul_ps(qa[1], qb[1])), _mm_add_ps(_mm_mul_ps(qa[2], qb[2]), _mm_mul_ps(qa[3], qb[3])));
+	__m128 fa = _mm_sub_ps(_mm_set1_ps(1.0f), f);
+	__m128 fb = _mm_xor_ps(f, _mm_and_ps(_mm_cmplt_ps(dot, _mm_setzero_ps()), _mm_set1_ps(-0.0f)));
+	for (int i = 0; i < 4; ++i)
+		q[i] = _mm_add_ps(_mm_mul_ps(qa[i], fa), _mm_mul_ps(qb[i], fb));
+
+	//translation and scale, the lerp goes before the dequantization
+	__m128 vectors[2][3];
+	__m128 unit = _mm_set1_ps(1.0f / 65535.0f);
+	for (int type = sAnimBoneTracks::TRANSLATION; type <= sAnimBoneTracks::SCALE; ++type)
+	{
+		loadKeys(keys, bone_keys + type, frame_a, values);
+		loadKeys(keys, bone_keys + 4 + type, frame_b, next);
+		f = _mm_mul_ps(keyFactor(frame_a, frame_b, frame, num_samples), unit);
+		//the ranges are read from the float before them so it never reads past the end of the tracks, xyz end in the registers 1 to 3
+		__m128 min[4], size[4];
+		for (int j = 0; j < 4; ++j)
+		{
+			min[j] = _mm_loadu_ps(&bone_tracks[j]->range_min[type].x - 1);
+			size[j] = _mm_loadu_ps(&bone_tracks[j]->range_size[type].x - 1);
+		}
+		_MM_TRANSPOSE4_PS(min[0], min[1], min[2], min[3]);
+		_MM_TRANSPOSE4_PS(size[0], size[1], size[2], size[3]);
+		for (int i = 0; i < 3; ++i)
+		{
+			__m128 value = _mm_add_ps(_mm_mul_ps(values[i], unit), _mm_mul_ps(_mm_sub_ps(next[i], values[i]), f));
+			vectors[type - 1][i] = _mm_add_ps(min[i + 1], _mm_mul_ps(value, size[i + 1]));
+		}
+	}
+	const __m128* t = vectors[0];
+	const __m128* s = vectors[1];
+
+	//same as Quaternion::toMatrix with the scale, the normalization goes in the factor 2 / length^2
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(q[0], q[0]), _mm_mul_ps(q[1], q[1])), _mm_add_ps(_mm_mul_ps(q[2], q[2]), _mm_mul_ps(q[3], q[3])));
+	__m128 factor = _mm_div_ps(_mm_set1_ps(2.0f), length2);
+	__m128 x2 = _mm_mul_ps(q[0], factor), y2 = _mm_mul_ps(q[1], factor), z2 = _mm_mul_ps(q[2], factor);
+	__m128 xx = _mm_mul_ps(q[0], x2), xy = _mm_mul_ps(q[0], y2), xz = _mm_mul_ps(q[0], z2);
+	__m128 yy = _mm_mul_ps(q[1], y2), yz = _mm_mul_ps(q[1], z2), zz = _mm_mul_ps(q[2], z2);
+	__m128 wx = _mm_mul_ps(q[3], x2), wy = _mm_mul_ps(q[3], y2), wz = _mm_mul_ps(q[3], z2);
+	storeRow(_mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, yy), zz), s[0]), _mm_mul_ps(_mm_add_ps(xy, wz), s[0]), _mm_mul_ps(_mm_sub_ps(xz, wy), s[0]), zero, models, 0);
+	storeRow(_mm_mul_ps(_mm_sub_ps(xy, wz), s[1]), _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, xx), zz), s[1]), _mm_mul_ps(_mm_add_ps(yz, wx), s[1]), zero, models, 1);
+	storeRow(_mm_mul_ps(_mm_add_ps(xz, wy), s[2]), _mm_mul_ps(_mm_sub_ps(yz, wx), s[2]), _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, xx), yy), s[2]), zero, models, 2);
+	storeRow(t[0], t[1], t[2], one, models, 3);
+#else
+	for (int j = 0; j < 4; ++j)
+	{
+		const sAnimBoneTracks& track = *bone_tracks[j];
+		const uint32* key = bone_keys + j * 8;
+		const sAnimKey& rotation = keys[key[sAnimBoneTracks::ROTATION]];
+		const sAnimKey& next_rotation = keys[key[4 + sAnimBoneTracks::ROTATION]];
+		float qa[4], qb[4], q[4];
+		decodeRotation(rotation, qa);
+		decodeRotation(next_rotation, qb);
+		nlerp(qa, qb, keyFactor(rotation, next_rotation, v, num_keyframes), q);
+		Vector3 vectors[2];
+		for (int type = sAnimBoneTracks::TRANSLATION; type <= sAnimBoneTracks::SCALE; ++type)
+		{
+			const sAnimKey& a = keys[key[type]];
+			const sAnimKey& b = keys[key[4 + type]];
+			vectors[type - 1] = sampleVector(a, b, keyFactor(a, b, v, num_keyframes), track.range_min[type], track.range_size[type]);
+		}
+		composeMatrix(q, vectors[0].v, vectors[1].v, *models[j]);
+	}
+#endif
+}
+
+void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
+{
+	assert(tracks && key_index && skeleton.num_bones);
+
+	float v = getFrame(t, loop, interpolate);
+	int sample = (int)v;
+	const uint32* row = key_index + (sample / ANIM_KEY_INDEX_STEP) * num_animated_bones * 3;
+#ifdef ANIMATION_SSE
+	__m128i sample_mask = _mm_set1_epi32((2 << (sample % ANIM_KEY_INDEX_STEP)) - 1);
+#else
+	uint32 sample_mask = (2u << (sample % ANIM_KEY_INDEX_STEP)) - 1;
+#endif
+
+	//compute local bones, 4 at a time
+	const sAnimBoneTracks* bone_tracks[4];
+	uint32 bone_keys[4 * 8];
+	Matrix44* models[4];
+	int count = 0;
 	for (int i = 0; i < num_animated_bones; ++i)
 	{
-		int bone_index = bones_map[i];
-		Skeleton::Bone& bone = skeleton.bones[bone_index];
+		Skeleton::Bone& bone = skeleton.bones[ (uint8)bones_map[i] ];
 		if (layers != 0xFF && !(bone.layer & layers))
 			continue;
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		bone_tracks[count] = tracks + i;
+		findKeys(tracks[i], row + i * 3, sample_mask, bone_keys + count * 8);
+		models[count] = &bone.model;
+		if (++count == 4)
+		{
+			sampleBones(bone_tracks, bone_keys, v, models);
+			count = 0;
+		}
+	}
+	if (count)
+	{
+		for (int j = count; j < 4; ++j) //the first one again
+		{
+			bone_tracks[j] = bone_tracks[0];
+			memcpy(bone_keys + j * 8, bone_keys, sizeof(uint32) * 8);
+			models[j] = models[0];
+		}
+		sampleBones(bone_tracks, bone_keys, v, models);
 	}
 
 	skeleton.updateGlobalMatrices();
 }
 
+void Animation::samplePose(float t, Matrix44* local_matrices, bool loop, bool interpolate, uint8 layers) const
+{
+	assert(tracks && key_index && local_matrices);
+
+	float v = getFrame(t, loop, interpolate);
+	int sample = (int)v;
+	const uint32* row = key_index + (sample / ANIM_KEY_INDEX_STEP) * num_animated_bones * 3;
+#ifdef ANIMATION_SSE
+	__m128i sample_mask = _mm_set1_epi32((2 << (sample % ANIM_KEY_INDEX_STEP)) - 1);
+#else
+	uint32 sample_mask = (2u << (sample % ANIM_KEY_INDEX_STEP)) - 1;
+#endif
+
+	const sAnimBoneTracks* bone_tracks[4];
+	uint32 bone_keys[4 * 8];
+	Matrix44* models[4];
+	int count = 0;
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		int bone_index = (uint8)bones_map[i];
+		if (layers != 0xFF && !(skeleton.bones[bone_index].layer & layers))
+			continue;
+		bone_tracks[count] = tracks + i;
+		findKeys(tracks[i], row + i * 3, sample_mask, bone_keys + count * 8);
+		models[count] = local_matrices + bone_index;
+		if (++count == 4)
+		{
+			sampleBones(bone_tracks, bone_keys, v, models);
+			count = 0;
+		}
+	}
+	if (count)
+	{
+		for (int j = count; j < 4; ++j) //the first one again
+		{
+			bone_tracks[j] = bone_tracks[0];
+			memcpy(bone_keys + j * 8, bone_keys, sizeof(uint32) * 8);
+			models[j] = models[0];
+		}
+		sampleBones(bone_tracks, bone_keys, v, models);
+	}
+}
+
+void sSkeletonPose::setRestPose(const Skeleton& skeleton)
+{
+	local.resize(skeleton.num_bones);
+	global.resize(skeleton.num_bones);
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		local[i] = skeleton.bones[i].model;
+}
+
+void sSkeletonPose::updateGlobalMatrices(const Skeleton& skeleton)
+{
+	assert((int)local.size() == skeleton.num_bones);
+	global.resize(local.size());
+	global[0] = local[0];
+	//order dependant
+	for (int i = 1; i < (int)local.size(); ++i)
+		global[i] = local[i] * global[ skeleton.bones[i].parent ];
+}
+
+void blendPoses(const sSkeletonPose& a, const sSkeletonPose& b, float w, sSkeletonPose& result, const Skeleton& skeleton, uint8 layer)
+{
+	assert(a.local.size() == b.local.size() && "poses must contain the same number of bones");
+
+	w = clamp(w, 0.0f, 1.0f);//safety
+	int num_bones = (int)a.local.size();
+	result.local.resize(num_bones);
+
+	for (int i = 0; i < num_bones; ++i)
+	{
+		if (layer != 0xFF && !(skeleton.bones[i].layer & layer))
+		{
+			if (&result != &a)
+				result.local[i] = a.local[i];
+			continue;
+		}
+		const Matrix44& boneA = a.local[i];
+		const Matrix44& boneB = b.local[i];
+		Matrix44& bone = result.local[i];
+		for (int j = 0; j < 16; ++j)
+			bone.m[j] = lerp(boneA.m[j], boneB.m[j], w);
+	}
+}
+
+void sMeshSkin::create(Skeleton& skeleton, Mesh* mesh)
+{
+	assert(mesh);
+	skeleton.computeMeshBoneIndices(mesh, bones);
+	bind_matrices.resize(mesh->bones_info.size());
+	for (int i = 0; i < (int)mesh->bones_info.size(); ++i)
+		bind_matrices[i] = mesh->bind_matrix * mesh->bones_info[i].bind_pose;
+}
+
+void sMeshSkin::computeFinalBoneMatrices(const sSkeletonPose& pose, Matrix44* bone_matrices) const
+{
+	for (int i = 0; i < (int)bones.size(); ++i)
+	{
+		int bone_index = bones[i];
+		bone_matrices[i] = bone_index == -1 ? bind_matrices[i] : bind_matrices[i] * pose.global[bone_index];
+	}
+}
+
+namespace {
+
+	void evaluateInstance(sAnimationInstance& instance, const sMeshSkin& skin)
+	{
+		assert(instance.animation && "instance without animation");
+		const Animation* anim = instance.animation;
+		const Skeleton& skeleton = anim->skeleton;
+
+		//bones without tracks keep the rest pose
+		if ((int)instance.pose.local.size() != skeleton.num_bones)
+			instance.pose.setRestPose(skeleton);
+		anim->samplePose(instance.time, instance.pose.local.data(), instance.loop);
+
+		const Animation* blend = instance.blend_animation;
+		if (blend && instance.blend_weight > 0.0f)
+		{
+			assert(blend->skeleton.num_bones == skeleton.num_bones && "skeleton must contain the same number of bones");
+			if ((int)instance.blend_pose.local.size() != skeleton.num_bones)
+				instance.blend_pose.setRestPose(blend->skeleton);
+			blend->samplePose(instance.blend_time, instance.blend_pose.local.data(), instance.loop, true, instance.blend_layers);
+			blendPoses(instance.pose, instance.blend_pose, instance.blend_weight, instance.pose, skeleton, instance.blend_layers);
+		}
+
+		instance.pose.updateGlobalMatrices(skeleton);
+
+		instance.bone_matrices.resize(skin.getNumBones());
+		if (skin.getNumBones())
+			skin.computeFinalBoneMatrices(instance.pose, &instance.bone_matrices[0]);
+	}
+}
+
+void evaluateAnimationInstances(std::vector<sAnimationInstance>& instances, Mesh* mesh)
+{
+	if (instances.empty())
+		return;
+
+	//the mapping between the mesh and the skeleton is the same for all the instances
+	sMeshSkin skin;
+	if (mesh)
+	{
+		assert(instances[0].animation && "instance without animation");
+		skin.create(instances[0].animation->skeleton, mesh);
+	}
+
+	//a few instances per job, one is too little work for the cost of taking it
+	int num_instances = (int)instances.size();
+	int num_jobs = (num_instances + ANIM_INSTANCES_PER_JOB - 1) / ANIM_INSTANCES_PER_JOB;
+	JobSystem::parallelFor(num_jobs, [&](int job) {
+		int end = std::min(num_instances, (job + 1) * ANIM_INSTANCES_PER_JOB);
+		for (int i = job * ANIM_INSTANCES_PER_JOB; i < end; ++i)
+			evaluateInstance(instances[i], skin);
+	});
+}
+
 
 void Animation::operator = (Animation* anim)
 {
 	memcpy(this, anim, sizeof(Animation));
-	this->keyframes = NULL;
+	this->tracks = NULL;
+	this->keys = NULL;
+	this->key_index = NULL;
+}
+
+void Animation::compressKeyframes(const Matrix44* keyframes)
+{
+	assert(num_keyframes <= ANIM_KEY_FRAME_MASK + 1 && "too many samples for the key format");
+	std::vector<sAnimBoneTracks> new_tracks(num_animated_bones);
+	std::vector<sAnimKey> new_keys;
+
+	std::vector<Quaternion> rotations(num_keyframes);
+	std::vector<Vector3> vectors[3];
+	vectors[sAnimBoneTracks::TRANSLATION].resize(num_keyframes);
+	vectors[sAnimBoneTracks::SCALE].resize(num_keyframes);
+	std::vector<sAnimKey> quantized(num_keyframes);
+	std::vector<int> selected;
+
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		sAnimBoneTracks& track = new_tracks[i];
+		for (int k = 0; k < num_keyframes; ++k)
+			decomposeMatrix(keyframes[k * num_animated_bones + i], rotations[k], vectors[sAnimBoneTracks::TRANSLATION][k], vectors[sAnimBoneTracks::SCALE][k]);
+
+		//rotation
+		bool constant = true;
+		float qa[4], qb[4], q[4];
+		for (int k = 0; k < num_keyframes; ++k)
+		{
+			quantized[k].frame = k;
+			encodeRotation(rotations[k], quantized[k]);
+			decodeRotation(quantized[0], qa);
+			constant = constant && rotationFits(qa, rotations[k].q);
+		}
+		reduceTrack(num_keyframes, constant, [&](int a, int b, int j) {
+			decodeRotation(quantized[a], qa);
+			decodeRotation(quantized[b], qb);
+			nlerp(qa, qb, (j - a) / (float)(b - a), q);
+			return rotationFits(q, rotations[j].q);
+		}, selected);
+		track.first_key[sAnimBoneTracks::ROTATION] = (uint32)new_keys.size();
+		track.num_keys[sAnimBoneTracks::ROTATION] = (uint16)selected.size();
+		for (int k : selected)
+			new_keys.push_back(quantized[k]);
+
+		//translation and scale
+		for (int type = sAnimBoneTracks::TRANSLATION; type <= sAnimBoneTracks::SCALE; ++type)
+		{
+			std::vector<Vector3>& values = vectors[type];
+			float tolerance = type == sAnimBoneTracks::TRANSLATION ? translation_tolerance : scale_tolerance;
+			Vector3 min = values[0], max = values[0];
+			for (int k = 0; k < num_keyframes; ++k)
+			{
+				min.setMin(values[k]);
+				max.setMax(values[k]);
+			}
+			track.range_min[type] = min;
+			track.range_size[type] = max - min;
+
+			constant = true;
+			for (int k = 0; k < num_keyframes; ++k)
+			{
+				quantized[k].frame = k;
+				encodeVector(values[k], min, max - min, quantized[k]);
+				constant = constant && vectorFits(values[0], values[k], tolerance);
+			}
+			reduceTrack(num_keyframes, constant, [&](int a, int b, int j) {
+				Vector3 value = sampleVector(quantized[a], quantized[b], (j - a) / (float)(b - a), min, max - min);
+				return vectorFits(value, values[j], tolerance);
+			}, selected);
+			track.first_key[type] = (uint32)new_keys.size();
+			track.num_keys[type] = (uint16)selected.size();
+			for (int k : selected)
+				new_keys.push_back(quantized[k]);
+		}
+	}
+
+	if (tracks)
+		delete[] tracks;
+	if (keys)
+		delete[] keys;
+	tracks = new sAnimBoneTracks[num_animated_bones];
+	std::copy(new_tracks.begin(), new_tracks.end(), tracks);
+	num_keys = (int)new_keys.size();
+	keys = new sAnimKey[num_keys];
+	std::copy(new_keys.begin(), new_keys.end(), keys);
+	buildKeyIndex();
+}
+
+void Animation::buildKeyIndex()
+{
+	//one entry every ANIM_KEY_INDEX_STEP samples, the keys of the samples in between are counted from its bits so the sampling never searches
+	assert(num_keys < (1 << 24) && "too many keys for the key index");
+	if (key_index)
+		delete[] key_index;
+	int num_rows = (num_keyframes + ANIM_KEY_INDEX_STEP - 1) / ANIM_KEY_INDEX_STEP;
+	key_index = new uint32[num_rows * num_animated_bones * 3 + 1]; //the SSE sampling reads the entries of a bone 4 at a time
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		const sAnimBoneTracks& track = tracks[i];
+		for (int type = sAnimBoneTracks::ROTATION; type <= sAnimBoneTracks::SCALE; ++type)
+		{
+			const sAnimKey* first = keys + track.first_key[type];
+			for (int row = 0, k = 0; row < num_rows; ++row)
+			{
+				int start = row * ANIM_KEY_INDEX_STEP;
+				while (k + 1 < track.num_keys[type] && (first[k + 1].frame & ANIM_KEY_FRAME_MASK) <= start)
+					k++;
+				uint32 bits = 0;
+				int j = k + 1;
+				for (; j < track.num_keys[type] && (first[j].frame & ANIM_KEY_FRAME_MASK) < start + ANIM_KEY_INDEX_STEP; ++j)
+					bits |= 1u << ((first[j].frame & ANIM_KEY_FRAME_MASK) - start);
+				if (j == track.num_keys[type])
+					bits |= 1;
+				key_index[(row * num_animated_bones + i) * 3 + type] = ((track.first_key[type] + k) << 8) | bits;
+			}
+		}
+	}
+}
+
+size_t Animation::getMemoryUsed() const
+{
+	int num_rows = (num_keyframes + ANIM_KEY_INDEX_STEP - 1) / ANIM_KEY_INDEX_STEP;
+	return sizeof(sAnimBoneTracks) * num_animated_bones + sizeof(sAnimKey) * num_keys + sizeof(uint32) * num_rows * num_animated_bones * 3;
 }
 
 bool Animation::load(const char* filename)
@@ -251,7 +948,7 @@ bool Animation::load(const char* filename)
 		}
 	}
 
-	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Keys: " << num_keys << " (" << getMemoryUsed() / 1024 << "KB, " << (sizeof(Matrix44) * num_keyframes * num_animated_bones) / 1024 << "KB as matrices) Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	return true;
 }
 
@@ -263,6 +960,7 @@ struct sAnimHeader {
 	int num_animated_bones;
 	int num_keyframes;
 	int num_bones;
+	int num_keys;
 	int8 bones_map[128];
 	char extra[16];
 };
@@ -290,6 +988,7 @@ bool Animation::writeABIN(const char* filename)
 	header.num_animated_bones = num_animated_bones;
 	header.num_keyframes = num_keyframes;
 	header.num_bones = skeleton.num_bones;
+	header.num_keys = num_keys;
 	memcpy( header.bones_map, bones_map, sizeof(bones_map)  );
 
 	//write header
@@ -298,8 +997,9 @@ bool Animation::writeABIN(const char* filename)
 	//write skeleton
 	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write tracks and keys
+	fwrite((void*)tracks, sizeof(sAnimBoneTracks) * num_animated_bones, 1, f);
+	fwrite((void*)keys, sizeof(sAnimKey) * num_keys, 1, f);
 
 	fclose(f);
 	return true;
@@ -346,17 +1046,22 @@ bool Animation::loadABIN(const char* filename)
 	num_animated_bones = header.num_animated_bones;
 	num_keyframes = header.num_keyframes;
 	skeleton.num_bones = header.num_bones;
+	num_keys = header.num_keys;
 	memcpy(bones_map, header.bones_map, sizeof(bones_map));
 
 	//extract skeleton
 	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
 	pos += sizeof(skeleton.bones);
 
-	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+	//extract tracks and keys
+	assert(tracks == NULL && keys == NULL);
+	tracks = new sAnimBoneTracks[num_animated_bones];
+	memcpy( tracks, pos, sizeof(sAnimBoneTracks) * num_animated_bones );
+	pos += sizeof(sAnimBoneTracks) * num_animated_bones;
+	keys = new sAnimKey[num_keys];
+	memcpy( keys, pos, sizeof(sAnimKey) * num_keys );
+	pos += sizeof(sAnimKey) * num_keys;
+	buildKeyIndex();
 
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
@@ -396,6 +1101,7 @@ bool Animation::loadSKANIM(const char* filename)
 	num_animated_bones = 0;
 
 	int current_keyframe = 0;
+	Matrix44* keyframes = NULL; //uncompressed, only while parsing
 
 	while (*pos)
 	{
@@ -468,6 +1174,14 @@ bool Animation::loadSKANIM(const char* filename)
 		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
 	}
 
+	if (!keyframes)
+	{
+		delete[] data;
+		return false;
+	}
+	compressKeyframes(keyframes);
+	delete[] keyframes;
+
 	assignTime(0); //reset pose
 
 	delete[] data;
@@ -9,7 +9,7 @@
 
 class Camera;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 4
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -54,12 +54,31 @@ public:
 
 	void renderSkeleton(Camera* camera, Matrix44 model, Vector4 color = Vector4(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, Mesh* mesh); //fills the std::vector with the bones ready for the shader
+	void computeMeshBoneIndices(Mesh* mesh, std::vector<int>& indices); //index of the bone for every bone of the mesh (-1 if it is not in the skeleton)
 	void assignLayer(Bone* bone, uint8 layer); //assigns a layer to a node and all its children
 };
 
 //this function takes skeleton A and blends it with skeleton B and stores the result in result
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer = 0xFF);
 
+#define ANIM_KEY_FRAME_MASK 0x3FFF //the rotation keys store the dropped component in the 2 higher bits of the frame
+#define ANIM_KEY_INDEX_STEP 8 //samples in a row of the key index, one bit per sample
+
+//one quantized key of a track
+struct sAnimKey {
+	uint16 frame; //sample index
+	uint16 value[3]; //rotation: smallest three components of the quaternion, translation and scale: position in the range of the track
+};
+
+//the tracks of one animated bone, only the keys needed to reconstruct the samples within the tolerances are stored
+struct sAnimBoneTracks {
+	enum { ROTATION, TRANSLATION, SCALE };
+	uint32 first_key[3]; //index in the keys of the animation
+	uint16 num_keys[3];
+	Vector3 range_min[3]; //quantization range of the translation and scale tracks
+	Vector3 range_size[3];
+};
+
 //This class contains one animation loaded from a file (it also uses a skeleton to store the current snapshot)
 class Animation {
 public:
@@ -72,7 +91,16 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	//compressed keyframes
+	sAnimBoneTracks* tracks; //one per animated bone
+	sAnimKey* keys;
+	int num_keys;
+	uint32* key_index; //every ANIM_KEY_INDEX_STEP samples, for every track: the key at the first sample of the row << 8 | which samples of the row have a key (bit 0: no keys after the row)
+
+	//max error allowed when removing keys
+	static float rotation_tolerance; //radians
+	static float translation_tolerance; //units
+	static float scale_tolerance;
 
 	Animation();
 	~Animation();	//we need the dtor to remove the keyframes memory
@@ -80,6 +108,19 @@ public:
 	//change the skeleton to the given pose according to time
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
 
+	//like assignTime but writes the local matrices (one per bone of the skeleton)
+	//it does not modify the animation so several threads can sample it at the same time
+	void samplePose(float time, Matrix44* local_matrices, bool loop = true, bool interpolate = true, uint8 layers = 0xFF) const;
+
+	//builds the tracks from num_keyframes * num_animated_bones local matrices
+	void compressKeyframes(const Matrix44* keyframes);
+	size_t getMemoryUsed() const; //bytes used by the keyframes and their index
+	void buildKeyIndex(); //fills key_index from the tracks, after compressing or loading them
+
+	//used by assignTime and samplePose
+	float getFrame(float time, bool loop, bool interpolate) const;
+	void sampleBones(const sAnimBoneTracks* const* bone_tracks, const uint32* bone_keys, float frame, Matrix44* const* models) const; //4 bones at once, bone_keys has 8 per bone: the key of every track at the frame and from 4 the next ones
+
 	//storage
 	bool load(const char* filename);
 	bool loadSKANIM(const char* filename);
@@ -93,3 +134,50 @@ public:
 	void operator = (Animation* anim);
 };
 
+//pose of one character: only the matrices of the bones, the hierarchy comes from the skeleton of the animation
+struct sSkeletonPose {
+	std::vector<Matrix44> local; //according to the parent bone
+	std::vector<Matrix44> global;
+
+	void setRestPose(const Skeleton& skeleton); //copies the local matrices of the skeleton
+	void updateGlobalMatrices(const Skeleton& skeleton);
+};
+
+//same as blendSkeleton but with poses, result can be a
+void blendPoses(const sSkeletonPose& a, const sSkeletonPose& b, float w, sSkeletonPose& result, const Skeleton& skeleton, uint8 layer = 0xFF);
+
+//how a mesh is bound to a skeleton, computed once and used for every pose
+struct sMeshSkin {
+	std::vector<int> bones; //index in the skeleton for every bone of the mesh (-1 if missing)
+	std::vector<Matrix44> bind_matrices; //mesh->bind_matrix * bind_pose
+
+	void create(Skeleton& skeleton, Mesh* mesh);
+	int getNumBones() const { return (int)bones.size(); }
+	void computeFinalBoneMatrices(const sSkeletonPose& pose, Matrix44* bone_matrices) const; //getNumBones matrices, same as Skeleton::computeFinalBoneMatrices
+};
+
+#define ANIM_INSTANCES_PER_JOB 16
+
+//one character of a crowd, plays an animation and optionally blends it with another one
+struct sAnimationInstance {
+	Animation* animation; //both animations must use the same skeleton
+	float time;
+	Animation* blend_animation; //NULL to play only the first one
+	float blend_time;
+	float blend_weight;
+	uint8 blend_layers;
+	bool loop;
+
+	sSkeletonPose pose; //result of the last evaluation
+	std::vector<Matrix44> bone_matrices; //ready for the shader, like computeFinalBoneMatrices
+
+	//kept between evaluations
+	sSkeletonPose blend_pose;
+
+	sAnimationInstance() { animation = NULL; blend_animation = NULL; time = blend_time = blend_weight = 0.0f; blend_layers = 0xFF; loop = true; }
+};
+
+//samples, blends and computes the final bone matrices of all the instances using the workers of the JobSystem
+//all the instances share the mesh, it can be NULL to compute only the poses
+void evaluateAnimationInstances(std::vector<sAnimationInstance>& instances, Mesh* mesh);
+
@@ -10,12 +10,16 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "texturestreamer.h"
+#include "profiler.h"
 
 #include <cmath>
 #include <string>
 #include <cstdio>
 
 Application* Application::instance = nullptr;
+const char* Application::scene_filename = "data/scene.json";
+const char* Application::camera_path_filename = "data/camera_path.txt";
 
 Camera* camera = nullptr;
 GTR::Scene* scene = nullptr;
@@ -38,6 +42,8 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	render_gui = true;
 
 	render_wireframe = false;
+	recording_camera = false;
+	recording_start = 0.0f;
 
 	fps = 0;
 	frame = 0;
@@ -66,7 +72,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
 	scene = new GTR::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename))
 		exit(1);
 
 	camera->lookAt(scene->main_camera.eye, scene->main_camera.center, Vector3(0, 1, 0));
@@ -82,6 +88,8 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 //what to do when the image has to be draw
 void Application::render(void)
 {
+	PROFILE_GPU_SCOPE("Render");
+
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
@@ -105,6 +113,9 @@ void Application::render(void)
 	//renderer->renderScene(scene, camera);
 	renderer->renderToFBO(scene, camera);
 
+	//upload the texture mips requested while rendering
+	TextureStreamer::update();
+
 	//Draw the floor grid, helpful to have a reference point
 	//if(render_debug)
 	//	drawGrid();
@@ -155,6 +166,9 @@ void Application::update(double seconds_elapsed)
 	if (Input::isKeyPressed(SDL_SCANCODE_Q)) camera->moveGlobal(Vector3(0.0f, -1.0f, 0.0f) * speed);
 	if (Input::isKeyPressed(SDL_SCANCODE_E)) camera->moveGlobal(Vector3(0.0f, 1.0f, 0.0f) * speed);
 
+	if (recording_camera)
+		camera_path.addKey(time - recording_start, camera);
+
 	//to navigate with the mouse fixed in the middle
 	SDL_ShowCursor(!mouse_locked);
 	#ifndef SKIP_IMGUI
@@ -247,6 +261,14 @@ void Application::renderDebugGUI(void)
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
+	TextureStreamer::renderInMenu();
+	Profiler::renderInMenu();
+	renderer->bone_palette.renderInMenu();
+	renderer->ssao.renderInMenu();
+	renderer->dynamic_resolution.renderInMenu();
+	scene->irradiance.renderInMenu(scene);
+	scene->reflections.renderInMenu();
+	scene->environment.renderInMenu();
 
 	//add info to the debug panel about the camera
 	if (ImGui::TreeNode(camera, "Camera")) {
@@ -290,6 +312,18 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 		case SDLK_F1: render_debug = !render_debug; break;
 		case SDLK_f: camera->center.set(0, 0, 0); camera->updateViewMatrix(); break;
 		case SDLK_F5: Shader::ReloadAll(); break;
+		case SDLK_F7: Profiler::exportChromeTrace("profile.json"); break;
+		case SDLK_F8: //start or stop recording the camera path
+			recording_camera = !recording_camera;
+			if (recording_camera)
+			{
+				camera_path.clear();
+				recording_start = time;
+				std::cout << "Recording camera path" << std::endl;
+			}
+			else if (camera_path.save(camera_path_filename))
+				std::cout << " + Camera path saved: " << camera_path_filename << " (" << camera_path.keys.size() << " keys)" << std::endl;
+			break;
 		case SDLK_t: renderer->render_mode = GTR::eRenderMode::SHOW_AO; break;
 		case SDLK_u: renderer->render_mode = GTR::eRenderMode::SHOW_UVS; break;
 		case SDLK_i: renderer->render_mode = GTR::eRenderMode::SHOW_NORMAL; break;
@@ -337,6 +371,20 @@ void Application::onMouseButtonDown( SDL_MouseButtonEvent event )
 		mouse_locked = !mouse_locked;
 		SDL_ShowCursor(!mouse_locked);
 	}
+
+	//picking: selects the entity under the mouse
+	if (event.button == SDL_BUTTON_LEFT && !mouse_locked)
+	{
+		#ifndef SKIP_IMGUI
+		if (ImGui::GetIO().WantCaptureMouse || ImGuizmo::IsOver())
+			return;
+		#endif
+		Vector3 direction = camera->getRayDirection(event.x, event.y, (float)window_width, (float)window_height);
+		scene->updateRayBVH(); //the gizmo may have moved something
+		GTR::sSceneRayHit hit;
+		if (scene->testRay(camera->eye, direction, hit))
+			selected_entity = hit.entity;
+	}
 }
 
 void Application::onMouseButtonUp(SDL_MouseButtonEvent event)
@@ -8,11 +8,14 @@
 #include "includes.h"
 #include "camera.h"
 #include "utils.h"
+#include "camerapath.h"
 
 class Application
 {
 public:
 	static Application* instance;
+	static const char* scene_filename; //set before creating the app to load another scene
+	static const char* camera_path_filename; //where F8 records the camera path
 
 	//window
 	SDL_Window* window;
@@ -32,6 +35,11 @@ public:
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
 
+	//camera path recording, played back by the scene benchmark
+	bool recording_camera;
+	float recording_start;
+	CameraPath camera_path;
+
 	Application( int window_width, int window_height, SDL_Window* window );
 
 	//main functions
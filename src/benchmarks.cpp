@@ -0,0 +1,1020 @@
+#include "benchmarks.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "utils.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "shader.h"
+#include "camera.h"
+#include "camerapath.h"
+#include "application.h"
+#include "renderer.h"
+#include "scene.h"
+#include "animation.h"
+#include "bvh.h"
+#include "sphericalharmonics.h"
+#include "extra/coldet/coldet.h"
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef USE_EGL
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#endif
+
+#ifdef WIN32
+	#include <psapi.h>
+	#pragma comment(lib, "psapi.lib")
+#else
+	#include <sys/resource.h>
+#endif
+
+//created by the Application
+extern Camera* camera;
+extern GTR::Renderer* renderer;
+
+namespace {
+
+	double now()
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	}
+
+	bool isImageFile(const std::string& filename)
+	{
+		std::string ext = filename.substr(filename.find_last_of('.') + 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		return ext == "png" || ext == "jpg" || ext == "jpeg";
+	}
+
+	bool isPNG(const std::vector<unsigned char>& buffer)
+	{
+		return buffer.size() > 4 && buffer[1] == 'P' && buffer[2] == 'N' && buffer[3] == 'G';
+	}
+
+	bool decodeImage(Image& image, std::vector<unsigned char>& buffer)
+	{
+		return isPNG(buffer) ? image.loadPNG(buffer) : image.loadJPG(buffer);
+	}
+
+	struct sDecodeResult {
+		double ms;
+		double megapixels;
+		int failed;
+	};
+
+	//files are already in memory, only the decoding is measured
+	sDecodeResult decodeAll(std::vector< std::vector<unsigned char> >& buffers, bool parallel)
+	{
+		std::atomic<int> failed(0);
+		std::vector<double> pixels(buffers.size(), 0.0);
+		double start = now();
+		auto decode = [&](int i) {
+			Image image;
+			if (!decodeImage(image, buffers[i]))
+			{
+				failed++;
+				return;
+			}
+			pixels[i] = (double)image.width * image.height;
+		};
+		if (parallel)
+			JobSystem::parallelFor((int)buffers.size(), decode);
+		else
+			for (int i = 0; i < (int)buffers.size(); ++i)
+				decode(i);
+		sDecodeResult result;
+		result.ms = now() - start;
+		result.megapixels = 0;
+		for (double p : pixels)
+			result.megapixels += p / 1000000.0;
+		result.failed = failed;
+		return result;
+	}
+
+	//GL context without a window
+	struct sHeadlessContext {
+#ifdef USE_EGL
+		EGLDisplay display;
+		EGLSurface surface;
+		EGLContext context;
+#endif
+		SDL_Window* window;
+		SDL_GLContext sdl_context;
+	};
+
+#ifdef USE_EGL
+	bool createEGLContext(sHeadlessContext& ctx, int width, int height)
+	{
+		//the surfaceless platform of Mesa doesnt need a display server
+		ctx.display = EGL_NO_DISPLAY;
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		if (getPlatformDisplay && client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+			ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		if (ctx.display == EGL_NO_DISPLAY)
+			ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+		EGLint major, minor;
+		if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor))
+			return false;
+
+		const EGLint config_attribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+			EGL_DEPTH_SIZE, 24, EGL_STENCIL_SIZE, 8,
+			EGL_NONE };
+		EGLConfig config;
+		EGLint num_configs = 0;
+		if (!eglChooseConfig(ctx.display, config_attribs, &config, 1, &num_configs) || !num_configs)
+			return false;
+
+		const EGLint surface_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+		ctx.surface = eglCreatePbufferSurface(ctx.display, config, surface_attribs);
+		if (ctx.surface == EGL_NO_SURFACE)
+			return false;
+
+		eglBindAPI(EGL_OPENGL_API);
+		const EGLint context_attribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE };
+		ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, context_attribs);
+		if (ctx.context == EGL_NO_CONTEXT)
+			return false;
+		return eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context) == EGL_TRUE;
+	}
+#endif
+
+	bool createHeadlessContext(sHeadlessContext& ctx, int width, int height)
+	{
+		ctx.window = NULL;
+#ifdef USE_EGL
+		if (createEGLContext(ctx, width, height))
+			return true;
+		std::cout << "[WARN] EGL context failed, using a hidden window" << std::endl;
+		if (ctx.display != EGL_NO_DISPLAY)
+			eglTerminate(ctx.display);
+		ctx.display = EGL_NO_DISPLAY;
+#endif
+		//fallback: a hidden SDL window, needs a display
+		SDL_Init(SDL_INIT_VIDEO);
+		SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+		SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		ctx.window = SDL_CreateWindow("GTR bench", 0, 0, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		if (!ctx.window)
+			return false;
+		ctx.sdl_context = SDL_GL_CreateContext(ctx.window);
+		if (!ctx.sdl_context)
+			return false;
+		#ifdef USE_GLEW
+			glewInit();
+		#endif
+		return true;
+	}
+
+	void destroyHeadlessContext(sHeadlessContext& ctx)
+	{
+		if (ctx.window)
+		{
+			SDL_GL_DeleteContext(ctx.sdl_context);
+			SDL_DestroyWindow(ctx.window);
+			SDL_Quit();
+			return;
+		}
+#ifdef USE_EGL
+		eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(ctx.display, ctx.context);
+		eglDestroySurface(ctx.display, ctx.surface);
+		eglTerminate(ctx.display);
+#endif
+	}
+
+	double getPeakMemoryMB()
+	{
+#ifdef WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+		return 0;
+#else
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+	#ifdef __APPLE__
+		return usage.ru_maxrss / (1024.0 * 1024.0); //bytes
+	#else
+		return usage.ru_maxrss / 1024.0; //KB
+	#endif
+#endif
+	}
+
+	double percentile(std::vector<double> values, double p)
+	{
+		if (values.empty())
+			return 0;
+		std::sort(values.begin(), values.end());
+		size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+		return values[std::min(index, values.size() - 1)];
+	}
+
+	cJSON* createTimesJSON(const std::vector<double>& times)
+	{
+		cJSON* json = cJSON_CreateObject();
+		double total = 0;
+		for (double t : times)
+			total += t;
+		cJSON_AddNumberToObject(json, "avg", times.size() ? total / times.size() : 0);
+		cJSON_AddNumberToObject(json, "min", percentile(times, 0.0));
+		cJSON_AddNumberToObject(json, "p50", percentile(times, 0.5));
+		cJSON_AddNumberToObject(json, "p90", percentile(times, 0.9));
+		cJSON_AddNumberToObject(json, "p95", percentile(times, 0.95));
+		cJSON_AddNumberToObject(json, "p99", percentile(times, 0.99));
+		cJSON_AddNumberToObject(json, "max", percentile(times, 1.0));
+		return json;
+	}
+
+	float randomRange(float min, float max)
+	{
+		return min + (rand() / (float)RAND_MAX) * (max - min);
+	}
+
+	//model-like matrix: rotation, scale and translation
+	Matrix44 randomAffineMatrix()
+	{
+		Matrix44 m;
+		Vector3 axis(randomRange(-1, 1), randomRange(-1, 1), randomRange(-1, 1));
+		m.setRotation(randomRange(0, 2.0f * (float)PI), axis.length() > 0.01f ? axis.normalize() : Vector3(0, 1, 0));
+		m.scale(randomRange(0.1f, 10.0f), randomRange(0.1f, 10.0f), randomRange(0.1f, 10.0f));
+		m.translateGlobal(randomRange(-1000, 1000), randomRange(-1000, 1000), randomRange(-1000, 1000));
+		return m;
+	}
+
+	float maxDifference(const Matrix44& a, const Matrix44& b)
+	{
+		float diff = 0;
+		for (int i = 0; i < 16; ++i)
+			diff = std::max(diff, fabsf(a.m[i] - b.m[i]) / std::max(1.0f, fabsf(b.m[i])));
+		return diff;
+	}
+
+	float maxDifference(const Vector3& a, const Vector3& b)
+	{
+		return std::max(std::max(fabsf(a.x - b.x) / std::max(1.0f, fabsf(b.x)), fabsf(a.y - b.y) / std::max(1.0f, fabsf(b.y))), fabsf(a.z - b.z) / std::max(1.0f, fabsf(b.z)));
+	}
+
+	//runs the function for every element and returns the ns per call
+	template<typename F> double measure(int count, int iterations, F function)
+	{
+		double best = 1e20;
+		for (int it = 0; it < iterations; ++it)
+		{
+			double start = now();
+			for (int i = 0; i < count; ++i)
+				function(i);
+			best = std::min(best, now() - start);
+		}
+		return best * 1000000.0 / count;
+	}
+
+	//a chain of bones swinging, the upper half is in the UPPER_BODY layer so the layered blend is used
+	void createTestAnimation(Animation& anim, int num_bones, int num_frames, float speed)
+	{
+		Skeleton& skeleton = anim.skeleton;
+		skeleton.num_bones = num_bones;
+		for (int i = 0; i < num_bones; ++i)
+		{
+			Skeleton::Bone& bone = skeleton.bones[i];
+			bone = Skeleton::Bone(); //zero, with an identity model
+			sprintf(bone.name, "bone_%d", i);
+			bone.parent = i ? (i - 1) / 2 : 0; //binary tree, like limbs branching
+			bone.layer = i >= num_bones / 2 ? UPPER_BODY | BODY : BODY;
+			bone.model.setTranslation(0, 10, 0);
+			skeleton.bones_by_name[bone.name] = i;
+		}
+
+		anim.num_keyframes = num_frames;
+		anim.samples_per_second = 30;
+		anim.duration = num_frames / anim.samples_per_second;
+		anim.num_animated_bones = num_bones;
+		for (int i = 0; i < num_bones; ++i)
+			anim.bones_map[i] = i;
+		std::vector<Matrix44> keyframes(num_frames * num_bones);
+		for (int k = 0; k < num_frames; ++k)
+			for (int i = 0; i < num_bones; ++i)
+			{
+				Matrix44& m = keyframes[k * num_bones + i];
+				m.setRotation(sinf(k * speed + i) * 1.5f, Vector3(1.0f, (float)(i % 5), 0.5f).normalize());
+				m.translateGlobal(0, 10, 0);
+			}
+		anim.compressKeyframes(&keyframes[0]);
+		anim.assignTime(0);
+	}
+
+	float texelSolidAngleReference(float u, float v, float size)
+	{
+		auto area = [](float x, float y) { return atan2f(x * y, sqrtf(x * x + y * y + 1.0f)); };
+		float U = (2.0f * (u + 0.5f) / size) - 1.0f;
+		float V = (2.0f * (v + 0.5f) / size) - 1.0f;
+		float x0 = U - 1.0f / size, y0 = V - 1.0f / size, x1 = U + 1.0f / size, y1 = V + 1.0f / size;
+		return area(x0, y0) - area(x0, y1) - area(x1, y0) + area(x1, y1);
+	}
+
+	//what computeSH did before: one thread, scalar, one texel at a time
+	SphericalHarmonics computeSHReference(FloatImage images[])
+	{
+		int size = images[0].width;
+		SphericalHarmonics sh;
+		float weight_accum = 0;
+		for (int face = 0; face < 6; ++face)
+			for (int y = 0; y < size; y++)
+				for (int x = 0; x < size; x++)
+				{
+					Vector3 d = cubemapTexelDirection(face, x, y, size);
+					float weight = texelSolidAngleReference((float)x, (float)y, (float)size);
+					Vector3 value = images[face].getPixel(x, y).xyz();
+					sh.coeffs[0] += value * (weight * 4 / 17);
+					sh.coeffs[1] += value * (weight * 8 / 17 * d.y);
+					sh.coeffs[2] += value * (weight * 8 / 17 * d.z);
+					sh.coeffs[3] += value * (weight * 8 / 17 * d.x);
+					sh.coeffs[4] += value * (weight * 15 / 17 * d.x * d.y);
+					sh.coeffs[5] += value * (weight * 15 / 17 * d.y * d.z);
+					sh.coeffs[6] += value * (weight * 5 / 68 * (3.0f * d.z * d.z - 1.0f));
+					sh.coeffs[7] += value * (weight * 15 / 17 * d.x * d.z);
+					sh.coeffs[8] += value * (weight * 15 / 68 * (d.x * d.x - d.y * d.y));
+					weight_accum += weight * 3.0f;
+				}
+		for (int i = 0; i < 9; i++)
+			sh.coeffs[i] = sh.coeffs[i] * (4 * (float)PI / weight_accum);
+		return sh;
+	}
+
+	void resetRenderStats()
+	{
+		Mesh::num_meshes_rendered = 0;
+		Mesh::num_triangles_rendered = 0;
+		Shader::num_program_changes = 0;
+		Shader::num_texture_binds = 0;
+	}
+
+	//the same work the main loop does for every frame, without the GUI and the swap
+	void renderBenchFrame(const CameraPath& path, float time)
+	{
+		JobSystem::processMainThreadJobs();
+		Shader::processPending();
+		path.apply(camera, time);
+		Application::instance->render();
+	}
+}
+
+int runBenchmarks(int argc, char** argv)
+{
+	if (argc < 2)
+		return -1;
+	if (strcmp(argv[1], "--bench-images") == 0)
+		return benchImageDecoding(argc > 2 ? argv[2] : "data/prefabs");
+	if (strcmp(argv[1], "--bench-math") == 0)
+		return benchMath();
+	if (strcmp(argv[1], "--bench-crowd") == 0)
+		return benchCrowd(argc > 2 ? std::max(1, atoi(argv[2])) : 500);
+	if (strcmp(argv[1], "--bench-rays") == 0)
+		return benchRays(argc > 2 ? std::max(1, atoi(argv[2])) : 100000);
+	if (strcmp(argv[1], "--bench-sh") == 0)
+		return benchSH(argc > 2 ? std::max(2, atoi(argv[2])) : 128);
+	if (strcmp(argv[1], "--bench-scene") == 0)
+	{
+		sSceneBenchOptions options;
+		for (int i = 2; i < argc; ++i)
+		{
+			bool has_value = i + 1 < argc;
+			if (strcmp(argv[i], "--frames") == 0 && has_value)
+				options.frames = std::max(1, atoi(argv[++i]));
+			else if (strcmp(argv[i], "--warmup") == 0 && has_value)
+				options.warmup_frames = std::max(0, atoi(argv[++i]));
+			else if (strcmp(argv[i], "--path") == 0 && has_value)
+				options.camera_path = argv[++i];
+			else if (strcmp(argv[i], "--out") == 0 && has_value)
+				options.output = argv[++i];
+			else if (strcmp(argv[i], "--size") == 0 && has_value)
+				sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+			else if (argv[i][0] != '-')
+				options.scene = argv[i];
+			else
+			{
+				std::cout << "[ERROR] unknown option " << argv[i] << std::endl;
+				return 1;
+			}
+		}
+		return benchScene(options);
+	}
+	return -1;
+}
+
+int benchImageDecoding(const char* folder)
+{
+	const int iterations = 3;
+
+	std::vector<std::string> files;
+	listFiles(folder, files);
+	files.erase(std::remove_if(files.begin(), files.end(), [](const std::string& f) { return !isImageFile(f); }), files.end());
+	if (files.empty())
+	{
+		std::cout << "[ERROR] no images found in " << folder << std::endl;
+		return 1;
+	}
+
+	std::vector< std::vector<unsigned char> > buffers(files.size());
+	size_t total_bytes = 0;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		readFileBin(files[i], buffers[i]);
+		total_bytes += buffers[i].size();
+	}
+	std::cout << "Decoding " << files.size() << " images (" << total_bytes / (1024 * 1024) << " MB) from " << folder << std::endl;
+
+	JobSystem::init();
+	std::cout << "Workers: " << JobSystem::getNumWorkers() << std::endl;
+
+	struct sMode { const char* name; bool legacy; bool parallel; };
+	sMode modes[] = {
+		{ "picopng/jpgd", true, false },
+		{ "stb_image", false, false },
+		{ "stb_image parallel", false, true },
+	};
+
+	for (sMode& mode : modes)
+	{
+		Image::use_legacy_decoders = mode.legacy;
+		sDecodeResult best = { 1e20, 0, 0 };
+		for (int i = 0; i < iterations; ++i)
+		{
+			sDecodeResult result = decodeAll(buffers, mode.parallel);
+			if (result.ms < best.ms)
+				best = result;
+		}
+		printf(" %-20s %9.2f ms %8.2f MPix/s %s\n", mode.name, best.ms, best.megapixels / (best.ms * 0.001), best.failed ? "(some failed)" : "");
+	}
+	Image::use_legacy_decoders = false;
+
+	JobSystem::shutdown();
+	return 0;
+}
+
+int benchScene(const sSceneBenchOptions& options)
+{
+	sHeadlessContext context;
+	if (!createHeadlessContext(context, options.width, options.height))
+	{
+		std::cout << "[ERROR] cannot create an offscreen GL context" << std::endl;
+		return 1;
+	}
+	std::string gl_renderer = (const char*)glGetString(GL_RENDERER);
+	std::cout << " * OpenGL: " << glGetString(GL_VERSION) << " " << gl_renderer << std::endl;
+
+	//everything ready before measuring
+	Shader::async_compile = false;
+	JobSystem::init();
+
+	Application::scene_filename = options.scene;
+	Application* app = new Application(options.width, options.height, context.window);
+	app->render_gui = false;
+	glViewport(0, 0, options.width, options.height);
+
+	//all the modes at the full size, the deferred one would be faster only because it renders less pixels
+	renderer->dynamic_resolution.enabled = false;
+
+	CameraPath path;
+	if (!path.load(options.camera_path))
+	{
+		std::cout << "No camera path in " << options.camera_path << ", orbiting the scene" << std::endl;
+		path.createOrbit(camera->eye, camera->center, camera->fov, 10.0f);
+	}
+	float duration = path.getDuration();
+
+	struct sBenchMode { const char* name; GTR::ePipelineMode pipeline; GTR::eRenderMode render; };
+	sBenchMode modes[] = {
+		{ "forward", GTR::FORWARD, GTR::DEFAULT },
+		{ "forward_multipass", GTR::FORWARD, GTR::SHOW_MULTI },
+		{ "deferred", GTR::DEFERRED, GTR::SHOW_DEFERRED },
+	};
+
+	cJSON* json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "scene", options.scene);
+	cJSON_AddStringToObject(json, "gl_renderer", gl_renderer.c_str());
+	cJSON_AddNumberToObject(json, "width", options.width);
+	cJSON_AddNumberToObject(json, "height", options.height);
+	cJSON_AddNumberToObject(json, "frames", options.frames);
+	cJSON_AddNumberToObject(json, "camera_keys", (double)path.keys.size());
+	cJSON* modes_json = cJSON_AddArrayToObject(json, "modes");
+
+	for (sBenchMode& mode : modes)
+	{
+		renderer->pipeline_mode = mode.pipeline;
+		renderer->render_mode = mode.render;
+
+		for (int i = 0; i < options.warmup_frames; ++i)
+			renderBenchFrame(path, 0.0f);
+		glFinish();
+
+		std::vector<double> frame_times(options.frames);
+		std::vector<double> cpu_times(options.frames);
+		double draw_calls = 0, triangles = 0, program_changes = 0, texture_binds = 0;
+		for (int i = 0; i < options.frames; ++i)
+		{
+			float time = options.frames > 1 ? duration * i / (float)(options.frames - 1) : 0.0f;
+			resetRenderStats();
+			double start = now();
+			renderBenchFrame(path, time);
+			cpu_times[i] = now() - start;
+			glFinish(); //so the frame time includes the GPU
+			frame_times[i] = now() - start;
+			draw_calls += Mesh::num_meshes_rendered;
+			triangles += Mesh::num_triangles_rendered;
+			program_changes += Shader::num_program_changes;
+			texture_binds += Shader::num_texture_binds;
+		}
+		checkGLErrors();
+
+		//stats are the average per frame
+		cJSON* mode_json = cJSON_CreateObject();
+		cJSON_AddStringToObject(mode_json, "name", mode.name);
+		cJSON_AddNumberToObject(mode_json, "resolution_scale", mode.pipeline == GTR::DEFERRED ? renderer->dynamic_resolution.scale : 1.0);
+		cJSON_AddItemToObject(mode_json, "frame_ms", createTimesJSON(frame_times));
+		cJSON_AddItemToObject(mode_json, "cpu_ms", createTimesJSON(cpu_times));
+		cJSON_AddNumberToObject(mode_json, "draw_calls", draw_calls / options.frames);
+		cJSON_AddNumberToObject(mode_json, "triangles", triangles / options.frames);
+		cJSON_AddNumberToObject(mode_json, "program_changes", program_changes / options.frames);
+		cJSON_AddNumberToObject(mode_json, "texture_binds", texture_binds / options.frames);
+		cJSON_AddItemToArray(modes_json, mode_json);
+
+		printf(" %-18s p50 %7.2f ms  p99 %7.2f ms  DCs %6.0f  Tris %9.0f\n", mode.name, percentile(frame_times, 0.5), percentile(frame_times, 0.99), draw_calls / options.frames, triangles / options.frames);
+	}
+	cJSON_AddNumberToObject(json, "peak_memory_mb", getPeakMemoryMB());
+
+	char* text = cJSON_Print(json);
+	FILE* f = fopen(options.output, "wb");
+	bool saved = f && fputs(text, f) >= 0;
+	if (f)
+		fclose(f);
+	if (saved)
+		std::cout << " + Results saved: " << options.output << std::endl;
+	else
+		std::cout << "[ERROR] cannot write " << options.output << std::endl;
+	cJSON_free(text);
+	cJSON_Delete(json);
+
+	JobSystem::shutdown();
+	destroyHeadlessContext(context);
+	return saved ? 0 : 1;
+}
+
+int benchMath()
+{
+	const int count = 100000;
+	const int iterations = 5;
+	const float tolerance = 0.001f; //relative
+
+	srand(1234);
+	std::vector<Matrix44> matrices(count);
+	std::vector<Vector3> points(count);
+	std::vector<BoundingBox> boxes(count);
+	for (int i = 0; i < count; ++i)
+	{
+		matrices[i] = randomAffineMatrix();
+		points[i] = Vector3(randomRange(-100, 100), randomRange(-100, 100), randomRange(-100, 100));
+		boxes[i] = BoundingBox(points[i], Vector3(randomRange(0.1f, 50), randomRange(0.1f, 50), randomRange(0.1f, 50)));
+	}
+
+	std::vector<Matrix44> result_matrices(count), reference_matrices(count);
+	std::vector<Vector3> result_points(count), reference_points(count);
+	std::vector<BoundingBox> result_boxes(count), reference_boxes(count);
+	std::cout << "Math functions, " << count << " elements, SIMD: " << getMathSIMDName() << std::endl;
+	printf(" %-22s %10s %10s %8s %12s\n", "", "scalar ns", "new ns", "speedup", "max error");
+	int failed = 0;
+
+	auto report = [&](const char* name, double scalar_ns, double simd_ns, float error) {
+		bool ok = error <= tolerance;
+		failed += ok ? 0 : 1;
+		printf(" %-22s %10.2f %10.2f %7.2fx %12g %s\n", name, scalar_ns, simd_ns, scalar_ns / simd_ns, error, ok ? "" : "MISMATCH");
+	};
+
+	//matrix * matrix
+	{
+		double scalar_ns = measure(count, iterations, [&](int i) { reference_matrices[i] = ScalarMath::multiply(matrices[i], matrices[(i + 1) % count]); });
+		double simd_ns = measure(count, iterations, [&](int i) { result_matrices[i] = matrices[i] * matrices[(i + 1) % count]; });
+		float error = 0;
+		for (int i = 0; i < count; ++i)
+			error = std::max(error, maxDifference(result_matrices[i], reference_matrices[i]));
+		report("Matrix44 * Matrix44", scalar_ns, simd_ns, error);
+	}
+
+	//inverse, the affine one is compared with the general one
+	{
+		double scalar_ns = measure(count, iterations, [&](int i) { reference_matrices[i] = matrices[i]; ScalarMath::inverse(reference_matrices[i]); });
+		double simd_ns = measure(count, iterations, [&](int i) { result_matrices[i] = matrices[i]; result_matrices[i].inverse(); });
+		float error = 0;
+		for (int i = 0; i < count; ++i)
+			error = std::max(error, maxDifference(result_matrices[i], reference_matrices[i]));
+		report("inverse", scalar_ns, simd_ns, error);
+
+		simd_ns = measure(count, iterations, [&](int i) { result_matrices[i] = matrices[i]; result_matrices[i].inverseAffine(); });
+		error = 0;
+		for (int i = 0; i < count; ++i)
+			error = std::max(error, maxDifference(result_matrices[i], reference_matrices[i]));
+		report("inverseAffine", scalar_ns, simd_ns, error);
+	}
+
+	//matrix * point
+	{
+		double scalar_ns = measure(count, iterations, [&](int i) { reference_points[i] = ScalarMath::transform(matrices[i], points[i]); });
+		double simd_ns = measure(count, iterations, [&](int i) { result_points[i] = matrices[i] * points[i]; });
+		float error = 0;
+		for (int i = 0; i < count; ++i)
+			error = std::max(error, maxDifference(result_points[i], reference_points[i]));
+		report("Matrix44 * Vector3", scalar_ns, simd_ns, error);
+	}
+
+	//bounding boxes, corners against Arvo
+	{
+		double scalar_ns = measure(count, iterations, [&](int i) { reference_boxes[i] = ScalarMath::transformBoundingBox(matrices[i], boxes[i]); });
+		double simd_ns = measure(count, iterations, [&](int i) { result_boxes[i] = transformBoundingBox(matrices[i], boxes[i]); });
+		float error = 0;
+		for (int i = 0; i < count; ++i)
+			error = std::max(error, std::max(maxDifference(result_boxes[i].center, reference_boxes[i].center), maxDifference(result_boxes[i].halfsize, reference_boxes[i].halfsize)));
+		report("transformBoundingBox", scalar_ns, simd_ns, error);
+	}
+
+	if (failed)
+		std::cout << "[ERROR] " << failed << " functions do not match the scalar version" << std::endl;
+	return failed ? 1 : 0;
+}
+
+int benchCrowd(int num_instances)
+{
+	const int num_bones = 64;
+	const int iterations = 10;
+	const float tolerance = 0.001f;
+
+	Animation walk, wave;
+	createTestAnimation(walk, num_bones, 120, 0.1f);
+	createTestAnimation(wave, num_bones, 90, 0.23f);
+
+	//mesh with only the skin info, bind poses are the inverse of the rest pose
+	Mesh mesh;
+	mesh.bones_info.resize(num_bones);
+	for (int i = 0; i < num_bones; ++i)
+	{
+		strcpy(mesh.bones_info[i].name, walk.skeleton.bones[i].name);
+		mesh.bones_info[i].bind_pose = walk.skeleton.global_bone_matrices[i];
+		mesh.bones_info[i].bind_pose.inverse();
+	}
+
+	//half of the crowd waves with the upper body while walking
+	std::vector<sAnimationInstance> instances(num_instances);
+	for (int i = 0; i < num_instances; ++i)
+	{
+		sAnimationInstance& instance = instances[i];
+		instance.animation = &walk;
+		if (i % 2)
+		{
+			instance.blend_animation = &wave;
+			instance.blend_weight = 0.5f;
+			instance.blend_layers = UPPER_BODY;
+		}
+	}
+	auto setTime = [&](int frame) {
+		for (int i = 0; i < num_instances; ++i)
+		{
+			instances[i].time = i * 0.37f + frame / 30.0f;
+			instances[i].blend_time = i * 0.11f + frame / 30.0f;
+		}
+	};
+
+	std::cout << "Crowd of " << num_instances << " instances, " << num_bones << " bones" << std::endl;
+
+	//one skeleton per instance, evaluated one after another
+	std::vector<Skeleton> skeletons(num_instances);
+	std::vector< std::vector<Matrix44> > reference(num_instances);
+	double best_single = 1e20;
+	for (int it = 0; it < iterations; ++it)
+	{
+		setTime(it);
+		double start = now();
+		for (int i = 0; i < num_instances; ++i)
+		{
+			sAnimationInstance& instance = instances[i];
+			walk.assignTime(instance.time);
+			if (instance.blend_animation)
+			{
+				wave.assignTime(instance.blend_time, true, true, instance.blend_layers);
+				blendSkeleton(&walk.skeleton, &wave.skeleton, instance.blend_weight, &skeletons[i], instance.blend_layers);
+			}
+			else
+				skeletons[i] = walk.skeleton;
+			skeletons[i].computeFinalBoneMatrices(reference[i], &mesh);
+		}
+		best_single = std::min(best_single, now() - start);
+	}
+
+	//batch, first only in this thread and then with the workers
+	double best_batch[2] = { 1e20, 1e20 };
+	int num_workers[2] = { 0, -1 };
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		JobSystem::shutdown();
+		JobSystem::init(num_workers[mode]);
+		for (int it = 0; it < iterations; ++it)
+		{
+			setTime(it);
+			double start = now();
+			evaluateAnimationInstances(instances, &mesh);
+			best_batch[mode] = std::min(best_batch[mode], now() - start);
+		}
+	}
+	int threads = JobSystem::getNumWorkers() + 1;
+	JobSystem::shutdown();
+
+	//last iteration of both must match
+	float error = 0;
+	for (int i = 0; i < num_instances; ++i)
+		for (int j = 0; j < num_bones; ++j)
+			error = std::max(error, maxDifference(instances[i].bone_matrices[j], reference[i][j]));
+
+	size_t pose_size = sizeof(sAnimationInstance) + (instances[1].pose.local.size() * 2 + instances[1].blend_pose.local.size() * 2) * sizeof(Matrix44);
+	printf(" %-28s %10.3f ms\n", "skeleton per instance", best_single);
+	printf(" %-28s %10.3f ms %7.2fx\n", "batch, 1 thread", best_batch[0], best_single / best_batch[0]);
+	printf(" %-28s %10.3f ms %7.2fx\n", ("batch, " + std::to_string(threads) + " threads").c_str(), best_batch[1], best_single / best_batch[1]);
+	printf(" state per instance: Skeleton %d bytes, pose %d bytes\n", (int)sizeof(Skeleton), (int)pose_size);
+	printf(" max error %g\n", error);
+
+	if (error > tolerance)
+	{
+		std::cout << "[ERROR] the batch does not match the skeleton evaluation" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int benchRays(int num_rays)
+{
+	const float size = 1000.0f;
+	const float tolerance = 0.001f; //relative to the distance
+
+	//a bumpy terrain, rays from above to every direction so some of them go through the hills
+	Mesh mesh;
+	mesh.createSubdividedPlane(size, 256);
+	for (size_t i = 0; i < mesh.vertices.size(); ++i)
+	{
+		Vector3& v = mesh.vertices[i];
+		v.y = sinf(v.x * 0.02f) * cosf(v.z * 0.03f) * 50.0f + sinf(v.x * 0.11f + v.z * 0.07f) * 10.0f;
+	}
+	int num_triangles = (int)mesh.vertices.size() / 3;
+
+	srand(1234);
+	std::vector<sRay> rays(num_rays);
+	for (int i = 0; i < num_rays; ++i)
+	{
+		sRay& ray = rays[i];
+		ray.origin.set(randomRange(0, size), randomRange(60, 200), randomRange(0, size));
+		ray.direction.set(randomRange(-1, 1), randomRange(-1, 0.2f), randomRange(-1, 1));
+		ray.direction.normalize();
+		ray.max_distance = 10000.0f;
+	}
+	std::cout << "Rays against a mesh of " << num_triangles << " triangles, " << num_rays << " rays" << std::endl;
+
+	//what Mesh used before: coldet, with setTransform in every query
+	double start = now();
+	CollisionModel3D* collision_model = newCollisionModel3D(false);
+	collision_model->setTriangleNumber(num_triangles);
+	for (int i = 0; i < num_triangles; ++i)
+		collision_model->addTriangle(mesh.vertices[i * 3].v, mesh.vertices[i * 3 + 1].v, mesh.vertices[i * 3 + 2].v);
+	collision_model->finalize();
+	double coldet_build = now() - start;
+
+	Matrix44 identity;
+	std::vector<float> reference(num_rays);
+	start = now();
+	for (int i = 0; i < num_rays; ++i)
+	{
+		reference[i] = -1.0f;
+		collision_model->setTransform(identity.m);
+		if (!collision_model->rayCollision(rays[i].origin.v, rays[i].direction.v, true, 0.0f, rays[i].max_distance))
+			continue;
+		Vector3 collision;
+		collision_model->getCollisionPoint(collision.v, false);
+		reference[i] = collision.distance(rays[i].origin);
+	}
+	double coldet_time = now() - start;
+	delete collision_model;
+
+	start = now();
+	MeshBVH bvh;
+	bvh.build(&mesh);
+	double bvh_build = now() - start;
+
+	std::vector<sRayHit> hits(num_rays);
+	start = now();
+	for (int i = 0; i < num_rays; ++i)
+		bvh.testRay(rays[i], hits[i]);
+	double bvh_time = now() - start;
+
+	JobSystem::init();
+	start = now();
+	bvh.testRays(&rays[0], &hits[0], num_rays);
+	double batch_time = now() - start;
+	int threads = JobSystem::getNumWorkers() + 1;
+	JobSystem::shutdown();
+
+	int mismatches = 0, num_hits = 0;
+	for (int i = 0; i < num_rays; ++i)
+	{
+		bool hit = hits[i].triangle != -1;
+		num_hits += hit ? 1 : 0;
+		if (hit != (reference[i] >= 0.0f) || (hit && fabsf(hits[i].distance - reference[i]) > tolerance * std::max(1.0f, reference[i])))
+			mismatches++;
+	}
+
+	printf(" %-28s %10.3f ms\n", "coldet build", coldet_build);
+	printf(" %-28s %10.3f ms %7.2fx  %d nodes, %.2f MB\n", "BVH build", bvh_build, coldet_build / bvh_build, (int)bvh.nodes.size(), bvh.getMemoryUsed() / (1024.0f * 1024.0f));
+	printf(" %-28s %10.3f ms  %.3f us/ray\n", "coldet rays", coldet_time, coldet_time * 1000.0 / num_rays);
+	printf(" %-28s %10.3f ms  %.3f us/ray %7.2fx\n", "BVH rays", bvh_time, bvh_time * 1000.0 / num_rays, coldet_time / bvh_time);
+	printf(" %-28s %10.3f ms  %.3f us/ray %7.2fx\n", ("BVH rays, " + std::to_string(threads) + " threads").c_str(), batch_time, batch_time * 1000.0 / num_rays, coldet_time / batch_time);
+	printf(" %d hits, %d mismatches\n", num_hits, mismatches);
+
+	//coldet misses a few rays along shared edges, the BVH tests are inclusive
+	if (mismatches > num_rays / 1000)
+	{
+		std::cout << "[ERROR] the BVH does not match coldet" << std::endl;
+		return 1;
+	}
+
+	//a scene: a grid of smaller copies of the terrain, against testing every instance like Node::testRay does
+	const int grid = 16;
+	const float spacing = 120.0f;
+	InstancesBVH scene_bvh;
+	for (int i = 0; i < grid * grid; ++i)
+	{
+		sBVHInstance instance;
+		instance.bvh = &bvh;
+		instance.model.setTranslation((i % grid) * spacing, randomRange(-20, 20), (i / grid) * spacing);
+		instance.model.rotate(randomRange(0, 2.0f * (float)PI), Vector3(0, 1, 0));
+		instance.model.scale(0.1f, randomRange(0.5f, 2.0f), 0.1f);
+		instance.layers = 1;
+		instance.id = i;
+		scene_bvh.instances.push_back(instance);
+	}
+	start = now();
+	scene_bvh.build();
+	double scene_build = now() - start;
+
+	for (int i = 0; i < num_rays; ++i)
+	{
+		sRay& ray = rays[i];
+		ray.origin.set(randomRange(0, grid * spacing), randomRange(60, 200), randomRange(0, grid * spacing));
+		ray.direction.set(randomRange(-1, 1), randomRange(-1, 0.2f), randomRange(-1, 1));
+		ray.direction.normalize();
+	}
+
+	//brute force with fewer rays, it is slow
+	int num_brute = std::max(1, num_rays / 10);
+	std::vector<float> brute(num_brute);
+	start = now();
+	for (int i = 0; i < num_brute; ++i)
+	{
+		brute[i] = -1.0f;
+		for (const sBVHInstance& instance : scene_bvh.instances)
+		{
+			sRay local_ray;
+			local_ray.origin = instance.inverse * rays[i].origin;
+			local_ray.direction = instance.inverse.rotateVector(rays[i].direction);
+			local_ray.max_distance = brute[i] < 0.0f ? rays[i].max_distance : brute[i];
+			sRayHit hit;
+			if (instance.bvh->testRay(local_ray, hit))
+				brute[i] = hit.distance;
+		}
+	}
+	double brute_time = now() - start;
+
+	start = now();
+	for (int i = 0; i < num_rays; ++i)
+		scene_bvh.testRay(rays[i], hits[i]);
+	double scene_time = now() - start;
+
+	JobSystem::init();
+	start = now();
+	scene_bvh.testRays(&rays[0], &hits[0], num_rays);
+	double scene_batch_time = now() - start;
+
+	std::vector<sRayHit> any_hits(num_rays);
+	start = now();
+	scene_bvh.testRays(&rays[0], &any_hits[0], num_rays, true);
+	double any_time = now() - start;
+	JobSystem::shutdown();
+
+	mismatches = 0;
+	for (int i = 0; i < num_rays; ++i)
+	{
+		bool hit = hits[i].triangle != -1;
+		if (hit != (any_hits[i].triangle != -1) || (hit && any_hits[i].distance < hits[i].distance))
+			mismatches++;
+		else if (i < num_brute && (hit != (brute[i] >= 0.0f) || (hit && fabsf(hits[i].distance - brute[i]) > tolerance * std::max(1.0f, brute[i]))))
+			mismatches++;
+	}
+
+	double brute_per_ray = brute_time * 1000.0 / num_brute;
+	std::cout << "Scene of " << grid * grid << " instances" << std::endl;
+	printf(" %-28s %10.3f ms\n", "build", scene_build);
+	printf(" %-28s %10.3f ms  %.3f us/ray\n", "every instance", brute_time, brute_per_ray);
+	printf(" %-28s %10.3f ms  %.3f us/ray %7.2fx\n", "two levels", scene_time, scene_time * 1000.0 / num_rays, brute_per_ray / (scene_time * 1000.0 / num_rays));
+	printf(" %-28s %10.3f ms  %.3f us/ray %7.2fx\n", ("two levels, " + std::to_string(threads) + " threads").c_str(), scene_batch_time, scene_batch_time * 1000.0 / num_rays, brute_per_ray / (scene_batch_time * 1000.0 / num_rays));
+	printf(" %-28s %10.3f ms  %.3f us/ray %7.2fx\n", "any hit", any_time, any_time * 1000.0 / num_rays, brute_per_ray / (any_time * 1000.0 / num_rays));
+	printf(" %d mismatches\n", mismatches);
+
+	if (mismatches)
+	{
+		std::cout << "[ERROR] the two levels BVH does not match testing every instance" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int benchSH(int size)
+{
+	const int iterations = 10;
+	const int num_probes = 256; //like a baked grid of 8x4x8
+	const int probe_size = 8;
+	const float tolerance = 0.0001f;
+
+	srand(1234);
+	FloatImage faces[6];
+	for (int face = 0; face < 6; ++face)
+	{
+		faces[face].resize(size, size, 3);
+		for (int i = 0; i < size * size * 3; ++i)
+			faces[face].data[i] = randomRange(0, 1.0f + face);
+	}
+
+	JobSystem::init();
+	int threads = JobSystem::getNumWorkers() + 1;
+	std::cout << "Spherical harmonics of a cubemap of " << size << "x" << size << std::endl;
+
+	SphericalHarmonics reference, result;
+	double start = now();
+	for (int i = 0; i < iterations; ++i)
+		reference = computeSHReference(faces);
+	double reference_time = (now() - start) / iterations;
+
+	start = now();
+	for (int i = 0; i < iterations; ++i)
+		result = computeSH(faces);
+	double sh_time = (now() - start) / iterations;
+
+	float error = 0.0f;
+	for (int i = 0; i < 9; ++i)
+		error = std::max(error, maxDifference(result.coeffs[i], reference.coeffs[i]));
+
+	//the baker projects a small cubemap per probe from every worker, computeSH must be reentrant
+	std::vector<FloatImage> probe_faces(num_probes * 6);
+	for (int i = 0; i < num_probes * 6; ++i)
+	{
+		probe_faces[i].resize(probe_size, probe_size, 3);
+		for (int j = 0; j < probe_size * probe_size * 3; ++j)
+			probe_faces[i].data[j] = randomRange(0, 2.0f);
+	}
+	std::vector<SphericalHarmonics> probes_reference(num_probes), probes(num_probes);
+	start = now();
+	for (int i = 0; i < num_probes; ++i)
+		probes_reference[i] = computeSHReference(&probe_faces[i * 6]);
+	double probes_reference_time = now() - start;
+	start = now();
+	JobSystem::parallelFor(num_probes, [&](int i) { probes[i] = computeSH(&probe_faces[i * 6]); });
+	double probes_time = now() - start;
+	JobSystem::shutdown();
+
+	for (int i = 0; i < num_probes; ++i)
+		for (int j = 0; j < 9; ++j)
+			error = std::max(error, maxDifference(probes[i].coeffs[j], probes_reference[i].coeffs[j]));
+
+	printf(" %-28s %10.3f ms\n", "scalar", reference_time);
+	printf(" %-28s %10.3f ms %7.2fx\n", ("computeSH, " + std::to_string(threads) + " threads").c_str(), sh_time, reference_time / sh_time);
+	printf(" %-28s %10.3f ms\n", (std::to_string(num_probes) + " probes scalar").c_str(), probes_reference_time);
+	printf(" %-28s %10.3f ms %7.2fx\n", (std::to_string(num_probes) + " probes in parallel").c_str(), probes_time, probes_reference_time / probes_time);
+	printf(" max error %g\n", error);
+
+	if (error > tolerance)
+	{
+		std::cout << "[ERROR] computeSH does not match the scalar projection" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,36 @@
+/*  Benchmarks that run from the command line without creating a window:
+		main --bench-images [folder]		decodes all the PNG/JPG found in the folder (data/prefabs by default)
+		main --bench-math					compares the SIMD matrix functions with the scalar ones (speed and results)
+		main --bench-crowd [instances]		evaluates the animations of a crowd, one skeleton per instance against the batch with the workers
+		main --bench-rays [rays]			ray queries against a terrain mesh, the old coldet model against the BVH (single and batched),
+											and against a grid of instances of it, testing all of them against the two levels BVH
+		main --bench-sh [size]				spherical harmonics of a cubemap, the old scalar projection against computeSH,
+											and many small cubemaps projected at once like the irradiance baker does
+		main --bench-scene [scene.json] [--frames N] [--path camera_path.txt] [--size WxH] [--out bench.json]
+			renders the scene in an offscreen context (EGL when available, so it runs on llvmpipe without GPU)
+			following the camera path in every pipeline mode, and writes the frame times and render stats as JSON
+*/
+#pragma once
+
+//returns the exit code, -1 if the arguments are not a benchmark so the app starts normally
+int runBenchmarks(int argc, char** argv);
+
+int benchImageDecoding(const char* folder);
+int benchMath();
+int benchCrowd(int num_instances);
+int benchRays(int num_rays);
+int benchSH(int size);
+
+struct sSceneBenchOptions {
+	const char* scene;
+	const char* camera_path; //if it cannot be loaded the camera orbits the scene
+	const char* output;
+	int frames; //measured frames per mode
+	int warmup_frames; //before measuring, to let the textures stream and the shaders compile
+	int width;
+	int height;
+
+	sSceneBenchOptions() { scene = "data/scene.json"; camera_path = "data/camera_path.txt"; output = "bench.json"; frames = 300; warmup_frames = 60; width = 1280; height = 720; }
+};
+
+int benchScene(const sSceneBenchOptions& options);
@@ -0,0 +1,759 @@
+#include "bvh.h"
+
+#include "mesh.h"
+#include "jobs.h"
+
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+//same detection as framework.cpp
+#ifndef FRAMEWORK_NO_SIMD
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define BVH_SSE
+		#include <xmmintrin.h>
+	#endif
+#endif
+
+#define BVH_NO_TRIANGLE 0xFFFFFFFF
+
+namespace {
+
+	struct sBuildPrimitive {
+		Vector3 min;
+		Vector3 max;
+		Vector3 centroid;
+	};
+
+	struct sBin {
+		Vector3 min;
+		Vector3 max;
+		int count;
+	};
+
+	void growBounds(Vector3& min, Vector3& max, const Vector3& p_min, const Vector3& p_max)
+	{
+		min.set(std::min(min.x, p_min.x), std::min(min.y, p_min.y), std::min(min.z, p_min.z));
+		max.set(std::max(max.x, p_max.x), std::max(max.y, p_max.y), std::max(max.z, p_max.z));
+	}
+
+	float surfaceArea(const Vector3& min, const Vector3& max)
+	{
+		Vector3 d = max - min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	//builds the nodes over the boxes of the primitives (triangles or instances),
+	//the leaves point to a range of order: first is where it starts, count how many
+	class BVHBuilder
+	{
+	public:
+		std::vector<sBVHNode>& nodes;
+		int leaf_size;
+		std::vector<sBuildPrimitive> primitives;
+		std::vector<uint32> order; //the subdivision reorders it, the leaves take consecutive ranges
+
+		BVHBuilder(std::vector<sBVHNode>& nodes, int leaf_size) : nodes(nodes), leaf_size(leaf_size) {}
+
+		void addPrimitive(const Vector3& min, const Vector3& max)
+		{
+			sBuildPrimitive p;
+			p.min = min;
+			p.max = max;
+			p.centroid = (min + max) * 0.5f;
+			order.push_back((uint32)primitives.size());
+			primitives.push_back(p);
+		}
+
+		void build()
+		{
+			int num = (int)primitives.size();
+			nodes.clear();
+			if (!num)
+				return;
+			nodes.reserve(num / 2 + 1);
+			nodes.resize(1);
+			subdivide(0, 0, num, 0);
+		}
+
+		void subdivide(uint32 node_index, int begin, int end, int depth)
+		{
+			//bounds of the triangles and of their centroids
+			Vector3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			Vector3 c_min = min, c_max = max;
+			for (int i = begin; i < end; ++i)
+			{
+				const sBuildPrimitive& p = primitives[order[i]];
+				growBounds(min, max, p.min, p.max);
+				growBounds(c_min, c_max, p.centroid, p.centroid);
+			}
+			nodes[node_index].min = min;
+			nodes[node_index].max = max;
+
+			int count = end - begin;
+			if (count <= leaf_size)
+			{
+				nodes[node_index].first = begin;
+				nodes[node_index].count = count;
+				return;
+			}
+
+			int middle = -1;
+			if (depth < BVH_MAX_DEPTH / 2) //deeper we only use median splits so the depth stays bounded
+				middle = findSAHSplit(begin, end, c_min, c_max);
+			if (middle <= begin || middle >= end)
+			{
+				//all the centroids in the same place (or too deep), any split is as good as another
+				int axis = 0;
+				Vector3 extent = c_max - c_min;
+				if (extent.y > extent.x) axis = 1;
+				if (extent.z > extent.v[axis]) axis = 2;
+				middle = begin + count / 2;
+				std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](uint32 a, uint32 b) {
+					return primitives[a].centroid.v[axis] < primitives[b].centroid.v[axis];
+				});
+			}
+
+			uint32 first = (uint32)nodes.size();
+			nodes.resize(first + 2);
+			nodes[node_index].first = first;
+			nodes[node_index].count = 0;
+			subdivide(first, begin, middle, depth + 1);
+			subdivide(first + 1, middle, end, depth + 1);
+		}
+
+		//binned SAH in the three axis, returns where the range is split (after partitioning it) or -1
+		int findSAHSplit(int begin, int end, const Vector3& c_min, const Vector3& c_max)
+		{
+			float best_cost = FLT_MAX;
+			int best_axis = -1;
+			int best_bin = 0;
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float extent = c_max.v[axis] - c_min.v[axis];
+				if (extent <= 0.0f)
+					continue;
+				float scale = BVH_NUM_BINS / extent;
+
+				sBin bins[BVH_NUM_BINS];
+				for (int i = 0; i < BVH_NUM_BINS; ++i)
+				{
+					bins[i].min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+					bins[i].max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+					bins[i].count = 0;
+				}
+				for (int i = begin; i < end; ++i)
+				{
+					const sBuildPrimitive& p = primitives[order[i]];
+					int b = std::min(BVH_NUM_BINS - 1, (int)((p.centroid.v[axis] - c_min.v[axis]) * scale));
+					growBounds(bins[b].min, bins[b].max, p.min, p.max);
+					bins[b].count++;
+				}
+
+				//areas and counts at the left of every split, then sweep from the right
+				float left_area[BVH_NUM_BINS - 1];
+				int left_count[BVH_NUM_BINS - 1];
+				Vector3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				int num = 0;
+				for (int i = 0; i < BVH_NUM_BINS - 1; ++i)
+				{
+					num += bins[i].count;
+					if (bins[i].count)
+						growBounds(min, max, bins[i].min, bins[i].max);
+					left_count[i] = num;
+					left_area[i] = num ? surfaceArea(min, max) : 0.0f;
+				}
+				min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+				max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				num = 0;
+				for (int i = BVH_NUM_BINS - 1; i > 0; --i)
+				{
+					num += bins[i].count;
+					if (bins[i].count)
+						growBounds(min, max, bins[i].min, bins[i].max);
+					if (!num || !left_count[i - 1])
+						continue;
+					float cost = left_count[i - 1] * left_area[i - 1] + num * surfaceArea(min, max);
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_bin = i; //first bin of the right side
+					}
+				}
+			}
+
+			if (best_axis == -1)
+				return -1;
+
+			float scale = BVH_NUM_BINS / (c_max.v[best_axis] - c_min.v[best_axis]);
+			uint32* middle = std::partition(&order[0] + begin, &order[0] + end, [&](uint32 i) {
+				int b = std::min(BVH_NUM_BINS - 1, (int)((primitives[i].centroid.v[best_axis] - c_min.v[best_axis]) * scale));
+				return b < best_bin;
+			});
+			return (int)(middle - &order[0]);
+		}
+	};
+
+	//the triangles of a leaf in SoA, positions has three per triangle
+	void createTrianglesBlock(sBVHTriangles4& block, const std::vector<Vector3>& positions, const uint32* ids, int count)
+	{
+		memset(&block, 0, sizeof(block));
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			block.id[lane] = BVH_NO_TRIANGLE;
+			if (lane >= count)
+				continue;
+			uint32 id = ids[lane];
+			const Vector3* p = &positions[id * 3];
+			Vector3 e1 = p[1] - p[0];
+			Vector3 e2 = p[2] - p[0];
+			for (int k = 0; k < 3; ++k)
+			{
+				block.v0[k][lane] = p[0].v[k];
+				block.e1[k][lane] = e1.v[k];
+				block.e2[k][lane] = e2.v[k];
+			}
+			block.id[lane] = id;
+		}
+	}
+
+	//world bounds of the root of the mesh BVH, Arvo's method like transformBoundingBox
+	void updateInstanceBounds(sBVHInstance& instance)
+	{
+		instance.inverse = instance.model;
+		instance.inverse.inverseAffine();
+		const sBVHNode& root = instance.bvh->nodes[0];
+		const float* m = instance.model.m;
+		for (int k = 0; k < 3; ++k)
+		{
+			float min = m[12 + k], max = m[12 + k];
+			for (int j = 0; j < 3; ++j)
+			{
+				float a = m[j * 4 + k] * root.min.v[j];
+				float b = m[j * 4 + k] * root.max.v[j];
+				min += std::min(a, b);
+				max += std::max(a, b);
+			}
+			instance.min.v[k] = min;
+			instance.max.v[k] = max;
+		}
+	}
+
+	//the ray with the values every test needs
+	struct sRayTraversal {
+		float origin[4];
+		float direction[4];
+		float inv_direction[4];
+		float best_distance;
+		uint32 best_block;
+		int best_lane;
+	};
+
+	void prepareRay(const sRay& ray, sRayTraversal& r)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			float d = ray.direction.v[k];
+			if (fabsf(d) < 1e-20f) //avoids 0 * inf in the slabs
+				d = d < 0.0f ? -1e-20f : 1e-20f;
+			r.origin[k] = ray.origin.v[k];
+			r.direction[k] = ray.direction.v[k];
+			r.inv_direction[k] = 1.0f / d;
+		}
+		r.origin[3] = r.direction[3] = r.inv_direction[3] = 0.0f;
+		r.best_distance = ray.max_distance;
+		r.best_block = 0;
+		r.best_lane = -1;
+	}
+
+	//slab test, near is where the ray enters the box
+	inline bool intersectBox(const sRayTraversal& r, const sBVHNode& node, float& near)
+	{
+#ifdef BVH_SSE
+		//the 4th lane has first/count, it is ignored
+		__m128 origin = _mm_loadu_ps(r.origin);
+		__m128 inv = _mm_loadu_ps(r.inv_direction);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.min.x), origin), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.max.x), origin), inv);
+		__m128 t_min = _mm_min_ps(t0, t1);
+		__m128 t_max = _mm_max_ps(t0, t1);
+		__m128 n = _mm_max_ss(_mm_max_ss(t_min, _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(2, 2, 2, 2)));
+		__m128 f = _mm_min_ss(_mm_min_ss(t_max, _mm_shuffle_ps(t_max, t_max, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_ps(t_max, t_max, _MM_SHUFFLE(2, 2, 2, 2)));
+		near = std::max(_mm_cvtss_f32(n), 0.0f);
+		float far = std::min(_mm_cvtss_f32(f), r.best_distance);
+		return near <= far;
+#else
+		near = 0.0f;
+		float far = r.best_distance;
+		for (int k = 0; k < 3; ++k)
+		{
+			float t0 = (node.min.v[k] - r.origin[k]) * r.inv_direction[k];
+			float t1 = (node.max.v[k] - r.origin[k]) * r.inv_direction[k];
+			near = std::max(near, std::min(t0, t1));
+			far = std::min(far, std::max(t0, t1));
+		}
+		return near <= far;
+#endif
+	}
+
+	//Moller-Trumbore with the 4 triangles of the block at once
+	inline void intersectTriangles(sRayTraversal& r, const sBVHTriangles4& block, uint32 block_index)
+	{
+		const float epsilon = 1e-12f;
+#ifdef BVH_SSE
+		__m128 dx = _mm_set1_ps(r.direction[0]), dy = _mm_set1_ps(r.direction[1]), dz = _mm_set1_ps(r.direction[2]);
+		__m128 e1x = _mm_loadu_ps(block.e1[0]), e1y = _mm_loadu_ps(block.e1[1]), e1z = _mm_loadu_ps(block.e1[2]);
+		__m128 e2x = _mm_loadu_ps(block.e2[0]), e2y = _mm_loadu_ps(block.e2[1]), e2z = _mm_loadu_ps(block.e2[2]);
+
+		//p = d x e2
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+		__m128 valid = _mm_cmpgt_ps(abs_det, _mm_set1_ps(epsilon));
+		__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+		//s = o - v0
+		__m128 sx = _mm_sub_ps(_mm_set1_ps(r.origin[0]), _mm_loadu_ps(block.v0[0]));
+		__m128 sy = _mm_sub_ps(_mm_set1_ps(r.origin[1]), _mm_loadu_ps(block.v0[1]));
+		__m128 sz = _mm_sub_ps(_mm_set1_ps(r.origin[2]), _mm_loadu_ps(block.v0[2]));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+		//q = s x e1
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+		__m128 zero = _mm_setzero_ps();
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(r.best_distance)));
+		int mask = _mm_movemask_ps(valid);
+		if (!mask)
+			return;
+		float distances[4];
+		_mm_storeu_ps(distances, t);
+		for (int lane = 0; lane < 4; ++lane)
+			if ((mask & (1 << lane)) && distances[lane] < r.best_distance)
+			{
+				r.best_distance = distances[lane];
+				r.best_block = block_index;
+				r.best_lane = lane;
+			}
+#else
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			Vector3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+			Vector3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+			Vector3 d(r.direction[0], r.direction[1], r.direction[2]);
+			Vector3 p = d.cross(e2);
+			float det = e1.dot(p);
+			if (fabsf(det) <= epsilon)
+				continue;
+			float inv_det = 1.0f / det;
+			Vector3 s(r.origin[0] - block.v0[0][lane], r.origin[1] - block.v0[1][lane], r.origin[2] - block.v0[2][lane]);
+			float u = s.dot(p) * inv_det;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+			Vector3 q = s.cross(e1);
+			float v = d.dot(q) * inv_det;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+			float t = e2.dot(q) * inv_det;
+			if (t >= 0.0f && t < r.best_distance)
+			{
+				r.best_distance = t;
+				r.best_block = block_index;
+				r.best_lane = lane;
+			}
+		}
+#endif
+	}
+
+	Vector3 getTriangleNormal(const sBVHTriangles4& block, int lane)
+	{
+		Vector3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+		Vector3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+		Vector3 normal = e1.cross(e2);
+		float length = normal.length();
+		return length > 0.0f ? normal * (1.0f / length) : Vector3(0, 1, 0);
+	}
+
+	//Ericson, Real-Time Collision Detection 5.1.5
+	Vector3 closestPointInTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+	{
+		Vector3 ab = b - a, ac = c - a, ap = p - a;
+		float d1 = ab.dot(ap), d2 = ac.dot(ap);
+		if (d1 <= 0.0f && d2 <= 0.0f)
+			return a;
+		Vector3 bp = p - b;
+		float d3 = ab.dot(bp), d4 = ac.dot(bp);
+		if (d3 >= 0.0f && d4 <= d3)
+			return b;
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+			return a + ab * (d1 / (d1 - d3));
+		Vector3 cp = p - c;
+		float d5 = ab.dot(cp), d6 = ac.dot(cp);
+		if (d6 >= 0.0f && d5 <= d6)
+			return c;
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+			return a + ac * (d2 / (d2 - d6));
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	float distanceToBox2(const Vector3& p, const sBVHNode& node)
+	{
+		float d = 0.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			float v = std::max(std::max(node.min.v[k] - p.v[k], 0.0f), p.v[k] - node.max.v[k]);
+			d += v * v;
+		}
+		return d;
+	}
+}
+
+bool MeshBVH::build(Mesh* mesh)
+{
+	assert(mesh);
+
+	//works for indexed, interleaved and packed meshes
+	std::vector<Vector3> positions;
+	unsigned int num_indices = mesh->getNumIndices();
+	unsigned int num = num_indices ? num_indices : mesh->getNumVertices();
+	num -= num % 3;
+	if (!num)
+		return false;
+	positions.resize(num);
+	for (unsigned int i = 0; i < num; ++i)
+		positions[i] = mesh->getVertexPosition(num_indices ? mesh->getIndex(i) : i);
+
+	BVHBuilder builder(nodes, BVH_LEAF_TRIANGLES);
+	for (unsigned int i = 0; i < num; i += 3)
+	{
+		Vector3 min = positions[i], max = positions[i];
+		growBounds(min, max, positions[i + 1], positions[i + 1]);
+		growBounds(min, max, positions[i + 2], positions[i + 2]);
+		builder.addPrimitive(min, max);
+	}
+	builder.build();
+
+	//the leaves point to their block instead of to the range of order
+	triangles.resize(0);
+	triangles.reserve(nodes.size() / 2 + 1);
+	for (sBVHNode& node : nodes)
+	{
+		if (!node.count)
+			continue;
+		triangles.resize(triangles.size() + 1);
+		createTrianglesBlock(triangles.back(), positions, &builder.order[node.first], node.count);
+		node.first = (uint32)triangles.size() - 1;
+	}
+	return true;
+}
+
+bool MeshBVH::testRay(const sRay& ray, sRayHit& hit, bool any_hit) const
+{
+	hit.triangle = -1;
+	hit.instance = -1;
+	if (nodes.empty())
+		return false;
+
+	sRayTraversal r;
+	prepareRay(ray, r);
+
+	float near;
+	if (!intersectBox(r, nodes[0], near))
+		return false;
+
+	//the far child waits in the stack with its entry distance, it is skipped if something closer was hit meanwhile
+	struct sStackEntry { uint32 node; float near; };
+	sStackEntry stack[BVH_MAX_DEPTH];
+	int stack_size = 0;
+	const sBVHNode* node = &nodes[0];
+
+	while (true)
+	{
+		if (node->count)
+		{
+			intersectTriangles(r, triangles[node->first], node->first);
+			if (any_hit && r.best_lane != -1)
+				break;
+		}
+		else
+		{
+			const sBVHNode* a = &nodes[node->first];
+			const sBVHNode* b = a + 1;
+			float near_a, near_b;
+			bool hit_a = intersectBox(r, *a, near_a);
+			bool hit_b = intersectBox(r, *b, near_b);
+			if (hit_a && hit_b)
+			{
+				if (near_b < near_a)
+				{
+					std::swap(a, b);
+					std::swap(near_a, near_b);
+				}
+				assert(stack_size < BVH_MAX_DEPTH);
+				stack[stack_size].node = (uint32)(b - &nodes[0]);
+				stack[stack_size].near = near_b;
+				stack_size++;
+				node = a;
+				continue;
+			}
+			if (hit_a || hit_b)
+			{
+				node = hit_a ? a : b;
+				continue;
+			}
+		}
+
+		//next one from the stack
+		node = NULL;
+		while (stack_size)
+		{
+			sStackEntry& entry = stack[--stack_size];
+			if (entry.near <= r.best_distance)
+			{
+				node = &nodes[entry.node];
+				break;
+			}
+		}
+		if (!node)
+			break;
+	}
+
+	if (r.best_lane == -1)
+		return false;
+
+	const sBVHTriangles4& block = triangles[r.best_block];
+	hit.distance = r.best_distance;
+	hit.triangle = (int)block.id[r.best_lane];
+	hit.normal = getTriangleNormal(block, r.best_lane);
+	return true;
+}
+
+bool MeshBVH::testSphere(const Vector3& center, float radius, Vector3& collision, Vector3& normal) const
+{
+	if (nodes.empty())
+		return false;
+
+	float best = radius * radius;
+	bool found = false;
+	uint32 stack[BVH_MAX_DEPTH * 2]; //both children are pushed
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const sBVHNode& node = nodes[stack[--stack_size]];
+		if (distanceToBox2(center, node) > best)
+			continue;
+		if (!node.count)
+		{
+			assert(stack_size + 2 <= BVH_MAX_DEPTH * 2);
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = node.first + 1;
+			continue;
+		}
+
+		const sBVHTriangles4& block = triangles[node.first];
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if (block.id[lane] == BVH_NO_TRIANGLE)
+				continue;
+			Vector3 a(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+			Vector3 b = a + Vector3(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+			Vector3 c = a + Vector3(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+			Vector3 p = closestPointInTriangle(center, a, b, c);
+			Vector3 d = p - center;
+			float distance2 = d.dot(d);
+			if (distance2 > best)
+				continue;
+			best = distance2;
+			found = true;
+			collision = p;
+			normal = getTriangleNormal(block, lane);
+		}
+	}
+	return found;
+}
+
+void MeshBVH::testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit) const
+{
+	int num_jobs = (count + BVH_RAYS_PER_JOB - 1) / BVH_RAYS_PER_JOB;
+	JobSystem::parallelFor(num_jobs, [&](int job) {
+		int end = std::min(count, (job + 1) * BVH_RAYS_PER_JOB);
+		for (int i = job * BVH_RAYS_PER_JOB; i < end; ++i)
+			testRay(rays[i], hits[i], any_hit);
+	});
+}
+
+void InstancesBVH::build()
+{
+	BVHBuilder builder(nodes, BVH_LEAF_INSTANCES);
+	for (sBVHInstance& instance : instances)
+	{
+		assert(instance.bvh && !instance.bvh->isEmpty());
+		updateInstanceBounds(instance);
+		builder.addPrimitive(instance.min, instance.max);
+	}
+	builder.build();
+
+	//in the order of the leaves, so they point directly to their instances
+	std::vector<sBVHInstance> sorted(instances.size());
+	for (size_t i = 0; i < builder.order.size(); ++i)
+		sorted[i] = instances[builder.order[i]];
+	instances.swap(sorted);
+}
+
+void InstancesBVH::refit()
+{
+	for (sBVHInstance& instance : instances)
+		updateInstanceBounds(instance);
+
+	//the children are always after their parent
+	for (int i = (int)nodes.size() - 1; i >= 0; --i)
+	{
+		sBVHNode& node = nodes[i];
+		node.min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+		node.max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		if (node.count)
+		{
+			for (uint32 j = node.first; j < node.first + node.count; ++j)
+				growBounds(node.min, node.max, instances[j].min, instances[j].max);
+		}
+		else
+		{
+			growBounds(node.min, node.max, nodes[node.first].min, nodes[node.first].max);
+			growBounds(node.min, node.max, nodes[node.first + 1].min, nodes[node.first + 1].max);
+		}
+	}
+}
+
+bool InstancesBVH::testRay(const sRay& ray, sRayHit& hit, bool any_hit, int layers) const
+{
+	hit.triangle = -1;
+	hit.instance = -1;
+	if (nodes.empty())
+		return false;
+
+	sRayTraversal r;
+	prepareRay(ray, r);
+
+	float near;
+	if (!intersectBox(r, nodes[0], near))
+		return false;
+
+	struct sStackEntry { uint32 node; float near; };
+	sStackEntry stack[BVH_MAX_DEPTH];
+	int stack_size = 0;
+	const sBVHNode* node = &nodes[0];
+	const sBVHInstance* best_instance = NULL;
+	sRayHit local_hit;
+
+	while (true)
+	{
+		if (node->count)
+		{
+			//the ray goes to the space of the instance without normalizing, so the distances are the same
+			for (uint32 i = node->first; i < node->first + node->count; ++i)
+			{
+				const sBVHInstance& instance = instances[i];
+				if (!(instance.layers & layers))
+					continue;
+				sRay local_ray;
+				local_ray.origin = instance.inverse * ray.origin;
+				local_ray.direction = instance.inverse.rotateVector(ray.direction);
+				local_ray.max_distance = r.best_distance;
+				if (!instance.bvh->testRay(local_ray, local_hit, any_hit) || local_hit.distance >= r.best_distance)
+					continue;
+				r.best_distance = local_hit.distance;
+				best_instance = &instance;
+				hit = local_hit;
+				if (any_hit)
+					break;
+			}
+			if (any_hit && best_instance)
+				break;
+		}
+		else
+		{
+			const sBVHNode* a = &nodes[node->first];
+			const sBVHNode* b = a + 1;
+			float near_a, near_b;
+			bool hit_a = intersectBox(r, *a, near_a);
+			bool hit_b = intersectBox(r, *b, near_b);
+			if (hit_a && hit_b)
+			{
+				if (near_b < near_a)
+				{
+					std::swap(a, b);
+					std::swap(near_a, near_b);
+				}
+				assert(stack_size < BVH_MAX_DEPTH);
+				stack[stack_size].node = (uint32)(b - &nodes[0]);
+				stack[stack_size].near = near_b;
+				stack_size++;
+				node = a;
+				continue;
+			}
+			if (hit_a || hit_b)
+			{
+				node = hit_a ? a : b;
+				continue;
+			}
+		}
+
+		node = NULL;
+		while (stack_size)
+		{
+			sStackEntry& entry = stack[--stack_size];
+			if (entry.near <= r.best_distance)
+			{
+				node = &nodes[entry.node];
+				break;
+			}
+		}
+		if (!node)
+			break;
+	}
+
+	if (!best_instance)
+		return false;
+	hit.instance = best_instance->id;
+	hit.normal = transformNormal(best_instance->inverse, hit.normal);
+	return true;
+}
+
+void InstancesBVH::testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit, int layers) const
+{
+	int num_jobs = (count + BVH_RAYS_PER_JOB - 1) / BVH_RAYS_PER_JOB;
+	JobSystem::parallelFor(num_jobs, [&](int job) {
+		int end = std::min(count, (job + 1) * BVH_RAYS_PER_JOB);
+		for (int i = job * BVH_RAYS_PER_JOB; i < end; ++i)
+			testRay(rays[i], hits[i], any_hit, layers);
+	});
+}
+
+Vector3 transformNormal(const Matrix44& inv, const Vector3& n)
+{
+	Vector3 result(inv.m[0] * n.x + inv.m[1] * n.y + inv.m[2] * n.z, inv.m[4] * n.x + inv.m[5] * n.y + inv.m[6] * n.z, inv.m[8] * n.x + inv.m[9] * n.y + inv.m[10] * n.z);
+	float length = result.length();
+	return length > 0.0f ? result * (1.0f / length) : n;
+}
@@ -0,0 +1,97 @@
+/*  BVH of the triangles of a mesh, used by the ray and sphere queries of Mesh (picking, baking).
+	It is built with binned SAH and stored flattened: the two children of a node are consecutive and the leaves
+	keep up to 4 triangles in SoA, so a ray tests the 4 of them at once with SIMD.
+	Meshes build it with the first query, or read it from the .mbin where it is stored when cooking.
+	InstancesBVH is the level above: a BVH over the boxes of placed meshes (the nodes of the scene), the rays go
+	to the space of every instance they reach and continue in its MeshBVH.
+*/
+#pragma once
+
+#include "framework.h"
+
+#include <vector>
+
+class Mesh;
+
+#define BVH_NUM_BINS 16 //candidate splits per axis
+#define BVH_LEAF_TRIANGLES 4 //one sBVHTriangles4 per leaf
+#define BVH_MAX_DEPTH 64
+#define BVH_LEAF_INSTANCES 2 //instances per leaf of the InstancesBVH
+#define BVH_RAYS_PER_JOB 256 //testRays splits the batch in jobs of this size
+
+struct sBVHNode {
+	Vector3 min;
+	uint32 first; //inner: first child (the second one is first + 1), leaf: its triangle block
+	Vector3 max;
+	uint32 count; //triangles in the leaf, 0 for inner nodes
+};
+
+//4 triangles in SoA, the unused lanes have no area so they never hit
+struct sBVHTriangles4 {
+	float v0[3][4];
+	float e1[3][4]; //v1 - v0
+	float e2[3][4]; //v2 - v0
+	uint32 id[4]; //index of the triangle in the mesh
+};
+
+struct sRay {
+	Vector3 origin;
+	Vector3 direction; //if it is normalized the distances are in units
+	float max_distance;
+};
+
+struct sRayHit {
+	float distance;
+	int triangle; //-1 if there was no hit
+	int instance; //id of the sBVHInstance, -1 when testing a single mesh
+	Vector3 normal; //normalized, from the triangle (in world space for instances)
+
+	sRayHit() { distance = 0.0f; triangle = -1; instance = -1; }
+};
+
+class MeshBVH
+{
+public:
+	std::vector<sBVHNode> nodes; //the first one is the root
+	std::vector<sBVHTriangles4> triangles;
+
+	bool build(Mesh* mesh);
+	bool isEmpty() const { return nodes.empty(); }
+	size_t getMemoryUsed() const { return nodes.size() * sizeof(sBVHNode) + triangles.size() * sizeof(sBVHTriangles4); }
+
+	//queries in object space, the closest hit or with any_hit the first one found (for occlusion)
+	bool testRay(const sRay& ray, sRayHit& hit, bool any_hit = false) const;
+	bool testSphere(const Vector3& center, float radius, Vector3& collision, Vector3& normal) const;
+
+	//hits must have count elements, the rays are split between all the workers
+	void testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit = false) const;
+};
+
+//a MeshBVH placed in the world
+struct sBVHInstance {
+	const MeshBVH* bvh;
+	Matrix44 model;
+	Matrix44 inverse; //updated by build and refit
+	Vector3 min; //world bounds, updated by build and refit
+	Vector3 max;
+	int layers; //the queries skip the instances that don't share any bit with their layers
+	int id; //given by the owner, it is what the hits return (the instances are reordered)
+};
+
+class InstancesBVH
+{
+public:
+	std::vector<sBVHNode> nodes; //leaves: first instance and count
+	std::vector<sBVHInstance> instances;
+
+	void build(); //after filling instances
+	void refit(); //after changing the models, cheaper than build but the tree gets worse if they move a lot
+	bool isEmpty() const { return nodes.empty(); }
+
+	//rays in world space, the distances are in the units of the ray direction
+	bool testRay(const sRay& ray, sRayHit& hit, bool any_hit = false, int layers = 0xFF) const;
+	void testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit = false, int layers = 0xFF) const;
+};
+
+//normals go with the inverse transpose so they work with non uniform scales
+Vector3 transformNormal(const Matrix44& inv, const Vector3& n);
@@ -56,7 +56,7 @@ void Camera::updateProjectionMatrix()
 Vector3 Camera::getLocalVector(const Vector3& v)
 {
 	Matrix44 iV = view_matrix;
-	if (iV.inverse() == false)
+	if (iV.inverseAffine() == false)
 		std::cout << "Matrix Inverse error" << std::endl;
 	Vector3 result = iV.rotateVector(v);
 	return result;
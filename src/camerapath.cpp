@@ -0,0 +1,107 @@
+#include "camerapath.h"
+
+#include "camera.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cmath>
+#include <sstream>
+#include <iostream>
+
+void CameraPath::addKey(float time, Camera* camera)
+{
+	sCameraKey key;
+	key.time = time;
+	key.eye = camera->eye;
+	key.center = camera->center;
+	key.fov = camera->fov;
+	keys.push_back(key);
+}
+
+void CameraPath::apply(Camera* camera, float time) const
+{
+	if (keys.empty())
+		return;
+
+	//first key after time
+	size_t next = 0;
+	while (next < keys.size() && keys[next].time < time)
+		next++;
+
+	sCameraKey key;
+	if (next == 0)
+		key = keys.front();
+	else if (next == keys.size())
+		key = keys.back();
+	else
+	{
+		const sCameraKey& a = keys[next - 1];
+		const sCameraKey& b = keys[next];
+		float f = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0f;
+		key.eye = lerp(a.eye, b.eye, f);
+		key.center = lerp(a.center, b.center, f);
+		key.fov = lerp(a.fov, b.fov, f);
+	}
+
+	camera->lookAt(key.eye, key.center, Vector3(0, 1, 0));
+	camera->fov = key.fov;
+	camera->updateProjectionMatrix();
+}
+
+void CameraPath::createOrbit(const Vector3& eye, const Vector3& center, float fov, float duration, int num_keys)
+{
+	keys.clear();
+	Vector3 offset = eye - center;
+	float radius = sqrtf(offset.x * offset.x + offset.z * offset.z);
+	float angle = atan2f(offset.z, offset.x);
+	for (int i = 0; i < num_keys; ++i)
+	{
+		float f = i / (float)(num_keys - 1);
+		float a = angle + f * 2.0f * (float)PI;
+		sCameraKey key;
+		key.time = f * duration;
+		key.eye = center + Vector3(cosf(a) * radius, offset.y, sinf(a) * radius);
+		key.center = center;
+		key.fov = fov;
+		keys.push_back(key);
+	}
+}
+
+bool CameraPath::load(const char* filename)
+{
+	std::string content;
+	if (!readFile(filename, content))
+		return false;
+
+	keys.clear();
+	std::istringstream stream(content);
+	std::string line;
+	while (std::getline(stream, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		sCameraKey key;
+		if (sscanf(line.c_str(), "%f %f %f %f %f %f %f %f", &key.time, &key.eye.x, &key.eye.y, &key.eye.z, &key.center.x, &key.center.y, &key.center.z, &key.fov) != 8)
+		{
+			std::cout << "[ERROR] wrong camera key in " << filename << ": " << line << std::endl;
+			return false;
+		}
+		keys.push_back(key);
+	}
+	return keys.size() > 0;
+}
+
+bool CameraPath::save(const char* filename) const
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write camera path: " << filename << std::endl;
+		return false;
+	}
+	fprintf(f, "#time eye.x eye.y eye.z center.x center.y center.z fov\n");
+	for (const sCameraKey& key : keys)
+		fprintf(f, "%.3f %f %f %f %f %f %f %f\n", key.time, key.eye.x, key.eye.y, key.eye.z, key.center.x, key.center.y, key.center.z, key.fov);
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,35 @@
+/*  Camera path: keys of the camera recorded while navigating (F8 in the app), played back by the scene benchmark.
+	Stored as text, one key per line: time eye.xyz center.xyz fov
+*/
+#pragma once
+
+#include "framework.h"
+
+#include <vector>
+
+class Camera;
+
+struct sCameraKey {
+	float time; //seconds since the recording started
+	Vector3 eye;
+	Vector3 center;
+	float fov;
+};
+
+class CameraPath
+{
+public:
+	std::vector<sCameraKey> keys;
+
+	void clear() { keys.clear(); }
+	float getDuration() const { return keys.size() ? keys.back().time : 0.0f; }
+
+	void addKey(float time, Camera* camera);
+	void apply(Camera* camera, float time) const; //interpolates the keys around time
+
+	//a circle around center, used when there is no recorded path
+	void createOrbit(const Vector3& eye, const Vector3& center, float fov, float duration, int num_keys = 16);
+
+	bool load(const char* filename);
+	bool save(const char* filename) const;
+};
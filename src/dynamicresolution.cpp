@@ -0,0 +1,86 @@
+#include "dynamicresolution.h"
+
+#include "includes.h"
+#include "framework.h"
+#include "profiler.h"
+
+#include <algorithm>
+
+DynamicResolution::DynamicResolution()
+{
+	enabled = true;
+	target_ms = 16.0f;
+	min_scale = 0.5f;
+	max_scale = 1.0f;
+	kp = 0.1f;
+	ki = 0.05f;
+	kd = 0.0f;
+	scale = 1.0f;
+	gpu_ms = 0.0;
+	last_frame = -1;
+	errors[0] = errors[1] = 0.0f;
+}
+
+void DynamicResolution::update()
+{
+	max_scale = clamp(max_scale, 0.1f, 1.0f);
+	min_scale = clamp(min_scale, 0.1f, max_scale);
+	if (!enabled)
+	{
+		scale = max_scale;
+		errors[0] = errors[1] = 0.0f;
+		return;
+	}
+
+	//nothing new if the profiler is disabled or the GPU is still behind
+	const sProfilerFrame* frame = Profiler::getLastFrame(true);
+	if (!frame || frame->index == last_frame)
+		return;
+	last_frame = frame->index;
+	update(frame->getGPUTime());
+}
+
+void DynamicResolution::update(double frame_gpu_ms)
+{
+	gpu_ms = frame_gpu_ms;
+	if (frame_gpu_ms <= 0.0 || target_ms <= 0.0f)
+		return;
+
+	//positive when there is time left. The cost grows with the pixels, the square of the scale, so the scale changes half of it
+	float error = (float)((target_ms - frame_gpu_ms) / target_ms);
+	float delta = kp * (error - errors[0]) + ki * error + kd * (error - 2.0f * errors[0] + errors[1]);
+	errors[1] = errors[0];
+	errors[0] = error;
+	scale = clamp(scale * (1.0f + delta * 0.5f), min_scale, max_scale);
+}
+
+void DynamicResolution::getTargetSize(int window_width, int window_height, int& width, int& height) const
+{
+	width = std::max((int)(window_width * max_scale + 0.5f), 1);
+	height = std::max((int)(window_height * max_scale + 0.5f), 1);
+}
+
+void DynamicResolution::getRenderSize(int window_width, int window_height, int& width, int& height) const
+{
+	int target_width, target_height;
+	getTargetSize(window_width, window_height, target_width, target_height);
+	width = std::min(std::max((int)(window_width * scale + 0.5f), 1), target_width);
+	height = std::min(std::max((int)(window_height * scale + 0.5f), 1), target_height);
+}
+
+void DynamicResolution::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode(this, "Dynamic resolution"))
+		return;
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::Text("Scale %.2f, GPU %.2f ms", scale, gpu_ms);
+	ImGui::DragFloat("Target (ms)", &target_ms, 0.1f, 1.0f, 100.0f);
+	ImGui::SliderFloat("Min scale", &min_scale, 0.1f, 1.0f);
+	ImGui::SliderFloat("Max scale", &max_scale, 0.1f, 1.0f); //changing it allocates the targets again
+	ImGui::DragFloat("Kp", &kp, 0.005f, 0.0f, 1.0f);
+	ImGui::DragFloat("Ki", &ki, 0.005f, 0.0f, 1.0f);
+	ImGui::DragFloat("Kd", &kd, 0.005f, 0.0f, 1.0f);
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,36 @@
+/*  Dynamic resolution for the deferred pipeline: every frame it renders only a part of its render targets, the window size
+	times a scale that a controller moves to keep the GPU time of the frames close to a target. The targets are allocated
+	once for the biggest scale, so changing it only changes the viewports, and the result is upscaled to the window.
+	The controller is a PID in velocity form over the error relative to the target: it changes the scale, so the clamp
+	to the bounds doesn't wind up anything. The GPU times arrive PROFILER_GPU_LATENCY frames late, the gains are small.
+*/
+#pragma once
+
+class DynamicResolution
+{
+public:
+	bool enabled;
+	float target_ms; //GPU time wanted for a frame
+	float min_scale; //of the window size, in every axis
+	float max_scale; //the targets are allocated with this one
+	float kp; //gains of the controller
+	float ki;
+	float kd;
+
+	float scale; //used this frame
+	double gpu_ms; //the last one measured
+
+	DynamicResolution();
+
+	void update(); //once per frame before rendering, with the last frame of the profiler that has its GPU times
+	void update(double frame_gpu_ms); //a new measure
+
+	void getTargetSize(int window_width, int window_height, int& width, int& height) const; //to allocate
+	void getRenderSize(int window_width, int window_height, int& width, int& height) const; //the part used this frame
+
+	void renderInMenu();
+
+private:
+	long last_frame; //of the profiler, every frame is used once
+	float errors[2]; //of the previous two measures
+};
@@ -0,0 +1,538 @@
+#include "environment.h"
+
+#include "includes.h"
+#include "shader.h"
+#include "texture.h"
+#include "jobs.h"
+#include "utils.h"
+#include "extra/hdre.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+	struct sEnvironmentCacheHeader {
+		char magic[4]; //IBLP
+		int version;
+		uint64_t hash; //of the source pixels and the parameters
+		int size;
+		int levels;
+		int samples;
+	};
+
+	uint64_t computeParamsHash(int source_size, int channels, int size, int levels, int samples)
+	{
+		int params[6] = { ENVIRONMENT_CACHE_VERSION, source_size, channels, size, levels, samples };
+		return hashFNV64(params, sizeof(params));
+	}
+
+	uint64_t computeCacheHash(const float* const faces[6], int source_size, int channels, int size, int levels, int samples)
+	{
+		uint64_t hash = computeParamsHash(source_size, channels, size, levels, samples);
+		for (int i = 0; i < 6; ++i)
+			hash = hashFNV64(faces[i], (size_t)source_size * source_size * channels * sizeof(float), hash);
+		return hash;
+	}
+
+	int getMaxLevels(int size)
+	{
+		//every level halves the previous one, down to 1x1 at most
+		int max_levels = 1;
+		while ((size >> max_levels) > 0 && max_levels < ENVIRONMENT_MAX_LEVELS)
+			max_levels++;
+		return max_levels;
+	}
+
+	//a level of the source and its box filtered mips, rgb
+	struct sCubemapLevel {
+		int size;
+		std::vector<float> faces[6];
+	};
+
+	void downsample(const sCubemapLevel& src, sCubemapLevel& dst)
+	{
+		dst.size = std::max(src.size / 2, 1);
+		int last = src.size - 1;
+		for (int face = 0; face < 6; ++face)
+		{
+			const float* in = &src.faces[face][0];
+			dst.faces[face].resize(dst.size * dst.size * 3);
+			float* out = &dst.faces[face][0];
+			for (int y = 0; y < dst.size; ++y)
+				for (int x = 0; x < dst.size; ++x)
+				{
+					int x0 = std::min(x * 2, last), x1 = std::min(x * 2 + 1, last);
+					int y0 = std::min(y * 2, last), y1 = std::min(y * 2 + 1, last);
+					for (int c = 0; c < 3; ++c)
+						out[(y * dst.size + x) * 3 + c] = 0.25f * (in[(y0 * src.size + x0) * 3 + c] + in[(y0 * src.size + x1) * 3 + c] +
+							in[(y1 * src.size + x0) * 3 + c] + in[(y1 * src.size + x1) * 3 + c]);
+				}
+		}
+	}
+
+	//the face and its coordinates of a direction like the GL does it, the same axes as cubemapFaceNormals
+	int directionToFace(const Vector3& dir, float& s, float& t)
+	{
+		float ax = fabsf(dir.x), ay = fabsf(dir.y), az = fabsf(dir.z);
+		int face;
+		float sc, tc, ma;
+		if (ax >= ay && ax >= az)
+		{
+			face = dir.x > 0.0f ? 0 : 1;
+			ma = ax;
+			sc = dir.x > 0.0f ? -dir.z : dir.z;
+			tc = -dir.y;
+		}
+		else if (ay >= az)
+		{
+			face = dir.y > 0.0f ? 2 : 3;
+			ma = ay;
+			sc = dir.x;
+			tc = dir.y > 0.0f ? dir.z : -dir.z;
+		}
+		else
+		{
+			face = dir.z > 0.0f ? 4 : 5;
+			ma = az;
+			sc = dir.z > 0.0f ? dir.x : -dir.x;
+			tc = -dir.y;
+		}
+		s = (sc / ma + 1.0f) * 0.5f;
+		t = (tc / ma + 1.0f) * 0.5f;
+		return face;
+	}
+
+	//bilinear inside the face, the borders are clamped
+	Vector3 sampleFace(const sCubemapLevel& level, int face, float s, float t)
+	{
+		float x = s * level.size - 0.5f;
+		float y = t * level.size - 0.5f;
+		int x0 = (int)floorf(x), y0 = (int)floorf(y);
+		float fx = x - x0, fy = y - y0;
+		int last = level.size - 1;
+		int x1 = std::min(std::max(x0 + 1, 0), last), y1 = std::min(std::max(y0 + 1, 0), last);
+		x0 = std::min(std::max(x0, 0), last);
+		y0 = std::min(std::max(y0, 0), last);
+
+		const float* p = &level.faces[face][0];
+		const float* a = p + (y0 * level.size + x0) * 3;
+		const float* b = p + (y0 * level.size + x1) * 3;
+		const float* c = p + (y1 * level.size + x0) * 3;
+		const float* d = p + (y1 * level.size + x1) * 3;
+		float wa = (1.0f - fx) * (1.0f - fy), wb = fx * (1.0f - fy), wc = (1.0f - fx) * fy, wd = fx * fy;
+		return Vector3(a[0] * wa + b[0] * wb + c[0] * wc + d[0] * wd,
+			a[1] * wa + b[1] * wb + c[1] * wc + d[1] * wd,
+			a[2] * wa + b[2] * wb + c[2] * wc + d[2] * wd);
+	}
+
+	Vector3 sampleCubemap(const std::vector<sCubemapLevel>& mips, const Vector3& dir, float lod)
+	{
+		float s, t;
+		int face = directionToFace(dir, s, t);
+		lod = clamp(lod, 0.0f, (float)(mips.size() - 1));
+		int level = (int)lod;
+		float f = lod - level;
+		Vector3 color = sampleFace(mips[level], face, s, t);
+		if (f <= 0.0f || level + 1 >= (int)mips.size())
+			return color;
+		return color * (1.0f - f) + sampleFace(mips[level + 1], face, s, t) * f;
+	}
+
+	//van der corput, the second coordinate of the hammersley points
+	float radicalInverse(unsigned int bits)
+	{
+		bits = (bits << 16u) | (bits >> 16u);
+		bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+		bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+		bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+		bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+		return bits * 2.3283064365386963e-10f;
+	}
+
+	struct sLobeSample {
+		Vector3 direction; //around (0,0,1)
+		float weight; //NdotL
+		float lod; //of the source with the solid angle of the sample
+	};
+
+	//the same samples for every texel of a level, only rotated: the lights of the GGX lobe with N = V = R
+	std::vector<sLobeSample> computeLobe(float roughness, int samples, int source_size)
+	{
+		float alpha = roughness * roughness;
+		float alpha2 = alpha * alpha;
+		float texel_solid_angle = 4.0f * (float)PI / (6.0f * source_size * source_size);
+		std::vector<sLobeSample> lobe;
+		for (int i = 0; i < samples; ++i)
+		{
+			float phi = 2.0f * (float)PI * (i + 0.5f) / samples;
+			float xi = radicalInverse(i);
+			float cos_theta = sqrtf((1.0f - xi) / (1.0f + (alpha2 - 1.0f) * xi));
+			float sin_theta = sqrtf(std::max(1.0f - cos_theta * cos_theta, 0.0f));
+			Vector3 H(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+			Vector3 L = H * (2.0f * cos_theta) - Vector3(0, 0, 1);
+			if (L.z <= 0.0f)
+				continue;
+
+			//pdf of L is D * NdotH / (4 * VdotH), and here NdotH == VdotH
+			float d = cos_theta * cos_theta * (alpha2 - 1.0f) + 1.0f;
+			float D = alpha2 / ((float)PI * d * d);
+			float sample_solid_angle = 1.0f / (samples * std::max(D * 0.25f, 0.0001f));
+			sLobeSample sample;
+			sample.direction = L;
+			sample.weight = L.z;
+			sample.lod = std::max(0.5f * log2f(sample_solid_angle / texel_solid_angle) + 1.0f, 0.0f);
+			lobe.push_back(sample);
+		}
+		return lobe;
+	}
+
+	Vector3 texelDirection(int face, int x, int y, int size)
+	{
+		const Vector3* axis = cubemapFaceNormals[face];
+		float u = 2.0f * (x + 0.5f) / size - 1.0f;
+		float v = 2.0f * (y + 0.5f) / size - 1.0f;
+		return normalize(axis[0] * u + axis[1] * v + axis[2]);
+	}
+}
+
+PrefilteredEnvironment::PrefilteredEnvironment()
+{
+	size = 128;
+	levels = 6;
+	samples = 128;
+	enabled = true;
+	texture = NULL;
+	sh = SphericalHarmonics();
+}
+
+PrefilteredEnvironment::~PrefilteredEnvironment()
+{
+	clear();
+}
+
+void PrefilteredEnvironment::clear()
+{
+	if (texture)
+		delete texture;
+	texture = NULL;
+	pixels.clear();
+	source_filename.clear();
+}
+
+const float* PrefilteredEnvironment::getFace(int level, int face) const
+{
+	assert(isValid() && level < levels && face < 6);
+	size_t offset = 0;
+	for (int i = 0; i < level; ++i)
+		offset += (size_t)getLevelSize(i) * getLevelSize(i) * 3 * 6;
+	return &pixels[offset + (size_t)getLevelSize(level) * getLevelSize(level) * 3 * face];
+}
+
+std::string PrefilteredEnvironment::getCacheFilename(const char* source_filename)
+{
+	std::string filename = source_filename;
+	size_t dot = filename.find_last_of('.');
+	if (dot != std::string::npos)
+		filename = filename.substr(0, dot);
+	return filename + ".ibl";
+}
+
+bool PrefilteredEnvironment::loadHDRE(const char* filename, int max_size)
+{
+	//the file is mapped, only the pages of the level read are loaded (none if the cache is valid)
+	HDRE hdre;
+	if (!hdre.load(filename))
+		return false;
+	std::string source = filename; //filename could be source_filename
+
+	//the quality tier, only the levels that halve the previous one (before v3 the last ones are 8x8)
+	int level = 0;
+	while (max_size > 0 && level + 1 < hdre.levels && hdre.getLevelSize(level) > max_size && hdre.getLevelSize(level + 1) == (hdre.width >> (level + 1)))
+		level++;
+	int source_size = hdre.getLevelSize(level);
+	int channels = hdre.header.numChannels;
+	if (max_size > 0)
+		size = std::min(size, max_size);
+	levels = std::min(std::max(levels, 1), getMaxLevels(size));
+
+	SphericalHarmonics header_sh;
+	const float* coeffs = hdre.getSHCoeffs();
+	if (coeffs)
+		for (int i = 0; i < 9; ++i)
+			header_sh.coeffs[i] = Vector3(coeffs[i * 3], coeffs[i * 3 + 1], coeffs[i * 3 + 2]);
+
+	//the file instead of its pixels in the hash, so the next runs don't read them
+	size_t file_size = 0;
+	long long file_time = 0;
+	getFileInfo(source, file_size, file_time);
+	uint64_t hash = computeParamsHash(source_size, channels, size, levels, samples);
+	hash = hashFNV64(&file_size, sizeof(file_size), hash);
+	hash = hashFNV64(&file_time, sizeof(file_time), hash);
+	if (!build(hdre.getFaces(level), source_size, channels, getCacheFilename(filename).c_str(), hash, coeffs ? &header_sh : NULL))
+		return false;
+	source_filename = source;
+	return true;
+}
+
+bool PrefilteredEnvironment::build(FloatImage faces[6], const char* cache_filename)
+{
+	const float* data[6];
+	for (int i = 0; i < 6; ++i)
+	{
+		if (faces[i].width != faces[0].width || faces[i].height != faces[i].width || faces[i].num_channels != faces[0].num_channels)
+		{
+			std::cout << "[ERROR] the faces of a cubemap must be square and of the same size" << std::endl;
+			return false;
+		}
+		data[i] = faces[i].data;
+	}
+	return build(data, faces[0].width, faces[0].num_channels, cache_filename);
+}
+
+bool PrefilteredEnvironment::build(const float* const faces[6], int source_size, int channels, const char* cache_filename)
+{
+	levels = std::min(std::max(levels, 1), getMaxLevels(size));
+	return build(faces, source_size, channels, cache_filename, computeCacheHash(faces, source_size, channels, size, levels, samples), NULL);
+}
+
+bool PrefilteredEnvironment::build(const float* const faces[6], int source_size, int channels, const char* cache_filename, uint64_t hash, const SphericalHarmonics* source_sh)
+{
+	assert(source_size > 0 && channels >= 3);
+	if (cache_filename && load(cache_filename, hash))
+	{
+		if (source_sh)
+			sh = *source_sh;
+		return true;
+	}
+
+	double start_time = getTime();
+	if (!prefilter(faces, source_size, channels, source_sh))
+		return false;
+	std::cout << " + Environment prefiltered: " << size << "x" << size << ", " << levels << " levels in " << (getTime() - start_time) << " ms" << std::endl;
+	if (cache_filename)
+		save(cache_filename, hash);
+	return true;
+}
+
+bool PrefilteredEnvironment::prefilter(const float* const faces[6], int source_size, int channels, const SphericalHarmonics* source_sh)
+{
+	//the source without alpha and its mips, the samples of the rough levels read the small ones
+	std::vector<sCubemapLevel> mips(1);
+	mips[0].size = source_size;
+	for (int face = 0; face < 6; ++face)
+	{
+		mips[0].faces[face].resize(source_size * source_size * 3);
+		for (int i = 0; i < source_size * source_size; ++i)
+			for (int c = 0; c < 3; ++c)
+				mips[0].faces[face][i * 3 + c] = faces[face][i * channels + c];
+	}
+	while (mips.back().size > 1)
+	{
+		mips.push_back(sCubemapLevel());
+		downsample(mips[mips.size() - 2], mips.back());
+	}
+
+	//the diffuse from a small mip, 9 coefficients don't need more. The ones of the source if it has them
+	if (source_sh)
+		sh = *source_sh;
+	else
+	{
+		int sh_level = 0;
+		while (sh_level + 1 < (int)mips.size() && mips[sh_level].size > 32)
+			sh_level++;
+		FloatImage sh_faces[6];
+		for (int face = 0; face < 6; ++face)
+		{
+			sh_faces[face].resize(mips[sh_level].size, mips[sh_level].size, 3);
+			memcpy(sh_faces[face].data, &mips[sh_level].faces[face][0], mips[sh_level].faces[face].size() * sizeof(float));
+		}
+		sh = computeSH(sh_faces);
+	}
+
+	size_t total = 0;
+	for (int level = 0; level < levels; ++level)
+		total += (size_t)getLevelSize(level) * getLevelSize(level) * 3 * 6;
+	pixels.resize(total);
+
+	float* out = &pixels[0];
+	for (int level = 0; level < levels; ++level)
+	{
+		int level_size = getLevelSize(level);
+		float roughness = levels > 1 ? level / (float)(levels - 1) : 0.0f;
+		std::vector<sLobeSample> lobe;
+		if (roughness > 0.0f)
+			lobe = computeLobe(roughness, std::max(samples, 1), source_size);
+		float mirror_lod = std::max(log2f(source_size / (float)level_size), 0.0f); //the box filter to the size of the level
+
+		//a row of a face per job, every texel rotates the lobe around its direction
+		JobSystem::parallelFor(6 * level_size, [&](int row) {
+			int face = row / level_size;
+			int y = row % level_size;
+			float* dst = out + ((size_t)face * level_size + y) * level_size * 3;
+			for (int x = 0; x < level_size; ++x)
+			{
+				Vector3 N = texelDirection(face, x, y, level_size);
+				Vector3 color;
+				if (lobe.empty())
+					color = sampleCubemap(mips, N, mirror_lod);
+				else
+				{
+					Vector3 up = fabsf(N.z) < 0.999f ? Vector3(0, 0, 1) : Vector3(1, 0, 0);
+					Vector3 tangent = normalize(up.cross(N));
+					Vector3 bitangent = N.cross(tangent);
+					float total_weight = 0.0f;
+					for (size_t i = 0; i < lobe.size(); ++i)
+					{
+						const sLobeSample& sample = lobe[i];
+						Vector3 L = tangent * sample.direction.x + bitangent * sample.direction.y + N * sample.direction.z;
+						color += sampleCubemap(mips, L, sample.lod) * sample.weight;
+						total_weight += sample.weight;
+					}
+					color = color * (1.0f / std::max(total_weight, 0.0001f));
+				}
+				dst[x * 3] = color.x;
+				dst[x * 3 + 1] = color.y;
+				dst[x * 3 + 2] = color.z;
+			}
+		});
+		out += (size_t)level_size * level_size * 3 * 6;
+	}
+	return true;
+}
+
+bool PrefilteredEnvironment::load(const char* filename, uint64_t hash)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	sEnvironmentCacheHeader header;
+	bool valid = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, "IBLP", 4) == 0 && header.version == ENVIRONMENT_CACHE_VERSION &&
+		header.hash == hash && header.size == size && header.levels == levels && header.samples == samples;
+	SphericalHarmonics file_sh;
+	std::vector<float> file_pixels;
+	if (valid)
+	{
+		size_t total = 0;
+		for (int level = 0; level < levels; ++level)
+			total += (size_t)getLevelSize(level) * getLevelSize(level) * 3 * 6;
+		file_pixels.resize(total);
+		valid = fread(&file_sh, sizeof(SphericalHarmonics), 1, f) == 1 && fread(&file_pixels[0], sizeof(float), total, f) == total;
+	}
+	fclose(f);
+
+	if (!valid)
+	{
+		std::cout << "[WARN] environment cache is outdated: " << filename << std::endl;
+		return false;
+	}
+	sh = file_sh;
+	pixels.swap(file_pixels);
+	return true;
+}
+
+bool PrefilteredEnvironment::save(const char* filename, uint64_t hash) const
+{
+	assert(isValid() && "environment not prefiltered");
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write environment cache: " << filename << std::endl;
+		return false;
+	}
+
+	sEnvironmentCacheHeader header;
+	memcpy(header.magic, "IBLP", 4);
+	header.version = ENVIRONMENT_CACHE_VERSION;
+	header.hash = hash;
+	header.size = size;
+	header.levels = levels;
+	header.samples = samples;
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&sh, sizeof(SphericalHarmonics), 1, f);
+	fwrite(&pixels[0], sizeof(float), pixels.size(), f);
+	fclose(f);
+	return true;
+}
+
+void PrefilteredEnvironment::upload()
+{
+	if (texture)
+		delete texture;
+	texture = NULL;
+	if (!isValid())
+		return;
+
+	texture = new Texture();
+	texture->width = texture->height = (float)size;
+	texture->format = GL_RGB;
+	texture->type = GL_FLOAT;
+	texture->internal_format = GL_RGB16F;
+	texture->texture_type = GL_TEXTURE_CUBE_MAP;
+	texture->mipmaps = levels > 1;
+	glGenTextures(1, &texture->texture_id);
+
+	//the levels stop at the roughness 1, the mips below it are never read
+	for (int level = 0; level < levels; ++level)
+	{
+		const float* faces[6];
+		for (int face = 0; face < 6; ++face)
+			faces[face] = getFace(level, face);
+		texture->uploadCubemap(GL_RGB, GL_FLOAT, false, (Uint8**)faces, GL_RGB16F, level);
+	}
+
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, texture->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+void PrefilteredEnvironment::setUniforms(Shader* shader) const
+{
+	//the split sum of the reflections, also for the probes (only tried once if it is missing)
+	static Texture* brdf_lut = Texture::Get("data/textures/brdfLUT.png", false, false);
+	shader->setUniform("u_brdf_enabled", brdf_lut ? 1 : 0);
+	if (brdf_lut)
+		shader->setUniform("u_brdf_lut", brdf_lut, BRDF_LUT_SLOT);
+	else
+		shader->setUniform1("u_brdf_lut", BRDF_LUT_SLOT);
+
+	if (!enabled || !texture)
+	{
+		shader->setUniform("u_env_enabled", 0);
+		shader->setUniform1("u_env_texture", ENVIRONMENT_SLOT); //a cube sampler can't share the unit 0 with the 2D ones
+		return;
+	}
+	shader->setUniform("u_env_enabled", 1);
+	shader->setUniform("u_env_texture", texture, ENVIRONMENT_SLOT);
+	shader->setUniform("u_env_levels", (float)levels);
+}
+
+void PrefilteredEnvironment::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode(this, "Environment"))
+		return;
+	if (source_filename.empty())
+		ImGui::Text("No environment");
+	else
+		ImGui::Text("%s (the ambient comes from its SH)", source_filename.c_str());
+	ImGui::Checkbox("Reflected", &enabled);
+	int size_option = 0; //power of two so it has all the mips
+	while (size_option < 3 && (32 << size_option) < size)
+		size_option++;
+	if (ImGui::Combo("Size", &size_option, "32\0" "64\0" "128\0" "256\0"))
+		size = 32 << size_option;
+	ImGui::SliderInt("Levels", &levels, 1, ENVIRONMENT_MAX_LEVELS);
+	ImGui::SliderInt("Samples", &samples, 16, 1024);
+	if (!source_filename.empty() && ImGui::Button("Prefilter") && loadHDRE(source_filename.c_str(), size)) //no need to read a bigger level
+		upload();
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,67 @@
+/*  Prefiltered environment: the specular mips of a cubemap for image based lighting, and its diffuse SH.
+	Every mip is the environment convolved with the GGX lobe of a roughness (the first one is a mirror, the last one
+	roughness 1), importance sampled on the CPU with N = V = R and split between the workers. The samples read the mips
+	of the source that match their solid angle (filtered importance sampling), so a few of them are enough without noise.
+	The result is stored in a cache next to the source with the hash of its pixels (of the size and date of the HDRE file),
+	the next runs only read it.
+	The shaders reflect it where there are no reflection probes, with the split sum of brdfLUT.png.
+*/
+#pragma once
+
+#include "framework.h"
+#include "sphericalharmonics.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+class Shader;
+class Texture;
+
+#define ENVIRONMENT_SLOT 10 //texture slot used by u_env_texture
+#define BRDF_LUT_SLOT 11 //texture slot used by u_brdf_lut
+#define ENVIRONMENT_MAX_LEVELS 8
+#define ENVIRONMENT_CACHE_VERSION 1
+
+class PrefilteredEnvironment
+{
+public:
+	int size; //of the faces of the first mip
+	int levels; //mips, the roughness of a mip is level / (levels - 1)
+	int samples; //of the GGX lobe for every texel
+	bool enabled;
+
+	std::string source_filename; //the HDRE, to prefilter it again with other parameters
+	std::vector<float> pixels; //rgb, all the faces of a level together and the levels one after the other (like a HDRE)
+	SphericalHarmonics sh; //of the source, for the diffuse
+	Texture* texture; //GL_TEXTURE_CUBE_MAP with the levels as mips
+
+	PrefilteredEnvironment();
+	~PrefilteredEnvironment();
+
+	bool isValid() const { return !pixels.empty(); }
+	int getLevelSize(int level) const { return std::max(size >> level, 1); }
+	const float* getFace(int level, int face) const;
+
+	//from a HDRE or six faces of any size (+x, -x, +y, -y, +z, -z). Of the HDRE only one level is read, the first one not bigger
+	//than max_size (0 the first one): the rest are blurred with another filter. The SH of its header is used when it has one
+	bool loadHDRE(const char* filename, int max_size = 0);
+	bool build(FloatImage faces[6], const char* cache_filename = NULL);
+	bool build(const float* const faces[6], int source_size, int channels, const char* cache_filename = NULL);
+
+	//the cache keeps the hash of the source and of the parameters, it is ignored if they don't match
+	static std::string getCacheFilename(const char* source_filename);
+
+	void upload();
+	void clear();
+	void setUniforms(Shader* shader) const; //u_env_enabled is 0 if there is nothing prefiltered
+
+	void renderInMenu();
+
+private:
+	bool build(const float* const faces[6], int source_size, int channels, const char* cache_filename, uint64_t hash, const SphericalHarmonics* source_sh);
+	bool prefilter(const float* const faces[6], int source_size, int channels, const SphericalHarmonics* source_sh);
+	bool load(const char* filename, uint64_t hash);
+	bool save(const char* filename, uint64_t hash) const;
+};
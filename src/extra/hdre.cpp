@@ -2,6 +2,7 @@
 #include <fstream>
 #include <cmath>
 #include <cassert>
+#include <cstring>
 #include <algorithm>
 
 #include "../utils.h"
@@ -23,18 +24,15 @@ HDRE::HDRE(const char* filename)
 
 void HDRE::init()
 {
-    data = nullptr;
+    file = nullptr;
     width = height = 0;
-    levels = N_MAX_LEVELS;
+    levels = 0;
 
-    for (int j = 0; j < N_FACES; j++)
+    for (int i = 0; i < N_LEVELS; i++)
     {
-        for (int i = 0; i < N_MAX_LEVELS; i++)
-        {
-            pixels_h[i][j] = nullptr;
-            pixels_f[i][j] = nullptr;
-            pixels_b[i][j] = nullptr;
-        }
+        level_sizes[i] = 0;
+        for (int j = 0; j < N_FACES; j++)
+            pixels[i][j] = nullptr;
     }
 }
 
@@ -47,196 +45,88 @@ HDRE::~HDRE()
 	    s_loaded_hdres.erase(it);
 }
 
-/*sHDRELevel HDRE::getLevel(int n)
+const float** HDRE::getFaces(int level)
 {
-	sHDRELevel level;
-
-	//float size = std::max(8, (int)(this->width / pow(2.0, n)));
-	float size = fmax(8, (int)(this->width / pow(2.0, n)));
-
-	if (this->version > 2.0)
-		size = (int)(this->width / pow(2.0, n));
-
-	level.width = size;
-	level.height = size; // cubemap sizes!
-	level.data_f = this->faces_array_f[n];
-	level.faces_f = this->getFacesf(n);
-
-	level.data_h = this->faces_array_h[n];
-	level.faces_h = this->getFacesh(n);
-
-	return level;
-}*/
-
-float* HDRE::getData()
-{
-	return this->data;
+    return this->pixels[level];
 }
-
-float** HDRE::getFacesf(int level)
+const float* HDRE::getFace(int level, int face)
 {
-    return this->pixels_f[level];
-}
-float* HDRE::getFacef(int level, int face)
-{
-    return this->pixels_f[level][face];
-}
-
-byte** HDRE::getFacesb(int level)
-{
-	return this->pixels_b[level];
-}
-byte* HDRE::getFaceb(int level, int face)
-{
-    return this->pixels_b[level][face];
-}
-
-short** HDRE::getFacesh(int level)
-{
-    return this->pixels_h[level];
-}
-short* HDRE::getFaceh(int level, int face)
-{
-    return this->pixels_h[level][face];
+    return this->pixels[level][face];
 }
 
 
 bool HDRE::load(const char* filename)
 {
 	assert(filename);
+	clean();
 
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+	file = new MappedFile();
+	if (!file->open(filename) || file->size < sizeof(sHDREHeader))
+	{
+		clean();
 		return false;
+	}
 
 	sHDREHeader HDREHeader;
+	memcpy(&HDREHeader, file->data, sizeof(sHDREHeader));
 
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
-
-	if (HDREHeader.type != 3) {
-        printf("HDRE Header has wrong type: %d\n", HDREHeader.type);
-        throw ("ArrayType not supported. Please export in Float32Array.");
-    }
-
-    this->header = HDREHeader;
-
-	int width = HDREHeader.width;
-	int height = HDREHeader.height;
-
-	this->width = width;
-	this->height = height;
-
-	int dataSize = 0;
-	int w = width;
-
-	// Get number of floats inside the HDRE
-	// Per channel & Per face
-	for (int i = 0; i < N_LEVELS; i++)
+	if (strncmp(HDREHeader.signature, "HDRE", 4) != 0 || HDREHeader.type != 3 || (HDREHeader.numChannels != 3 && HDREHeader.numChannels != 4) || HDREHeader.width <= 0)
 	{
-		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
-
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+		std::cout << "[ERROR] HDRE not supported (only Float32Array with 3 or 4 channels): " << filename << std::endl;
+		clean();
+		return false;
 	}
 
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
-
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
-
-	// get separated levels
-
-	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
-
-	int nFullMips = 0;
-	while (w)
-    {
-	    nFullMips++;
-	    w >>= 1;
-    }
-	assert(nFullMips <= N_MAX_LEVELS);
-	levels = nFullMips;
-	w = width;
-    printf("Load %d mips of HDRE texture\n", nFullMips);
+    this->header = HDREHeader;
+	this->width = HDREHeader.width;
+	this->height = HDREHeader.height;
 
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
+	// the levels go one after the other, all the faces of a level together
+	// before v3 the levels don't go below 8x8
+	size_t offset = HDREHeader.headerSize;
+	int w = width;
+	levels = 0;
+	for (int i = 0; i < N_LEVELS && w > 0; i++)
 	{
-		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
-
-		int faceOffset = 0;
+		size_t face_floats = (size_t)w * w * HDREHeader.numChannels;
+		if (offset + face_floats * N_FACES * sizeof(float) > file->size)
+		{
+			std::cout << "[ERROR] HDRE file is truncated: " << filename << std::endl;
+			clean();
+			return false;
+		}
 
+		level_sizes[i] = w;
 		for (int j = 0; j < N_FACES; j++)
 		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
-
-			// set data
-			for (int k = 0; k < faceSize; k++) {
-
-				float value = this->data[mapOffset + faceOffset + k];
-
-				this->pixels_f[i][j][k] = value;
-			}
-
-			// update face offset
-			faceOffset += faceSize;
+			pixels[i][j] = (const float*)(file->data + offset);
+			offset += face_floats * sizeof(float);
 		}
+		levels++;
 
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
-		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+		w = width >> (i + 1);
+		if (this->header.version <= 2.0)
+			w = std::max(8, w);
 	}
-	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
+
+	std::cout << " + '" << filename << "' (v" << this->header.version << ") mapped, " << levels << " levels" << std::endl;
 	return true;
 }
 
 bool HDRE::clean()
 {
-	try
-	{
-		if (data)
-			delete data;
-
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
-		}
+	if (file)
+		delete file;
+	file = nullptr;
 
-		return true;
-	}
-	catch (const std::exception&)
+	for (int i = 0; i < N_LEVELS; i++)
 	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
+		level_sizes[i] = 0;
+		for (int j = 0; j < N_FACES; j++)
+			pixels[i][j] = nullptr;
 	}
-
-	return false;
+	levels = 0;
+	return true;
 }
 
 HDRE* HDRE::Get(const char* filename)
@@ -255,4 +145,4 @@ HDRE* HDRE::Get(const char* filename)
 
 	s_loaded_hdres[filename] = hdre;
 	return hdre;
-}
\ No newline at end of file
+}
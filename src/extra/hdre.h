@@ -7,7 +7,7 @@
 #include <string>
 #include <map>
 
-typedef unsigned char byte;
+class MappedFile;
 
 typedef struct {
 
@@ -33,28 +33,16 @@ typedef struct {
 
 } sHDREHeader;
 
-typedef struct {
-
-	int width;
-	int height;
-
-	float* data_f;
-	float** faces_f;
-	short* data_h;
-	short** faces_h;
-
-} sHDRELevel;
-
+//the file is mapped and the faces point inside it, nothing is copied: only the pages of the levels read are loaded
 class HDRE {
 
 private:
 
     std::string filename;
-	float* data; // only f32 now
+	MappedFile* file;
 
-    float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
-    short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
-    byte* pixels_b[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
+    const float* pixels[N_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
+	int level_sizes[N_LEVELS];
 
 	bool clean();
 	void init();
@@ -65,36 +53,26 @@ public:
 	sHDREHeader header;
 	int width;
 	int height;
-    int levels = N_MAX_LEVELS;
+    int levels; // stored in the file, the first is the environment and the rest are blurred for the roughness
 
 	HDRE();
 	HDRE(const char* filename);
 	~HDRE();
 
 	bool load(const char* filename);
-	//bool load(void* data, int size);
 
 	// useful methods
 	float getMaxLuminance() { return this->header.maxLuminance; };
-	float* getSHCoeffs()
+	float* getSHCoeffs() // 9 RGB coefficients, NULL if the file doesn't have them
 	{
-		if (this->header.numCoeffs > 0)
+		if (this->header.includesSH && this->header.numCoeffs > 0)
 			return this->header.coeffs;
 		return nullptr;
 	}
 
-	float* getData(); // All pixel data
-
-	float* getFacef(int level, int face);	// Specific level and face
-	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data
-
-    byte* getFaceb(int level, int face);	// Specific level and face
-    byte** getFacesb(int level = 0);		// [[]]: Array per face with all level data
-
-    short* getFaceh(int level, int face);	// Specific level and face
-	short** getFacesh(int level = 0);		// [[]]: Array per face with all level data
-
-	//sHDRELevel getLevel(int level = 0);
+	int getLevelSize(int level) { return level_sizes[level]; }
+	const float* getFace(int level, int face);	// Specific level and face, in the mapped file
+	const float** getFaces(int level = 0);		// [[]]: Array per face with all level data
 
 	static HDRE* Get(const char* filename);
 };
@@ -1,5 +1,6 @@
 #include "fbo.h"
 #include <cassert>
+#include <algorithm>
 #include "utils.h"
 
 FBO::FBO()
@@ -221,6 +222,37 @@ bool FBO::setDepthOnly(int width, int height)
 	return true;
 }
 
+bool FBO::setTextureLayer(Texture* texture, int layer, int level)
+{
+	assert(texture && texture->texture_type == GL_TEXTURE_2D_ARRAY);
+	assert(layer >= 0 && layer < (int)texture->depth);
+	assert(glGetError() == GL_NO_ERROR);
+
+	width = std::max(1, (int)texture->width >> level);
+	height = std::max(1, (int)texture->height >> level);
+
+	if (fbo_id == 0)
+		glGenFramebuffersEXT(1, &fbo_id);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, texture->texture_id, level, layer);
+
+	memset(bufs, 0, sizeof(bufs));
+	bufs[0] = GL_COLOR_ATTACHMENT0_EXT;
+	glDrawBuffers(4, bufs);
+	color_textures[0] = texture;
+	num_color_textures = 1;
+	depth_texture = NULL;
+
+	GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
+	{
+		std::cout << "Error: Framebuffer object is not completed: " << status << std::endl;
+		return false;
+	}
+	return true;
+}
+
 void FBO::bind()
 {
 	assert(glGetError() == GL_NO_ERROR);
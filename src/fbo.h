@@ -28,6 +28,7 @@ public:
 	bool setTexture(Texture* texture, int cubemap_face = -1);
 	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
 	bool setDepthOnly(int width, int height); //use this for shadowmaps
+	bool setTextureLayer(Texture* texture, int layer, int level = 0); //one layer (and mip) of a GL_TEXTURE_2D_ARRAY, without depth
 	
 	void bind();
 	void unbind();
@@ -12,6 +12,21 @@
 
 #define M_PI_2 1.57079632679489661923
 
+//SIMD used by the matrix functions when the compiler supports it
+#ifndef FRAMEWORK_NO_SIMD
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define FRAMEWORK_SSE
+		#include <xmmintrin.h>
+		#ifdef __AVX__
+			#define FRAMEWORK_AVX
+			#include <immintrin.h>
+		#endif
+	#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		#define FRAMEWORK_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
+
 //**************************************
 float Vector2::distance(const Vector2& v)
 {
@@ -436,44 +451,120 @@ Vector3 Matrix44::project(const Vector3& v)
 }
 
 
+const char* getMathSIMDName()
+{
+#if defined(FRAMEWORK_AVX)
+	return "AVX";
+#elif defined(FRAMEWORK_SSE)
+	return "SSE";
+#elif defined(FRAMEWORK_NEON)
+	return "NEON";
+#else
+	return "scalar";
+#endif
+}
+
 //Multiply a matrix by another and returns the result
+//every row of the result is the sum of the rows of the second matrix weighted by the row of the first one
 Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 {
 	Matrix44 ret;
-
-	unsigned int i,j,k;
-	for (i=0;i<4;i++) 	
+#if defined(FRAMEWORK_AVX)
+	//two rows at once
+	__m256 b0 = _mm256_broadcast_ps((const __m128*)matrix.M[0]);
+	__m256 b1 = _mm256_broadcast_ps((const __m128*)matrix.M[1]);
+	__m256 b2 = _mm256_broadcast_ps((const __m128*)matrix.M[2]);
+	__m256 b3 = _mm256_broadcast_ps((const __m128*)matrix.M[3]);
+	for (int i = 0; i < 4; i += 2)
 	{
-		for (j=0;j<4;j++) 
-		{
-			ret.M[i][j]=0.0;
-			for (k=0;k<4;k++) 
-				ret.M[i][j] += M[i][k] * matrix.M[k][j];
-		}
+		__m256 a = _mm256_loadu_ps(M[i]);
+		__m256 r = _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x00), b0);
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x55), b1));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xAA), b2));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xFF), b3));
+		_mm256_storeu_ps(ret.M[i], r);
 	}
-
+#elif defined(FRAMEWORK_SSE)
+	__m128 b0 = _mm_loadu_ps(matrix.M[0]);
+	__m128 b1 = _mm_loadu_ps(matrix.M[1]);
+	__m128 b2 = _mm_loadu_ps(matrix.M[2]);
+	__m128 b3 = _mm_loadu_ps(matrix.M[3]);
+	for (int i = 0; i < 4; ++i)
+	{
+		__m128 a = _mm_loadu_ps(M[i]);
+		__m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xAA), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xFF), b3));
+		_mm_storeu_ps(ret.M[i], r);
+	}
+#elif defined(FRAMEWORK_NEON)
+	float32x4_t b0 = vld1q_f32(matrix.M[0]);
+	float32x4_t b1 = vld1q_f32(matrix.M[1]);
+	float32x4_t b2 = vld1q_f32(matrix.M[2]);
+	float32x4_t b3 = vld1q_f32(matrix.M[3]);
+	for (int i = 0; i < 4; ++i)
+	{
+		float32x4_t a = vld1q_f32(M[i]);
+		float32x4_t r = vmulq_n_f32(b0, vgetq_lane_f32(a, 0));
+		r = vmlaq_n_f32(r, b1, vgetq_lane_f32(a, 1));
+		r = vmlaq_n_f32(r, b2, vgetq_lane_f32(a, 2));
+		r = vmlaq_n_f32(r, b3, vgetq_lane_f32(a, 3));
+		vst1q_f32(ret.M[i], r);
+	}
+#else
+	ret = ScalarMath::multiply(*this, matrix);
+#endif
 	return ret;
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector3 operator * (const Matrix44& matrix, const Vector3& v) 
-{   
-   float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12]; 
-   float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13]; 
-   float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14];
-   return Vector3(x,y,z);
+{
+#if defined(FRAMEWORK_SSE)
+	__m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(matrix.m), _mm_set1_ps(v.x)), _mm_loadu_ps(matrix.m + 12));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(matrix.m + 4), _mm_set1_ps(v.y)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(matrix.m + 8), _mm_set1_ps(v.z)));
+	float result[4];
+	_mm_storeu_ps(result, r);
+	return Vector3(result[0], result[1], result[2]);
+#elif defined(FRAMEWORK_NEON)
+	float32x4_t r = vmlaq_n_f32(vld1q_f32(matrix.m + 12), vld1q_f32(matrix.m), v.x);
+	r = vmlaq_n_f32(r, vld1q_f32(matrix.m + 4), v.y);
+	r = vmlaq_n_f32(r, vld1q_f32(matrix.m + 8), v.z);
+	return Vector3(vgetq_lane_f32(r, 0), vgetq_lane_f32(r, 1), vgetq_lane_f32(r, 2));
+#else
+	return ScalarMath::transform(matrix, v);
+#endif
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector4 operator * (const Matrix44& matrix, const Vector4& v)
 {
+#if defined(FRAMEWORK_SSE)
+	__m128 r = _mm_mul_ps(_mm_loadu_ps(matrix.m), _mm_set1_ps(v.x));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(matrix.m + 4), _mm_set1_ps(v.y)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(matrix.m + 8), _mm_set1_ps(v.z)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(matrix.m + 12), _mm_set1_ps(v.w)));
+	Vector4 result;
+	_mm_storeu_ps(result.v, r);
+	return result;
+#elif defined(FRAMEWORK_NEON)
+	float32x4_t r = vmulq_n_f32(vld1q_f32(matrix.m), v.x);
+	r = vmlaq_n_f32(r, vld1q_f32(matrix.m + 4), v.y);
+	r = vmlaq_n_f32(r, vld1q_f32(matrix.m + 8), v.z);
+	r = vmlaq_n_f32(r, vld1q_f32(matrix.m + 12), v.w);
+	Vector4 result;
+	vst1q_f32(result.v, r);
+	return result;
+#else
 	float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + v.w * matrix.m[12];
 	float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + v.w * matrix.m[13];
 	float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + v.w * matrix.m[14];
 	float w = matrix.m[3] * v.x + matrix.m[7] * v.y + matrix.m[11] * v.z + v.w * matrix.m[15];
 	return Vector4(x, y, z, w);
+#endif
 }
-
 void Matrix44::setUpAndOrthonormalize(Vector3 up)
 {
 	up.normalize();
@@ -547,79 +638,119 @@ void Matrix44::setFrontAndOrthonormalize(Vector3 front)
 	
 }
 
-bool Matrix44::inverse()
-{
-   unsigned int i, j, k, swap;
-   float t;
-   Matrix44 temp, final;
-   final.setIdentity();
-
-   temp = (*this);
-
-   unsigned int m,n;
-   m = n = 4;
-	
-   for (i = 0; i < m; i++)
-   {
-      // Look for largest element in column
-
-      swap = i;
-      for (j = i + 1; j < m; j++)// m or n
-	  {
-		 if ( fabs(temp.M[j][i]) > fabs( temp.M[swap][i]) )
-            swap = j;
-	  }
-   
-      if (swap != i)
-      {
-         // Swap rows.
-         for (k = 0; k < n; k++)
-         {
-			 std::swap( temp.M[i][k],temp.M[swap][k]);
-			 std::swap( final.M[i][k], final.M[swap][k]);
-         }
-      }
-
-      // No non-zero pivot.  The CMatrix is singular, which shouldn't
-      // happen.  This means the user gave us a bad CMatrix.
-
-
 #define MATRIX_SINGULAR_THRESHOLD 0.00001 //change this if you experience problems with matrices
 
-      if ( fabsf(temp.M[i][i]) <= MATRIX_SINGULAR_THRESHOLD)
-	  {
-		  final.setIdentity();
-         return false;
-	  }
-#undef MATRIX_SINGULAR_THRESHOLD
+#ifdef FRAMEWORK_SSE
+//2x2 matrices stored in a __m128 as | x y |
+//                                   | z w |
+#define SIMD_SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+#define SIMD_SWIZZLE(v, x, y, z, w) SIMD_SHUFFLE(v, v, x, y, z, w)
 
-      t = 1.0f/temp.M[i][i];
+//A*B
+static inline __m128 mat2Mul(__m128 a, __m128 b)
+{
+	return _mm_add_ps(_mm_mul_ps(a, SIMD_SWIZZLE(b, 0, 3, 0, 3)), _mm_mul_ps(SIMD_SWIZZLE(a, 1, 0, 3, 2), SIMD_SWIZZLE(b, 2, 1, 2, 1)));
+}
 
-      for (k = 0; k < n; k++)//m or n
-      {
-         temp.M[i][k] *= t;
-         final.M[i][k] *= t;
-      }
+//adjugate(A)*B
+static inline __m128 mat2AdjMul(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(SIMD_SWIZZLE(a, 3, 3, 0, 0), b), _mm_mul_ps(SIMD_SWIZZLE(a, 1, 1, 2, 2), SIMD_SWIZZLE(b, 2, 3, 0, 1)));
+}
 
-      for (j = 0; j < m; j++) // m or n
-      {
-         if (j != i)
-         {
-            t = temp.M[j][i];
-            for (k = 0; k < n; k++)//m or n
-            {
-               temp.M[j][k] -= (temp.M[i][k] * t);
-               final.M[j][k] -= (final.M[i][k] * t);
-            }
-         }
-      }
-   }
+//A*adjugate(B)
+static inline __m128 mat2MulAdj(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(a, SIMD_SWIZZLE(b, 3, 0, 3, 0)), _mm_mul_ps(SIMD_SWIZZLE(a, 1, 0, 3, 2), SIMD_SWIZZLE(b, 2, 1, 2, 1)));
+}
+#endif
 
-   *this = final;
+//the SSE version inverts by 2x2 blocks (no pivoting), the others use gauss-jordan
+bool Matrix44::inverse()
+{
+#ifdef FRAMEWORK_SSE
+	__m128 r0 = _mm_loadu_ps(M[0]);
+	__m128 r1 = _mm_loadu_ps(M[1]);
+	__m128 r2 = _mm_loadu_ps(M[2]);
+	__m128 r3 = _mm_loadu_ps(M[3]);
+
+	//the matrix as | A B |
+	//              | C D |
+	__m128 A = _mm_movelh_ps(r0, r1);
+	__m128 B = _mm_movehl_ps(r1, r0);
+	__m128 C = _mm_movelh_ps(r2, r3);
+	__m128 D = _mm_movehl_ps(r3, r2);
+
+	//determinants of the blocks (|A| |B| |C| |D|)
+	__m128 det_sub = _mm_sub_ps(
+		_mm_mul_ps(SIMD_SHUFFLE(r0, r2, 0, 2, 0, 2), SIMD_SHUFFLE(r1, r3, 1, 3, 1, 3)),
+		_mm_mul_ps(SIMD_SHUFFLE(r0, r2, 1, 3, 1, 3), SIMD_SHUFFLE(r1, r3, 0, 2, 0, 2)));
+	__m128 det_A = SIMD_SWIZZLE(det_sub, 0, 0, 0, 0);
+	__m128 det_B = SIMD_SWIZZLE(det_sub, 1, 1, 1, 1);
+	__m128 det_C = SIMD_SWIZZLE(det_sub, 2, 2, 2, 2);
+	__m128 det_D = SIMD_SWIZZLE(det_sub, 3, 3, 3, 3);
+
+	__m128 D_C = mat2AdjMul(D, C);
+	__m128 A_B = mat2AdjMul(A, B);
+	__m128 X = _mm_sub_ps(_mm_mul_ps(det_D, A), mat2Mul(B, D_C));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(det_A, D), mat2Mul(C, A_B));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(det_B, C), mat2MulAdj(D, A_B));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(det_C, B), mat2MulAdj(A, D_C));
+
+	//|M| = |A|*|D| + |B|*|C| - trace(A#B * D#C)
+	__m128 trace = _mm_mul_ps(A_B, SIMD_SWIZZLE(D_C, 0, 2, 1, 3));
+	trace = _mm_add_ps(trace, SIMD_SWIZZLE(trace, 1, 0, 3, 2));
+	trace = _mm_add_ps(trace, SIMD_SWIZZLE(trace, 2, 3, 0, 1));
+	__m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_A, det_D), _mm_mul_ps(det_B, det_C)), trace);
+
+	//same threshold as the pivots of gauss-jordan, but for the whole matrix
+	if (fabsf(_mm_cvtss_f32(det)) <= MATRIX_SINGULAR_THRESHOLD * MATRIX_SINGULAR_THRESHOLD * MATRIX_SINGULAR_THRESHOLD * MATRIX_SINGULAR_THRESHOLD)
+		return false;
 
-   return true;
+	__m128 inv_det = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+	X = _mm_mul_ps(X, inv_det);
+	Y = _mm_mul_ps(Y, inv_det);
+	Z = _mm_mul_ps(Z, inv_det);
+	W = _mm_mul_ps(W, inv_det);
+
+	//adjugate of the blocks while storing
+	_mm_storeu_ps(M[0], SIMD_SHUFFLE(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(M[1], SIMD_SHUFFLE(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(M[2], SIMD_SHUFFLE(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(M[3], SIMD_SHUFFLE(Z, W, 2, 0, 2, 0));
+	return true;
+#else
+	return ScalarMath::inverse(*this);
+#endif
 }
 
+bool Matrix44::inverseAffine()
+{
+	//rotation and scale (3x3) by its adjugate, then the translation
+	float a = m[0], b = m[1], c = m[2];
+	float d = m[4], e = m[5], f = m[6];
+	float g = m[8], h = m[9], i = m[10];
+
+	float c0 = e * i - f * h;
+	float c1 = f * g - d * i;
+	float c2 = d * h - e * g;
+	float det = a * c0 + b * c1 + c * c2;
+	if (fabsf(det) <= MATRIX_SINGULAR_THRESHOLD * MATRIX_SINGULAR_THRESHOLD * MATRIX_SINGULAR_THRESHOLD)
+		return false;
+	float inv_det = 1.0f / det;
+
+	Matrix44 r;
+	r.m[0] = c0 * inv_det; r.m[1] = (c * h - b * i) * inv_det; r.m[2] = (b * f - c * e) * inv_det;
+	r.m[4] = c1 * inv_det; r.m[5] = (a * i - c * g) * inv_det; r.m[6] = (c * d - a * f) * inv_det;
+	r.m[8] = c2 * inv_det; r.m[9] = (b * g - a * h) * inv_det; r.m[10] = (a * e - b * d) * inv_det;
+
+	float tx = m[12], ty = m[13], tz = m[14];
+	r.m[12] = -(tx * r.m[0] + ty * r.m[4] + tz * r.m[8]);
+	r.m[13] = -(tx * r.m[1] + ty * r.m[5] + tz * r.m[9]);
+	r.m[14] = -(tx * r.m[2] + ty * r.m[6] + tz * r.m[10]);
+	*this = r;
+	return true;
+}
 #ifdef FIXEDPIPELINE
 void Matrix44::multGL()
 {
@@ -1308,25 +1439,46 @@ float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 
 const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
 
+//Arvo, "Transforming Axis-Aligned Bounding Boxes" (Graphics Gems): the new center is the transformed center
+//and the new halfsize the halfsize transformed by the absolute values of the matrix, same result as transforming the 8 corners
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 {
-	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
-
-	for (int i = 0; i < 8; ++i)
-	{
-		Vector3 corner = corners[i];
-		corner = box.halfsize * corner;
-		corner = corner + box.center;
-		corner = m * corner;
-		box_min.setMin(corner);
-		box_max.setMax(corner);
-	}
-
-	Vector3 halfsize = (box_max - box_min) * 0.5;
-	return BoundingBox(box_max - halfsize, halfsize );
+#if defined(FRAMEWORK_SSE)
+	__m128 r0 = _mm_loadu_ps(m.m);
+	__m128 r1 = _mm_loadu_ps(m.m + 4);
+	__m128 r2 = _mm_loadu_ps(m.m + 8);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 center = _mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(box.center.x)), _mm_loadu_ps(m.m + 12));
+	center = _mm_add_ps(center, _mm_mul_ps(r1, _mm_set1_ps(box.center.y)));
+	center = _mm_add_ps(center, _mm_mul_ps(r2, _mm_set1_ps(box.center.z)));
+	__m128 halfsize = _mm_mul_ps(_mm_andnot_ps(sign, r0), _mm_set1_ps(box.halfsize.x));
+	halfsize = _mm_add_ps(halfsize, _mm_mul_ps(_mm_andnot_ps(sign, r1), _mm_set1_ps(box.halfsize.y)));
+	halfsize = _mm_add_ps(halfsize, _mm_mul_ps(_mm_andnot_ps(sign, r2), _mm_set1_ps(box.halfsize.z)));
+	float c[4], h[4];
+	_mm_storeu_ps(c, center);
+	_mm_storeu_ps(h, halfsize);
+	return BoundingBox(Vector3(c[0], c[1], c[2]), Vector3(h[0], h[1], h[2]));
+#elif defined(FRAMEWORK_NEON)
+	float32x4_t r0 = vld1q_f32(m.m);
+	float32x4_t r1 = vld1q_f32(m.m + 4);
+	float32x4_t r2 = vld1q_f32(m.m + 8);
+	float32x4_t center = vmlaq_n_f32(vld1q_f32(m.m + 12), r0, box.center.x);
+	center = vmlaq_n_f32(center, r1, box.center.y);
+	center = vmlaq_n_f32(center, r2, box.center.z);
+	float32x4_t halfsize = vmulq_n_f32(vabsq_f32(r0), box.halfsize.x);
+	halfsize = vmlaq_n_f32(halfsize, vabsq_f32(r1), box.halfsize.y);
+	halfsize = vmlaq_n_f32(halfsize, vabsq_f32(r2), box.halfsize.z);
+	return BoundingBox(Vector3(vgetq_lane_f32(center, 0), vgetq_lane_f32(center, 1), vgetq_lane_f32(center, 2)),
+		Vector3(vgetq_lane_f32(halfsize, 0), vgetq_lane_f32(halfsize, 1), vgetq_lane_f32(halfsize, 2)));
+#else
+	Vector3 center = m * box.center;
+	Vector3 halfsize(
+		fabsf(m.m[0]) * box.halfsize.x + fabsf(m.m[4]) * box.halfsize.y + fabsf(m.m[8]) * box.halfsize.z,
+		fabsf(m.m[1]) * box.halfsize.x + fabsf(m.m[5]) * box.halfsize.y + fabsf(m.m[9]) * box.halfsize.z,
+		fabsf(m.m[2]) * box.halfsize.x + fabsf(m.m[6]) * box.halfsize.y + fabsf(m.m[10]) * box.halfsize.z);
+	return BoundingBox(center, halfsize);
+#endif
 }
-
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
 {
 	BoundingBox result;
@@ -1448,4 +1600,127 @@ bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3& center, flo
 	}
 
 	return false; //OUTSIDE;
-}
\ No newline at end of file
+}
+
+
+//*********************************
+//scalar versions, used as reference by the math benchmark
+namespace ScalarMath {
+
+Matrix44 multiply(const Matrix44& a, const Matrix44& b)
+{
+	Matrix44 ret;
+
+	unsigned int i,j,k;
+	for (i=0;i<4;i++) 	
+	{
+		for (j=0;j<4;j++) 
+		{
+			ret.M[i][j]=0.0;
+			for (k=0;k<4;k++) 
+				ret.M[i][j] += a.M[i][k] * b.M[k][j];
+		}
+	}
+
+	return ret;
+}
+
+Vector3 transform(const Matrix44& matrix, const Vector3& v)
+{   
+   float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12]; 
+   float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13]; 
+   float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14];
+   return Vector3(x,y,z);
+}
+
+bool inverse(Matrix44& matrix)
+{
+   unsigned int i, j, k, swap;
+   float t;
+   Matrix44 temp, final;
+   final.setIdentity();
+
+   temp = matrix;
+
+   unsigned int m,n;
+   m = n = 4;
+	
+   for (i = 0; i < m; i++)
+   {
+      // Look for largest element in column
+
+      swap = i;
+      for (j = i + 1; j < m; j++)// m or n
+	  {
+		 if ( fabs(temp.M[j][i]) > fabs( temp.M[swap][i]) )
+            swap = j;
+	  }
+   
+      if (swap != i)
+      {
+         // Swap rows.
+         for (k = 0; k < n; k++)
+         {
+			 std::swap( temp.M[i][k],temp.M[swap][k]);
+			 std::swap( final.M[i][k], final.M[swap][k]);
+         }
+      }
+
+      // No non-zero pivot.  The CMatrix is singular, which shouldn't
+      // happen.  This means the user gave us a bad CMatrix.
+
+
+
+      if ( fabsf(temp.M[i][i]) <= MATRIX_SINGULAR_THRESHOLD)
+	  {
+		  final.setIdentity();
+         return false;
+	  }
+
+      t = 1.0f/temp.M[i][i];
+
+      for (k = 0; k < n; k++)//m or n
+      {
+         temp.M[i][k] *= t;
+         final.M[i][k] *= t;
+      }
+
+      for (j = 0; j < m; j++) // m or n
+      {
+         if (j != i)
+         {
+            t = temp.M[j][i];
+            for (k = 0; k < n; k++)//m or n
+            {
+               temp.M[j][k] -= (temp.M[i][k] * t);
+               final.M[j][k] -= (final.M[i][k] * t);
+            }
+         }
+      }
+   }
+
+   matrix = final;
+
+   return true;
+}
+
+BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box)
+{
+	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
+	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner = corners[i];
+		corner = box.halfsize * corner;
+		corner = corner + box.center;
+		corner = m * corner;
+		box_min.setMin(corner);
+		box_max.setMax(corner);
+	}
+
+	Vector3 halfsize = (box_max - box_min) * 0.5;
+	return BoundingBox(box_max - halfsize, halfsize );
+}
+
+}
@@ -230,6 +230,7 @@ class Matrix44
 		Vector3 bottomVector() { return Vector3(m[12], m[13], m[14]); }
 
 		bool inverse();
+		bool inverseAffine(); //faster, only for matrices without projection (last column is 0,0,0,1), like models and views
 		void setUpAndOrthonormalize(Vector3 up);
 		void setFrontAndOrthonormalize(Vector3 front);
 
@@ -274,6 +275,9 @@ class Matrix44
 Vector3 operator * (const Matrix44& matrix, const Vector3& v);
 Vector4 operator * (const Matrix44& matrix, const Vector4& v); 
 
+//the matrix functions use SSE/AVX or NEON when the compiler has them (define FRAMEWORK_NO_SIMD to disable it)
+const char* getMathSIMDName();
+
 
 class Quaternion
 {
@@ -373,7 +377,15 @@ public:
 
 //applies a transform to a AABB from object to world
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
+BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box); //Arvo's method, no corners
+
+//the original scalar versions, used as reference by the math benchmark
+namespace ScalarMath {
+	Matrix44 multiply(const Matrix44& a, const Matrix44& b);
+	bool inverse(Matrix44& m); //gauss-jordan
+	Vector3 transform(const Matrix44& m, const Vector3& v);
+	BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box); //transforms the 8 corners
+}
 
 float signedDistanceToPlane(const Vector4& plane, const Vector3& point);
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize );
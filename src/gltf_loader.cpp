@@ -10,11 +10,15 @@
 #include "material.h"
 #include "prefab.h"
 #include "utils.h"
+#include "meshoptimizer.h"
+#include "jobs.h"
+#include "texturestreamer.h"
+#include "texturecache.h"
+#include "profiler.h"
 
 #include <iostream>
 
 //** PARSING GLTF IS UGLY
-std::string base_folder;
 
 #ifdef _DEBUG2
 	bool load_textures = false; //must textures be loadead?
@@ -152,141 +156,260 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
-std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
+//mesh names can contain chars that are not valid in a filename
+std::string getBinSafeName(const std::string& name)
 {
-	std::vector<Mesh*> result;
+	std::string result = name;
+	for (size_t i = 0; i < result.size(); ++i)
+		if (!isalnum((unsigned char)result[i]) && result[i] != '-' && result[i] != '.')
+			result[i] = '_';
+	return result;
+}
 
-	if (meshdata->name)
-		stdlog( std::string("\t<- MESH: ") + meshdata->name);
+//resources requested by the tasks of the current batch, so two gltfs sharing them only load them once
+//at the beginning of the batch they are filled with the ones already loaded
+InFlightRequests<Mesh*> mesh_requests; //by submesh name
+InFlightRequests< std::shared_ptr<sCookedTexture> > image_requests; //by fullpath
 
-    //submeshes
-	for (int i = 0; i < meshdata->primitives_count; ++i)
+//WORKER: parses the streams of a primitive, it is not uploaded nor registered
+Mesh* parseGLTFPrimitive(sGLTFLoadTask* task, cgltf_primitive* primitive, const std::string& submesh_name)
+{
+	Mesh* mesh = new Mesh();
+
+	//try the binary version, it already contains the optimized indices
+	std::string binfilename;
+	if (Mesh::use_binary && submesh_name.size())
 	{
-		cgltf_primitive* primitive = &meshdata->primitives[i];
-		Mesh* mesh = NULL;
+		binfilename = task->folder + "/" + getBinSafeName(submesh_name);
+		if (!isCacheOutdated(binfilename + ".mbin", task->filename) && mesh->readBin((binfilename + ".mbin").c_str(), false))
+			return mesh;
+	}
 
-		std::string submesh_name;
-		if (meshdata->name)
+	//streams
+	for (int j = 0; j < primitive->attributes_count; ++j)
+	{
+		cgltf_attribute* attr = &primitive->attributes[j];
+
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
 		{
-			submesh_name = std::string(meshdata->name) + std::string("::") + std::to_string(i);
-			mesh = Mesh::Get(submesh_name.c_str(), true);
-			if (mesh)
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			if (attr->data->has_min && attr->data->has_max)
 			{
-				result.push_back(mesh);
-				continue;
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
 			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else
+		if (attr->type == cgltf_attribute_type_normal)
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+		else
+		if (attr->type == cgltf_attribute_type_texcoord)
+		{
+			if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
+				parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+			else
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
 		}
+	}
 
-		mesh = new Mesh();
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 
-        //streams
-		for (int j = 0; j < primitive->attributes_count; ++j)
-		{
-			cgltf_attribute* attr = &primitive->attributes[j];
+	sVertexCacheStats before, after;
+	if (Mesh::optimize_meshes && primitive->type == cgltf_primitive_type_triangles && mesh->optimizeIndices(&before, &after))
+		stdlog("\t\t optimized " + submesh_name + " ACMR: " + std::to_string(before.acmr) + " -> " + std::to_string(after.acmr) + " ATVR: " + std::to_string(before.atvr) + " -> " + std::to_string(after.atvr));
 
-            //std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
-			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
-			}
+	if (binfilename.size())
+		mesh->writeBin(binfilename.c_str());
+
+	//pack it here so the main thread only has to upload it
+	if (Mesh::quantize_meshes && !mesh->packed_vertices.size() && mesh->getNumVertices())
+	{
+		mesh->computeVertexLayout(true);
+		mesh->packVertices();
+	}
+
+	return mesh;
+}
+
+//WORKER: one mesh per primitive, named ones are shared with other gltfs using the same name
+std::vector<Mesh*> parseGLTFMesh(sGLTFLoadTask* task, cgltf_mesh* meshdata)
+{
+	std::vector<Mesh*> result;
+
+	if (meshdata->name)
+		stdlog( std::string("\t<- MESH: ") + meshdata->name);
 
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+	//submeshes
+	for (int i = 0; i < meshdata->primitives_count; ++i)
+	{
+		cgltf_primitive* primitive = &meshdata->primitives[i];
+		if (!meshdata->name)
+		{
+			result.push_back(parseGLTFPrimitive(task, primitive, ""));
+			continue;
 		}
-		mesh->uploadToVRAM();
-		if (meshdata->name)
-			mesh->registerMesh(submesh_name);
-		result.push_back(mesh);
+
+		std::string submesh_name = std::string(meshdata->name) + std::string("::") + std::to_string(i);
+		result.push_back(mesh_requests.get(submesh_name, [&]() { return parseGLTFPrimitive(task, primitive, submesh_name); }));
 	}
 
 	return result;
 }
 
-int GLTF_TEXTURE_LAST_ID = 1;
+//MAIN THREAD: uploads and registers the meshes parsed by the worker
+std::vector<Mesh*> getGLTFMeshes(sGLTFLoadTask* task, cgltf_mesh* meshdata)
+{
+	std::vector<Mesh*>& meshes = task->meshes[meshdata];
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		Mesh* mesh = meshes[i];
+		if (mesh->name.size() || mesh->vertices_vbo_id || mesh->interleaved_vbo_id) //registered or uploaded by another node or gltf
+			continue;
+		mesh->uploadToVRAM();
+		if (meshdata->name)
+			mesh->registerMesh(std::string(meshdata->name) + std::string("::") + std::to_string(i));
+	}
+	return meshes;
+}
 
-Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+//WORKER: decodes and cooks an image stored inside the gltf buffers (not cached, there is no file)
+std::shared_ptr<sCookedTexture> decodeGLTFImageBuffer(cgltf_image* image, bool srgb)
 {
-	if (!load_textures || !image )
+	if (!image->buffer_view)
+	{
+		stdlog(std::string(" No texture data") + (image->mime_type ? image->mime_type : ""));
 		return NULL;
+	}
 
-	std::string fullpath = filename ? filename : "";
+	std::unique_ptr<Image> img(new Image());
+	std::vector<unsigned char> buffer;
+	buffer.resize(image->buffer_view->size);
+	memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
 
-	if (image->uri)
-		return Texture::Get((std::string(base_folder) + "/" + image->uri).c_str());
+	std::string mime_type = image->mime_type ? image->mime_type : "";
+	if (mime_type == "image/png")
+		img->loadPNG(buffer);
+	else if (mime_type == "image/jpeg")
+		img->loadJPG(buffer);
 	else
-	if (filename)
 	{
-		fullpath = std::string(base_folder) + "/" + filename;
-		Texture* tex = Texture::Find(fullpath.c_str());
-		if (tex)
-			return tex;
+		stdlog(std::string("image format not supported: ") + mime_type);
+		return NULL;
 	}
-	else
+	if (!img->width)
 	{
-		std::stringstream ss;
-		ss << GLTF_TEXTURE_LAST_ID++;
-		fullpath = std::string(base_folder) + "/image" + ss.str();
+		stdlog(std::string("image encoding has error: ") + mime_type);
+		return NULL;
 	}
+	std::shared_ptr<sCookedTexture> cooked = std::make_shared<sCookedTexture>();
+	if (!cookImage(img.get(), srgb, *cooked))
+		return NULL;
+	return cooked;
+}
+
+//color textures have their mips filtered in linear space
+void markGLTFColorImage(std::vector<bool>& srgb, cgltf_data* data, cgltf_texture_view& view)
+{
+	if (view.texture && view.texture->image)
+		srgb[view.texture->image - data->images] = true;
+}
 
-	if (image->buffer_view)
+//WORKER: cooks all the images of the gltf in parallel (or reads the cooked .ktx), files shared with other gltfs are only done once
+void decodeGLTFImages(sGLTFLoadTask* task)
+{
+	PROFILE_FUNCTION();
+	cgltf_data* data = task->data;
+	if (!load_textures || !data->images_count)
+		return;
+
+	std::vector<bool> srgb(data->images_count, false);
+	for (size_t i = 0; i < data->materials_count; ++i)
 	{
-		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
+		cgltf_material* matdata = &data->materials[i];
+		markGLTFColorImage(srgb, data, matdata->pbr_metallic_roughness.base_color_texture);
+		markGLTFColorImage(srgb, data, matdata->pbr_specular_glossiness.diffuse_texture);
+		markGLTFColorImage(srgb, data, matdata->emissive_texture);
+	}
 
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
+	std::vector< std::shared_ptr<sCookedTexture> > decoded(data->images_count);
+	JobSystem::parallelFor((int)data->images_count, [&](int i) {
+		cgltf_image* image = &data->images[i];
+		if (!image->uri)
 		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
-			return NULL;
+			decoded[i] = decodeGLTFImageBuffer(image, srgb[i]);
+			return;
 		}
-		if (!img.width)
+		std::string fullpath = task->folder + "/" + image->uri;
+		decoded[i] = image_requests.get(fullpath, [&]() {
+			std::shared_ptr<sCookedTexture> cooked = std::make_shared<sCookedTexture>();
+			bool found = false;
+			if (Texture::use_cooked_cache)
+				found = getCookedTexture(fullpath.c_str(), srgb[i], *cooked);
+			else
+			{
+				Image img;
+				found = img.load(fullpath.c_str()) && cookImage(&img, srgb[i], *cooked);
+			}
+			if (found)
+				return cooked;
+			stdlog(std::string(" [ERROR]: Texture not found ") + fullpath);
+			return std::shared_ptr<sCookedTexture>();
+		});
+	});
+
+	for (size_t i = 0; i < data->images_count; ++i)
+		task->images[&data->images[i]] = decoded[i];
+}
+
+//MAIN THREAD: creates the texture from the image cooked by the worker
+Texture* parseGLTFTexture(sGLTFLoadTask* task, cgltf_image* image, const char* filename)
+{
+	if (!load_textures || !image )
+		return NULL;
+
+	//used by another material
+	auto it = task->textures.find(image);
+	if (it != task->textures.end())
+		return it->second;
+
+	std::string fullpath;
+	if (image->uri)
+		fullpath = task->folder + "/" + image->uri;
+	else if (filename)
+		fullpath = task->folder + "/" + filename;
+
+	Texture* tex = fullpath.size() ? Texture::Find(fullpath.c_str()) : NULL;
+	if (!tex)
+	{
+		std::shared_ptr<sCookedTexture> cooked = task->images[image];
+		if (!cooked)
+			return NULL; //the worker already reported the error
+		if (TextureStreamer::enabled) //the mips are uploaded in the next frames
+			tex = TextureStreamer::Create(fullpath.c_str(), cooked, image->uri && Texture::use_cooked_cache ? (fullpath + ".ktx").c_str() : NULL);
+		else
 		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
-			return NULL;
+			tex = new Texture();
+			tex->loadFromCooked(cooked.get());
+			if (fullpath.size())
+				tex->setName(fullpath.c_str());
 		}
-		Texture* tex = new Texture();
-		tex->loadFromImage(&img);
-		if (filename)
-		{
-			tex->setName(fullpath.c_str());
+		if (fullpath.size())
 			stdlog(std::string("\t<- TEXTURE: ") + fullpath);
-		}
 		else
-			stdlog(std::string(" TEXTURE: UNNAMED ") + image->mime_type );
-
-		return tex;
+			stdlog(std::string(" TEXTURE: UNNAMED ") + (image->mime_type ? image->mime_type : ""));
 	}
-	else
-		stdlog(std::string(" No texture data") + image->mime_type);
-	return NULL;
+
+	task->textures[image] = tex;
+	return tex;
 }
 
-GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
+GTR::Material* parseGLTFMaterial(sGLTFLoadTask* task, cgltf_material* matdata)
 {
 	GTR::Material* material = matdata->name ? GTR::Material::Get(matdata->name) : NULL;
 	if (material)
@@ -303,7 +426,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	//normalmap
 	if (matdata->normal_texture.texture)
 	{
-		material->normal_texture.texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
+		material->normal_texture.texture = parseGLTFTexture(task, matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
 		material->normal_texture.uv_channel = matdata->normal_texture.texcoord;
 	}
 
@@ -311,7 +434,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
 	{
-		material->emissive_texture.texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
+		material->emissive_texture.texture = parseGLTFTexture(task, matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
 		material->emissive_texture.uv_channel = matdata->emissive_texture.texcoord;
 	}
 
@@ -320,7 +443,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->color_texture.texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->color_texture.texture = parseGLTFTexture(task, matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -332,12 +455,12 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
 			{
-				material->color_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
+				material->color_texture.texture = parseGLTFTexture(task, matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
 				material->color_texture.uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
 			}
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
 			{
-				material->metallic_roughness_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
+				material->metallic_roughness_texture.texture = parseGLTFTexture(task, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
 				material->metallic_roughness_texture.uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
 			}
 		}
@@ -345,7 +468,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 
 	if (matdata->occlusion_texture.texture)
 	{
-		material->occlusion_texture.texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
+		material->occlusion_texture.texture = parseGLTFTexture(task, matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
 		material->occlusion_texture.uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
@@ -373,7 +496,7 @@ void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 }
 
 //GLTF PARSING: you can pass the node or it will create it
-GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
+GTR::Node* parseGLTFNode(sGLTFLoadTask* task, cgltf_node* node, GTR::Node* scenenode = NULL)
 {
 	if (scenenode == NULL)
 		scenenode = new GTR::Node();
@@ -392,14 +515,14 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 		if (node->mesh->primitives_count > 1)
 		{
 			std::vector<Mesh*> meshes;
-			meshes = parseGLTFMesh(node->mesh);
+			meshes = getGLTFMeshes(task, node->mesh);
 
 			for (int i = 0; i < node->mesh->primitives_count; ++i)
 			{
 				GTR::Node* subnode = new GTR::Node();
 				subnode->mesh = meshes[i];
 				if (node->mesh->primitives[i].material)
-					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material);
+					subnode->material = parseGLTFMaterial(task, node->mesh->primitives[i].material);
 				scenenode->addChild(subnode);
 			}
 		}
@@ -411,7 +534,7 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 			if (!scenenode->mesh)
 			{
 				std::vector<Mesh*> meshes;
-				meshes = parseGLTFMesh(node->mesh);
+				meshes = getGLTFMeshes(task, node->mesh);
 				//printf("Parsed GLTF mesh %s (success)\n", node->name);
 				//return nullptr;
 				if(meshes.size())
@@ -419,12 +542,12 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 			}
 
 			if (node->mesh->primitives->material)
-				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material);
+				scenenode->material = parseGLTFMaterial(task, node->mesh->primitives->material);
 		}
 	}
 
 	for (int i = 0; i < node->children_count; ++i)
-		scenenode->addChild(parseGLTFNode(node->children[i]));
+		scenenode->addChild(parseGLTFNode(task, node->children[i]));
 
 	return scenenode;
 }
@@ -442,62 +565,115 @@ cgltf_result internalOpenFile(const struct cgltf_memory_options* memory_options,
     return cgltf_result_success;
 }
 
-std::vector<unsigned char> g_buffer;
-
+//the memory is in the task (file_options->user_data), only the first read (the gltf) uses it
 cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_options, const struct cgltf_file_options* file_options, const char* path, cgltf_size* size, void** data)
 {
 	stdlog(std::string(" <- ") + path);
-	*size = g_buffer.size();
+	sGLTFLoadTask* task = (sGLTFLoadTask*)file_options->user_data;
+	*size = task->memory.size();
 	char* file_data = new char[*size];
-	memcpy(file_data, &g_buffer[0], *size);
+	if (*size)
+		memcpy(file_data, &task->memory[0], *size);
 	*data = file_data;
 
-	g_buffer.clear();
+	task->memory.clear();
 
 	return cgltf_result_success;
 }
 
-GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
+sGLTFLoadTask::~sGLTFLoadTask()
 {
-	cgltf_result result;
+	//frees all data, including bin
+	if (data)
+		cgltf_free(data);
+}
+
+//WORKER: reads and parses the gltf, decodes the images and prepares the meshes
+bool decodeGLTF(sGLTFLoadTask* task)
+{
+	PROFILE_SCOPE("decodeGLTF");
+	cgltf_options options;
+	memset(&options, 0, sizeof(cgltf_options));
+	if (task->memory.size())
+	{
+		options.file.read = internalOpenMemory;
+		options.file.user_data = task;
+	}
+	else
+		options.file.read = internalOpenFile;
+
+	cgltf_result result = cgltf_parse_file(&options, task->filename.c_str(), &task->data);
+	if (result != cgltf_result_success) {
+		std::cout << "[NOT FOUND]" << std::endl;
+		return false;
+	}
 
-	if (data->scenes_count > 1)
+	if (!task->data->scenes_count)
+	{
+		stdlog(std::string("[NO SCENES]:") + task->filename);
+		return false;
+	}
+	if (task->data->scenes_count > 1)
 		std::cout << "[WARN] more than one scene, skipping the rest" << std::endl;
 
-	//get nodes
-	cgltf_scene* scene = &data->scenes[0];
+	size_t pos = task->filename.find_last_of('/');
+	task->folder = pos == std::string::npos ? "." : task->filename.substr(0, pos);
 
-	char folder[1024];
-	strcpy(folder, filename);
-	char* name_start = strrchr(folder, '/');
-	*name_start = '\0';
-	base_folder = folder; //global
+	result = cgltf_load_buffers(&options, task->data, task->filename.c_str());
+	if (result != cgltf_result_success) {
+		stdlog(std::string("[BIN NOT FOUND]:") + task->filename);
+		return false;
+	}
+
+	decodeGLTFImages(task);
 
+	cgltf_data* data = task->data;
+	std::vector< std::vector<Mesh*> > meshes(data->meshes_count);
+	JobSystem::parallelFor((int)data->meshes_count, [&](int i) {
+		meshes[i] = parseGLTFMesh(task, &data->meshes[i]);
+	});
+	for (size_t i = 0; i < data->meshes_count; ++i)
+		task->meshes[&data->meshes[i]] = meshes[i];
+
+	return true;
+}
+
+sGLTFLoadTask* decodeGLTF(const char* filename)
+{
+	stdlog(std::string("loading gltf... ") + filename);
+	sGLTFLoadTask* task = new sGLTFLoadTask();
+	task->filename = filename;
+	if (!decodeGLTF(task))
 	{
-		result = cgltf_load_buffers(&options, data, filename);
-		if (result != cgltf_result_success) {
-			stdlog(std::string("[BIN NOT FOUND]:") + filename);
-			return NULL;
-		}
+		delete task;
+		return NULL;
 	}
+	return task;
+}
+
+//MAIN THREAD: creates the prefab, uploads the meshes and textures
+GTR::Prefab* buildGLTF(sGLTFLoadTask* task)
+{
+	if (!task)
+		return NULL;
+
+	//get nodes
+	cgltf_scene* scene = &task->data->scenes[0];
 
 	GTR::Prefab* prefab = new GTR::Prefab();
 
 	{
 		if (scene->nodes_count > 1)
 		{
-			cgltf_node *root = nullptr;
-			float fiTotal = 1.0f / (float) scene->nodes_count;
 			for (int i = 0; i < scene->nodes_count; ++i)
 			{
-				float fProgress = ((float) i * fiTotal) * 100.0f;
-				GTR::Node *node = parseGLTFNode(scene->nodes[i]);
+				GTR::Node *node = parseGLTFNode(task, scene->nodes[i]);
 				prefab->root.addChild(node);
 			}
 		}
 		else
 		{
-			parseGLTFNode(scene->nodes[0], &prefab->root);
+			parseGLTFNode(task, scene->nodes[0], &prefab->root);
 		}
 	}
 
@@ -521,48 +697,76 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	prefab->updateNodesByName();
 	prefab->updateBounding();
 
-	//frees all data, including bin
-	cgltf_free(data);
+	stdlog( std::string(" - Loaded ") + task->filename );
+	delete task;
 
-    stdlog( std::string(" - Loaded ") + filename );
-
-    return prefab;
+	return prefab;
 }
 
-GTR::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string& path)
+//the in-flight requests start with what is already loaded, the registries are only modified in the main thread
+void beginGLTFBatch()
 {
-	cgltf_options options;
-	memset(&options, 0, sizeof(cgltf_options));
-	cgltf_data *data = NULL;
-
-	g_buffer = dat;
-	options.file.read = internalOpenMemory;
-	cgltf_result result = cgltf_parse_file(&options, path.c_str(), &data);
+	for (auto it : Mesh::sMeshesLoaded)
+		mesh_requests.set(it.first, it.second);
+	for (auto it : Texture::sTexturesLoaded)
+		image_requests.set(it.first, std::shared_ptr<sCookedTexture>()); //no need to decode, buildGLTF will find the texture
+}
 
-	if (result != cgltf_result_success) {
-		std::cout << "[NOT FOUND]" << std::endl;
-		return NULL;
-	}
-	return loadGLTF(path.c_str(), data, options);
+void endGLTFBatch()
+{
+	mesh_requests.clear();
+	image_requests.clear();
 }
 
-GTR::Prefab* loadGLTF(const char* filename)
+std::vector<GTR::Prefab*> loadGLTFs(const std::vector<std::string>& filenames)
 {
-	stdlog(std::string("loading gltf... ") + filename);
-	cgltf_options options;
-	memset(&options, 0, sizeof(cgltf_options));
-	cgltf_data *data = NULL;
+	beginGLTFBatch();
 
+	//decode all of them in the workers, every file once
+	std::map<std::string, std::shared_future<sGLTFLoadTask*> > pending;
+	for (size_t i = 0; i < filenames.size(); ++i)
 	{
-		options.file.read = internalOpenFile;
-		cgltf_result result = cgltf_parse_file(&options, filename, &data);
+		std::string filename = filenames[i];
+		if (pending.find(filename) == pending.end())
+			pending[filename] = JobSystem::run<sGLTFLoadTask*>([filename]() { return decodeGLTF(filename.c_str()); });
+	}
 
-		if (result != cgltf_result_success) {
-			std::cout << "[NOT FOUND]" << std::endl;
-			return NULL;
+	//build them here while the rest are still decoding
+	std::vector<GTR::Prefab*> result(filenames.size(), NULL);
+	std::map<std::string, GTR::Prefab*> built;
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		auto it = built.find(filenames[i]);
+		if (it != built.end())
+		{
+			result[i] = it->second;
+			continue;
 		}
+		result[i] = built[filenames[i]] = buildGLTF(JobSystem::wait(pending[filenames[i]]));
 	}
 
-	return loadGLTF(filename, data, options);
+	endGLTFBatch();
+	return result;
+}
+
+GTR::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string& path)
+{
+	beginGLTFBatch();
+	sGLTFLoadTask* task = new sGLTFLoadTask();
+	task->filename = path;
+	task->memory = dat;
+	if (!decodeGLTF(task))
+	{
+		delete task;
+		task = NULL;
+	}
+	GTR::Prefab* prefab = buildGLTF(task);
+	endGLTFBatch();
+	return prefab;
+}
+
+GTR::Prefab* loadGLTF(const char* filename)
+{
+	return loadGLTFs(std::vector<std::string>(1, filename))[0];
 }
 
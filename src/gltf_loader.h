@@ -2,6 +2,32 @@
 
 #include "prefab.h"
 
+#include <memory>
+
+struct cgltf_data;
+struct sCookedTexture;
+
+//a gltf being loaded, it is done in two steps so the heavy part can run in a worker:
+//decodeGLTF (any thread) reads the files, parses the gltf, decodes the images and prepares the meshes
+//buildGLTF (main thread) creates the nodes and uploads meshes and textures to the GPU
+struct sGLTFLoadTask
+{
+	std::string filename;
+	std::string folder;
+	std::vector<unsigned char> memory; //when loading from memory
+	cgltf_data* data;
+	std::map<const void*, std::shared_ptr<sCookedTexture> > images; //cooked image for every cgltf_image
+	std::map<const void*, std::vector<Mesh*> > meshes; //meshes for every cgltf_mesh, not uploaded yet
+	std::map<const void*, Texture*> textures; //created while building, so images used by several materials are uploaded once
+
+	sGLTFLoadTask() { data = NULL; }
+	~sGLTFLoadTask();
+};
+
+sGLTFLoadTask* decodeGLTF(const char* filename);
+GTR::Prefab* buildGLTF(sGLTFLoadTask* task); //deletes the task
+
 GTR::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+std::vector<GTR::Prefab*> loadGLTFs(const std::vector<std::string>& filenames); //decodes all of them in parallel
@@ -0,0 +1,354 @@
+#include "irradiance.h"
+
+#include "includes.h"
+#include "scene.h"
+#include "prefab.h"
+#include "material.h"
+#include "shader.h"
+#include "texture.h"
+#include "jobs.h"
+#include "utils.h"
+
+#include <cassert>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+	struct sIrradianceCacheHeader {
+		char magic[4]; //IRRP
+		int version;
+		uint64_t hash; //of the scene file, the size and date of its prefabs and environment, and the grid
+		int dims[3];
+		int face_size;
+		int num_probes;
+	};
+
+	uint64_t computeCacheHash(GTR::Scene* scene, const Vector3& start, const Vector3& end, const int* dims, int face_size)
+	{
+		std::string content;
+		readFile(scene->filename, content);
+		uint64_t hash = hashFNV64(content.data(), content.size());
+
+		//the files it points to only by their size and date, reading them would cost as much as loading them again
+		std::vector<std::string> files;
+		for (GTR::BaseEntity* entity : scene->entities)
+			if (entity->entity_type == GTR::PREFAB)
+				files.push_back("data/" + ((GTR::PrefabEntity*)entity)->filename);
+		if (scene->environment_filename.size())
+			files.push_back("data/" + scene->environment_filename);
+		for (const std::string& file : files)
+		{
+			size_t size = 0;
+			long long modified = 0;
+			getFileInfo(file, size, modified);
+			uint64_t info[2] = { (uint64_t)size, (uint64_t)modified };
+			hash = hashFNV64(info, sizeof(info), hash);
+		}
+
+		hash = hashFNV64(start.v, sizeof(start.v), hash);
+		hash = hashFNV64(end.v, sizeof(end.v), hash);
+		hash = hashFNV64(dims, sizeof(int) * 3, hash);
+		hash = hashFNV64(&face_size, sizeof(face_size), hash);
+		return hash;
+	}
+
+	//the lights like deferred.fs computes them, with a shadow ray to every one
+	Vector3 computeDirectLight(GTR::Scene* scene, const Vector3& position, const Vector3& normal, float bias, float far_distance)
+	{
+		Vector3 light;
+		Vector3 origin = position + normal * bias;
+		for (GTR::LightEntity* lent : scene->l_entities)
+		{
+			if (!lent->visible)
+				continue;
+			Vector3 light_position = lent->model.getTranslation();
+
+			if (lent->light_type == GTR::DIRECTIONAL)
+			{
+				Vector3 L = normalize(light_position);
+				float NdotL = normal.dot(L);
+				if (NdotL > 0.0f && scene->testLineOfSight(origin, origin + L * far_distance))
+					light += lent->color * (NdotL * lent->intensity);
+				continue;
+			}
+
+			Vector3 to_light = light_position - position;
+			float distance = to_light.length();
+			float attenuation = std::max(lent->max_distance - distance, 0.0f) / lent->max_distance;
+			if (attenuation <= 0.0f || distance <= 0.0f)
+				continue;
+			Vector3 L = to_light * (1.0f / distance);
+			float NdotL = clamp(normal.dot(L), 0.0f, 1.0f);
+			if (NdotL <= 0.0f)
+				continue;
+
+			float factor = lent->intensity;
+			if (lent->light_type == GTR::SPOT)
+			{
+				float spot_cosine = normalize(lent->target).dot(L * -1.0f);
+				if (spot_cosine < cosf(lent->cone_angle))
+					continue;
+				factor = powf(spot_cosine, 1.0f / lent->area_size);
+			}
+			if (scene->testLineOfSight(origin, light_position))
+				light += lent->color * (NdotL * factor * attenuation);
+		}
+		return light;
+	}
+
+	//one bounce: the surface lit by the lights and the ambient light, the ambient light (or the environment) where the ray escapes
+	Vector3 computeRadiance(GTR::Scene* scene, const Vector3& origin, const Vector3& direction, float bias, float far_distance)
+	{
+		GTR::sSceneRayHit hit;
+		if (!scene->testRay(origin, direction, hit))
+			return scene->getAmbientLight(direction);
+
+		Vector3 normal = hit.normal;
+		if (normal.dot(direction) > 0.0f)
+			normal = normal * -1.0f;
+		GTR::Material* material = hit.node->material;
+		Vector3 albedo = material ? material->color.xyz() : Vector3(1, 1, 1);
+		Vector3 emissive = material ? material->emissive_factor : Vector3();
+		return albedo * (computeDirectLight(scene, hit.position, normal, bias, far_distance) + scene->getAmbientLight(normal)) + emissive;
+	}
+}
+
+IrradianceGrid::IrradianceGrid()
+{
+	dims[0] = 8;
+	dims[1] = 4;
+	dims[2] = 8;
+	memset(baked_dims, 0, sizeof(baked_dims));
+	face_size = 8;
+	normal_distance = 1.0f;
+	bias = 0.1f;
+	enabled = true;
+	texture = NULL;
+}
+
+IrradianceGrid::~IrradianceGrid()
+{
+	if (texture)
+		delete texture;
+}
+
+Vector3 IrradianceGrid::getProbePosition(int x, int y, int z) const
+{
+	Vector3 delta = end - start;
+	return start + Vector3(
+		dims[0] > 1 ? delta.x * x / (dims[0] - 1) : 0.0f,
+		dims[1] > 1 ? delta.y * y / (dims[1] - 1) : 0.0f,
+		dims[2] > 1 ? delta.z * z / (dims[2] - 1) : 0.0f);
+}
+
+void IrradianceGrid::fitToScene(GTR::Scene* scene)
+{
+	scene->updateRayBVH();
+	if (scene->ray_bvh.isEmpty())
+		return;
+
+	//the probes at the border would be just on the surfaces, they go a bit inside
+	const sBVHNode& root = scene->ray_bvh.nodes[0];
+	Vector3 margin = (root.max - root.min) * 0.05f;
+	start = root.min + margin;
+	end = root.max - margin;
+}
+
+bool IrradianceGrid::bake(GTR::Scene* scene)
+{
+	assert(dims[0] > 0 && dims[1] > 0 && dims[2] > 0 && face_size > 1);
+
+	//built in this thread before the workers query it
+	scene->updateRayBVH();
+	if (scene->ray_bvh.isEmpty())
+	{
+		std::cout << "[WARN] nothing to bake the irradiance against" << std::endl;
+		return false;
+	}
+	const sBVHNode& root = scene->ray_bvh.nodes[0];
+	float far_distance = (root.max - root.min).length() * 2.0f;
+
+	double start_time = getTime();
+	probes.resize(getNumProbes());
+	JobSystem::parallelFor(getNumProbes(), [&](int index) {
+		Vector3 position = getProbePosition(index % dims[0], (index / dims[0]) % dims[1], index / (dims[0] * dims[1]));
+		FloatImage faces[6];
+		for (int face = 0; face < 6; ++face)
+		{
+			faces[face].resize(face_size, face_size, 3);
+			for (int y = 0; y < face_size; ++y)
+				for (int x = 0; x < face_size; ++x)
+				{
+					Vector3 direction = cubemapTexelDirection(face, x, y, face_size);
+					faces[face].setPixel(x, y, Vector4(computeRadiance(scene, position, direction, bias, far_distance), 1.0f));
+				}
+		}
+		probes[index] = computeSH(faces);
+	});
+	baked_start = start;
+	baked_end = end;
+	memcpy(baked_dims, dims, sizeof(dims));
+	std::cout << " + Irradiance baked: " << getNumProbes() << " probes in " << (getTime() - start_time) << " ms" << std::endl;
+	return true;
+}
+
+std::string IrradianceGrid::getCacheFilename(GTR::Scene* scene)
+{
+	std::string filename = scene->filename;
+	size_t dot = filename.find_last_of('.');
+	if (dot != std::string::npos)
+		filename = filename.substr(0, dot);
+	return filename + ".irr";
+}
+
+bool IrradianceGrid::load(const char* filename, GTR::Scene* scene)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	//the grid in the file is the one used (it could have been changed from the menu), the hash tells if it is still valid for the scene
+	sIrradianceCacheHeader header;
+	Vector3 file_start, file_end;
+	std::vector<SphericalHarmonics> file_probes;
+	bool valid = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, "IRRP", 4) == 0 && header.version == IRRADIANCE_CACHE_VERSION &&
+		fread(file_start.v, sizeof(file_start.v), 1, f) == 1 && fread(file_end.v, sizeof(file_end.v), 1, f) == 1 &&
+		header.num_probes == header.dims[0] * header.dims[1] * header.dims[2] && header.num_probes > 0 &&
+		header.hash == computeCacheHash(scene, file_start, file_end, header.dims, header.face_size);
+	if (valid)
+	{
+		file_probes.resize(header.num_probes);
+		valid = fread(&file_probes[0], sizeof(SphericalHarmonics), file_probes.size(), f) == file_probes.size();
+	}
+	fclose(f);
+
+	if (!valid)
+	{
+		std::cout << "[WARN] irradiance cache is outdated: " << filename << std::endl;
+		return false;
+	}
+	start = baked_start = file_start;
+	end = baked_end = file_end;
+	memcpy(dims, header.dims, sizeof(dims));
+	memcpy(baked_dims, header.dims, sizeof(baked_dims));
+	face_size = header.face_size;
+	probes.swap(file_probes);
+	return true;
+}
+
+bool IrradianceGrid::save(const char* filename, GTR::Scene* scene) const
+{
+	assert(probes.size() && (int)probes.size() == baked_dims[0] * baked_dims[1] * baked_dims[2] && "irradiance not baked");
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write irradiance cache: " << filename << std::endl;
+		return false;
+	}
+
+	sIrradianceCacheHeader header;
+	memcpy(header.magic, "IRRP", 4);
+	header.version = IRRADIANCE_CACHE_VERSION;
+	header.hash = computeCacheHash(scene, baked_start, baked_end, baked_dims, face_size);
+	memcpy(header.dims, baked_dims, sizeof(baked_dims));
+	header.face_size = face_size;
+	header.num_probes = (int)probes.size();
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(baked_start.v, sizeof(baked_start.v), 1, f);
+	fwrite(baked_end.v, sizeof(baked_end.v), 1, f);
+	fwrite(&probes[0], sizeof(SphericalHarmonics), probes.size(), f);
+	fclose(f);
+	return true;
+}
+
+Vector3 IrradianceGrid::computeIrradiance(const Vector3& position, const Vector3& normal) const
+{
+	if (probes.empty())
+		return Vector3();
+
+	//the same trilinear interpolation as the shader
+	const int* dims = baked_dims;
+	Vector3 local;
+	int base[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		float delta = dims[k] > 1 ? (baked_end.v[k] - baked_start.v[k]) / (dims[k] - 1) : 1.0f;
+		float v = (position.v[k] + normal.v[k] * normal_distance - baked_start.v[k]) / std::max(delta, 0.0001f);
+		v = clamp(v, 0.0f, (float)(dims[k] - 1));
+		base[k] = std::min((int)v, std::max(dims[k] - 2, 0));
+		local.v[k] = v - base[k];
+	}
+
+	Vector3 result;
+	for (int i = 0; i < 8; ++i)
+	{
+		int p[3] = { i & 1, (i >> 1) & 1, (i >> 2) & 1 };
+		float weight = 1.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			weight *= p[k] ? local.v[k] : 1.0f - local.v[k];
+			p[k] = std::min(base[k] + p[k], dims[k] - 1);
+		}
+		result += evaluateSH(probes[p[0] + p[1] * dims[0] + p[2] * dims[0] * dims[1]], normal) * weight;
+	}
+	return Vector3(std::max(result.x, 0.0f), std::max(result.y, 0.0f), std::max(result.z, 0.0f));
+}
+
+void IrradianceGrid::upload()
+{
+	if (texture)
+		delete texture;
+	texture = NULL;
+	if (probes.empty())
+		return;
+
+	//the 9 coefficients of every probe one after the other, IRRADIANCE_PROBES_PER_ROW in a row, read with texelFetch
+	int rows = ((int)probes.size() + IRRADIANCE_PROBES_PER_ROW - 1) / IRRADIANCE_PROBES_PER_ROW;
+	std::vector<SphericalHarmonics> data(rows * IRRADIANCE_PROBES_PER_ROW);
+	std::copy(probes.begin(), probes.end(), data.begin());
+	texture = new Texture(9 * IRRADIANCE_PROBES_PER_ROW, rows, GL_RGB, GL_FLOAT, false, (Uint8*)&data[0], GL_RGB32F);
+}
+
+void IrradianceGrid::setUniforms(Shader* shader) const
+{
+	if (!enabled || !texture)
+	{
+		shader->setUniform("u_irr_enabled", 0);
+		return;
+	}
+	shader->setUniform("u_irr_enabled", 1);
+	shader->setUniform("u_irr_texture", texture, IRRADIANCE_SLOT);
+	shader->setUniform("u_irr_start", baked_start);
+	shader->setUniform("u_irr_end", baked_end);
+	shader->setUniform("u_irr_dims", Vector3((float)baked_dims[0], (float)baked_dims[1], (float)baked_dims[2]));
+	shader->setUniform("u_irr_normal_distance", normal_distance);
+}
+
+void IrradianceGrid::renderInMenu(GTR::Scene* scene)
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode(this, "Irradiance"))
+		return;
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::Text("%d probes baked (%dx%dx%d)", (int)probes.size(), baked_dims[0], baked_dims[1], baked_dims[2]);
+	ImGui::DragFloat3("Start", start.v);
+	ImGui::DragFloat3("End", end.v);
+	ImGui::SliderInt3("Dims", dims, 1, 32);
+	ImGui::SliderInt("Face size", &face_size, 2, 32);
+	ImGui::DragFloat("Normal distance", &normal_distance, 0.1f, 0.0f, 100.0f);
+	ImGui::DragFloat("Bias", &bias, 0.01f, 0.0f, 10.0f);
+	if (ImGui::Button("Fit to scene"))
+		fitToScene(scene);
+	ImGui::SameLine();
+	if (ImGui::Button("Bake") && bake(scene))
+	{
+		save(getCacheFilename(scene).c_str(), scene);
+		upload();
+	}
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,65 @@
+/*  Irradiance probes: a grid of spherical harmonics that replaces the flat ambient light of the scene.
+	Every probe casts the rays of a small cubemap against the scene BVH on the CPU (one bounce: the lights and the
+	ambient light hitting the surfaces, the ambient light where the rays escape) and projects it with computeSH.
+	The result is stored in a cache next to the scene, the next runs only read it.
+	The shaders interpolate the 8 probes around every pixel from a texture with the 9 coefficients of every probe,
+	IRRADIANCE_PROBES_PER_ROW probes in each row so big grids don't go over the maximum texture size.
+*/
+#pragma once
+
+#include "framework.h"
+#include "sphericalharmonics.h"
+
+#include <string>
+#include <vector>
+
+class Shader;
+class Texture;
+
+namespace GTR { class Scene; }
+
+#define IRRADIANCE_SLOT 8 //texture slot used by u_irr_texture
+#define IRRADIANCE_CACHE_VERSION 1
+#define IRRADIANCE_PROBES_PER_ROW 64 //of the texture, the same in the shader
+
+class IrradianceGrid
+{
+public:
+	//the grid of the next bake, edited in the menu
+	Vector3 start; //position of the first probe
+	Vector3 end; //position of the last one
+	int dims[3]; //probes in every axis
+	int face_size; //of the cubemap every probe casts
+	float normal_distance; //the lookup moves this along the normal, less leaking from behind the walls
+	float bias; //distance the shadow rays start from the surface
+	bool enabled;
+
+	//the grid of the probes, the lookups use it until it is baked again
+	Vector3 baked_start;
+	Vector3 baked_end;
+	int baked_dims[3];
+	std::vector<SphericalHarmonics> probes; //x first, then y, then z
+	Texture* texture;
+
+	IrradianceGrid();
+	~IrradianceGrid();
+
+	int getNumProbes() const { return dims[0] * dims[1] * dims[2]; }
+	Vector3 getProbePosition(int x, int y, int z) const;
+	void fitToScene(GTR::Scene* scene); //start and end from the bounds of the scene BVH
+
+	//casts the rays of all the probes, split between the workers
+	bool bake(GTR::Scene* scene);
+
+	//the cache keeps the hash of the scene file, the size and date of its prefabs and environment, and the grid.
+	//it is ignored if they don't match (the buffers and textures a .gltf points to are not checked)
+	static std::string getCacheFilename(GTR::Scene* scene);
+	bool load(const char* filename, GTR::Scene* scene);
+	bool save(const char* filename, GTR::Scene* scene) const;
+
+	Vector3 computeIrradiance(const Vector3& position, const Vector3& normal) const; //what the shader does, in the CPU
+	void upload();
+	void setUniforms(Shader* shader) const; //u_irr_enabled is 0 if there is nothing baked
+
+	void renderInMenu(GTR::Scene* scene);
+};
@@ -0,0 +1,198 @@
+#include "jobs.h"
+
+#include <thread>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <cassert>
+#include <algorithm>
+
+#include "utils.h"
+
+namespace {
+	std::vector<std::thread> workers;
+	std::deque< std::function<void()> > jobs;
+	std::deque< std::function<void()> > main_thread_jobs;
+	std::mutex jobs_mutex;
+	std::mutex main_thread_mutex;
+	std::condition_variable jobs_condition;
+	std::thread::id main_thread_id = std::this_thread::get_id(); //static init happens in the main thread
+	bool initialized = false;
+	bool stopping = false;
+
+	bool popJob(std::function<void()>& job)
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		if (jobs.empty())
+			return false;
+		job = std::move(jobs.front());
+		jobs.pop_front();
+		return true;
+	}
+
+	void workerLoop()
+	{
+		while (true)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(jobs_mutex);
+				jobs_condition.wait(lock, [] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) //stopping and nothing left
+					return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	//stops the workers when the app exits
+	struct sJobSystemCleaner { ~sJobSystemCleaner() { JobSystem::shutdown(); } } job_system_cleaner;
+}
+
+void JobSystem::init(int num_workers)
+{
+	if (initialized)
+		return;
+	initialized = true;
+	stopping = false;
+	main_thread_id = std::this_thread::get_id();
+
+	if (num_workers < 0)
+	{
+		num_workers = (int)std::thread::hardware_concurrency() - 1;
+		if (num_workers < 1)
+			num_workers = 1;
+	}
+
+	for (int i = 0; i < num_workers; ++i)
+		workers.push_back(std::thread(workerLoop));
+	stdlog(" + Job system: " + std::to_string(num_workers) + " workers");
+}
+
+void JobSystem::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		stopping = true;
+	}
+	jobs_condition.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+	initialized = false;
+}
+
+int JobSystem::getNumWorkers()
+{
+	return (int)workers.size();
+}
+
+bool JobSystem::isMainThread()
+{
+	return std::this_thread::get_id() == main_thread_id;
+}
+
+void JobSystem::enqueue(std::function<void()> job)
+{
+	if (!initialized)
+		init();
+
+	if (workers.empty())
+	{
+		job();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		jobs.push_back(std::move(job));
+	}
+	jobs_condition.notify_one();
+}
+
+bool JobSystem::helpWhileWaiting()
+{
+	if (isMainThread() && processMainThreadJobs(1))
+		return true;
+
+	std::function<void()> job;
+	if (!popJob(job))
+		return false;
+	job();
+	return true;
+}
+
+void JobSystem::parallelFor(int count, const std::function<void(int)>& job)
+{
+	if (count <= 0)
+		return;
+	if (!initialized)
+		init();
+
+	int num_tasks = std::min(count, (int)workers.size() + 1);
+	if (num_tasks == 1)
+	{
+		for (int i = 0; i < count; ++i)
+			job(i);
+		return;
+	}
+
+	//every task takes the next index until there are no more, the caller thread also works
+	struct sParallelForState {
+		std::atomic<int> next;
+		std::atomic<int> finished;
+	};
+	std::shared_ptr<sParallelForState> state = std::make_shared<sParallelForState>();
+	state->next = 0;
+	state->finished = 0;
+	const std::function<void(int)>* job_ptr = &job; //valid until we return
+
+	auto task = [state, job_ptr, count]() {
+		int i;
+		while ((i = state->next++) < count)
+			(*job_ptr)(i);
+		state->finished++;
+	};
+
+	for (int i = 1; i < num_tasks; ++i)
+		enqueue(task);
+	task();
+
+	while (state->finished < num_tasks)
+		if (!helpWhileWaiting())
+			std::this_thread::yield();
+}
+
+void JobSystem::runOnMainThread(std::function<void()> job)
+{
+	if (isMainThread())
+	{
+		job();
+		return;
+	}
+	std::lock_guard<std::mutex> lock(main_thread_mutex);
+	main_thread_jobs.push_back(std::move(job));
+}
+
+int JobSystem::processMainThreadJobs(int max_jobs)
+{
+	assert(isMainThread() && "main thread jobs can only be executed from the main thread");
+	int num = 0;
+	while (max_jobs < 0 || num < max_jobs)
+	{
+		std::function<void()> job;
+		{
+			std::lock_guard<std::mutex> lock(main_thread_mutex);
+			if (main_thread_jobs.empty())
+				break;
+			job = std::move(main_thread_jobs.front());
+			main_thread_jobs.pop_front();
+		}
+		job();
+		num++;
+	}
+	return num;
+}
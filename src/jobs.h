@@ -0,0 +1,96 @@
+/*  Small job system used to load and process assets in the background.
+	OpenGL calls must stay in the main thread (the one with the context), workers can send them there with runOnMainThread.
+*/
+#pragma once
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <string>
+
+class JobSystem
+{
+public:
+	static void init(int num_workers = -1); //-1 to create one worker per core (minus the main thread)
+	static void shutdown(); //waits for the jobs in the queue and stops the workers
+	static int getNumWorkers();
+	static bool isMainThread();
+
+	//runs the job in a worker (or in the caller thread if there are no workers)
+	static void enqueue(std::function<void()> job);
+
+	//runs a job that returns a value, use wait to get it
+	template<typename T> static std::shared_future<T> run(std::function<T()> job)
+	{
+		std::shared_ptr< std::promise<T> > promise = std::make_shared< std::promise<T> >();
+		std::shared_future<T> future = promise->get_future().share();
+		enqueue([promise, job]() { promise->set_value(job()); });
+		return future;
+	}
+
+	//waits for a result, meanwhile it executes other jobs (and the main thread queue if called from the main thread)
+	template<typename T> static T wait(const std::shared_future<T>& future)
+	{
+		while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			if (!helpWhileWaiting())
+				future.wait_for(std::chrono::milliseconds(1));
+		return future.get();
+	}
+
+	//calls job(i) for every i in [0,count) using all the workers, returns when all have finished
+	static void parallelFor(int count, const std::function<void(int)>& job);
+
+	//used by workers to send work that needs the GL context
+	static void runOnMainThread(std::function<void()> job);
+	static int processMainThreadJobs(int max_jobs = -1); //call it from the main thread once per frame, returns the number of jobs executed
+
+private:
+	static bool helpWhileWaiting(); //executes one pending job, returns false if there was nothing to do
+};
+
+//keeps track of the resources being loaded so if two threads request the same one it is only loaded once
+//the second thread waits for the result of the first one
+template<typename T> class InFlightRequests
+{
+public:
+	T get(const std::string& name, const std::function<T()>& loader)
+	{
+		std::shared_ptr< std::promise<T> > promise;
+		std::shared_future<T> future;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = requests.find(name);
+			if (it != requests.end())
+				future = it->second;
+			else
+			{
+				promise = std::make_shared< std::promise<T> >();
+				future = requests[name] = promise->get_future().share();
+			}
+		}
+		if (promise)
+			promise->set_value(loader()); //we are the first one, load it
+		return JobSystem::wait(future);
+	}
+
+	//registers a resource that is already loaded
+	void set(const std::string& name, T value)
+	{
+		std::promise<T> promise;
+		promise.set_value(value);
+		std::lock_guard<std::mutex> lock(mutex);
+		requests[name] = promise.get_future().share();
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		requests.clear();
+	}
+
+private:
+	std::mutex mutex;
+	std::map<std::string, std::shared_future<T> > requests;
+};
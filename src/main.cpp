@@ -11,10 +11,14 @@
 
 #include "framework.h"
 #include "mesh.h"
+#include "shader.h"
 #include "camera.h"
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "jobs.h"
+#include "benchmarks.h"
+#include "profiler.h"
 
 #include <iostream> //to output
 
@@ -127,12 +131,33 @@ void mainLoop(SDL_Window* window)
 
 	while (!app->must_exit)
 	{
+		PROFILE_FRAME_BEGIN();
+
+		//GL work sent by the workers (uploads)
+		{
+			PROFILE_SCOPE("MainThreadJobs");
+			JobSystem::processMainThreadJobs();
+		}
+
+		//shaders compiled in the background
+		{
+			PROFILE_SCOPE("Shaders");
+			Shader::processPending();
+		}
+
 		//render frame
 		app->render();
 		if (app->render_gui)
+		{
+			PROFILE_GPU_SCOPE("GUI");
 			renderDebug(window, app);
+		}
 		// swap between front buffer and back buffer
-		SDL_GL_SwapWindow(window);
+		{
+			PROFILE_SCOPE("Swap");
+			SDL_GL_SwapWindow(window);
+		}
+		PROFILE_FRAME_END();
 
 		//update events
 		while(SDL_PollEvent(&sdlEvent))
@@ -208,6 +233,11 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//command line benchmarks run without window
+	int bench_result = runBenchmarks(argc, argv);
+	if (bench_result != -1)
+		return bench_result;
+
 	std::cout << "Initiating app..." << std::endl;
 
 	//prepare SDL
@@ -244,6 +274,9 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
+	//workers to load assets in the background (must be created from the main thread)
+	JobSystem::init();
+
 	//launch the application (app is a global variable)
 	app = new Application(window_width, window_height, window);
 
@@ -9,32 +9,51 @@
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
+#include <unordered_map>
 
 #include "camera.h"
 #include "texture.h"
+#include "meshoptimizer.h"
 //#include "animation.h"
-#include "extra/coldet/coldet.h"
+#include "bvh.h"
+
+#include <mutex>
 
 //#include "engine/application.h"
 
-bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
+bool Mesh::use_binary = true;			//checks if there is .mbin newer than the file, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::optimize_meshes = true;		//reorders the indices when importing, the result is stored in the .mbin
+bool Mesh::quantize_meshes = true;		//packs the vertices in a compact layout when uploading, the result is stored in the .mbin
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 
+std::mutex bvh_mutex; //meshes can be queried from the workers (baking)
+
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
 #define FORMAT_MBIN 3
 #define FORMAT_MESH 4
 
+#ifndef GL_INT_2_10_10_10_REV
+	#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+#ifndef GL_HALF_FLOAT
+	#define GL_HALF_FLOAT 0x140B
+#endif
+
+const char* vertex_attribute_names[VA_COUNT] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights" };
+
 Mesh::Mesh()
 {
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
-	collision_model = NULL;
+	bvh = NULL;
+	mapped_file = NULL;
+	memset(&layout, 0, sizeof(layout));
 
 	clear();
 }
@@ -102,9 +121,20 @@ void Mesh::clear()
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
-
-	if (collision_model)
-		delete (CollisionModel3D*)collision_model;
+	packed_vertices.clear();
+	packed_indices.clear();
+	bvh_nodes.clear();
+	bvh_triangles.clear();
+	memset(&layout, 0, sizeof(layout));
+
+	//after clearing the views
+	if (mapped_file)
+		delete mapped_file;
+	mapped_file = NULL;
+
+	if (bvh)
+		delete bvh;
+	bvh = NULL;
 }
 
 int vertex_location = -1;
@@ -115,8 +145,50 @@ int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
 
+int* vertex_attribute_locations[VA_COUNT] = { &vertex_location, &normal_location, &uv_location, &uv1_location, &color_location, &bones_location, &weights_location };
+
+void getVertexFormatGL(unsigned char format, GLenum& type, GLboolean& normalized)
+{
+	normalized = GL_FALSE;
+	switch (format)
+	{
+		case VF_HALF: type = GL_HALF_FLOAT; break;
+		case VF_UNORM16: type = GL_UNSIGNED_SHORT; normalized = GL_TRUE; break;
+		case VF_SNORM10: type = GL_INT_2_10_10_10_REV; normalized = GL_TRUE; break;
+		case VF_UNORM8: type = GL_UNSIGNED_BYTE; normalized = GL_TRUE; break;
+		case VF_UINT8: type = GL_UNSIGNED_BYTE; break;
+		default: type = GL_FLOAT; break;
+	}
+}
+
 void Mesh::enableBuffers(Shader* sh)
 {
+	//packed meshes describe all the attributes in the layout
+	if (layout.stride && (interleaved_vbo_id || packed_vertices.size()))
+	{
+		const unsigned char* base = NULL;
+		if (interleaved_vbo_id)
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id);
+		else
+			base = packed_vertices.data();
+
+		for (int i = 0; i < VA_COUNT; ++i)
+		{
+			sVertexAttribute& attribute = layout.attributes[i];
+			int& location = *vertex_attribute_locations[i];
+			location = attribute.format ? sh->getAttribLocation(vertex_attribute_names[i]) : -1;
+			if (location == -1)
+				continue;
+			GLenum type;
+			GLboolean normalized;
+			getVertexFormatGL(attribute.format, type, normalized);
+			glEnableVertexAttribArray(location);
+			glVertexAttribPointer(location, attribute.components, type, normalized, layout.stride, base + attribute.offset);
+		}
+		checkGLErrors();
+		return;
+	}
+
 	vertex_location = sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
@@ -265,7 +337,7 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert(getNumVertices() && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -283,33 +355,34 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	int start = 0; //in primitives
-	int size = (int)vertices.size();
-	if (m_indices.size())
-		size = (int)m_indices.size();
-	else
-	if (interleaved.size())
-		size = (int)interleaved.size();
+	int num_indices = getNumIndices();
+	int size = num_indices ? num_indices : getNumVertices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
+	}
+
+	//packed indices can be 16 bits
+	GLenum index_type = GL_UNSIGNED_INT;
+	int index_size = sizeof(unsigned int);
+	if (layout.index_size == 2)
+	{
+		index_type = GL_UNSIGNED_SHORT;
+		index_size = sizeof(unsigned short);
 	}
 
 	//DRAW
-	if (m_indices.size())
+	if (num_indices)
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawElementsInstanced(primitive, size, index_type, (void*)((size_t)start * index_size), num_instances); //core since GL 3.1, the context we create
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -318,11 +391,13 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glDrawElements(primitive, size, index_type,(void *)((size_t)start * index_size));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
+			else if (packed_indices.size())
+				glDrawElements(primitive, size, index_type, (void*)(packed_indices.data() + start * index_size));
 			else
 				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
 		}
@@ -330,13 +405,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -501,7 +570,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	assert(getNumVertices());
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -509,6 +578,33 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
+	if (quantize_meshes && !packed_vertices.size())
+	{
+		computeVertexLayout(true);
+		packVertices();
+	}
+
+	//all the attributes go in the same buffer
+	if (layout.stride && packed_vertices.size())
+	{
+		if (interleaved_vbo_id == 0)
+			glGenBuffersARB(1, &interleaved_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, packed_vertices.size(), packed_vertices.data(), GL_STATIC_DRAW_ARB);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+		if (packed_indices.size())
+		{
+			if (indices_vbo_id == 0)
+				glGenBuffersARB(1, &indices_vbo_id);
+			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, packed_indices.size(), packed_indices.data(), GL_STATIC_DRAW_ARB);
+			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
+		}
+		checkGLErrors();
+		return;
+	}
+
 	if (interleaved.size())
 	{
 		// Vertex,Normal,UV
@@ -593,123 +689,107 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
-bool Mesh::createCollisionModel(bool is_static)
+MeshBVH* Mesh::getBVH()
 {
-	if (collision_model)
-		return true;
-
-	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
-
-	if (m_indices.size()) //indexed
 	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
-
-		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
-			{
-				auto v1 = interleaved[m_indices[i+0]];
-				auto v2 = interleaved[m_indices[i+1]];
-				auto v3 = interleaved[m_indices[i+2]];
-				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-			}
-		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
-		{
-			auto v1 = vertices[m_indices[i+0]];
-			auto v2 = vertices[m_indices[i+1]];
-			auto v3 = vertices[m_indices[i+2]];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
+		std::lock_guard<std::mutex> lock(bvh_mutex);
+		if (bvh)
+			return bvh;
 	}
-	else if (interleaved.size()) //is interleaved
+
+	//built out of the lock so different meshes can build in parallel
+	MeshBVH* new_bvh = new MeshBVH();
+	if (bvh_nodes.size() && bvh_triangles.size())
 	{
-		collision_model->setTriangleNumber(interleaved.size() / 3);
-		for (unsigned int i = 0; i < interleaved.size(); i+=3)
-		{
-			auto v1 = interleaved[i];
-			auto v2 = interleaved[i+1];
-			auto v3 = interleaved[i+2];
-			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-		}
+		//cooked, it only has to be copied out of the mapping
+		new_bvh->nodes.resize(bvh_nodes.size() / sizeof(sBVHNode));
+		new_bvh->triangles.resize(bvh_triangles.size() / sizeof(sBVHTriangles4));
+		memcpy(&new_bvh->nodes[0], bvh_nodes.data(), new_bvh->nodes.size() * sizeof(sBVHNode));
+		memcpy(&new_bvh->triangles[0], bvh_triangles.data(), new_bvh->triangles.size() * sizeof(sBVHTriangles4));
 	}
-	else if (vertices.size()) //non interleaved
+	else if (!new_bvh->build(this))
 	{
-		collision_model->setTriangleNumber((int)vertices.size() / 3);
-		for (unsigned int i = 0; i < (int)vertices.size(); i+=3)
-		{
-			auto v1 = vertices[i];
-			auto v2 = vertices[i + 1];
-			auto v3 = vertices[i + 2];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
+		delete new_bvh;
+		return NULL;
 	}
+
+	std::lock_guard<std::mutex> lock(bvh_mutex);
+	if (bvh) //another thread built it meanwhile
+		delete new_bvh;
 	else
-	{
-		assert(0 && "mesh without vertices, cannot create collision model");
-		return false;
-	}
-	collision_model->finalize();
-	this->collision_model = collision_model;
-	return true;
+		bvh = new_bvh;
+	return bvh;
 }
 
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 bool Mesh::testRayCollision(Matrix44 model, Vector3 start, Vector3 front, Vector3& collision, Vector3& normal, float max_ray_dist, bool in_object_space )
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
-			return false;
-
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform( model.m );
-	if (collision_model->rayCollision( start.v , front.v, true,0.0, max_ray_dist) == false)
+	MeshBVH* bvh = getBVH();
+	if (!bvh)
 		return false;
 
-	collision_model->getCollisionPoint( collision.v, in_object_space);
-
-	float t1[9],t2[9];
-	collision_model->getCollidingTriangles(t1,t2, in_object_space);
+	//the ray goes to object space, the direction keeps the scale so the distances are the same
+	Matrix44 inv = model;
+	if (!inv.inverseAffine())
+		return false;
+	sRay ray;
+	ray.origin = inv * start;
+	ray.direction = inv.rotateVector(front);
+	ray.max_distance = max_ray_dist;
 
-	Vector3 v1;
-	Vector3 v2;
-	v1=Vector3(t1[3]-t1[0],t1[4]-t1[1],t1[5]-t1[2]);
-	v2=Vector3(t1[6]-t1[0],t1[7]-t1[1],t1[8]-t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	sRayHit hit;
+	if (!bvh->testRay(ray, hit))
+		return false;
 
+	collision = ray.origin + ray.direction * hit.distance;
+	normal = hit.normal;
+	if (!in_object_space)
+	{
+		collision = model * collision;
+		normal = transformNormal(inv, normal);
+	}
 	return true;
 }
 
 bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal)
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
-			return false;
-
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform(model.m);
-	if (collision_model->sphereCollision(center.v, radius) == false)
+	MeshBVH* bvh = getBVH();
+	if (!bvh)
 		return false;
 
-	collision_model->getCollisionPoint(collision.v, false);
+	Matrix44 inv = model;
+	if (!inv.inverseAffine())
+		return false;
+	float scale = std::max(std::max(inv.rotateVector(Vector3(1, 0, 0)).length(), inv.rotateVector(Vector3(0, 1, 0)).length()), inv.rotateVector(Vector3(0, 0, 1)).length());
+	if (!bvh->testSphere(inv * center, radius * scale, collision, normal))
+		return false;
 
-	float t1[9], t2[9];
-	collision_model->getCollidingTriangles(t1, t2, false);
+	collision = model * collision;
+	normal = transformNormal(inv, normal);
+	return true;
+}
 
-	Vector3 v1;
-	Vector3 v2;
-	v1 = Vector3(t1[3] - t1[0], t1[4] - t1[1], t1[5] - t1[2]);
-	v2 = Vector3(t1[6] - t1[0], t1[7] - t1[1], t1[8] - t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+void Mesh::testRaysCollision(const Matrix44& model, const sRay* rays, sRayHit* hits, int count)
+{
+	MeshBVH* bvh = getBVH();
+	Matrix44 inv = model;
+	if (!bvh || !inv.inverseAffine())
+	{
+		for (int i = 0; i < count; ++i)
+			hits[i].triangle = -1;
+		return;
+	}
 
-	return true;
+	std::vector<sRay> local_rays(rays, rays + count);
+	for (int i = 0; i < count; ++i)
+	{
+		local_rays[i].origin = inv * rays[i].origin;
+		local_rays[i].direction = inv.rotateVector(rays[i].direction);
+	}
+	bvh->testRays(local_rays.data(), hits, count);
+	for (int i = 0; i < count; ++i)
+		if (hits[i].triangle != -1)
+			hits[i].normal = transformNormal(inv, hits[i].normal);
 }
 
 bool Mesh::interleaveBuffers()
@@ -735,126 +815,525 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
-typedef struct 
+unsigned int Mesh::getNumVertices()
 {
-	int version;
-	int header_bytes;
-	int size;
-	int num_indices;
-	Vector3 aabb_min;
-	Vector3	aabb_max;
-	Vector3	center;
-	Vector3	halfsize;
-	float radius;
-	int num_bones;
-	int num_submeshes;
-	Matrix44 bind_matrix;
-	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
-} sMeshInfo;
+	if (interleaved.size())
+		return (unsigned int)interleaved.size();
+	if (vertices.size())
+		return (unsigned int)vertices.size();
+	if (layout.stride)
+		return (unsigned int)(packed_vertices.size() / layout.stride);
+	return 0;
+}
 
-bool Mesh::readBin(const char* filename, bool bFromNetwork)
+unsigned int Mesh::getNumIndices()
 {
-	FILE *f;
-	assert(filename);
+	if (m_indices.size())
+		return (unsigned int)m_indices.size();
+	if (layout.index_size)
+		return (unsigned int)(packed_indices.size() / layout.index_size);
+	return 0;
+}
 
-	struct stat stbuffer;
+unsigned int Mesh::getIndex(unsigned int i)
+{
+	if (m_indices.size())
+		return m_indices[i];
+	if (layout.index_size == sizeof(unsigned short))
+		return ((const unsigned short*)packed_indices.data())[i];
+	return ((const unsigned int*)packed_indices.data())[i];
+}
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
-		return false;
+const Vector3& Mesh::getVertexPosition(unsigned int i)
+{
+	if (interleaved.size())
+		return interleaved[i].vertex;
+	if (vertices.size())
+		return vertices[i];
+	assert(layout.attributes[VA_POSITION].format == VF_FLOAT);
+	return *(const Vector3*)(packed_vertices.data() + i * layout.stride + layout.attributes[VA_POSITION].offset);
+}
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+unsigned short floatToHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(float));
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = bits & 0x7FFFFF;
+
+	if (((bits >> 23) & 0xFF) == 0xFF) //inf or nan
+		return (unsigned short)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+	if (exponent >= 31) //too big
+		return (unsigned short)(sign | 0x7C00);
+	if (exponent <= 0) //denormalized
+	{
+		if (exponent < -10)
+			return (unsigned short)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return (unsigned short)(sign | half);
+	}
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //round to nearest
+		half++;
+	return (unsigned short)half;
+}
 
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+int getVertexFormatSize(unsigned char format, unsigned char components)
+{
+	switch (format)
 	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
-		return false;
+		case VF_FLOAT: return 4 * components;
+		case VF_HALF:
+		case VF_UNORM16: return 2 * components;
+		case VF_SNORM10: return 4;
+		case VF_UNORM8:
+		case VF_UINT8: return components;
+	}
+	return 0;
+}
+
+void writeVertexAttribute(unsigned char* dest, const sVertexAttribute& attribute, const float* value)
+{
+	switch (attribute.format)
+	{
+		case VF_FLOAT: memcpy(dest, value, sizeof(float) * attribute.components); break;
+		case VF_HALF:
+			for (int i = 0; i < attribute.components; ++i)
+				((unsigned short*)dest)[i] = floatToHalf(value[i]);
+			break;
+		case VF_UNORM16:
+			for (int i = 0; i < attribute.components; ++i)
+				((unsigned short*)dest)[i] = (unsigned short)(clamp(value[i], 0.0f, 1.0f) * 65535.0f + 0.5f);
+			break;
+		case VF_SNORM10:
+			{
+				unsigned int packed = 0;
+				for (int i = 0; i < 3; ++i)
+				{
+					int v = (int)floor(clamp(value[i], -1.0f, 1.0f) * 511.0f + 0.5f);
+					packed |= (v & 0x3FF) << (i * 10);
+				}
+				memcpy(dest, &packed, sizeof(unsigned int));
+			}
+			break;
+		case VF_UNORM8:
+			for (int i = 0; i < attribute.components; ++i)
+				dest[i] = (unsigned char)(clamp(value[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+			break;
 	}
+}
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+void addVertexAttribute(sVertexLayout& layout, int attribute, unsigned char format, unsigned char components)
+{
+	sVertexAttribute& attrib = layout.attributes[attribute];
+	attrib.format = format;
+	attrib.components = components;
+	attrib.offset = layout.stride;
+	layout.stride += getVertexFormatSize(format, components);
+	layout.stride = (layout.stride + 3) & ~3; //keep attributes 4 bytes aligned
+}
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+bool areUVsNormalized(const Vector2* uvs, unsigned int num, size_t stride)
+{
+	for (unsigned int i = 0; i < num; ++i)
 	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
-		return false;
+		const Vector2& uv = *(const Vector2*)((const char*)uvs + i * stride);
+		if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f || uv.y > 1.0f)
+			return false;
 	}
+	return true;
+}
+
+void Mesh::computeVertexLayout(bool quantize)
+{
+	memset(&layout, 0, sizeof(layout));
+	unsigned int num_vertices = getNumVertices();
+	if (!num_vertices)
+		return;
+
+	addVertexAttribute(layout, VA_POSITION, VF_FLOAT, 3);
 
-	if (info.streams[0] == 'I')
+	if (interleaved.size() || normals.size())
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		if (quantize)
+			addVertexAttribute(layout, VA_NORMAL, VF_SNORM10, 4);
+		else
+			addVertexAttribute(layout, VA_NORMAL, VF_FLOAT, 3);
 	}
-	else if (info.streams[0] == 'V')
+
+	//uvs outside the 0..1 range (tiling) need half floats
+	if (interleaved.size() || uvs.size())
 	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		bool normalized = interleaved.size() ? areUVsNormalized(&interleaved[0].uv, num_vertices, sizeof(tInterleaved)) : areUVsNormalized(&uvs[0], num_vertices, sizeof(Vector2));
+		addVertexAttribute(layout, VA_UV, !quantize ? VF_FLOAT : (normalized ? VF_UNORM16 : VF_HALF), 2);
 	}
 
-	if (info.streams[1] == 'N')
+	if (m_uvs1.size())
 	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		bool normalized = areUVsNormalized(&m_uvs1[0], num_vertices, sizeof(Vector2));
+		addVertexAttribute(layout, VA_UV1, !quantize ? VF_FLOAT : (normalized ? VF_UNORM16 : VF_HALF), 2);
 	}
 
-	if (info.streams[2] == 'U')
+	if (colors.size())
+		addVertexAttribute(layout, VA_COLOR, quantize ? VF_UNORM8 : VF_FLOAT, 4);
+
+	if (bones.size())
+		addVertexAttribute(layout, VA_BONES, VF_UINT8, 4);
+
+	if (weights.size())
+		addVertexAttribute(layout, VA_WEIGHTS, quantize ? VF_UNORM8 : VF_FLOAT, 4);
+
+	//16 bits indices if the vertices fit (0xFFFF is left out as it is used for primitive restart)
+	if (m_indices.size())
+		layout.index_size = (quantize && num_vertices < 0xFFFF) ? sizeof(unsigned short) : sizeof(unsigned int);
+}
+
+bool Mesh::packVertices()
+{
+	unsigned int num_vertices = getNumVertices();
+	if (!layout.stride || !num_vertices)
+		return false;
+
+	unsigned char* dest = packed_vertices.allocate(num_vertices * layout.stride);
+	memset(dest, 0, packed_vertices.size());
+
+	for (unsigned int i = 0; i < num_vertices; ++i)
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		unsigned char* vertex = dest + i * layout.stride;
+		sVertexAttribute* attributes = layout.attributes;
+
+		if (interleaved.size())
+		{
+			writeVertexAttribute(vertex + attributes[VA_POSITION].offset, attributes[VA_POSITION], interleaved[i].vertex.v);
+			writeVertexAttribute(vertex + attributes[VA_NORMAL].offset, attributes[VA_NORMAL], interleaved[i].normal.v);
+			writeVertexAttribute(vertex + attributes[VA_UV].offset, attributes[VA_UV], interleaved[i].uv.value);
+		}
+		else
+		{
+			writeVertexAttribute(vertex + attributes[VA_POSITION].offset, attributes[VA_POSITION], vertices[i].v);
+			if (attributes[VA_NORMAL].format)
+				writeVertexAttribute(vertex + attributes[VA_NORMAL].offset, attributes[VA_NORMAL], normals[i].v);
+			if (attributes[VA_UV].format)
+				writeVertexAttribute(vertex + attributes[VA_UV].offset, attributes[VA_UV], uvs[i].value);
+		}
+
+		if (attributes[VA_UV1].format)
+			writeVertexAttribute(vertex + attributes[VA_UV1].offset, attributes[VA_UV1], m_uvs1[i].value);
+		if (attributes[VA_COLOR].format)
+			writeVertexAttribute(vertex + attributes[VA_COLOR].offset, attributes[VA_COLOR], colors[i].v);
+		if (attributes[VA_BONES].format)
+			memcpy(vertex + attributes[VA_BONES].offset, bones[i].v, sizeof(Vector4ub));
+		if (attributes[VA_WEIGHTS].format)
+		{
+			unsigned char* w = vertex + attributes[VA_WEIGHTS].offset;
+			writeVertexAttribute(w, attributes[VA_WEIGHTS], weights[i].v);
+			if (attributes[VA_WEIGHTS].format == VF_UNORM8)
+			{
+				//rounding could make the weights not add up to one, fix it in the biggest one
+				int sum = w[0] + w[1] + w[2] + w[3];
+				int biggest = 0;
+				for (int j = 1; j < 4; ++j)
+					if (w[j] > w[biggest])
+						biggest = j;
+				if (sum)
+					w[biggest] = (unsigned char)clamp((float)(w[biggest] + 255 - sum), 0.0f, 255.0f);
+			}
+		}
 	}
 
-	if (info.streams[3] == 'C')
+	unsigned char* indices = packed_indices.allocate(m_indices.size() * layout.index_size);
+	if (layout.index_size == sizeof(unsigned short))
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		for (unsigned int i = 0; i < m_indices.size(); ++i)
+			((unsigned short*)indices)[i] = (unsigned short)m_indices[i];
 	}
+	else if (m_indices.size())
+		memcpy(indices, &m_indices[0], m_indices.size() * sizeof(unsigned int));
 
-	if (info.streams[4] == 'I')
+	return true;
+}
+
+struct sWeldKey {
+	float values[8]; //position, normal, uv
+
+	bool operator == (const sWeldKey& other) const { return memcmp(values, other.values, sizeof(values)) == 0; }
+};
+
+struct sWeldKeyHash {
+	size_t operator()(const sWeldKey& key) const
 	{
-		m_indices.resize(info.num_indices);
-		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		//FNV-1a
+		const unsigned char* data = (const unsigned char*)key.values;
+		size_t hash = 2166136261u;
+		for (size_t i = 0; i < sizeof(key.values); ++i)
+			hash = (hash ^ data[i]) * 16777619u;
+		return hash;
 	}
+};
+
+bool Mesh::weldVertices()
+{
+	if (m_indices.size() || interleaved.size() || !vertices.size())
+		return false;
+
+	//streams that cannot be part of the key would be lost
+	if (colors.size() || m_uvs1.size() || bones.size() || weights.size())
+		return false;
+
+	size_t num_vertices = vertices.size();
+	bool has_normals = normals.size() == num_vertices;
+	bool has_uvs = uvs.size() == num_vertices;
+
+	std::unordered_map<sWeldKey, unsigned int, sWeldKeyHash> unique;
+	unique.reserve(num_vertices);
+	m_indices.resize(num_vertices);
+
+	unsigned int num_unique = 0;
+	for (size_t i = 0; i < num_vertices; ++i)
+	{
+		sWeldKey key;
+		memset(&key, 0, sizeof(key));
+		memcpy(key.values, vertices[i].v, sizeof(Vector3));
+		if (has_normals)
+			memcpy(key.values + 3, normals[i].v, sizeof(Vector3));
+		if (has_uvs)
+			memcpy(key.values + 6, uvs[i].value, sizeof(Vector2));
+		for (int j = 0; j < 8; ++j)
+			if (key.values[j] == 0.0f)
+				key.values[j] = 0.0f; //-0 and 0 must match
+
+		auto it = unique.find(key);
+		if (it != unique.end())
+		{
+			m_indices[i] = it->second;
+			continue;
+		}
+
+		//compact the streams in place, the unique vertex is never ahead of the one being read
+		unique[key] = num_unique;
+		m_indices[i] = num_unique;
+		vertices[num_unique] = vertices[i];
+		if (has_normals)
+			normals[num_unique] = normals[i];
+		if (has_uvs)
+			uvs[num_unique] = uvs[i];
+		num_unique++;
+	}
+
+	vertices.resize(num_unique);
+	if (has_normals)
+		normals.resize(num_unique);
+	if (has_uvs)
+		uvs.resize(num_unique);
+	return true;
+}
+
+bool Mesh::optimizeIndices(sVertexCacheStats* before, sVertexCacheStats* after)
+{
+	if (m_indices.size() < 3 || m_indices.size() % 3)
+		return false;
+
+	size_t num_vertices = getNumVertices();
+	if (before)
+		*before = analyzeVertexCache(&m_indices[0], m_indices.size(), num_vertices);
+
+	const float* positions = interleaved.size() ? interleaved[0].vertex.v : vertices[0].v;
+	size_t stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	//every submesh is optimized independently so they keep their range of indices
+	std::vector<int> ranges;
+	for (unsigned int i = 0; i < submeshes.size(); ++i)
+	{
+		sSubmeshInfo& submesh = submeshes[i];
+		if (submesh.start < 0 || submesh.length % 3 || submesh.start + submesh.length > (int)m_indices.size())
+		{
+			ranges.clear(); //ranges dont match the indices, treat it as a single block
+			break;
+		}
+		ranges.push_back(submesh.start);
+		ranges.push_back(submesh.length);
+	}
+	if (ranges.empty())
+	{
+		ranges.push_back(0);
+		ranges.push_back((int)m_indices.size());
+	}
+
+	std::vector<unsigned int> reordered;
+	std::vector<unsigned int> clusters;
+	for (unsigned int i = 0; i < ranges.size(); i += 2)
+	{
+		int start = ranges[i];
+		int length = ranges[i + 1];
+		if (length < 3)
+			continue;
+		reordered.resize(length);
+		optimizeVertexCache(&reordered[0], &m_indices[start], length, num_vertices, &clusters);
+		optimizeOverdraw(&reordered[0], length, positions, num_vertices, stride, clusters);
+		memcpy(&m_indices[start], &reordered[0], length * sizeof(unsigned int));
+	}
+
+	//sort the vertices in the order they are used
+	std::vector<unsigned int> remap;
+	size_t used_vertices = optimizeVertexFetchRemap(&m_indices[0], m_indices.size(), num_vertices, remap);
+	remapVertexStream(vertices, remap, used_vertices);
+	remapVertexStream(normals, remap, used_vertices);
+	remapVertexStream(uvs, remap, used_vertices);
+	remapVertexStream(m_uvs1, remap, used_vertices);
+	remapVertexStream(colors, remap, used_vertices);
+	remapVertexStream(interleaved, remap, used_vertices);
+	remapVertexStream(bones, remap, used_vertices);
+	remapVertexStream(weights, remap, used_vertices);
+
+	if (after)
+		*after = analyzeVertexCache(&m_indices[0], m_indices.size(), used_vertices);
+	return true;
+}
+
+#define MESH_BIN_ALIGNMENT 16 //streams are aligned so they can be used directly from the mapped file
+#define MESH_BIN_MAX_STREAMS 16
+
+enum eMeshBinStream {
+	MBS_NONE = 0,
+	MBS_PACKED_VERTICES,
+	MBS_INDICES,
+	MBS_VERTICES,
+	MBS_INTERLEAVED,
+	MBS_NORMALS,
+	MBS_UVS,
+	MBS_UVS1,
+	MBS_COLORS,
+	MBS_BONES,
+	MBS_WEIGHTS,
+	MBS_BONES_INFO,
+	MBS_SUBMESHES,
+	MBS_BVH_NODES,
+	MBS_BVH_TRIANGLES
+};
+
+typedef struct
+{
+	int type; //eMeshBinStream
+	unsigned int offset; //in bytes from the start of the file
+	unsigned int size; //in bytes
+	unsigned int count; //num elements
+} sMeshBinStream;
+
+typedef struct 
+{
+	int version;
+	int header_bytes;
+	int size;
+	int num_indices;
+	Vector3 aabb_min;
+	Vector3	aabb_max;
+	Vector3	center;
+	Vector3	halfsize;
+	float radius;
+	int num_bones;
+	int num_submeshes;
+	Matrix44 bind_matrix;
+	sVertexLayout layout; //only for packed meshes
+	int num_streams;
+	sMeshBinStream streams[MESH_BIN_MAX_STREAMS]; //offset table
+	char extra[32]; //unused
+} sMeshInfo;
+
+//false if the elements don't fit in the bytes of the stream (the offset and size are already checked against the file)
+template<typename T> bool readBinStream(std::vector<T>& container, const unsigned char* data, const sMeshBinStream& stream)
+{
+	if ((size_t)stream.count * sizeof(T) > stream.size)
+		return false;
+	container.resize(stream.count);
+	if (stream.count)
+		memcpy((void*)&container[0], data, sizeof(T) * stream.count);
+	return true;
+}
 
-	if (info.streams[5] == 'B')
+bool Mesh::readBin(const char* filename, bool bFromNetwork)
+{
+	assert(filename);
+
+	MappedFile* file = new MappedFile();
+	if (!file->open(filename))
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		delete file;
+		return false;
 	}
 
-	if (info.streams[6] == 'W')
+	//watermark
+	if (file->size < 4 + sizeof(sMeshInfo) || memcmp(file->data, "MBIN", 4) != 0)
 	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete file;
+		return false;
 	}
 
-	if (info.streams[7] == 'u')
+	sMeshInfo info;
+	memcpy(&info, file->data + 4, sizeof(sMeshInfo));
+
+	if (info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) || info.num_streams > MESH_BIN_MAX_STREAMS)
 	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete file;
+		return false;
 	}
 
-	if (info.num_bones)
+	layout = info.layout;
+	bool uses_mapping = false;
+
+	for (int i = 0; i < info.num_streams; ++i)
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
+		const sMeshBinStream& stream = info.streams[i];
+		if ((size_t)stream.offset + stream.size > file->size)
+		{
+			std::cout << "[ERROR] loading BIN: stream out of bounds: " << filename << std::endl;
+			clear();
+			delete file;
+			return false;
+		}
+		const unsigned char* data = file->data + stream.offset;
+
+		bool ok = true;
+		switch (stream.type)
+		{
+			//packed streams are used straight from the mapped file (uploaded and read from there)
+			case MBS_PACKED_VERTICES: packed_vertices.setView(data, stream.size); uses_mapping = true; break;
+			case MBS_INDICES:
+				if (layout.stride)
+				{
+					packed_indices.setView(data, stream.size);
+					uses_mapping = true;
+				}
+				else
+					ok = readBinStream(m_indices, data, stream);
+				break;
+			case MBS_VERTICES: ok = readBinStream(vertices, data, stream); break;
+			case MBS_INTERLEAVED: ok = readBinStream(interleaved, data, stream); break;
+			case MBS_NORMALS: ok = readBinStream(normals, data, stream); break;
+			case MBS_UVS: ok = readBinStream(uvs, data, stream); break;
+			case MBS_UVS1: ok = readBinStream(m_uvs1, data, stream); break;
+			case MBS_COLORS: ok = readBinStream(colors, data, stream); break;
+			case MBS_BONES: ok = readBinStream(bones, data, stream); break;
+			case MBS_WEIGHTS: ok = readBinStream(weights, data, stream); break;
+			case MBS_BONES_INFO: ok = readBinStream(bones_info, data, stream); break;
+			case MBS_SUBMESHES: ok = readBinStream(submeshes, data, stream); break;
+			//the BVH is only copied if some query needs it
+			case MBS_BVH_NODES: bvh_nodes.setView(data, stream.size); uses_mapping = true; break;
+			case MBS_BVH_TRIANGLES: bvh_triangles.setView(data, stream.size); uses_mapping = true; break;
+		}
+		if (!ok)
+		{
+			std::cout << "[ERROR] loading BIN: stream bigger than its size: " << filename << std::endl;
+			clear();
+			delete file;
+			return false;
+		}
 	}
 
 	aabb_max = info.aabb_max;
@@ -864,36 +1343,34 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
 
-	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
-
-	createCollisionModel();
+	//the mapping must live as long as the views
+	if (uses_mapping)
+		mapped_file = file;
+	else
+		delete file;
 	return true;
 }
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
+	assert( getNumVertices() );
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
-	FILE* f = fopen(s_filename.c_str(),"wb");
-	if (f == NULL)
+	//store it packed so it can be uploaded as it is
+	if (quantize_meshes && !packed_vertices.size())
 	{
-		std::cout << "[ERROR] cannot write mesh BIN: " << s_filename.c_str() << std::endl;
-		return false;
+		computeVertexLayout(true);
+		packVertices();
 	}
-
-	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
+	bool packed = layout.stride && packed_vertices.size();
 
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
 	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
-	info.num_indices = m_indices.size();
+	info.size = getNumVertices();
+	info.num_indices = getNumIndices();
 	info.aabb_max = aabb_max;
 	info.aabb_min = aabb_min;
 	info.center = box.center;
@@ -903,46 +1380,71 @@ bool Mesh::writeBin(const char* filename)
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
 
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
-	info.streams[1] = normals.size() ? 'N' : ' ';
-	info.streams[2] = uvs.size() ? 'U' : ' ';
-	info.streams[3] = colors.size() ? 'C' : ' ';
-	info.streams[4] = m_indices.size() ? 'I' : ' ';
-	info.streams[5] = bones.size() ? 'B' : ' ';
-	info.streams[6] = weights.size() ? 'W' : ' ';
-	info.streams[7] = m_uvs1.size() ? 'u' : ' '; //uv second set
+	//build the offset table
+	const void* streams_data[MESH_BIN_MAX_STREAMS];
+	unsigned int offset = 4 + sizeof(sMeshInfo);
+	#define ADD_STREAM(TYPE, DATA, ELEMENT_SIZE, COUNT) if (COUNT) { \
+			sMeshBinStream& stream = info.streams[info.num_streams]; \
+			offset = (offset + MESH_BIN_ALIGNMENT - 1) & ~(MESH_BIN_ALIGNMENT - 1); \
+			stream.type = TYPE; stream.offset = offset; stream.count = (unsigned int)(COUNT); stream.size = (unsigned int)((ELEMENT_SIZE) * (COUNT)); \
+			streams_data[info.num_streams++] = DATA; offset += stream.size; }
 
-	//write info
-	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
-
-	//write streams
-	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
+	if (packed)
+	{
+		info.layout = layout;
+		ADD_STREAM(MBS_PACKED_VERTICES, packed_vertices.data(), layout.stride, info.size);
+		ADD_STREAM(MBS_INDICES, packed_indices.data(), layout.index_size, info.num_indices);
+	}
 	else
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+		ADD_STREAM(MBS_INTERLEAVED, &interleaved[0], sizeof(tInterleaved), interleaved.size());
+		ADD_STREAM(MBS_VERTICES, &vertices[0], sizeof(Vector3), vertices.size());
+		ADD_STREAM(MBS_NORMALS, &normals[0], sizeof(Vector3), normals.size());
+		ADD_STREAM(MBS_UVS, &uvs[0], sizeof(Vector2), uvs.size());
+		ADD_STREAM(MBS_UVS1, &m_uvs1[0], sizeof(Vector2), m_uvs1.size());
+		ADD_STREAM(MBS_COLORS, &colors[0], sizeof(Vector4), colors.size());
+		ADD_STREAM(MBS_BONES, &bones[0], sizeof(Vector4ub), bones.size());
+		ADD_STREAM(MBS_WEIGHTS, &weights[0], sizeof(Vector4), weights.size());
+		ADD_STREAM(MBS_INDICES, &m_indices[0], sizeof(unsigned int), m_indices.size());
 	}
+	ADD_STREAM(MBS_BONES_INFO, &bones_info[0], sizeof(BoneInfo), bones_info.size());
+	ADD_STREAM(MBS_SUBMESHES, &submeshes[0], sizeof(sSubmeshInfo), submeshes.size());
+	//the BVH is stored only if it was already built (or read), otherwise the first query will build it
+	if (bvh)
+	{
+		ADD_STREAM(MBS_BVH_NODES, &bvh->nodes[0], sizeof(sBVHNode), bvh->nodes.size());
+		ADD_STREAM(MBS_BVH_TRIANGLES, &bvh->triangles[0], sizeof(sBVHTriangles4), bvh->triangles.size());
+	}
+	else if (bvh_nodes.size() && bvh_triangles.size())
+	{
+		ADD_STREAM(MBS_BVH_NODES, bvh_nodes.data(), sizeof(sBVHNode), bvh_nodes.size() / sizeof(sBVHNode));
+		ADD_STREAM(MBS_BVH_TRIANGLES, bvh_triangles.data(), sizeof(sBVHTriangles4), bvh_triangles.size() / sizeof(sBVHTriangles4));
+	}
+	#undef ADD_STREAM
 
-	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
+	FILE* f = fopen(s_filename.c_str(),"wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write mesh BIN: " << s_filename.c_str() << std::endl;
+		return false;
+	}
 
-	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
+	//watermark
+	fwrite("MBIN",sizeof(char),4,f);
 
-	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
-	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
+	//write info
+	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	//write streams with their padding
+	const char padding[MESH_BIN_ALIGNMENT] = { 0 };
+	long pos = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < info.num_streams; ++i)
+	{
+		sMeshBinStream& stream = info.streams[i];
+		fwrite(padding, stream.offset - pos, 1, f);
+		fwrite(streams_data[i], stream.size, 1, f);
+		pos = stream.offset + stream.size;
+	}
 
 	fclose(f);
 	return true;
@@ -1075,6 +1577,7 @@ bool Mesh::loadASE(const char* filename)
 		normals[count*3+2]=Vector3(-nX,nZ,nY);
 	}
 
+	weldVertices();
 	return true;
 }
 
@@ -1212,6 +1715,8 @@ bool Mesh::loadOBJ(const char* filename)
 
 	submesh_info.length = vertices.size() - last_submesh_vertex;
 	submeshes.push_back(submesh_info);
+
+	weldVertices(); //submeshes ranges are now in indices
 	return true;
 }
 
@@ -1594,8 +2099,9 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
-	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str(), bFromNetwork) )
+	//try loading the binary version, unless the original was modified after cooking it
+	bool outdated = file_format != FORMAT_MBIN && !bFromNetwork && isCacheOutdated(binfilename, filename);
+	if (use_binary && !outdated && m->readBin(binfilename.c_str(), bFromNetwork) )
 	{
 		if (interleave_meshes && m->interleaved.size() == 0)
 		{
@@ -1609,7 +2115,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		std::cout << "[OK BIN]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 		sMeshesLoaded[filename] = m;
 		return m;
 	}
@@ -1632,6 +2138,11 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		return NULL;
 	}
 
+	//reorder indices, done before writing the bin so it only happens once
+	sVertexCacheStats before, after;
+	if (optimize_meshes && m->optimizeIndices(&before, &after))
+		std::cout << "[OPT] ACMR: " << before.acmr << " -> " << after.acmr << " ATVR: " << before.atvr << " -> " << after.atvr << " ";
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1646,7 +2157,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Vertices: " << m->getNumVertices() << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
@@ -10,15 +10,70 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+class MappedFile; //for binary meshes
 
 //version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 15 //this is used to regenerate bins if the format changes
+
+struct sVertexCacheStats;
+class MeshBVH; //for collisions
+struct sRay;
+struct sRayHit;
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
 	Matrix44 bind_pose;
 };
 
+//how every attribute is stored in the vertex buffer
+enum eVertexFormat {
+	VF_NONE = 0,
+	VF_FLOAT,		//32 bits float per component
+	VF_HALF,		//16 bits float per component
+	VF_UNORM16,		//16 bits normalized to [0..1]
+	VF_SNORM10,		//xyz packed in 10:10:10:2 bits, signed normalized to [-1..1]
+	VF_UNORM8,		//8 bits normalized to [0..1]
+	VF_UINT8		//8 bits integer
+};
+
+enum eVertexAttribute {
+	VA_POSITION = 0,
+	VA_NORMAL,
+	VA_UV,
+	VA_UV1,
+	VA_COLOR,
+	VA_BONES,
+	VA_WEIGHTS,
+	VA_COUNT
+};
+
+struct sVertexAttribute {
+	unsigned char format; //eVertexFormat, VF_NONE if the mesh doesnt have this attribute
+	unsigned char components;
+	unsigned short offset; //in bytes from the start of the vertex
+};
+
+//describes a packed interleaved vertex, it is used by the uploader and stored in the .mbin
+struct sVertexLayout {
+	sVertexAttribute attributes[VA_COUNT];
+	unsigned short stride; //bytes per vertex, 0 if the mesh is not packed
+	unsigned short index_size; //2 or 4 bytes per index, 0 if not indexed
+};
+
+//a block of bytes owned by the mesh or pointing to external memory (like a mapped .mbin)
+struct sMeshBuffer {
+	std::vector<unsigned char> storage;
+	const unsigned char* view;
+	size_t view_size;
+
+	sMeshBuffer() { view = NULL; view_size = 0; }
+	const unsigned char* data() const { return view ? view : (storage.size() ? &storage[0] : NULL); }
+	size_t size() const { return view ? view_size : storage.size(); }
+	unsigned char* allocate(size_t size) { view = NULL; view_size = 0; storage.resize(size); return size ? &storage[0] : NULL; }
+	void setView(const unsigned char* data, size_t size) { storage.clear(); view = data; view_size = size; }
+	void clear() { storage.clear(); view = NULL; view_size = 0; }
+};
+
 struct sSubmeshInfo
 {
 	char name[64];
@@ -34,6 +89,8 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool optimize_meshes; //loaded meshes will have their indices reordered for the vertex cache, overdraw and vertex fetch
+	static bool quantize_meshes; //meshes uploaded to VRAM will use a compact vertex layout (half/unorm16 uvs, 10:10:10:2 normals, 8 bits weights, 16 bits indices)
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
 
@@ -57,6 +114,13 @@ public:
 
 	std::vector<unsigned int> m_indices; //for indexed meshes
 
+	//packed vertex data following the layout, used to upload and store in the .mbin
+	//when loaded from a .mbin they point directly to the mapped file
+	sVertexLayout layout;
+	sMeshBuffer packed_vertices;
+	sMeshBuffer packed_indices;
+	MappedFile* mapped_file;
+
 	//for animated meshes
 	std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
 	std::vector< Vector4 > weights; //tells how much affect every bone
@@ -99,14 +163,20 @@ public:
 	bool writeBin(const char* filename);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices();
+	unsigned int getNumIndices();
+	unsigned int getIndex(unsigned int i); //works with 16 and 32 bits indices
+	const Vector3& getVertexPosition(unsigned int i); //works with packed meshes
 
 	//collision testing
-	void* collision_model;
-	bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+	MeshBVH* bvh;
+	sMeshBuffer bvh_nodes; //the BVH cooked in the .mbin, views of the mapped file until the first query
+	sMeshBuffer bvh_triangles;
+	MeshBVH* getBVH(); //built with the first query (from the .mbin if it has it), NULL if the mesh has no triangles
 	//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 	bool testRayCollision( Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
-	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
+	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal); //the radius is exact for uniform scales
+	void testRaysCollision(const Matrix44& model, const sRay* rays, sRayHit* hits, int count); //rays in world space, split between all the workers
 
 	//loader
 	static Mesh* Get(const char* filename, bool bFromNetwork, bool skip_load = false);
@@ -128,6 +198,10 @@ public:
 	//optimize meshes
 	void uploadToVRAM();
 	bool interleaveBuffers();
+	bool weldVertices(); //merges the vertices with the same position, normal and uv and fills m_indices
+	bool optimizeIndices(sVertexCacheStats* before = NULL, sVertexCacheStats* after = NULL); //only for indexed triangle meshes
+	void computeVertexLayout(bool quantize); //chooses the format of every attribute based on the streams and their range
+	bool packVertices(); //fills packed_vertices and packed_indices following the layout
 
 private:
 	bool loadASE(const char* filename);
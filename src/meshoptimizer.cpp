@@ -0,0 +1,346 @@
+#include "meshoptimizer.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "framework.h"
+
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, size_t num_indices, size_t num_vertices, int cache_size)
+{
+	sVertexCacheStats stats;
+	stats.acmr = stats.atvr = 0;
+	if (!num_indices || !num_vertices)
+		return stats;
+
+	//FIFO simulated using timestamps: a vertex is in cache if it was inserted less than cache_size misses ago
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	std::vector<bool> used(num_vertices, false);
+	unsigned int time = cache_size + 1;
+	unsigned int misses = 0;
+	unsigned int unique = 0;
+
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int index = indices[i];
+		assert(index < num_vertices);
+		if (time - timestamps[index] > (unsigned int)cache_size)
+		{
+			timestamps[index] = time++;
+			misses++;
+		}
+		if (!used[index])
+		{
+			used[index] = true;
+			unique++;
+		}
+	}
+
+	stats.acmr = misses / (float)(num_indices / 3);
+	stats.atvr = unique ? misses / (float)unique : 0;
+	return stats;
+}
+
+// VERTEX CACHE ***********************************
+// based in "Linear-Speed Vertex Cache Optimisation" by Tom Forsyth
+
+const float forsyth_cache_decay_power = 1.5f;
+const float forsyth_last_tri_score = 0.75f;
+const float forsyth_valence_boost_scale = 2.0f;
+const float forsyth_valence_boost_power = 0.5f;
+const int forsyth_max_valence = 32;
+
+float forsyth_cache_scores[VERTEX_CACHE_SIZE + 3];
+float forsyth_valence_scores[forsyth_max_valence];
+
+bool fillForsythTables()
+{
+	for (int i = 0; i < VERTEX_CACHE_SIZE + 3; ++i)
+	{
+		if (i < 3)
+			forsyth_cache_scores[i] = forsyth_last_tri_score; //the last triangle used, the score is fixed so we dont favour a direction
+		else if (i < VERTEX_CACHE_SIZE)
+			forsyth_cache_scores[i] = powf(1.0f - (i - 3) / (float)(VERTEX_CACHE_SIZE - 3), forsyth_cache_decay_power);
+		else
+			forsyth_cache_scores[i] = 0;
+	}
+	for (int i = 0; i < forsyth_max_valence; ++i)
+		forsyth_valence_scores[i] = i ? forsyth_valence_boost_scale * powf((float)i, -forsyth_valence_boost_power) : 0;
+	return true;
+}
+
+//meshes can be optimized from several threads, a static local is initialized only once
+void initForsythTables()
+{
+	static bool ready = fillForsythTables();
+	(void)ready;
+}
+
+inline float forsythVertexScore(int cache_pos, unsigned int remaining)
+{
+	if (remaining == 0)
+		return -1.0f; //no triangles left, never pick it
+	float score = cache_pos >= 0 ? forsyth_cache_scores[cache_pos] : 0.0f;
+	//boost vertices with few triangles left so we dont leave lonely triangles behind
+	return score + (remaining < forsyth_max_valence ? forsyth_valence_scores[remaining] : forsyth_valence_boost_scale * powf((float)remaining, -forsyth_valence_boost_power));
+}
+
+void optimizeVertexCache(unsigned int* dest, const unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>* clusters)
+{
+	assert(num_indices % 3 == 0 && dest != indices);
+	size_t num_triangles = num_indices / 3;
+	if (clusters)
+		clusters->clear();
+	if (!num_triangles)
+		return;
+
+	initForsythTables();
+
+	//adjacency: triangles using every vertex
+	std::vector<unsigned int> remaining(num_vertices, 0);
+	for (size_t i = 0; i < num_indices; ++i)
+		remaining[indices[i]]++;
+
+	std::vector<unsigned int> offsets(num_vertices + 1, 0);
+	for (size_t i = 0; i < num_vertices; ++i)
+		offsets[i + 1] = offsets[i] + remaining[i];
+
+	std::vector<unsigned int> adjacency(num_indices);
+	{
+		std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < num_indices; ++i)
+			adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+	}
+
+	std::vector<int> cache_pos(num_vertices, -1);
+	std::vector<float> vertex_score(num_vertices);
+	for (size_t i = 0; i < num_vertices; ++i)
+		vertex_score[i] = forsythVertexScore(-1, remaining[i]);
+
+	std::vector<float> triangle_score(num_triangles);
+	for (size_t i = 0; i < num_triangles; ++i)
+		triangle_score[i] = vertex_score[indices[i * 3]] + vertex_score[indices[i * 3 + 1]] + vertex_score[indices[i * 3 + 2]];
+
+	std::vector<bool> emitted(num_triangles, false);
+
+	unsigned int cache[VERTEX_CACHE_SIZE + 3];
+	unsigned int new_cache[VERTEX_CACHE_SIZE + 3];
+	int cache_count = 0;
+
+	unsigned int best_triangle = ~0u;
+	size_t input_cursor = 0;
+
+	for (size_t output = 0; output < num_triangles; ++output)
+	{
+		//nothing in cache worth using, restart from the next triangle in input order
+		if (best_triangle == ~0u)
+		{
+			while (emitted[input_cursor])
+				input_cursor++;
+			best_triangle = (unsigned int)input_cursor;
+			if (clusters)
+				clusters->push_back((unsigned int)output * 3);
+		}
+
+		const unsigned int* tri = indices + best_triangle * 3;
+		memcpy(dest + output * 3, tri, sizeof(unsigned int) * 3);
+		emitted[best_triangle] = true;
+
+		//remove the triangle from the adjacency of its vertices
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tri[k];
+			unsigned int* list = &adjacency[offsets[v]];
+			unsigned int count = remaining[v];
+			for (unsigned int j = 0; j < count; ++j)
+				if (list[j] == best_triangle)
+				{
+					list[j] = list[count - 1];
+					break;
+				}
+			remaining[v]--;
+		}
+
+		//push the vertices of the triangle to the front of the LRU cache
+		int new_count = 0;
+		new_cache[new_count++] = tri[0];
+		if (tri[1] != tri[0])
+			new_cache[new_count++] = tri[1];
+		if (tri[2] != tri[0] && tri[2] != tri[1]) //degenerated triangles
+			new_cache[new_count++] = tri[2];
+		for (int j = 0; j < cache_count; ++j)
+		{
+			unsigned int v = cache[j];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				new_cache[new_count++] = v;
+		}
+
+		//update scores of the vertices in cache (and the ones that fell out) and the triangles using them
+		best_triangle = ~0u;
+		float best_score = 0;
+		for (int j = 0; j < new_count; ++j)
+		{
+			unsigned int v = new_cache[j];
+			cache_pos[v] = j < VERTEX_CACHE_SIZE ? j : -1;
+			float score = forsythVertexScore(cache_pos[v], remaining[v]);
+			float delta = score - vertex_score[v];
+			vertex_score[v] = score;
+
+			unsigned int* list = &adjacency[offsets[v]];
+			for (unsigned int t = 0; t < remaining[v]; ++t)
+			{
+				unsigned int tri_index = list[t];
+				triangle_score[tri_index] += delta;
+				if (j < VERTEX_CACHE_SIZE && triangle_score[tri_index] > best_score)
+				{
+					best_score = triangle_score[tri_index];
+					best_triangle = tri_index;
+				}
+			}
+		}
+
+		cache_count = std::min(new_count, VERTEX_CACHE_SIZE);
+		memcpy(cache, new_cache, sizeof(unsigned int) * cache_count);
+	}
+}
+
+// OVERDRAW ***********************************
+// based in "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw" by Sander, Nehab and Barczak
+
+struct sOverdrawCluster {
+	unsigned int start; //in triangles
+	unsigned int count;
+	float sort_key;
+};
+
+void optimizeOverdraw(unsigned int* indices, size_t num_indices, const float* positions, size_t num_vertices, size_t stride, const std::vector<unsigned int>& clusters, float threshold)
+{
+	size_t num_triangles = num_indices / 3;
+	if (num_triangles < 2 || clusters.empty())
+		return;
+
+	//split the hard clusters where restarting the cache doesnt hurt the ACMR more than threshold (soft boundaries)
+	std::vector<unsigned int> boundaries;
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	unsigned int time = VERTEX_CACHE_SIM_SIZE + 1;
+
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		unsigned int start = clusters[c] / 3;
+		unsigned int end = c + 1 < clusters.size() ? clusters[c + 1] / 3 : (unsigned int)num_triangles;
+
+		//ACMR of the whole hard cluster
+		time += VERTEX_CACHE_SIM_SIZE + 1; //flush
+		unsigned int cluster_misses = 0;
+		for (unsigned int t = start; t < end; ++t)
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[t * 3 + k];
+				if (time - timestamps[v] > VERTEX_CACHE_SIM_SIZE)
+				{
+					timestamps[v] = time++;
+					cluster_misses++;
+				}
+			}
+		float cluster_acmr = cluster_misses / (float)(end - start);
+
+		time += VERTEX_CACHE_SIM_SIZE + 1;
+		boundaries.push_back(start);
+		unsigned int soft_start = start;
+		unsigned int misses = 0;
+		for (unsigned int t = start; t < end; ++t)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[t * 3 + k];
+				if (time - timestamps[v] > VERTEX_CACHE_SIM_SIZE)
+				{
+					timestamps[v] = time++;
+					misses++;
+				}
+			}
+			unsigned int count = t - soft_start + 1;
+			if (t + 1 < end && misses / (float)count <= cluster_acmr * threshold)
+			{
+				boundaries.push_back(t + 1);
+				soft_start = t + 1;
+				misses = 0;
+				time += VERTEX_CACHE_SIM_SIZE + 1;
+			}
+		}
+	}
+
+	//compute the centroid and average normal of every cluster
+	std::vector<sOverdrawCluster> sorted(boundaries.size());
+	std::vector<Vector3> centroids(boundaries.size());
+	std::vector<Vector3> normals(boundaries.size());
+	Vector3 mesh_centroid;
+	float mesh_area = 0;
+
+	for (size_t c = 0; c < boundaries.size(); ++c)
+	{
+		unsigned int start = boundaries[c];
+		unsigned int end = c + 1 < boundaries.size() ? boundaries[c + 1] : (unsigned int)num_triangles;
+		Vector3 centroid;
+		Vector3 normal;
+		float area = 0;
+		for (unsigned int t = start; t < end; ++t)
+		{
+			const float* p0 = (const float*)((const char*)positions + indices[t * 3] * stride);
+			const float* p1 = (const float*)((const char*)positions + indices[t * 3 + 1] * stride);
+			const float* p2 = (const float*)((const char*)positions + indices[t * 3 + 2] * stride);
+			Vector3 a(p0[0], p0[1], p0[2]);
+			Vector3 b(p1[0], p1[1], p1[2]);
+			Vector3 d(p2[0], p2[1], p2[2]);
+			Vector3 n = (b - a).cross(d - a); //length is twice the area
+			float tri_area = (float)n.length();
+			centroid = centroid + (a + b + d) * (tri_area / 3.0f);
+			normal = normal + n;
+			area += tri_area;
+		}
+		mesh_centroid = mesh_centroid + centroid;
+		mesh_area += area;
+		centroids[c] = area > 0 ? centroid * (1.0f / area) : centroid;
+		normals[c] = normal;
+		sorted[c].start = start;
+		sorted[c].count = end - start;
+	}
+
+	if (mesh_area > 0)
+		mesh_centroid = mesh_centroid * (1.0f / mesh_area);
+
+	//clusters facing outwards occlude more, render them first
+	for (size_t c = 0; c < sorted.size(); ++c)
+	{
+		float len = (float)normals[c].length();
+		sorted[c].sort_key = len > 0 ? (centroids[c] - mesh_centroid).dot(normals[c]) / len : 0;
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const sOverdrawCluster& a, const sOverdrawCluster& b) { return a.sort_key > b.sort_key; });
+
+	std::vector<unsigned int> result(num_triangles * 3);
+	size_t pos = 0;
+	for (size_t c = 0; c < sorted.size(); ++c)
+	{
+		memcpy(&result[pos], indices + sorted[c].start * 3, sorted[c].count * 3 * sizeof(unsigned int));
+		pos += sorted[c].count * 3;
+	}
+	memcpy(indices, &result[0], result.size() * sizeof(unsigned int));
+}
+
+// VERTEX FETCH ***********************************
+
+size_t optimizeVertexFetchRemap(unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>& remap)
+{
+	remap.assign(num_vertices, ~0u);
+	unsigned int next = 0;
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int& index = indices[i];
+		assert(index < num_vertices);
+		if (remap[index] == ~0u)
+			remap[index] = next++;
+		index = remap[index];
+	}
+	return next;
+}
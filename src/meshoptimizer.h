@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+//Index buffer optimizations applied when importing meshes.
+//All functions work on triangle lists, indices refer to a vertex buffer of num_vertices elements.
+
+#define VERTEX_CACHE_SIZE 32 //size of the LRU cache used by the reorder (Forsyth)
+#define VERTEX_CACHE_SIM_SIZE 16 //size of the FIFO used to measure ACMR/ATVR, closer to real hardware
+#define OVERDRAW_THRESHOLD 1.05f //how much ACMR we allow to lose when splitting clusters for overdraw
+
+struct sVertexCacheStats {
+	float acmr; //average cache miss ratio: transformed vertices per triangle (0.5 ideal, 3 worst)
+	float atvr; //average transform to vertex ratio: transformed vertices per unique vertex (1 ideal)
+};
+
+//simulates a FIFO post-transform cache and returns ACMR and ATVR
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, size_t num_indices, size_t num_vertices, int cache_size = VERTEX_CACHE_SIM_SIZE);
+
+//reorders the triangles to improve the vertex cache hits (Tom Forsyth linear-speed algorithm)
+//if clusters is provided it is filled with the index where every cluster starts (hard boundaries where the cache was restarted)
+void optimizeVertexCache(unsigned int* dest, const unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>* clusters = NULL);
+
+//reorders the clusters so the triangles facing outwards are rendered first (Tipsify style), reducing overdraw
+//positions is a pointer to the first vertex position (3 floats) and stride the bytes between vertices
+void optimizeOverdraw(unsigned int* indices, size_t num_indices, const float* positions, size_t num_vertices, size_t stride, const std::vector<unsigned int>& clusters, float threshold = OVERDRAW_THRESHOLD);
+
+//renumbers the vertices in the order they are first referenced so the vertex buffer is fetched linearly
+//fills remap (old index -> new index, or ~0u if unused) and returns the number of vertices used
+size_t optimizeVertexFetchRemap(unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>& remap);
+
+//moves the elements of a stream following a remap table generated by optimizeVertexFetchRemap
+template<typename T> void remapVertexStream(std::vector<T>& stream, const std::vector<unsigned int>& remap, size_t new_size)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> result(new_size);
+	for (size_t i = 0; i < remap.size() && i < stream.size(); ++i)
+		if (remap[i] != ~0u)
+			result[remap[i]] = stream[i];
+	stream.swap(result);
+}
@@ -13,6 +13,7 @@
 #include "application.h"
 
 #include <iostream>
+#include <algorithm>
 
 using namespace GTR;
 
@@ -221,6 +222,30 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+void Prefab::Preload(const std::vector<std::string>& filenames)
+{
+	std::vector<std::string> to_load;
+	for (size_t i = 0; i < filenames.size(); ++i)
+		if (sPrefabsLoaded.find(filenames[i]) == sPrefabsLoaded.end() && std::find(to_load.begin(), to_load.end(), filenames[i]) == to_load.end())
+			to_load.push_back(filenames[i]);
+	if (!to_load.size())
+		return;
+
+	double time = getTime();
+	std::vector<Prefab*> prefabs = loadGLTFs(to_load);
+	for (size_t i = 0; i < prefabs.size(); ++i)
+	{
+		Prefab* prefab = prefabs[i];
+		if (!prefab) {
+			std::cout << "[ERROR]: Prefab not found: " << to_load[i] << std::endl;
+			continue;
+		}
+		prefab->registerPrefab(to_load[i]);
+		prefab->updateBounding();
+	}
+	stdlog(" + Preloaded " + std::to_string(to_load.size()) + " prefabs in " + std::to_string((getTime() - time) * 0.001) + " sec");
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
@@ -113,6 +113,7 @@ namespace GTR {
 				//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
 		static Prefab* Get(const char* filename);
+		static void Preload(const std::vector<std::string>& filenames); //loads in parallel the ones not loaded yet, so Get finds them
 		void registerPrefab(std::string name);
 	};
 
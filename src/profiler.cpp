@@ -0,0 +1,366 @@
+#include "profiler.h"
+
+#include "includes.h"
+#include "jobs.h"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cassert>
+#include <algorithm>
+#include <iostream>
+
+bool Profiler::enabled = true;
+bool Profiler::paused = false;
+
+namespace {
+
+	struct sOpenScope {
+		const char* name;
+		double start;
+	};
+
+	struct sGPUScope {
+		const char* name;
+		int depth;
+		int begin_query;
+		int end_query;
+	};
+
+	//the timer queries of one frame, waiting for the GPU
+	struct sGPUFrame {
+		long index;
+		bool pending;
+		double cpu_reference; //CPU and GPU time at the start of the frame, to place the GPU events in the CPU timeline
+		double gpu_reference;
+		std::vector<GLuint> queries;
+		int used_queries;
+		std::vector<sGPUScope> scopes;
+		std::vector<int> open; //scopes not closed
+	};
+
+	std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+
+	std::mutex frames_mutex; //workers add events to the current frame
+	std::deque<sProfilerFrame> frames; //history, the last one is the current
+	bool in_frame = false;
+	long frame_index = 0;
+
+	sGPUFrame gpu_frames[PROFILER_GPU_LATENCY];
+	sGPUFrame* current_gpu_frame = NULL;
+
+	std::atomic<int> next_thread_id(1);
+	thread_local std::vector<sOpenScope> open_scopes;
+	thread_local int thread_id = -2;
+
+	int getThreadId()
+	{
+		if (thread_id == -2)
+			thread_id = JobSystem::isMainThread() ? 0 : next_thread_id++;
+		return thread_id;
+	}
+
+	sProfilerFrame* findFrame(long index)
+	{
+		for (auto it = frames.rbegin(); it != frames.rend(); ++it)
+			if (it->index == index)
+				return &(*it);
+		return NULL;
+	}
+
+	//reads the GPU queries that are ready, never waits
+	void collectGPUFrames()
+	{
+		for (int i = 0; i < PROFILER_GPU_LATENCY; ++i)
+		{
+			sGPUFrame& gpu = gpu_frames[i];
+			if (!gpu.pending || &gpu == current_gpu_frame)
+				continue;
+			if (gpu.used_queries)
+			{
+				GLint available = 0;
+				glGetQueryObjectiv(gpu.queries[gpu.used_queries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					continue;
+			}
+			gpu.pending = false;
+
+			std::lock_guard<std::mutex> lock(frames_mutex);
+			sProfilerFrame* frame = findFrame(gpu.index);
+			if (!frame)
+				continue; //too old or paused
+			for (size_t j = 0; j < gpu.scopes.size(); ++j)
+			{
+				sGPUScope& scope = gpu.scopes[j];
+				if (scope.end_query < 0)
+					continue;
+				GLuint64 begin_ns = 0, end_ns = 0;
+				glGetQueryObjectui64v(gpu.queries[scope.begin_query], GL_QUERY_RESULT, &begin_ns);
+				glGetQueryObjectui64v(gpu.queries[scope.end_query], GL_QUERY_RESULT, &end_ns);
+				sProfilerEvent event;
+				event.name = scope.name;
+				event.start = gpu.cpu_reference + (begin_ns * 1e-6 - gpu.gpu_reference);
+				event.end = gpu.cpu_reference + (end_ns * 1e-6 - gpu.gpu_reference);
+				event.depth = scope.depth;
+				event.thread = PROFILER_GPU_THREAD;
+				frame->events.push_back(event);
+			}
+			frame->gpu_ready = true;
+		}
+	}
+
+	int issueTimestamp()
+	{
+		sGPUFrame& gpu = *current_gpu_frame;
+		if (gpu.used_queries == (int)gpu.queries.size())
+		{
+			GLuint query = 0;
+			glGenQueries(1, &query);
+			gpu.queries.push_back(query);
+		}
+		int index = gpu.used_queries++;
+		glQueryCounter(gpu.queries[index], GL_TIMESTAMP);
+		return index;
+	}
+}
+
+double sProfilerFrame::getGPUTime() const
+{
+	double total = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+		if (events[i].thread == PROFILER_GPU_THREAD && events[i].depth == 0)
+			total += events[i].end - events[i].start;
+	return total;
+}
+
+double Profiler::getTime()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+}
+
+void Profiler::beginFrame()
+{
+	assert(JobSystem::isMainThread());
+	frame_index++;
+	if (!enabled)
+		return;
+
+	collectGPUFrames();
+
+	{
+		std::lock_guard<std::mutex> lock(frames_mutex);
+		if (!paused)
+		{
+			frames.push_back(sProfilerFrame());
+			sProfilerFrame& frame = frames.back();
+			frame.index = frame_index;
+			frame.start = getTime();
+			frame.end = frame.start;
+			frame.gpu_ready = false;
+			while (frames.size() > PROFILER_HISTORY_FRAMES)
+				frames.pop_front();
+		}
+		in_frame = !paused;
+	}
+
+	//a free slot for the GPU queries, if all are waiting this frame has no GPU times (we dont stall)
+	current_gpu_frame = NULL;
+	for (int i = 0; i < PROFILER_GPU_LATENCY && in_frame; ++i)
+	{
+		sGPUFrame& gpu = gpu_frames[i];
+		if (gpu.pending)
+			continue;
+		gpu.index = frame_index;
+		gpu.pending = true;
+		gpu.used_queries = 0;
+		gpu.scopes.clear();
+		gpu.open.clear();
+		GLint64 gpu_now = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+		gpu.gpu_reference = gpu_now * 1e-6;
+		gpu.cpu_reference = getTime();
+		current_gpu_frame = &gpu;
+		break;
+	}
+}
+
+void Profiler::endFrame()
+{
+	if (current_gpu_frame)
+	{
+		//scopes not closed are discarded
+		current_gpu_frame->open.clear();
+		current_gpu_frame = NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(frames_mutex);
+	if (in_frame && frames.size())
+		frames.back().end = getTime();
+	in_frame = false;
+}
+
+void Profiler::beginScope(const char* name)
+{
+	if (!enabled)
+		return;
+	sOpenScope scope;
+	scope.name = name;
+	scope.start = getTime();
+	open_scopes.push_back(scope);
+}
+
+void Profiler::endScope()
+{
+	if (open_scopes.empty())
+		return; //enabled while it was open
+	sOpenScope scope = open_scopes.back();
+	open_scopes.pop_back();
+	if (!enabled)
+		return;
+
+	sProfilerEvent event;
+	event.name = scope.name;
+	event.start = scope.start;
+	event.end = getTime();
+	event.depth = (int)open_scopes.size();
+	event.thread = getThreadId();
+
+	std::lock_guard<std::mutex> lock(frames_mutex);
+	if (in_frame && frames.size())
+		frames.back().events.push_back(event);
+}
+
+void Profiler::beginGPUScope(const char* name)
+{
+	if (!current_gpu_frame)
+		return;
+	assert(JobSystem::isMainThread() && "GPU scopes only in the main thread");
+	sGPUFrame& gpu = *current_gpu_frame;
+	sGPUScope scope;
+	scope.name = name;
+	scope.depth = (int)gpu.open.size();
+	scope.begin_query = issueTimestamp();
+	scope.end_query = -1;
+	gpu.open.push_back((int)gpu.scopes.size());
+	gpu.scopes.push_back(scope);
+}
+
+void Profiler::endGPUScope()
+{
+	if (!current_gpu_frame || current_gpu_frame->open.empty())
+		return;
+	sGPUFrame& gpu = *current_gpu_frame;
+	gpu.scopes[gpu.open.back()].end_query = issueTimestamp();
+	gpu.open.pop_back();
+}
+
+const sProfilerFrame* Profiler::getLastFrame(bool with_gpu)
+{
+	//the current one is not finished
+	for (int i = (int)frames.size() - 2; i >= 0; --i)
+		if (!with_gpu || frames[i].gpu_ready)
+			return &frames[i];
+	return NULL;
+}
+
+bool Profiler::exportChromeTrace(const char* filename, int num_frames)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write profile: " << filename << std::endl;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(frames_mutex);
+	int first = std::max(0, (int)frames.size() - 1 - num_frames); //the last one is not finished
+
+	//chrome uses microseconds, the GPU is shown as another thread
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Main\"}},\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", PROFILER_GPU_THREAD);
+	for (int i = first; i < (int)frames.size() - 1; ++i)
+	{
+		const sProfilerFrame& frame = frames[i];
+		fprintf(f, ",\n{\"name\":\"Frame %ld\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":0}", frame.index, frame.start * 1000.0, (frame.end - frame.start) * 1000.0);
+		for (size_t j = 0; j < frame.events.size(); ++j)
+		{
+			const sProfilerEvent& event = frame.events[j];
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+				event.name, event.thread == PROFILER_GPU_THREAD ? "gpu" : "cpu", event.start * 1000.0, (event.end - event.start) * 1000.0, event.thread);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	std::cout << " + Profile saved: " << filename << " (" << (int)frames.size() - 1 - first << " frames)" << std::endl;
+	return true;
+}
+
+void Profiler::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode("Profiler"))
+		return;
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::SameLine();
+	ImGui::Checkbox("Pause", &paused);
+	ImGui::SameLine();
+	if (ImGui::Button("Export trace"))
+		exportChromeTrace("profile.json");
+
+	std::lock_guard<std::mutex> lock(frames_mutex);
+	const sProfilerFrame* frame = getLastFrame();
+	if (!frame)
+	{
+		ImGui::Text("No frames");
+		ImGui::TreePop();
+		return;
+	}
+	double duration = frame->end - frame->start;
+	ImGui::Text("Frame %ld  CPU: %.2f ms  GPU: %.2f ms", frame->index, duration, frame->getGPUTime());
+
+	//timeline: a row for every thread and depth, the GPU at the bottom
+	int max_thread = 0;
+	int max_depth[2] = { 0, 0 }; //cpu, gpu
+	double end = frame->end;
+	for (size_t i = 0; i < frame->events.size(); ++i)
+	{
+		const sProfilerEvent& event = frame->events[i];
+		bool gpu = event.thread == PROFILER_GPU_THREAD;
+		if (!gpu)
+			max_thread = std::max(max_thread, event.thread);
+		max_depth[gpu] = std::max(max_depth[gpu], event.depth + 1);
+		end = std::max(end, event.end);
+	}
+	const float row_height = 16.0f;
+	int num_rows = (max_thread + 1) * max_depth[0] + max_depth[1];
+	float width = ImGui::GetContentRegionAvail().x;
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	ImGui::Dummy(ImVec2(width, num_rows * row_height + 4));
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	float scale = (float)(width / std::max(end - frame->start, 0.001));
+	ImVec2 mouse = ImGui::GetIO().MousePos;
+
+	for (size_t i = 0; i < frame->events.size(); ++i)
+	{
+		const sProfilerEvent& event = frame->events[i];
+		bool gpu = event.thread == PROFILER_GPU_THREAD;
+		int row = gpu ? (max_thread + 1) * max_depth[0] + event.depth : event.thread * max_depth[0] + event.depth;
+		ImVec2 min(origin.x + (float)(event.start - frame->start) * scale, origin.y + row * row_height);
+		ImVec2 max(origin.x + std::max((float)(event.end - frame->start) * scale, min.x - origin.x + 1.0f), min.y + row_height - 1);
+		ImU32 color = gpu ? IM_COL32(200, 90, 60, 255) : IM_COL32(60, 120 + 30 * (event.depth % 4), 200, 255);
+		draw_list->AddRectFilled(min, max, color);
+		if (max.x - min.x > 40)
+		{
+			draw_list->PushClipRect(min, max, true);
+			draw_list->AddText(ImVec2(min.x + 2, min.y), IM_COL32(255, 255, 255, 255), event.name);
+			draw_list->PopClipRect();
+		}
+		if (mouse.x >= min.x && mouse.x < max.x && mouse.y >= min.y && mouse.y < max.y)
+			ImGui::SetTooltip("%s%s: %.3f ms", gpu ? "[GPU] " : "", event.name, event.end - event.start);
+	}
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,80 @@
+/*  Frame profiler: nested CPU scopes (from any thread) and GPU timer queries (main thread) for every frame.
+	The GPU queries are read some frames later, when they are available, so the CPU never waits for the GPU.
+	Use the macros, they are compiled out if SKIP_PROFILER is defined.
+*/
+#pragma once
+
+#include <vector>
+
+#define PROFILER_HISTORY_FRAMES 240 //frames stored to show and export
+#define PROFILER_GPU_LATENCY 5 //frames in flight waiting for the GPU results
+#define PROFILER_GPU_THREAD -1
+
+struct sProfilerEvent {
+	const char* name; //not copied, it must be a literal
+	double start; //ms since the profiler started
+	double end;
+	int depth;
+	int thread; //0 is the main thread, PROFILER_GPU_THREAD for the GPU
+};
+
+struct sProfilerFrame {
+	long index;
+	double start;
+	double end;
+	bool gpu_ready; //the GPU events arrived
+	std::vector<sProfilerEvent> events;
+
+	double getGPUTime() const; //sum of the root GPU scopes
+};
+
+class Profiler
+{
+public:
+	static bool enabled;
+	static bool paused; //stops storing frames so the timeline can be inspected
+
+	//main thread, around every frame
+	static void beginFrame();
+	static void endFrame();
+
+	static void beginScope(const char* name);
+	static void endScope();
+	static void beginGPUScope(const char* name); //main thread only
+	static void endGPUScope();
+
+	static double getTime(); //ms
+	static const sProfilerFrame* getLastFrame(bool with_gpu = true);
+
+	//chrome://tracing or https://ui.perfetto.dev
+	static bool exportChromeTrace(const char* filename, int num_frames = PROFILER_HISTORY_FRAMES);
+
+	static void renderInMenu();
+};
+
+struct sProfilerScope {
+	sProfilerScope(const char* name) { Profiler::beginScope(name); }
+	~sProfilerScope() { Profiler::endScope(); }
+};
+
+//also measures the CPU time
+struct sProfilerGPUScope {
+	sProfilerGPUScope(const char* name) { Profiler::beginScope(name); Profiler::beginGPUScope(name); }
+	~sProfilerGPUScope() { Profiler::endGPUScope(); Profiler::endScope(); }
+};
+
+#ifndef SKIP_PROFILER
+	#define PROFILER_CONCAT2(a, b) a##b
+	#define PROFILER_CONCAT(a, b) PROFILER_CONCAT2(a, b)
+	#define PROFILE_SCOPE(name) sProfilerScope PROFILER_CONCAT(_profiler_scope_, __LINE__)(name)
+	#define PROFILE_GPU_SCOPE(name) sProfilerGPUScope PROFILER_CONCAT(_profiler_scope_, __LINE__)(name)
+	#define PROFILE_FUNCTION() PROFILE_SCOPE(__FUNCTION__)
+	#define PROFILE_FRAME_BEGIN() Profiler::beginFrame()
+	#define PROFILE_FRAME_END() Profiler::endFrame()
+#else
+	#define PROFILE_SCOPE(name)
+	#define PROFILE_GPU_SCOPE(name)
+	#define PROFILE_FUNCTION()
+	#define PROFILE_FRAME_BEGIN()
+	#define PROFILE_FRAME_END()
+#endif
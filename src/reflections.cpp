@@ -0,0 +1,233 @@
+#include "reflections.h"
+
+#include "includes.h"
+#include "scene.h"
+#include "renderer.h"
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "mesh.h"
+#include "profiler.h"
+
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+	//same orientation as the faces of a GL cubemap (+x, -x, +y, -y, +z, -z), the shaders use the same table
+	const Vector3 face_fronts[6] = { Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1) };
+	const Vector3 face_ups[6] = { Vector3(0, -1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1), Vector3(0, -1, 0), Vector3(0, -1, 0) };
+
+	struct sFaceRequest {
+		GTR::ReflectionProbeEntity* probe;
+		int face;
+		float priority;
+	};
+
+	bool compareFaceRequest(const sFaceRequest& a, const sFaceRequest& b)
+	{
+		return a.priority > b.priority;
+	}
+}
+
+ReflectionProbes::ReflectionProbes()
+{
+	face_size = 128;
+	faces_per_frame = 2;
+	continuous = true;
+	enabled = true;
+	near_plane = 1.0f;
+	far_plane = 10000.0f;
+	texture = NULL;
+	frame = 0;
+	faces_captured = 0;
+}
+
+ReflectionProbes::~ReflectionProbes()
+{
+	if (texture)
+		delete texture;
+}
+
+Camera ReflectionProbes::getFaceCamera(const Vector3& position, int face, float near_plane, float far_plane)
+{
+	Camera camera;
+	camera.lookAt(position, position + face_fronts[face], face_ups[face]);
+	camera.setPerspective(90.0f, 1.0f, near_plane, far_plane);
+	return camera;
+}
+
+void ReflectionProbes::createTextures()
+{
+	if (texture)
+		delete texture;
+	texture = new Texture();
+	texture->createArray(face_size, face_size, REFLECTIONS_MAX_PROBES * 6, GL_RGB, GL_HALF_FLOAT, true);
+	capture_fbo.create(face_size, face_size, 1, GL_RGB, GL_HALF_FLOAT, true);
+
+	//the contents are gone, everything is captured again
+	for (int i = 0; i < (int)probes.size(); ++i)
+		probes[i]->invalidate();
+}
+
+//the visible probes get the slots in the order of the scene, the ones that don't fit are ignored
+void ReflectionProbes::assignSlots(GTR::Scene* scene)
+{
+	probes.clear();
+	bool warned = false;
+	for (int i = 0; i < (int)scene->entities.size(); ++i)
+	{
+		GTR::BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != GTR::REFLECTION_PROBE)
+			continue;
+		GTR::ReflectionProbeEntity* probe = (GTR::ReflectionProbeEntity*)ent;
+		if (!probe->visible || probes.size() == REFLECTIONS_MAX_PROBES)
+		{
+			if (probe->visible && !warned)
+				std::cout << "[WARN] more than " << REFLECTIONS_MAX_PROBES << " reflection probes, the rest are ignored" << std::endl;
+			warned = warned || probe->visible;
+			probe->slot = -1;
+			continue;
+		}
+
+		//a new slot or a moved probe has nothing valid in its layers
+		Vector3 position = probe->model.getTranslation();
+		if (probe->slot != (int)probes.size() || probe->capture_position.distance(position) > 0.001f)
+			probe->invalidate();
+		probe->slot = (int)probes.size();
+		probes.push_back(probe);
+	}
+}
+
+void ReflectionProbes::update(GTR::Scene* scene, GTR::Renderer* renderer, Camera* camera)
+{
+	frame++;
+	faces_captured = 0;
+	if (!enabled)
+		return;
+
+	assignSlots(scene);
+	if (probes.empty())
+		return;
+	if (!texture || (int)texture->width != face_size)
+		createTextures();
+
+	//the faces never captured go first, then the ones captured longer ago, both favouring the probes close to the camera
+	std::vector<sFaceRequest> requests;
+	for (int i = 0; i < (int)probes.size(); ++i)
+	{
+		GTR::ReflectionProbeEntity* probe = probes[i];
+		float distance = camera->eye.distance(probe->model.getTranslation());
+		float closeness = 1.0f / (1.0f + distance / std::max(probe->radius, 1.0f));
+		for (int face = 0; face < 6; ++face)
+		{
+			int captured = probe->face_frame[face];
+			if (captured >= 0 && !continuous)
+				continue;
+			float staleness = captured < 0 ? 1.0e6f : (float)(frame - captured);
+			requests.push_back(sFaceRequest{ probe, face, staleness * closeness });
+		}
+	}
+
+	int count = std::min((int)requests.size(), std::max(faces_per_frame, 0));
+	if (!count)
+		return;
+	std::partial_sort(requests.begin(), requests.begin() + count, requests.end(), compareFaceRequest);
+
+	PROFILE_GPU_SCOPE("Reflections");
+	for (int i = 0; i < count; ++i)
+	{
+		captureFace(scene, renderer, requests[i].probe, requests[i].face);
+		prefilterFace(requests[i].probe->slot * 6 + requests[i].face);
+	}
+	faces_captured = count;
+}
+
+void ReflectionProbes::captureFace(GTR::Scene* scene, GTR::Renderer* renderer, GTR::ReflectionProbeEntity* probe, int face)
+{
+	Vector3 position = probe->model.getTranslation();
+	Camera camera = getFaceCamera(position, face, near_plane, far_plane);
+
+	capture_fbo.bind();
+	renderer->renderProbeFace(scene, &camera);
+	capture_fbo.unbind();
+
+	//the mips of the capture are the first step of the blur
+	capture_fbo.color_textures[0]->generateMipmaps();
+
+	probe->face_frame[face] = frame;
+	probe->capture_position = position;
+}
+
+//every level of the layer reads the capture at the same level with a small blur, more blurred the lower it is
+void ReflectionProbes::prefilterFace(int layer)
+{
+	Shader* shader = Shader::Get("reflection_prefilter");
+	if (!shader)
+		return;
+	Mesh* quad = Mesh::getQuad();
+	int levels = texture->getNumLevels();
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+	shader->enable();
+	shader->setUniform("u_texture", capture_fbo.color_textures[0], 0);
+	for (int level = 0; level < levels; ++level)
+	{
+		if (!prefilter_fbo.setTextureLayer(texture, layer, level))
+			break;
+		prefilter_fbo.bind();
+		glViewport(0, 0, prefilter_fbo.width, prefilter_fbo.height); //bind uses the size of the first level
+		shader->setUniform("u_level", (float)level);
+		shader->setUniform("u_roughness", level / (float)std::max(levels - 1, 1));
+		quad->render(GL_TRIANGLES);
+		prefilter_fbo.unbind();
+	}
+	shader->disable();
+	glEnable(GL_DEPTH_TEST);
+}
+
+void ReflectionProbes::setUniforms(Shader* shader) const
+{
+	if (!enabled || !texture || probes.empty())
+	{
+		shader->setUniform("u_refl_count", 0);
+		shader->setUniform1("u_refl_texture", REFLECTIONS_SLOT); //an array sampler can't share the unit 0 with the 2D ones
+		return;
+	}
+
+	//position and radius by slot, a probe not fully captured yet reflects nothing
+	Vector4 spheres[REFLECTIONS_MAX_PROBES];
+	for (int i = 0; i < (int)probes.size(); ++i)
+	{
+		GTR::ReflectionProbeEntity* probe = probes[i];
+		spheres[i] = Vector4(probe->capture_position, probe->isComplete() ? probe->radius : 0.0f);
+	}
+	shader->setUniform("u_refl_count", (int)probes.size());
+	shader->setUniform4Array("u_refl_probes", (float*)spheres, (int)probes.size());
+	shader->setUniform("u_refl_texture", texture, REFLECTIONS_SLOT);
+	shader->setUniform("u_refl_levels", (float)texture->getNumLevels());
+}
+
+void ReflectionProbes::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode(this, "Reflections"))
+		return;
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::Text("%d probes, %d faces captured this frame", (int)probes.size(), faces_captured);
+	ImGui::SliderInt("Faces per frame", &faces_per_frame, 0, 12);
+	ImGui::Checkbox("Continuous", &continuous);
+	int size_option = 0; //power of two so it has all the mips
+	while (size_option < 3 && (32 << size_option) < face_size)
+		size_option++;
+	if (ImGui::Combo("Face size", &size_option, "32\0" "64\0" "128\0" "256\0"))
+		face_size = 32 << size_option;
+	if (ImGui::Button("Capture all again"))
+		for (int i = 0; i < probes.size(); ++i)
+			probes[i]->invalidate();
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,57 @@
+/*  Reflection probes: cubemaps captured around the REFLECTION_PROBE entities, reflected by the ambient of the lighting passes.
+	The captures are time sliced: every frame only faces_per_frame faces are rendered and prefiltered, the most stale ones
+	of the probes closest to the camera first, so the cost of a frame is the same with 1 probe or with REFLECTION_MAX_PROBES.
+	All the probes share one texture array with 6 layers per probe (there are no cubemap arrays in GL 3.3), the shaders pick
+	the face from the direction. Every mip of a face is blurred from the capture, the rougher surfaces read the lower mips.
+*/
+#pragma once
+
+#include "framework.h"
+#include "fbo.h"
+
+#include <vector>
+
+class Shader;
+class Texture;
+class Camera;
+
+namespace GTR { class Scene; class Renderer; class ReflectionProbeEntity; }
+
+#define REFLECTIONS_SLOT 9 //texture slot used by u_refl_texture
+#define REFLECTIONS_MAX_PROBES 16 //layers of the array / 6, it must match MAX_REFLECTION_PROBES in the shaders
+
+class ReflectionProbes
+{
+public:
+	int face_size; //of the faces of every probe
+	int faces_per_frame; //faces captured (and prefiltered) every frame, the budget
+	bool continuous; //keep capturing the faces again, otherwise only the ones never captured (static scenes)
+	bool enabled;
+	float near_plane;
+	float far_plane;
+
+	Texture* texture; //GL_TEXTURE_2D_ARRAY, the layer of a face is slot * 6 + face
+	std::vector<GTR::ReflectionProbeEntity*> probes; //the ones with a slot, in slot order
+	int frame;
+	int faces_captured; //in the last update
+
+	ReflectionProbes();
+	~ReflectionProbes();
+
+	//once per frame before rendering, captures the faces with more priority
+	void update(GTR::Scene* scene, GTR::Renderer* renderer, Camera* camera);
+	void setUniforms(Shader* shader) const; //u_refl_count is 0 if there is nothing captured
+
+	static Camera getFaceCamera(const Vector3& position, int face, float near_plane, float far_plane);
+
+	void renderInMenu();
+
+private:
+	FBO capture_fbo; //a face with depth, its mips are the source of the prefilter
+	FBO prefilter_fbo; //a layer and level of the array
+
+	void createTextures();
+	void assignSlots(GTR::Scene* scene);
+	void captureFace(GTR::Scene* scene, GTR::Renderer* renderer, GTR::ReflectionProbeEntity* probe, int face);
+	void prefilterFace(int layer);
+};
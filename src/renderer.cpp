@@ -9,6 +9,8 @@
 #include "utils.h"
 #include "scene.h"
 #include "extra/hdre.h"
+#include "texturestreamer.h"
+#include "profiler.h"
 
 #include <algorithm>
 #include "application.h"
@@ -19,34 +21,63 @@ using namespace GTR;
 Renderer::Renderer(GTR::Scene* scene)
 {
 	render_mode = eRenderMode::SHOW_TEXTURE;
+	current_skinned_call = NULL;
 	for (int i = 0; i < scene->l_entities.size(); ++i) {
 		LightEntity* lent = scene->l_entities[i];
 		lent->fbo.create(Application::instance->window_width, Application::instance->window_height, 1, GL_RGB);
 	}
-	gbuffers_fbo = FBO();
-	gbuffers_fbo.create(Application::instance->window_width, Application::instance->window_height, 3, GL_RGBA, GL_FLOAT, true);
+	render_width = render_height = 0;
+	resizeTargets();
+}
+
+void Renderer::resizeTargets()
+{
+	int window_width = Application::instance->window_width;
+	int window_height = Application::instance->window_height;
+	int width, height;
+	dynamic_resolution.getTargetSize(window_width, window_height, width, height);
+	if (gbuffers_fbo.width != width || gbuffers_fbo.height != height)
+	{
+		gbuffers_fbo.create(width, height, 3, GL_RGBA, GL_FLOAT, true);
+		illumination_fbo.create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
+
+		//the upscale filters it
+		glBindTexture(GL_TEXTURE_2D, illumination_fbo.color_textures[0]->texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	dynamic_resolution.getRenderSize(window_width, window_height, render_width, render_height);
+}
+
+Vector2 Renderer::getUVScale() const
+{
+	return Vector2(render_width / (float)gbuffers_fbo.width, render_height / (float)gbuffers_fbo.height);
 }
 
 void Renderer::renderToFBOForward(GTR::Scene* scene, Camera* camera) {
 	Camera* cam = new Camera();
-	for (int i = 0; i < scene->l_entities.size(); ++i) {
-		LightEntity* lent = scene->l_entities[i];
-		if (lent->light_type == eLightType::SPOT) {
-			cam->lookAt(lent->model.bottomVector(), lent->model.bottomVector() + lent->target, Vector3(0.f, 1.f, 0.f));
-			cam->setPerspective(lent->cone_angle, Application::instance->window_width / (float)Application::instance->window_height, 1.0f, 10000.f);
-		}
-		else if (lent->light_type == eLightType::DIRECTIONAL) {
-			cam->lookAt(lent->model.bottomVector(), Vector3(0.0f, 0.0f, 0.0f), Vector3(-1.0f, -1.0f, 0.f));
-			cam->setOrthographic(-600,600,-600, 600,-600,600);			
-		}
-		else if (lent->light_type == eLightType::POINT) {
-			continue;
+	{
+		PROFILE_GPU_SCOPE("Shadowmaps");
+		for (int i = 0; i < scene->l_entities.size(); ++i) {
+			LightEntity* lent = scene->l_entities[i];
+			if (lent->light_type == eLightType::SPOT) {
+				cam->lookAt(lent->model.bottomVector(), lent->model.bottomVector() + lent->target, Vector3(0.f, 1.f, 0.f));
+				cam->setPerspective(lent->cone_angle, Application::instance->window_width / (float)Application::instance->window_height, 1.0f, 10000.f);
+			}
+			else if (lent->light_type == eLightType::DIRECTIONAL) {
+				cam->lookAt(lent->model.bottomVector(), Vector3(0.0f, 0.0f, 0.0f), Vector3(-1.0f, -1.0f, 0.f));
+				cam->setOrthographic(-600,600,-600, 600,-600,600);			
+			}
+			else if (lent->light_type == eLightType::POINT) {
+				continue;
+			}
+			lent->viewproj_mat = cam->viewprojection_matrix;
+			lent->fbo.bind();
+			render_alpha = false;
+			renderScene(scene, cam);
+			lent->fbo.unbind();
 		}
-		lent->viewproj_mat = cam->viewprojection_matrix;
-		lent->fbo.bind();
-		render_alpha = false;
-		renderScene(scene, cam);
-		lent->fbo.unbind();
 	}
 
 
@@ -55,10 +86,13 @@ void Renderer::renderToFBOForward(GTR::Scene* scene, Camera* camera) {
 		if (lent->name == "headlight1") {
 			if (render_mode == SHOW_DEPTH) {
 				Shader* shader = Shader::Get("depth");
+				if (!shader)
+					continue;
 				cam->lookAt(lent->model.bottomVector(), lent->model.bottomVector() + lent->target, Vector3(0.f, 1.f, 0.f));
 				cam->setPerspective(lent->cone_angle, Application::instance->window_width / (float)Application::instance->window_height, 1.0f, 10000.f);
 				shader->enable();
 				shader->setUniform("u_camera_nearfar", Vector2(cam->near_plane, cam->far_plane));
+				shader->setUniform("u_uv_scale", Vector2(1.0f, 1.0f));
 				lent->fbo.depth_texture->toViewport(shader);
 				shader->disable();
 			}
@@ -67,14 +101,36 @@ void Renderer::renderToFBOForward(GTR::Scene* scene, Camera* camera) {
 
 	if (render_mode != SHOW_DEPTH) 
 	{
+		PROFILE_GPU_SCOPE("Forward");
 		render_alpha = true;
 		renderScene(scene, camera);
 	}
 }
 
+//the captures always use the singlepass, whatever the user is looking at
+void Renderer::renderProbeFace(GTR::Scene* scene, Camera* camera)
+{
+	ePipelineMode prev_pipeline_mode = pipeline_mode;
+	eRenderMode prev_render_mode = render_mode;
+	bool prev_render_alpha = render_alpha;
+	pipeline_mode = FORWARD;
+	render_mode = DEFAULT;
+	render_alpha = true;
+
+	renderScene(scene, camera);
+
+	pipeline_mode = prev_pipeline_mode;
+	render_mode = prev_render_mode;
+	render_alpha = prev_render_alpha;
+}
+
 void Renderer::renderToFBODeferred(GTR::Scene* scene, Camera* camera) {
 	if (pipeline_mode == DEFERRED) {
+		dynamic_resolution.update();
+		resizeTargets();
+
 		gbuffers_fbo.bind();
+		glViewport(0, 0, render_width, render_height);
 		
 		gbuffers_fbo.enableSingleBuffer(0);
 
@@ -90,11 +146,18 @@ void Renderer::renderToFBODeferred(GTR::Scene* scene, Camera* camera) {
 		//enable all buffers back
 		gbuffers_fbo.enableAllBuffers();
 
-		renderScene(scene, camera);
+		{
+			PROFILE_GPU_SCOPE("GBuffer");
+			renderScene(scene, camera);
+		}
 
 		gbuffers_fbo.unbind();
 
 		Shader* shader = Shader::Get("depth");
+		Shader* upscale_shader = Shader::Get("upscale");
+		Shader* ambient_shader = Shader::Get("add_ambient");
+		if (!shader || !upscale_shader || !ambient_shader)
+			return;
 		shader->enable();
 		shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
 
@@ -102,44 +165,68 @@ void Renderer::renderToFBODeferred(GTR::Scene* scene, Camera* camera) {
 		float h = Application::instance->window_height;
 
 		if (render_mode == SHOW_GBUFFERS) {
+			//only the part rendered, like the upscale of the composite
+			Vector2 uv_scale = getUVScale();
+			shader->setUniform("u_uv_scale", uv_scale);
+			upscale_shader->enable();
+			upscale_shader->setUniform("u_uv_scale", uv_scale);
 			glViewport(0.0f, 0.0f, w / 2, h / 2);
-			gbuffers_fbo.color_textures[0]->toViewport();
+			gbuffers_fbo.color_textures[0]->toViewport(upscale_shader);
 			glViewport(w / 2, 0.0f, w / 2, h / 2);
-			gbuffers_fbo.color_textures[1]->toViewport();
+			gbuffers_fbo.color_textures[1]->toViewport(upscale_shader);
 			glViewport(0.0f, h / 2, w / 2, h / 2);
-			gbuffers_fbo.color_textures[2]->toViewport();
+			gbuffers_fbo.color_textures[2]->toViewport(upscale_shader);
 			glViewport(w / 2, h / 2, w / 2, h / 2);
 			gbuffers_fbo.depth_texture->toViewport(shader);
 		}
 		else { // show deferred all together
-			//create and FBO
-			glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+			ssao.compute(&gbuffers_fbo, camera, render_width, render_height);
+			Vector2 uv_scale = getUVScale();
 
-			illumination_fbo = FBO();
-			//create 3 textures of 4 components
-			illumination_fbo.create(w, h,1,GL_RGB, GL_UNSIGNED_BYTE, false);
-
-			//start rendering to the illumination fbo
+			//start rendering to the illumination fbo, the lights don't cover everything
 			illumination_fbo.bind();
+			glViewport(0, 0, render_width, render_height);
+			glClearColor(0.0, 0.0, 0.0, 1.0);
+			glClear(GL_COLOR_BUFFER_BIT);
 
 			//joinGbuffers(scene, camera);
-			illuminationDeferred(scene, camera);
+			{
+				PROFILE_GPU_SCOPE("Lighting");
+				illuminationDeferred(scene, camera);
+			}
 
+			//the ambient is added to the lights
+			{
+				PROFILE_GPU_SCOPE("Composite");
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_ONE, GL_ONE);
+				ambient_shader->enable();
+				ambient_shader->setUniform("u_ambient_light", scene->ambient_light);
+				ambient_shader->setUniform("u_color_texture", gbuffers_fbo.color_textures[0], 0);
+				ambient_shader->setUniform("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
+				ambient_shader->setUniform("u_depth_texture", gbuffers_fbo.depth_texture, 2);
+				ambient_shader->setUniform("u_extra_texture", gbuffers_fbo.color_textures[2], 3);
+				Matrix44 inv_vp = camera->viewprojection_matrix;
+				inv_vp.inverse();
+				ambient_shader->setUniform("u_inverse_viewprojection", inv_vp);
+				ambient_shader->setUniform("u_camera_position", camera->eye);
+				ambient_shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+				ambient_shader->setUniform("u_uv_scale", uv_scale);
+				scene->irradiance.setUniforms(ambient_shader);
+				scene->reflections.setUniforms(ambient_shader);
+				scene->environment.setUniforms(ambient_shader);
+				ssao.setUniforms(ambient_shader);
+				gbuffers_fbo.color_textures[0]->toViewport(ambient_shader);
+			}
 			illumination_fbo.unbind();
-			//be sure blending is not active
 			glDisable(GL_BLEND);
 
-			Shader* ambient_shader = Shader::Get("add_ambient");
-			ambient_shader->enable();
-			ambient_shader->setUniform("u_ambient_light", scene->ambient_light);
-			ambient_shader->setUniform("u_color_texture", gbuffers_fbo.color_textures[0], 0);
-
+			//to the window, bilinear from the part rendered
+			PROFILE_GPU_SCOPE("Upscale");
+			upscale_shader->enable();
+			upscale_shader->setUniform("u_uv_scale", uv_scale);
 			glViewport(0.0f, 0.0f, w, h);
-			gbuffers_fbo.color_textures[0]->toViewport(ambient_shader);
-			glEnable(GL_BLEND);
-			illumination_fbo.color_textures[0]->toViewport();
-			ambient_shader->disable();
-
+			illumination_fbo.color_textures[0]->toViewport(upscale_shader);
 		}
 		shader->disable();
 	}
@@ -158,6 +245,8 @@ void Renderer::illuminationDeferred(GTR::Scene* scene, Camera* camera) {
 	Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", true);
 
 	Shader* sh =Shader::Get("deferred_ws");
+	if (!sh)
+		return;
 
 	sh->enable();
 	//pass the gbuffers to the shader
@@ -168,8 +257,9 @@ void Renderer::illuminationDeferred(GTR::Scene* scene, Camera* camera) {
 
 	//pass the inverse projection of the camera to reconstruct world pos.
 	sh->setUniform("u_inverse_viewprojection", inv_vp);
-	//pass the inverse window resolution, this may be useful
-	sh->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	//pass the inverse resolution of the gbuffers and the part used, to get the uvs from the pixels
+	sh->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo.width, 1.0 / (float)gbuffers_fbo.height));
+	sh->setUniform("u_uv_scale", getUVScale());
 
 	sh->setUniform("u_ambient_light", scene->ambient_light);
 	sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
@@ -241,6 +331,9 @@ void Renderer::illuminationDeferred(GTR::Scene* scene, Camera* camera) {
 
 void Renderer::renderToFBO(GTR::Scene* scene, Camera* camera) {
 
+	updateAnimatedEntities(scene);
+	scene->reflections.update(scene, this, camera);
+
 	switch (pipeline_mode) {
 		case FORWARD: renderToFBOForward(scene, camera); break;
 		case DEFERRED: renderToFBODeferred(scene, camera); break;
@@ -254,8 +347,9 @@ bool compareRenderCall(sRenderCall& a, sRenderCall& b)
 	if (a.node->material->alpha_mode == b.node->material->alpha_mode) {
 		//return a.node->material->_zMax < b.node->material->_zMax;
 
-		Vector3 center_a = transformBoundingBox(a.node->getGlobalMatrix(false) * a.prefab_model, a.node->mesh->box).center;
-		Vector3 center_b = transformBoundingBox(b.node->getGlobalMatrix(false) * b.prefab_model, b.node->mesh->box).center;
+		//the center of the transformed box is the transformed center
+		Vector3 center_a = (a.node->getGlobalMatrix(false) * a.prefab_model) * a.node->mesh->box.center;
+		Vector3 center_b = (b.node->getGlobalMatrix(false) * b.prefab_model) * b.node->mesh->box.center;
 		float dist_a = a.camera->eye.distance(center_a);
 		float dist_b = b.camera->eye.distance(center_b);
 
@@ -298,9 +392,61 @@ void Renderer::renderCall(GTR::Scene* scene, Camera* camera) {
 	std::sort(rendercall_v.begin(), rendercall_v.end(), compareRenderCall);
 }
 
+//the branches of the shaders are resolved here and compiled as variants (see Shader::GetVariant)
+unsigned int getMaterialFeatures(GTR::Material* material)
+{
+	unsigned int features = 0;
+	if (material->normal_texture.texture)
+		features |= SF_NORMALMAP;
+	if (material->alpha_mode == GTR::eAlphaMode::MASK)
+		features |= SF_ALPHA_MASK;
+	return features;
+}
+
+unsigned int getLightFeatures(LightEntity* light)
+{
+	switch (light->light_type)
+	{
+		case POINT: return SF_POINT_LIGHT;
+		case SPOT: return SF_SPOT_LIGHT | SF_SHADOWS;
+		case DIRECTIONAL: return SF_DIRECTIONAL_LIGHT | SF_SHADOWS;
+		default: return 0;
+	}
+}
+
+//uniforms shared by all the passes of a mesh
+void setMaterialUniforms(Shader* shader, const Matrix44& model, GTR::Material* material, Camera* camera, Texture* texture, Texture* metallic_rougness_texture, Texture* emissive_texture, Texture* normal_texture)
+{
+	GTR::Scene* scene = GTR::Scene::instance;
+
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_model", model);
+	float t = getTime();
+	shader->setUniform("u_time", t);
+
+	shader->setUniform("u_color", material->color);
+	shader->setUniform("u_emissive_factor", material->emissive_factor);
+	if (texture) shader->setUniform("u_texture", texture, 0);
+	if (metallic_rougness_texture) shader->setUniform("u_metallic_roughness_texture", metallic_rougness_texture, 1);
+	if (emissive_texture) shader->setUniform("u_emissive_texture", emissive_texture, 2);
+	if (normal_texture) shader->setUniform("u_normal_texture", normal_texture, 3);
+
+	shader->setUniform("u_ambient_light", scene->ambient_light);
+	scene->irradiance.setUniforms(shader);
+	scene->reflections.setUniforms(shader);
+	scene->environment.setUniforms(shader);
+	shader->setUniform("u_roughness_factor", material->roughness_factor);
+	shader->setUniform("u_metallic_factor", material->metallic_factor);
+
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+
+	shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+}
+
 void Renderer::renderMeshDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera) {
 
-	Shader* shader = Shader::Get("multi");
 	Texture* texture = NULL;
 	Texture* normal_texture = NULL;
 	Texture* mat_properties_texture = NULL;
@@ -308,9 +454,10 @@ void Renderer::renderMeshDeferred(const Matrix44 model, Mesh* mesh, GTR::Materia
 	texture = material->color_texture.texture;
 	if (texture == NULL) texture = Texture::getWhiteTexture(); //a 1x1 white texture
 
-	bool read_normal = true;
 	normal_texture = material->normal_texture.texture;
-	if (!normal_texture) read_normal = false;
+	Shader* shader = Shader::GetVariant("multi", getMaterialFeatures(material) | (current_skinned_call ? SF_SKINNING : 0));
+	if (!shader)
+		return;
 
 	mat_properties_texture = material->metallic_roughness_texture.texture;
 	if (mat_properties_texture == NULL) mat_properties_texture = Texture::getWhiteTexture(); //a 1x1 white texture
@@ -343,9 +490,11 @@ void Renderer::renderMeshDeferred(const Matrix44 model, Mesh* mesh, GTR::Materia
 	if (texture) shader->setUniform("u_texture", texture, 0);
 	if (normal_texture) shader->setUniform("u_normal_texture", normal_texture, 1);
 	if (mat_properties_texture) shader->setUniform("u_mat_properties_texture", mat_properties_texture, 2);
-	shader->setUniform("u_read_normal", read_normal);
+	shader->setUniform("u_roughness_factor", material->roughness_factor);
+	shader->setUniform("u_metallic_factor", material->metallic_factor);
+	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 
-	mesh->render(GL_TRIANGLES);
+	renderMesh(mesh, shader);
 	shader->disable();
 	glDisable(GL_BLEND);
 }
@@ -365,6 +514,7 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 		for (std::vector<sRenderCall>::iterator it = rendercall_v.begin(); it != rendercall_v.end(); ++it) {
 			renderNode((*it).prefab_model, (*it).node, camera);
 		}
+		renderAnimatedEntities(camera);
 	}
 	else {
 		//render entities
@@ -398,6 +548,8 @@ void GTR::Renderer::joinGbuffers(GTR::Scene* scene, Camera* camera)
 	//we need a shader specially for this task, lets call it "deferred"
 	Shader* sh = Shader::Get("deferred");
 	//Shader* sh = Shader::Get("deferred_ws");
+	if (!sh)
+		return;
 	sh->enable();
 
 	//pass the gbuffers to the shader
@@ -468,6 +620,21 @@ void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera*
 	renderNode(model, &prefab->root, camera);
 }
 
+//tells the streamer how big the textures of the material are on screen (assuming the uvs cover the object once)
+void requestMaterialTextures(GTR::Material* material, Camera* camera, const BoundingBox& world_bounding)
+{
+	float radius = world_bounding.halfsize.length();
+	float dist = std::max(camera->eye.distance(world_bounding.center) - radius, camera->near_plane);
+	float pixels = (radius / (dist * tan(camera->fov * 0.5f * DEG2RAD))) * Application::instance->window_height;
+
+	TextureStreamer::requestScreenSize(material->color_texture.texture, pixels);
+	TextureStreamer::requestScreenSize(material->emissive_texture.texture, pixels);
+	TextureStreamer::requestScreenSize(material->opacity_texture.texture, pixels);
+	TextureStreamer::requestScreenSize(material->metallic_roughness_texture.texture, pixels);
+	TextureStreamer::requestScreenSize(material->occlusion_texture.texture, pixels);
+	TextureStreamer::requestScreenSize(material->normal_texture.texture, pixels);
+}
+
 //renders a node of the prefab and its children
 void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
 {
@@ -486,6 +653,8 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		//if bounding box is inside the camera frustum then the object is probably visible
 		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
 		{
+			requestMaterialTextures(node->material, camera, world_bounding);
+
 			//render node mesh
 			if(pipeline_mode == FORWARD)
 				renderMeshWithMaterial(node_model, node->mesh, node->material, camera);
@@ -517,13 +686,14 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	if (texture == NULL)
 		texture = Texture::getWhiteTexture(); //a 1x1 white texture
 
-	bool read_normal = true;
 	Texture* metallic_rougness_texture = material->metallic_roughness_texture.texture;
 	if (!metallic_rougness_texture) metallic_rougness_texture = Texture::getWhiteTexture();
 	Texture* emissive_texture = material->emissive_texture.texture;
 	if (!emissive_texture) emissive_texture = Texture::getWhiteTexture();
 	Texture* normal_texture = material->normal_texture.texture;
-	if (!normal_texture) read_normal = false;
+	unsigned int features = getMaterialFeatures(material);
+	unsigned int skinning = current_skinned_call ? SF_SKINNING : 0;
+	features |= skinning;
 
 	//select the	
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
@@ -543,13 +713,25 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 
 	//chose a shader
 	switch (render_mode) {
-		case SHOW_NORMAL: shader = Shader::Get("normal"); break;
-		case SHOW_UVS: shader = Shader::Get("uvs"); break;
-		case SHOW_TEXTURE: shader = Shader::Get("texture"); break;
-		case SHOW_AO: shader = Shader::Get("occlusion"); break;
-		case DEFAULT: shader = Shader::Get("light_singlepass"); break;
-		case SHOW_MULTI: shader = Shader::Get("light_multipass"); break;
-		case SHOW_DEPTH: shader = Shader::Get("texture"); break;
+		case SHOW_NORMAL: shader = Shader::GetVariant("normal", skinning); break;
+		case SHOW_UVS: shader = Shader::GetVariant("uvs", skinning); break;
+		case SHOW_TEXTURE: shader = Shader::GetVariant("texture", skinning); break;
+		case SHOW_AO: shader = Shader::GetVariant("occlusion", skinning); break;
+		case DEFAULT:
+			//the lights of the singlepass are fixed by name, only the visible ones are compiled in
+			for (int i = 0; i < (int)scene->l_entities.size(); ++i)
+			{
+				LightEntity* lent = scene->l_entities[i];
+				if (!lent->visible)
+					continue;
+				if (lent->name == "headlight1") features |= SF_SPOT_LIGHT;
+				if (lent->name == "moon") features |= SF_DIRECTIONAL_LIGHT;
+				if (lent->name == "lamp") features |= SF_POINT_LIGHT;
+			}
+			shader = Shader::GetVariant("light_singlepass", features);
+			break;
+		case SHOW_MULTI: shader = Shader::GetVariant("light_multipass", features); break; //ambient only, every light changes it below
+		case SHOW_DEPTH: shader = Shader::GetVariant("texture", skinning); break;
 	}
 
 	assert(glGetError() == GL_NO_ERROR);
@@ -560,25 +742,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	shader->enable();
 
 	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
-	float t = getTime();
-	shader->setUniform("u_time", t);
-
-	shader->setUniform("u_color", material->color);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);
-	if (texture) shader->setUniform("u_texture", texture, 0);
-	if (metallic_rougness_texture) shader->setUniform("u_metallic_roughness_texture", metallic_rougness_texture, 1);
-	if (emissive_texture) shader->setUniform("u_emissive_texture", emissive_texture, 2);
-	if (normal_texture) shader->setUniform("u_normal_texture", normal_texture, 3);
-
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
-
-	shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+	setMaterialUniforms(shader, model, material, camera, texture, metallic_rougness_texture, emissive_texture, normal_texture);
 
 	// SINGLEPASS
 	if (render_mode == DEFAULT) {
@@ -592,22 +756,18 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 				shader->setUniform("u_spotCosineCutoff", cos(lent->cone_angle));
 				shader->setUniform("u_spotExponent", (1 / lent->area_size));
 				shader->setUniform("u_spot_maxdist", lent->max_distance);
-				shader->setUniform("u_spot_visible", lent->visible);
 			}
 			if (lent->name == "moon") {
 				shader->setUniform("u_directional_color", lent->color);
 				shader->setUniform("u_directional_pos", lent->model.bottomVector());
 				shader->setUniform("u_directional_factor", lent->intensity);
-				shader->setUniform("u_directional_visible", lent->visible);
 			}
 			if (lent->name == "lamp") {
 				shader->setUniform("u_point_light_pos", lent->model.bottomVector());
 				shader->setUniform("u_point_color", lent->color);
 				shader->setUniform("u_point_factor", lent->intensity);
 				shader->setUniform("u_point_maxdist", lent->max_distance);
-				shader->setUniform("u_point_visible", lent->visible);
 			}
-			shader->setUniform("u_read_normal", read_normal);
 
 		}
 	}
@@ -624,8 +784,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-			shader->setUniform("u_light_type", (int)0);
-			mesh->render(GL_TRIANGLES);
+			renderMesh(mesh, shader);
 		}
 		else {
 			for (int i = 0; i < scene->l_entities.size(); ++i) {
@@ -636,30 +795,37 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 				if (i == 0) glDisable(GL_BLEND);	// first time rendering the mesh
 				else glEnable(GL_BLEND);				
 						
+				//specialized for this light
+				shader = Shader::GetVariant("light_multipass", features | getLightFeatures(lent));
+				if (!shader)
+					continue;
+				shader->enable();
+				setMaterialUniforms(shader, model, material, camera, texture, metallic_rougness_texture, emissive_texture, normal_texture);
+
 				// set uniforms
 				lent->setUniforms(shader);
-				shader->setUniform("u_read_normal", read_normal);
 
 				if (lent->light_type != POINT) {
 					shader->setUniform("u_shadowmap", lent->fbo.depth_texture, 4); 
-					shader->setUniform("u_have_shadows", true);
 					shader->setUniform("u_shadow_viewproj", lent->viewproj_mat);
 					shader->setUniform("u_shadow_bias", (float)0.001);
 				}
-				else shader->setUniform("u_have_shadows", false);
 
 				if (i != 0) {
 					shader->setUniform("u_ambient_light", Vector3(0, 0, 0));
+					shader->setUniform("u_irr_enabled", 0);
+					shader->setUniform("u_refl_count", 0);
+					shader->setUniform("u_env_enabled", 0);
 					shader->setUniform("u_emissive_factor", Vector3(0, 0, 0));
 				}
 				
-				mesh->render(GL_TRIANGLES);				
+				renderMesh(mesh, shader);
 			}
 		}
 	}
 	else {
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		renderMesh(mesh, shader);
 	}
 
 	if (pipeline_mode == DEFERRED) {
@@ -679,21 +845,91 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 }
 
 
-Texture* GTR::CubemapFromHDRE(const char* filename)
+void Renderer::renderMesh(Mesh* mesh, Shader* shader)
+{
+	if (!current_skinned_call)
+	{
+		mesh->render(GL_TRIANGLES);
+		return;
+	}
+	bone_palette.setUniforms(shader, current_skinned_call->palette_offset, current_skinned_call->palette_stride);
+	mesh->render(GL_TRIANGLES, -1, current_skinned_call->num_instances);
+}
+
+//evaluates the poses of all the instances (in the workers) and uploads their palettes in one buffer
+void Renderer::updateAnimatedEntities(GTR::Scene* scene)
+{
+	PROFILE_SCOPE("Skinning");
+
+	bone_palette.clear();
+	skinned_calls.clear();
+	float time = getTime() * 0.001f;
+
+	for (int i = 0; i < (int)scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->entity_type != ANIMATED)
+			continue;
+		AnimatedEntity* aent = (GTR::AnimatedEntity*)ent;
+		if (!aent->prefab || !aent->animation)
+			continue;
+		aent->update(time);
+		addSkinnedNodes(aent, &aent->prefab->root);
+	}
+
+	bone_palette.upload();
+}
+
+void Renderer::addSkinnedNodes(GTR::AnimatedEntity* entity, GTR::Node* node)
 {
-	HDRE* hdre = new HDRE();
-	if (!hdre->load(filename))
+	if (!node->visible)
+		return;
+
+	if (node->mesh && node->material && node->mesh->bones_info.size())
 	{
-		delete hdre;
-		return NULL;
+		sMeshSkin skin;
+		skin.create(entity->animation->skeleton, node->mesh);
+
+		sSkinnedRenderCall call;
+		call.node = node;
+		call.palette_offset = bone_palette.getNumMatrices();
+		call.palette_stride = skin.getNumBones() + 1;
+		call.num_instances = (int)entity->instances.size();
+
+		Matrix44 node_model = node->getGlobalMatrix(true);
+		for (int i = 0; i < call.num_instances; ++i)
+		{
+			Matrix44 model = node_model * entity->getInstanceModel(i);
+			bone_palette.add(model, entity->instances[i].pose, skin);
+			BoundingBox box = transformBoundingBox(model, node->mesh->box);
+			call.world_bounding = i ? mergeBoundingBoxes(call.world_bounding, box) : box;
+		}
+		skinned_calls.push_back(call);
 	}
 
-	/*
-	Texture* texture = new Texture();
-	texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFaces(0), hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT );
-	for(int i = 1; i < 6; ++i)
-		texture->uploadCubemap(texture->format, texture->type, false, (Uint8**)hdre->getFaces(i), GL_RGBA32F, i);
-	return texture;
-	*/
-	return NULL;
+	for (int i = 0; i < (int)node->children.size(); ++i)
+		addSkinnedNodes(entity, node->children[i]);
+}
+
+void Renderer::renderAnimatedEntities(Camera* camera)
+{
+	for (int i = 0; i < (int)skinned_calls.size(); ++i)
+	{
+		sSkinnedRenderCall& call = skinned_calls[i];
+		Node* node = call.node;
+		if (!render_alpha && node->material->alpha_mode == BLEND)
+			continue;
+		if (!camera->testBoxInFrustum(call.world_bounding.center, call.world_bounding.halfsize))
+			continue;
+
+		requestMaterialTextures(node->material, camera, call.world_bounding);
+
+		//the models come from the palette
+		current_skinned_call = &call;
+		if (pipeline_mode == FORWARD)
+			renderMeshWithMaterial(Matrix44(), node->mesh, node->material, camera);
+		else
+			renderMeshDeferred(Matrix44(), node->mesh, node->material, camera);
+		current_skinned_call = NULL;
+	}
 }
\ No newline at end of file
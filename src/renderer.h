@@ -1,6 +1,9 @@
 #pragma once
 #include "prefab.h"
 #include "fbo.h"
+#include "skinning.h"
+#include "ssao.h"
+#include "dynamicresolution.h"
 
 //forward declarations
 class Camera;
@@ -31,8 +34,18 @@ namespace GTR {
 		Prefab* prefab;
 	};
 
+	//all the instances of a skinned node of an animated entity, drawn with one instanced call
+	struct sSkinnedRenderCall {
+		Node* node;
+		int palette_offset; //first matrix in the bone palette
+		int palette_stride; //matrices per instance
+		int num_instances;
+		BoundingBox world_bounding; //of all the instances in the bind pose
+	};
+
 	class Prefab;
 	class Material;
+	class AnimatedEntity;
 	
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -49,6 +62,15 @@ namespace GTR {
 
 		FBO gbuffers_fbo;
 		FBO illumination_fbo;
+		SSAO ssao; //of the gbuffers, it darkens the ambient of the composite
+		DynamicResolution dynamic_resolution; //the deferred pipeline renders a part of its targets, upscaled to the window
+		int render_width; //the part of gbuffers_fbo and illumination_fbo used this frame
+		int render_height;
+
+		//animated entities are evaluated and uploaded once per frame, every pass draws them instanced
+		BonePalette bone_palette;
+		std::vector<sSkinnedRenderCall> skinned_calls;
+		sSkinnedRenderCall* current_skinned_call; //while it is set the mesh functions use the skinning shaders and draw all its instances
 
 		Renderer(GTR::Scene* scene);
 
@@ -60,10 +82,18 @@ namespace GTR {
 
 		void renderToFBOForward(GTR::Scene* scene, Camera* camera);
 		void renderToFBODeferred(GTR::Scene* scene, Camera* camera);
+		void resizeTargets(); //allocates the targets of the deferred pipeline when the window or the max scale change, and sets the render size
+		Vector2 getUVScale() const; //of the render size in the targets
+		void renderProbeFace(GTR::Scene* scene, Camera* camera); //forward and lit, in the bound FBO, used by the reflection probes
 		void renderMeshDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
 
 		//renders several elements of the scene
 		void renderScene(GTR::Scene* scene, Camera* camera);
+
+		void updateAnimatedEntities(GTR::Scene* scene);
+		void addSkinnedNodes(GTR::AnimatedEntity* entity, GTR::Node* node);
+		void renderAnimatedEntities(Camera* camera);
+		void renderMesh(Mesh* mesh, Shader* shader); //the draw call, instanced for the skinned calls
 		void joinGbuffers(GTR::Scene* scene, Camera* camera);
 		void illuminationDeferred(GTR::Scene* scene, Camera* camera);
 
@@ -77,6 +107,4 @@ namespace GTR {
 		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
 	};
 
-	Texture* CubemapFromHDRE(const char* filename);
-
 };
\ No newline at end of file
@@ -2,14 +2,19 @@
 #include "utils.h"
 
 #include "prefab.h"
+#include "mesh.h"
+#include "jobs.h"
 #include "extra/cJSON.h"
 
+#include <algorithm>
+
 GTR::Scene* GTR::Scene::instance = NULL;
 
 GTR::Scene::Scene()
 {
 	instance = this;
-	
+	ray_bvh_ready = false;
+	environment_max_size = 0;
 }
 
 void GTR::Scene::clear()
@@ -20,12 +25,28 @@ void GTR::Scene::clear()
 		delete ent;
 	}
 	entities.resize(0);
+	ray_bvh.nodes.clear();
+	ray_bvh.instances.clear();
+	ray_targets.clear();
+	ray_bvh_ready = false;
+	reflections.probes.clear(); //they point to the entities
+	environment.clear();
+	environment_filename.clear();
+}
+
+Vector3 GTR::Scene::getAmbientLight(const Vector3& direction) const
+{
+	if (!environment.isValid())
+		return ambient_light;
+	Vector3 light = evaluateSH(environment.sh, direction);
+	return Vector3(std::max(light.x, 0.0f), std::max(light.y, 0.0f), std::max(light.z, 0.0f));
 }
 
 
 void GTR::Scene::addEntity(BaseEntity* entity)
 {
 	entities.push_back(entity); entity->scene = this;
+	ray_bvh_ready = false;
 }
 
 void GTR::Scene::addEntityLight(LightEntity* entity)
@@ -65,6 +86,18 @@ bool GTR::Scene::load(const char* filename)
 	//entities
 	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
 	cJSON* entity_json;
+
+	//load all the prefabs in parallel before creating the entities
+	std::vector<std::string> prefab_filenames;
+	cJSON_ArrayForEach(entity_json, entities_json)
+	{
+		cJSON* type_json = cJSON_GetObjectItem(entity_json, "type");
+		cJSON* filename_json = cJSON_GetObjectItem(entity_json, "filename");
+		if (type_json && filename_json && std::string(type_json->valuestring) == "PREFAB")
+			prefab_filenames.push_back(std::string("data/") + filename_json->valuestring);
+	}
+	GTR::Prefab::Preload(prefab_filenames);
+
 	cJSON_ArrayForEach(entity_json, entities_json)
 	{
 		std::string type_str = cJSON_GetObjectItem(entity_json, "type")->valuestring;
@@ -182,6 +215,34 @@ bool GTR::Scene::load(const char* filename)
 	}
 
 
+	//environment, before the irradiance because the rays that escape see it
+	if (cJSON_GetObjectItem(json, "environment"))
+	{
+		environment_filename = cJSON_GetObjectItem(json, "environment")->valuestring;
+		environment_max_size = (int)readJSONNumber(json, "environment_max_size", (float)environment_max_size);
+		if (environment.loadHDRE((std::string("data/") + environment_filename).c_str(), environment_max_size))
+			environment.upload();
+		else
+			std::cout << "[WARN] environment not found: " << environment_filename << std::endl;
+	}
+
+	//irradiance probes: read from the cache, or baked and stored there the first time
+	irradiance.fitToScene(this);
+	cJSON* irradiance_json = cJSON_GetObjectItem(json, "irradiance");
+	if (irradiance_json)
+	{
+		irradiance.start = readJSONVector3(irradiance_json, "start", irradiance.start);
+		irradiance.end = readJSONVector3(irradiance_json, "end", irradiance.end);
+		Vector3 dims = readJSONVector3(irradiance_json, "dims", Vector3((float)irradiance.dims[0], (float)irradiance.dims[1], (float)irradiance.dims[2]));
+		for (int k = 0; k < 3; ++k)
+			irradiance.dims[k] = std::max(1, (int)dims.v[k]);
+		irradiance.normal_distance = readJSONNumber(irradiance_json, "normal_distance", irradiance.normal_distance);
+	}
+	std::string irradiance_filename = IrradianceGrid::getCacheFilename(this);
+	if (!irradiance.load(irradiance_filename.c_str(), this) && irradiance.bake(this))
+		irradiance.save(irradiance_filename.c_str(), this);
+	irradiance.upload();
+
 	//free memory
 	cJSON_Delete(json);
 
@@ -192,11 +253,128 @@ GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 {
 	if (type == "PREFAB")
 		return new GTR::PrefabEntity();
+	else if (type == "ANIMATED")
+		return new GTR::AnimatedEntity();
 	else if (type == "LIGHT")
 		return new GTR::LightEntity();
+	else if (type == "REFLECTION_PROBE")
+		return new GTR::ReflectionProbeEntity();
     return NULL;
 }
 
+namespace {
+	void addRayTargets(GTR::PrefabEntity* entity, GTR::Node* node, std::vector<GTR::sSceneRayTarget>& targets)
+	{
+		if (!node->visible)
+			return;
+		if (node->mesh)
+		{
+			GTR::sSceneRayTarget target;
+			target.entity = entity;
+			target.node = node;
+			targets.push_back(target);
+		}
+		for (GTR::Node* child : node->children)
+			addRayTargets(entity, child, targets);
+	}
+}
+
+void GTR::Scene::buildRayBVH()
+{
+	ray_targets.clear();
+	for (BaseEntity* entity : entities)
+	{
+		if (entity->entity_type != PREFAB || !entity->visible)
+			continue;
+		PrefabEntity* prefab_entity = (PrefabEntity*)entity;
+		if (prefab_entity->prefab)
+			addRayTargets(prefab_entity, &prefab_entity->prefab->root, ray_targets);
+	}
+
+	//the meshes that were not cooked build their BVH in parallel
+	std::vector<Mesh*> meshes;
+	for (sSceneRayTarget& target : ray_targets)
+		meshes.push_back(target.node->mesh);
+	std::sort(meshes.begin(), meshes.end());
+	meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+	JobSystem::parallelFor((int)meshes.size(), [&](int i) { meshes[i]->getBVH(); });
+
+	ray_bvh.instances.clear();
+	for (int i = 0; i < (int)ray_targets.size(); ++i)
+	{
+		sSceneRayTarget& target = ray_targets[i];
+		MeshBVH* bvh = target.node->mesh->getBVH();
+		if (!bvh)
+			continue;
+		sBVHInstance instance;
+		instance.bvh = bvh;
+		instance.model = target.node->getGlobalMatrix() * target.entity->model;
+		instance.layers = target.node->layers;
+		instance.id = i;
+		ray_bvh.instances.push_back(instance);
+	}
+	ray_bvh.build();
+	ray_bvh_ready = true;
+}
+
+void GTR::Scene::updateRayBVH()
+{
+	if (!ray_bvh_ready)
+	{
+		buildRayBVH();
+		return;
+	}
+	for (sBVHInstance& instance : ray_bvh.instances)
+	{
+		sSceneRayTarget& target = ray_targets[instance.id];
+		instance.model = target.node->getGlobalMatrix() * target.entity->model;
+	}
+	ray_bvh.refit();
+}
+
+bool GTR::Scene::testRay(const Vector3& origin, const Vector3& direction, sSceneRayHit& hit, float max_dist, int layers)
+{
+	if (!ray_bvh_ready)
+		buildRayBVH();
+
+	sRay ray;
+	ray.origin = origin;
+	ray.direction = direction;
+	ray.max_distance = max_dist;
+	sRayHit ray_hit;
+	if (!ray_bvh.testRay(ray, ray_hit, false, layers))
+		return false;
+
+	sSceneRayTarget& target = ray_targets[ray_hit.instance];
+	hit.entity = target.entity;
+	hit.node = target.node;
+	hit.distance = ray_hit.distance;
+	hit.position = origin + direction * ray_hit.distance;
+	hit.normal = ray_hit.normal;
+	return true;
+}
+
+bool GTR::Scene::testLineOfSight(const Vector3& from, const Vector3& to, int layers)
+{
+	if (!ray_bvh_ready)
+		buildRayBVH();
+
+	//the direction is not normalized so the segment goes from 0 to 1, slightly shortened to ignore the surface at the end
+	sRay ray;
+	ray.origin = from;
+	ray.direction = to - from;
+	ray.max_distance = 0.999f;
+	sRayHit hit;
+	return !ray_bvh.testRay(ray, hit, true, layers);
+}
+
+void GTR::Scene::testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit, int layers)
+{
+	if (!ray_bvh_ready)
+		buildRayBVH();
+	ray_bvh.testRays(rays, hits, count, any_hit, layers);
+}
+
 void GTR::BaseEntity::renderInMenu()
 {
 #ifndef SKIP_IMGUI
@@ -240,6 +418,111 @@ void GTR::PrefabEntity::renderInMenu()
 }
 
 
+GTR::AnimatedEntity::AnimatedEntity()
+{
+	entity_type = ANIMATED;
+	animation = NULL;
+	speed = 1.0f;
+	num_instances = 1;
+	spacing = 100.0f;
+	setNumInstances(1);
+}
+
+void GTR::AnimatedEntity::configure(cJSON* json)
+{
+	PrefabEntity::configure(json);
+	if (cJSON_GetObjectItem(json, "animation"))
+	{
+		animation_filename = cJSON_GetObjectItem(json, "animation")->valuestring;
+		animation = Animation::Get((std::string("data/") + animation_filename).c_str());
+	}
+	speed = readJSONNumber(json, "speed", speed);
+	spacing = readJSONNumber(json, "spacing", spacing);
+	setNumInstances((int)readJSONNumber(json, "instances", 1));
+}
+
+void GTR::AnimatedEntity::setNumInstances(int num)
+{
+	num_instances = std::max(1, num);
+	instances.resize(num_instances);
+}
+
+//the instances fill a square grid centered in the entity
+Matrix44 GTR::AnimatedEntity::getInstanceModel(int index)
+{
+	int side = (int)ceil(sqrt((float)num_instances));
+	float offset = (side - 1) * 0.5f;
+	Matrix44 m;
+	m.setTranslation(((index % side) - offset) * spacing, 0, ((index / side) - offset) * spacing);
+	return m * model;
+}
+
+void GTR::AnimatedEntity::update(float time)
+{
+	if (!animation)
+		return;
+	for (int i = 0; i < (int)instances.size(); ++i)
+	{
+		sAnimationInstance& instance = instances[i];
+		instance.animation = animation;
+		instance.time = time * speed + i * 0.37f; //so the crowd does not move in sync
+	}
+	evaluateAnimationInstances(instances, NULL);
+}
+
+void GTR::AnimatedEntity::renderInMenu()
+{
+	PrefabEntity::renderInMenu();
+
+#ifndef SKIP_IMGUI
+	ImGui::Text("animation: %s", animation_filename.c_str());
+	ImGui::DragFloat("Speed", &speed, 0.01f);
+	ImGui::DragFloat("Spacing", &spacing);
+	if (ImGui::DragInt("Instances", &num_instances, 1, 1, 10000))
+		setNumInstances(num_instances);
+#endif
+}
+
+GTR::ReflectionProbeEntity::ReflectionProbeEntity()
+{
+	entity_type = REFLECTION_PROBE;
+	radius = 500.0f;
+	slot = -1;
+	invalidate();
+}
+
+void GTR::ReflectionProbeEntity::configure(cJSON* json)
+{
+	radius = readJSONNumber(json, "radius", radius);
+}
+
+bool GTR::ReflectionProbeEntity::isComplete() const
+{
+	for (int i = 0; i < 6; ++i)
+		if (face_frame[i] < 0)
+			return false;
+	return true;
+}
+
+void GTR::ReflectionProbeEntity::invalidate()
+{
+	for (int i = 0; i < 6; ++i)
+		face_frame[i] = -1;
+}
+
+void GTR::ReflectionProbeEntity::renderInMenu()
+{
+	BaseEntity::renderInMenu();
+
+#ifndef SKIP_IMGUI
+	ImGui::DragFloat("Radius", &radius, 1.0f, 0.0f, 100000.0f);
+	ImGui::Text("Slot: %d", slot);
+	ImGui::Text("Faces captured at: %d %d %d %d %d %d", face_frame[0], face_frame[1], face_frame[2], face_frame[3], face_frame[4], face_frame[5]);
+	if (ImGui::Button("Capture again"))
+		invalidate();
+#endif
+}
+
 GTR::LightEntity::LightEntity()
 {
 	entity_type = LIGHT;	
@@ -5,6 +5,11 @@
 #include "shader.h"
 #include "fbo.h"
 #include "camera.h"
+#include "animation.h"
+#include "bvh.h"
+#include "irradiance.h"
+#include "reflections.h"
+#include "environment.h"
 #include <string>
 
 //forward declaration
@@ -20,7 +25,8 @@ namespace GTR {
 		LIGHT = 2,
 		CAMERA = 3,
 		REFLECTION_PROBE = 4,
-		DECALL = 5
+		DECALL = 5,
+		ANIMATED = 6
 	};
 
 	enum eLightType {
@@ -32,6 +38,7 @@ namespace GTR {
 
 	class Scene;
 	class Prefab;
+	class Node;
 
 	//represents one element of the scene (could be lights, prefabs, cameras, etc)
 	class BaseEntity
@@ -61,6 +68,27 @@ namespace GTR {
 		virtual void configure(cJSON* json);
 	};
 	
+	//a skinned prefab playing an animation, with more than one instance it is a crowd in a grid around the entity
+	class AnimatedEntity : public GTR::PrefabEntity
+	{
+	public:
+		std::string animation_filename;
+		Animation* animation;
+		float speed;
+		int num_instances;
+		float spacing; //distance between the instances of the grid
+
+		std::vector<sAnimationInstance> instances;
+
+		AnimatedEntity();
+		virtual void renderInMenu();
+		virtual void configure(cJSON* json);
+
+		void setNumInstances(int num);
+		Matrix44 getInstanceModel(int index);
+		void update(float time); //evaluates the poses of all the instances
+	};
+
 	class LightEntity : public GTR::BaseEntity 
 	{
 	public:
@@ -81,6 +109,37 @@ namespace GTR {
 		void setUniforms(Shader* s);
 	};
 
+	//a cubemap captured from its position, reflected by the surfaces inside its radius (see ReflectionProbes)
+	class ReflectionProbeEntity : public GTR::BaseEntity
+	{
+	public:
+		float radius; //of influence, the reflection fades to nothing at this distance
+		int slot; //its layers in the array of the ReflectionProbes, -1 without one
+		int face_frame[6]; //frame when every face was captured, -1 if it never was
+		Vector3 capture_position; //where the faces were captured, moving the probe captures them again
+
+		ReflectionProbeEntity();
+		virtual void renderInMenu();
+		virtual void configure(cJSON* json);
+
+		bool isComplete() const; //all the faces captured at least once
+		void invalidate(); //the faces go first in the next updates
+	};
+
+	//a node with mesh of a prefab entity, what the instances of the ray BVH point to
+	struct sSceneRayTarget {
+		PrefabEntity* entity;
+		Node* node;
+	};
+
+	struct sSceneRayHit {
+		BaseEntity* entity;
+		Node* node;
+		Vector3 position;
+		Vector3 normal;
+		float distance;
+	};
+
 	//contains all entities of the scene
 	class Scene
 	{
@@ -91,18 +150,39 @@ namespace GTR {
 		Vector3 ambient_light;
 		Camera main_camera;
 
+		//optional HDRE cubemap ("environment" in the json), prefiltered for the reflections (or read from its cache), environment_max_size limits its size
+		std::string environment_filename;
+		int environment_max_size;
+		PrefilteredEnvironment environment; //its SH is the ambient light when it is valid
+
 		Scene();
 
 		std::string filename;
 		std::vector<BaseEntity*> entities;
 		std::vector<LightEntity*> l_entities;
 
+		//ray queries (picking, line of sight): a BVH over the nodes of the prefab entities, each one with the BVH of its mesh.
+		//it is built with the first query, the animated entities are not in it
+		InstancesBVH ray_bvh;
+		std::vector<sSceneRayTarget> ray_targets; //the id of the instances is the index here
+		bool ray_bvh_ready;
+
+		IrradianceGrid irradiance; //ambient light from probes, loaded or baked with the scene
+		ReflectionProbes reflections; //captured by the renderer from the REFLECTION_PROBE entities
+
 		void clear();
 		void addEntity(BaseEntity* entity);
+		Vector3 getAmbientLight(const Vector3& direction) const; //from the SH of the environment, or the flat ambient_light
 		void addEntityLight(LightEntity* entity);
 
 		bool load(const char* filename);
 		BaseEntity* createEntity(std::string type);
+
+		void buildRayBVH(); //after adding or removing entities or nodes
+		void updateRayBVH(); //after moving them, only refits the boxes
+		bool testRay(const Vector3& origin, const Vector3& direction, sSceneRayHit& hit, float max_dist = 3.4e+38F, int layers = 0xFF);
+		bool testLineOfSight(const Vector3& from, const Vector3& to, int layers = 0xFF); //true if nothing is in between
+		void testRays(const sRay* rays, sRayHit* hits, int count, bool any_hit = false, int layers = 0xFF); //hit.instance indexes ray_targets
 	};
 
 };
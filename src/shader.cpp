@@ -11,6 +11,120 @@
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+bool Shader::use_binary_cache = true;
+bool Shader::async_compile = true;
+std::string Shader::binary_cache_filename = "data/shader_cache.bin";
+
+namespace {
+
+	struct sProgramBinary {
+		GLenum format;
+		std::vector<unsigned char> data;
+	};
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+	typedef void (APIENTRY *glMaxShaderCompilerThreadsKHR_func)(GLuint count);
+
+	std::vector<Shader*> pending_shaders; //sent to the driver, status not checked yet
+
+	//the entries of the atlas, to build the variants
+	struct sAtlasEntry {
+		std::string vs_filename;
+		std::string fs_filename;
+		std::string macros;
+	};
+	std::map<std::string, sAtlasEntry> atlas_entries;
+
+	const char* feature_macros[SF_NUM_FEATURES] = { "USE_NORMALMAP", "USE_ALPHA_MASK", "USE_SHADOWS", "POINT_LIGHT", "SPOT_LIGHT", "DIRECTIONAL_LIGHT", "USE_SKINNING" };
+
+	//GL_KHR_parallel_shader_compile lets us ask if a program finished without blocking
+	bool parallelCompileSupported()
+	{
+		static int supported = -1;
+		if (supported == -1)
+		{
+			supported = checkGLExtension("GL_KHR_parallel_shader_compile") || checkGLExtension("GL_ARB_parallel_shader_compile") ? 1 : 0;
+			if (supported)
+			{
+				glMaxShaderCompilerThreadsKHR_func setThreads = (glMaxShaderCompilerThreadsKHR_func)getGLProcAddress("glMaxShaderCompilerThreadsKHR");
+				if (!setThreads)
+					setThreads = (glMaxShaderCompilerThreadsKHR_func)getGLProcAddress("glMaxShaderCompilerThreadsARB");
+				if (setThreads)
+					setThreads(0xFFFFFFFF); //as many as the driver wants
+			}
+		}
+		return supported == 1;
+	}
+
+	std::map<uint64_t, sProgramBinary> binary_cache;
+	bool binary_cache_loaded = false;
+	bool binary_cache_dirty = false;
+
+	//binaries are only valid for the same driver
+	const std::string& getDriverId()
+	{
+		static std::string driver_id;
+		if (driver_id.empty())
+		{
+			const char* vendor = (const char*)glGetString(GL_VENDOR);
+			const char* renderer = (const char*)glGetString(GL_RENDERER);
+			const char* version = (const char*)glGetString(GL_VERSION);
+			driver_id = std::string(vendor ? vendor : "") + "|" + (renderer ? renderer : "") + "|" + (version ? version : "");
+		}
+		return driver_id;
+	}
+
+	bool programBinariesSupported()
+	{
+		static int supported = -1;
+		if (supported == -1)
+		{
+			GLint num_formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+			glGetError(); //not an error if the query is unknown
+			supported = num_formats > 0 ? 1 : 0;
+		}
+		return supported == 1;
+	}
+
+	//format: "GTRS", version, count, then for every program: key, format, size, binary
+	void loadBinaryCache()
+	{
+		binary_cache_loaded = true;
+		std::vector<unsigned char> buffer;
+		if (!readFileBin(Shader::binary_cache_filename, buffer) || buffer.size() < 12)
+			return;
+		const unsigned char* pos = &buffer[0];
+		const unsigned char* end = pos + buffer.size();
+		uint32_t header[3];
+		memcpy(header, pos, sizeof(header));
+		pos += sizeof(header);
+		if (memcmp(header, "GTRS", 4) != 0 || header[1] != SHADER_BINARY_CACHE_VERSION)
+		{
+			std::cout << " - Shader binary cache is from another version, ignored" << std::endl;
+			return;
+		}
+		for (uint32_t i = 0; i < header[2]; ++i)
+		{
+			uint64_t key;
+			uint32_t info[2]; //format, size
+			if (pos + sizeof(key) + sizeof(info) > end)
+				break;
+			memcpy(&key, pos, sizeof(key));
+			memcpy(info, pos + sizeof(key), sizeof(info));
+			pos += sizeof(key) + sizeof(info);
+			if (pos + info[1] > end)
+				break;
+			sProgramBinary& binary = binary_cache[key];
+			binary.format = info[0];
+			binary.data.assign(pos, pos + info[1]);
+			pos += info[1];
+		}
+	}
+}
 
 
 //typedef unsigned int GLhandle;
@@ -56,12 +170,20 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+long Shader::num_program_changes = 0;
+long Shader::num_texture_binds = 0;
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
 	vs = fs = 0;
+	program = 0;
+	source_hash = 0;
+	pending = false;
+	pending_hash = 0;
+	fallback = NULL;
+	features = 0;
 	compiled = false;
 	from_atlas = false;
 }
@@ -97,8 +219,8 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	//printf("Fragment shader from memory:\n%s\n", psm.c_str());
 	if (macros)
 	{
-		vsm = macros + vsm;
-		psm = macros + psm;
+		vsm = injectMacros(vsm, macros);
+		psm = injectMacros(psm, macros);
 		this->macros = macros;
 	}
 
@@ -120,7 +242,7 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 		name = vsf;
 	std::map<std::string,Shader*>::iterator it = s_Shaders.find(name);
 	if (it != s_Shaders.end())
-		return it->second;
+		return it->second->getUsable();
 
 	if (!psf)
 		return NULL;
@@ -129,18 +251,185 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	if (!sh->load( vsf,psf, macros ))
 		return NULL;
 	s_Shaders[name] = sh;
+	saveBinaryCache();
 	return sh;
 }
 
+std::string Shader::getFeatureMacros(unsigned int features)
+{
+	std::string macros;
+	for (int i = 0; i < SF_NUM_FEATURES; ++i)
+		if (features & (1 << i))
+			macros += std::string("#define ") + feature_macros[i] + "\n";
+	return macros;
+}
+
+//GLSL doesnt allow anything before #version
+std::string Shader::injectMacros(const std::string& code, const std::string& macros)
+{
+	if (macros.empty())
+		return code;
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return macros + "\n" + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + macros + "\n";
+	return code.substr(0, pos + 1) + macros + "\n" + code.substr(pos + 1);
+}
+
+Shader* Shader::getUsable()
+{
+	if (isReady())
+		return this;
+	if (!pending)
+		return NULL; //failed to compile
+	//still compiling, use a simpler one meanwhile
+	for (Shader* sh = fallback; sh; sh = sh->fallback)
+		if (sh->isReady())
+			return sh;
+	return finishCompile() ? this : NULL; //nothing to use instead, we have to wait
+}
+
+Shader* Shader::GetVariant(const char* name, unsigned int features)
+{
+	auto base = s_Shaders.find(name);
+	if (base == s_Shaders.end())
+		return NULL;
+	if (!features)
+		return base->second->getUsable();
+
+	//called for every draw, so the variants are found by their features in the base shader
+	std::map<unsigned int, Shader*>& variants = base->second->variants;
+	auto it = variants.find(features);
+	if (it != variants.end())
+		return it->second->getUsable();
+
+	if (atlas_entries.find(name) == atlas_entries.end())
+		return base->second->getUsable(); //not in the atlas, no variants
+
+	//also registered by name so ReloadAll compiles it again
+	std::string variant_name = std::string(name) + "@" + std::to_string(features);
+	Shader* sh = new Shader();
+	sh->atlas_name = name;
+	sh->features = features;
+	sh->fallback = base->second;
+	sh->from_atlas = true;
+	s_Shaders[variant_name] = sh;
+	variants[features] = sh;
+	if (!sh->compileVariant())
+		std::cout << " * Compilation error in shader variant: " << variant_name << std::endl;
+	return sh->getUsable();
+}
+
+bool Shader::compileVariant()
+{
+	const sAtlasEntry& entry = atlas_entries[atlas_name];
+	std::string macros = entry.macros + "\n" + getFeatureMacros(features);
+	std::string vs_code = injectMacros(s_shaders_atlas[entry.vs_filename], macros);
+	std::string fs_code = injectMacros(s_shaders_atlas[entry.fs_filename], macros);
+	vs_filename = entry.vs_filename;
+	ps_filename = entry.fs_filename;
+
+	uint64_t hash = getSourceHash(vs_code, fs_code);
+	if ((compiled && source_hash == hash) || (pending && pending_hash == hash))
+		return true; //didnt change
+	release();
+	return async_compile ? beginCompile(vs_code, fs_code) : compileFromMemory(vs_code, fs_code);
+}
+
+//only the shaders whose code changed are compiled again
 void Shader::ReloadAll()
 {
 	for( std::map<std::string,Shader*>::iterator it = s_Shaders.begin(); it!=s_Shaders.end();it++)
 		it->second->recompile();
 	if(!s_shader_atlas_filename.empty())
 		LoadAtlas(s_shader_atlas_filename.c_str());
+	saveBinaryCache();
 	std::cout << "Shaders recompiled" << std::endl;
 }
 
+uint64_t Shader::getSourceHash(const std::string& vsm, const std::string& psm)
+{
+	const std::string& driver_id = getDriverId();
+	const char separator = '\0'; //so moving code from one to the other changes the hash
+	uint64_t hash = hashFNV64(driver_id.data(), driver_id.size());
+	hash = hashFNV64(vsm.data(), vsm.size(), hash);
+	hash = hashFNV64(&separator, 1, hash);
+	return hashFNV64(psm.data(), psm.size(), hash);
+}
+
+bool Shader::loadFromBinaryCache(uint64_t key)
+{
+	if (!programBinariesSupported())
+		return false;
+	if (!binary_cache_loaded)
+		loadBinaryCache();
+	auto it = binary_cache.find(key);
+	if (it == binary_cache.end())
+		return false;
+
+	program = glCreateProgram();
+	glProgramBinary(program, it->second.format, &it->second.data[0], (GLsizei)it->second.data.size());
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetError(); //an unknown format is not an error, we compile it
+	if (!linked)
+	{
+		//the driver rejected it (updated driver or another GPU)
+		glDeleteProgram(program);
+		program = 0;
+		binary_cache.erase(it);
+		binary_cache_dirty = true;
+		return false;
+	}
+	return true;
+}
+
+void Shader::storeInBinaryCache(uint64_t key)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	sProgramBinary& binary = binary_cache[key];
+	binary.data.resize(length);
+	glGetProgramBinary(program, length, NULL, &binary.format, &binary.data[0]);
+	if (glGetError() != GL_NO_ERROR)
+	{
+		binary_cache.erase(key);
+		return;
+	}
+	binary_cache_dirty = true;
+}
+
+void Shader::saveBinaryCache()
+{
+	if (!binary_cache_dirty)
+		return;
+	binary_cache_dirty = false;
+
+	FILE* f = fopen(binary_cache_filename.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << " - Cannot write shader binary cache: " << binary_cache_filename << std::endl;
+		return;
+	}
+	uint32_t header[3];
+	memcpy(header, "GTRS", 4);
+	header[1] = SHADER_BINARY_CACHE_VERSION;
+	header[2] = (uint32_t)binary_cache.size();
+	fwrite(header, sizeof(header), 1, f);
+	for (auto& it : binary_cache)
+	{
+		uint32_t info[2] = { it.second.format, (uint32_t)it.second.data.size() };
+		fwrite(&it.first, sizeof(it.first), 1, f);
+		fwrite(info, sizeof(info), 1, f);
+		fwrite(&it.second.data[0], 1, it.second.data.size(), f);
+	}
+	fclose(f);
+}
+
 //functions to trim strings
 static inline std::string trim(std::string str) {
 	size_t startpos = str.find_first_not_of(" \t\r\n");
@@ -154,6 +443,22 @@ static inline std::string trim(std::string str) {
 	return str;
 }
 
+//the outputs declared by a fragment shader, a fallback has to write the same ones
+static std::string getFragmentOutputs(const std::string& fs_code)
+{
+	std::string outputs;
+	std::vector<std::string> lines = tokenize(fs_code, "\n");
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		std::string line = trim(lines[i]);
+		if (line.substr(0, 4) == "out " || (line.substr(0, 6) == "layout" && line.find(" out ") != std::string::npos))
+			outputs += line + "\n";
+	}
+	if (fs_code.find("gl_FragData") != std::string::npos)
+		outputs += "gl_FragData\n";
+	return outputs;
+}
+
 void Shader::setMacros(const char* macros)
 {
 	this->macros = macros;
@@ -210,8 +515,10 @@ bool Shader::LoadAtlas(const char* filename)
 	}
 	s_shaders_atlas[ subfile_name ] = subfile_content;
 
-	//compile shaders
+	//compile shaders, the first one of every vertex shader and fragment outputs is compiled now and used while the others are compiling
 	std::string shaders = s_shaders_atlas[""];
+	std::map<std::string, Shader*> fallbacks; //by vertex shader and fragment outputs
+	bool all_compiled = true;
 
 	lines = tokenize(shaders, "\n");
 	for (int i = 0; i < lines.size(); ++i)
@@ -239,8 +546,9 @@ bool Shader::LoadAtlas(const char* filename)
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		atlas_entries[name] = { vs_filename, fs_filename, macros };
+		vs_code = injectMacros(vs_code, macros);
+		fs_code = injectMacros(fs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find( name );
@@ -251,22 +559,39 @@ bool Shader::LoadAtlas(const char* filename)
 		}
 		else
 			shader = it->second;
-	
-		if (!shader->compileFromMemory(vs_code,fs_code))
-		{
-			delete shader;
-			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
-			continue;
-		}
 
 		shader->vs_filename = vs_filename;
 		shader->ps_filename = fs_filename;
 		shader->from_atlas = true;
-		std::cout << " + Shader from atlas: " << name << std::endl;
+		Shader*& fallback = fallbacks[vs_filename + "\n" + getFragmentOutputs(fs_code)];
+		bool is_fallback = fallback == NULL || !fallback->compiled; //the previous one failed
+		if (is_fallback)
+			fallback = shader;
+		shader->fallback = is_fallback ? NULL : fallback;
+
+		uint64_t hash = getSourceHash(vs_code, fs_code);
+		if ((shader->compiled && shader->source_hash == hash) || (shader->pending && shader->pending_hash == hash))
+			continue; //didnt change
+		shader->release();
+
+		//a failed shader stays registered but Get returns NULL for it, the rest of the atlas is still loaded
+		bool ok = is_fallback || !async_compile ? shader->compileFromMemory(vs_code, fs_code) : shader->beginCompile(vs_code, fs_code);
+		if (!ok)
+		{
+			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
+			all_compiled = false;
+			continue;
+		}
+		std::cout << " + Shader from atlas: " << name << (shader->pending ? " (compiling)" : "") << std::endl;
 	}
 
-	return true;
+	//variants already requested, only the ones whose code changed are compiled
+	for (auto it = s_Shaders.begin(); it != s_Shaders.end(); ++it)
+		if (it->second->atlas_name.size())
+			it->second->compileVariant();
+
+	saveBinaryCache();
+	return all_compiled;
 }
 
 bool Shader::compile()
@@ -279,6 +604,9 @@ bool Shader::recompile()
 { 
 	if (from_atlas || !vs_filename.size() || !ps_filename.size() ) //shaders compiled from memory cannot be recompiled
 		return false;
+	std::string vsm, psm;
+	if (compiled && readFile(vs_filename, vsm) && readFile(ps_filename, psm) && getSourceHash(injectMacros(vsm, macros), injectMacros(psm, macros)) == source_hash)
+		return true; //files didnt change
 	release(); //remove old shader
     return load( vs_filename,ps_filename, macros.size() ? macros.c_str() : NULL );
 }
@@ -296,6 +624,14 @@ bool Shader::hasInfoLog() const
 // ******************************************
 
 bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+{
+	if (!beginCompile(vsm, psm))
+		return false;
+	return compiled || finishCompile();
+}
+
+//sends the code to the driver without checking the status, so it can compile several in parallel
+bool Shader::beginCompile(const std::string& vsm, const std::string& psm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -303,32 +639,55 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		exit(0);
 	}
 
-	program = glCreateProgram();
-	assert (glGetError() == GL_NO_ERROR);
-
-	if (!createVertexShaderObject(vsm))
+	uint64_t key = getSourceHash(vsm, psm);
+	if (use_binary_cache && loadFromBinaryCache(key))
 	{
-		printf("Vertex shader compilation failed\n");
-		return false;
+		source_hash = key;
+		compiled = true;
+		return true;
 	}
 
-	if (!createFragmentShaderObject(psm))
-	{
-		printf("Fragment shader compilation failed\n");
-		return false;
-	}
+	program = glCreateProgram();
+	assert (glGetError() == GL_NO_ERROR);
+	if (use_binary_cache && programBinariesSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+	createVertexShaderObject(vsm);
+	createFragmentShaderObject(psm);
 
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
-	GLint linked=0;
-    
-	glGetProgramiv(program,GL_LINK_STATUS,&linked);
-	assert(glGetError() == GL_NO_ERROR);
+	pending = true;
+	pending_hash = key;
+	pending_code[0] = vsm;
+	pending_code[1] = psm;
+	pending_shaders.push_back(this);
+	return true;
+}
 
-	if (!linked)
+//checks the result of beginCompile, it blocks if the driver didnt finish
+bool Shader::finishCompile()
+{
+	assert(pending && "shader is not being compiled");
+	pending = false;
+	pending_shaders.erase(std::remove(pending_shaders.begin(), pending_shaders.end(), this), pending_shaders.end());
+
+	bool ok = checkShaderObject(vs, pending_code[0]) && checkShaderObject(fs, pending_code[1]);
+	pending_code[0].clear();
+	pending_code[1].clear();
+	if (ok)
 	{
-		saveProgramInfoLog(program);
+		GLint linked = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		assert(glGetError() == GL_NO_ERROR);
+		if (!linked)
+			saveProgramInfoLog(program);
+		ok = linked != 0;
+	}
+	if (!ok)
+	{
+		std::cout << " * Compilation error in shader: " << vs_filename << "," << ps_filename << std::endl;
 		release();
 		return false;
 	}
@@ -338,10 +697,51 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 #endif
 
 	compiled = true;
+	source_hash = pending_hash;
+	if (use_binary_cache && programBinariesSupported())
+		storeInBinaryCache(pending_hash);
 
 	return true;
 }
 
+bool Shader::isReady()
+{
+	if (compiled)
+		return true;
+	if (!pending)
+		return false; //failed
+	if (parallelCompileSupported())
+	{
+		GLint done = 0;
+		glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+		if (!done)
+			return false;
+	}
+	return finishCompile();
+}
+
+void Shader::processPending()
+{
+	if (pending_shaders.empty())
+		return;
+
+	//with the extension only the finished ones are checked, without it one per frame (checking blocks)
+	std::vector<Shader*> shaders = pending_shaders;
+	for (size_t i = 0; i < shaders.size(); ++i)
+	{
+		if (parallelCompileSupported())
+			shaders[i]->isReady();
+		else
+		{
+			shaders[i]->finishCompile();
+			break;
+		}
+	}
+
+	if (pending_shaders.empty())
+		saveBinaryCache();
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -386,6 +786,15 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
+	//the status is checked later (checkShaderObject) so the driver doesnt have to finish now
+	glAttachShader(program,handle);
+	assert( glGetError() == GL_NO_ERROR );
+
+	return true;
+}
+
+bool Shader::checkShaderObject(GLuint handle, const std::string& code)
+{
 	GLint compile=0;
 	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
@@ -395,22 +804,27 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	{
 		saveShaderInfoLog(handle);
         std::cout << "Shader code:\n " << std::endl;
-		std::vector<std::string> lines = split( fullcode, '\n' );
+		std::vector<std::string> lines = split( code, '\n' );
 		for( size_t i = 0; i < lines.size(); ++i)
 			std::cout << i << "  " << lines[i] << std::endl;
 
 		return false;
 	}
 
-	glAttachShader(program,handle);
-	assert( glGetError() == GL_NO_ERROR );
-
 	return true;
 }
 
 
 void Shader::release()
 {
+	if (pending)
+	{
+		pending = false;
+		pending_code[0].clear();
+		pending_code[1].clear();
+		pending_shaders.erase(std::remove(pending_shaders.begin(), pending_shaders.end(), this), pending_shaders.end());
+	}
+
 	if (vs)
 	{
 		glDeleteShader(vs);
@@ -446,6 +860,7 @@ void Shader::enable()
 	current = this;
 
 	glUseProgram(program);
+	num_program_changes++;
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -566,6 +981,7 @@ void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
 	glActiveTexture(GL_TEXTURE0 + slot);
 	glBindTexture(tex->texture_type, tex->texture_id);
+	num_texture_binds++;
 	setUniform1(varname, slot);
 	glActiveTexture(GL_TEXTURE0 + slot);
 }
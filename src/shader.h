@@ -10,6 +10,21 @@
 #include <map>
 #include "framework.h"
 #include <cassert>
+#include <cstdint>
+
+#define SHADER_BINARY_CACHE_VERSION 1 //cache files with another version are discarded
+
+//features of a shader variant, every bit adds a #define after the #version line (see Shader::GetVariant)
+enum eShaderFeature {
+	SF_NORMALMAP = 1 << 0,			//USE_NORMALMAP
+	SF_ALPHA_MASK = 1 << 1,			//USE_ALPHA_MASK
+	SF_SHADOWS = 1 << 2,			//USE_SHADOWS
+	SF_POINT_LIGHT = 1 << 3,		//POINT_LIGHT
+	SF_SPOT_LIGHT = 1 << 4,			//SPOT_LIGHT
+	SF_DIRECTIONAL_LIGHT = 1 << 5,	//DIRECTIONAL_LIGHT
+	SF_SKINNING = 1 << 6,			//USE_SKINNING
+	SF_NUM_FEATURES = 7
+};
 
 #ifdef _DEBUG
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
@@ -28,6 +43,8 @@ class Shader
 
 public:
 	static Shader* current;
+	static long num_program_changes; //stats, reset every frame like Mesh::num_meshes_rendered
+	static long num_texture_binds;
 
 	Shader();
 	virtual ~Shader();
@@ -109,6 +126,10 @@ public:
 	void setMacros(const char * macros);
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
+	//atlas shader specialized for the features (eShaderFeature bits), compiled the first time it is requested
+	static Shader* GetVariant(const char* name, unsigned int features);
+	static std::string getFeatureMacros(unsigned int features);
+	static std::string injectMacros(const std::string& code, const std::string& macros); //after the #version line
 	static void ReloadAll();
 	static std::map<std::string,Shader*> s_Shaders;
 
@@ -120,6 +141,23 @@ public:
 
 	static Shader* getDefaultShader(std::string name);
 
+	//linked programs are stored (glGetProgramBinary) so next runs dont compile them, keyed by the source and the driver
+	static bool use_binary_cache;
+	static std::string binary_cache_filename;
+	static void saveBinaryCache(); //only writes if something was added
+
+	static uint64_t getSourceHash(const std::string& vsm, const std::string& psm);
+
+	//atlas shaders are compiled in the background (GL_KHR_parallel_shader_compile if available, otherwise on first use)
+	static bool async_compile;
+	static void processPending(); //once per frame, finishes the shaders the driver is done with
+	bool isReady(); //never blocks if the driver supports the extension
+	bool beginCompile(const std::string& vsm, const std::string& psm);
+	bool finishCompile();
+	Shader* fallback; //used by Get while this one is compiling, same vertex shader and fragment outputs
+	Shader* getUsable(); //itself, a fallback that is ready while it compiles, or NULL if it failed
+	std::map<unsigned int, Shader*> variants; //of an atlas shader, by their features (they are also in s_Shaders)
+
 protected:
 
 	std::string info_log;
@@ -131,6 +169,8 @@ protected:
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+	bool checkShaderObject(GLuint handle, const std::string& code);
+	bool compileVariant(); //from atlas_name and features
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
 
@@ -140,6 +180,15 @@ protected:
 	GLuint fs;
 	GLuint program;
 	std::string log;
+	uint64_t source_hash; //of the code compiled, to skip the ones that didnt change when reloading
+	std::string atlas_name; //for variants, the atlas shader they come from
+	unsigned int features; //eShaderFeature bits of the variant
+	bool pending; //sent to the driver, status not checked
+	uint64_t pending_hash;
+	std::string pending_code[2]; //to show the errors
+
+	bool loadFromBinaryCache(uint64_t key);
+	void storeInBinaryCache(uint64_t key);
 
 //this is a hack to speed up shader usage (save info locally)
 private: 
@@ -0,0 +1,84 @@
+#include "skinning.h"
+
+#include "includes.h"
+#include "shader.h"
+#include "animation.h"
+
+#include <cassert>
+#include <iostream>
+
+BonePalette::BonePalette()
+{
+	buffer_id = 0;
+	texture_id = 0;
+	buffer_size = 0;
+}
+
+BonePalette::~BonePalette()
+{
+	if (texture_id)
+		glDeleteTextures(1, &texture_id);
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+}
+
+int BonePalette::add(const Matrix44& model, const sSkeletonPose& pose, const sMeshSkin& skin)
+{
+	int offset = (int)matrices.size();
+	matrices.resize(offset + 1 + skin.getNumBones());
+	matrices[offset] = model;
+	if (skin.getNumBones())
+		skin.computeFinalBoneMatrices(pose, &matrices[offset + 1]);
+	return offset;
+}
+
+void BonePalette::upload()
+{
+	if (matrices.empty())
+		return;
+
+	if (!buffer_id)
+	{
+		glGenBuffers(1, &buffer_id);
+		glGenTextures(1, &texture_id);
+	}
+
+	size_t size = matrices.size() * sizeof(Matrix44);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+	if (size > buffer_size)
+	{
+		//grow with some margin so a crowd that changes a little does not reallocate every frame
+		GLint max_texels = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+		if (matrices.size() * 4 > (size_t)max_texels)
+			std::cout << "[WARN] bone palette of " << matrices.size() << " matrices is bigger than GL_MAX_TEXTURE_BUFFER_SIZE" << std::endl;
+		buffer_size = size + size / 2;
+		glBufferData(GL_TEXTURE_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_id);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+	else
+		glBufferData(GL_TEXTURE_BUFFER, buffer_size, NULL, GL_STREAM_DRAW); //orphan the one the GPU could be reading
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, size, &matrices[0]);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void BonePalette::setUniforms(Shader* shader, int offset, int stride)
+{
+	assert(texture_id && "bone palette not uploaded");
+	glActiveTexture(GL_TEXTURE0 + BONE_PALETTE_SLOT);
+	glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+	glActiveTexture(GL_TEXTURE0);
+	Shader::num_texture_binds++;
+	shader->setUniform("u_bones_texture", BONE_PALETTE_SLOT);
+	shader->setUniform("u_palette_offset", offset);
+	shader->setUniform("u_palette_stride", stride);
+}
+
+void BonePalette::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Bone palette: %d matrices, %.2f MB", (int)matrices.size(), buffer_size / (1024.0f * 1024.0f));
+#endif
+}
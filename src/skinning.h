@@ -0,0 +1,40 @@
+/*  GPU skinning: the matrices of all the skinned instances of the frame are stored in one buffer texture, uploaded once per frame.
+	The skinning vertex shader (basic.vs with USE_SKINNING) reads the palette of every instance with gl_InstanceID,
+	so all the characters sharing a mesh are rendered with one instanced draw call.
+*/
+#pragma once
+
+#include "framework.h"
+
+#include <vector>
+
+class Shader;
+struct sSkeletonPose;
+struct sMeshSkin;
+
+#define BONE_PALETTE_SLOT 7 //texture slot used by u_bones_texture, the materials use the first ones
+
+class BonePalette
+{
+public:
+	std::vector<Matrix44> matrices; //for every instance its model followed by its bone matrices
+
+	BonePalette();
+	~BonePalette();
+
+	void clear() { matrices.clear(); }
+	int getNumMatrices() const { return (int)matrices.size(); }
+
+	//adds the palette of one instance and returns its first matrix
+	int add(const Matrix44& model, const sSkeletonPose& pose, const sMeshSkin& skin);
+
+	void upload(); //call it once per frame after adding all the instances
+	void setUniforms(Shader* shader, int offset, int stride); //binds the buffer texture
+
+	void renderInMenu();
+
+private:
+	unsigned int buffer_id;
+	unsigned int texture_id;
+	size_t buffer_size; //bytes allocated in the GPU
+};
@@ -1,5 +1,19 @@
 #include "sphericalharmonics.h"
 
+#include "jobs.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+//same detection as framework.cpp
+#ifndef FRAMEWORK_NO_SIMD
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define SH_SSE
+        #include <xmmintrin.h>
+    #endif
+#endif
+
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
     {{0, 0, -1} ,{0, -1, 0},{1, 0, 0} },  // posx
@@ -13,8 +27,9 @@ Vector3 cubemapFaceNormals[6][3] = {
 };
 
 const int sh_length = 9;
-std::vector< std::vector<Vector3> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+
+// forsyths weights, the cosine lobe of every band is folded in
+const float sh_weights[sh_length] = { 4.0f / 17.0f, 8.0f / 17.0f, 8.0f / 17.0f, 8.0f / 17.0f, 15.0f / 17.0f, 15.0f / 17.0f, 5.0f / 68.0f, 15.0f / 17.0f, 15.0f / 68.0f };
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,85 +55,154 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
-// give me a cubemap, its size and number of channels
-// and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
-    int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
+namespace {
+
+    //sums of one row of a face, the rows are added in order at the end so the result does not depend on the threads
+    struct sSHRowSums {
+        float coeffs[sh_length][3];
+    };
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
+    void addTexel(sSHRowSums& sums, float dx, float dy, float dz, float weight, const float* value)
     {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
+        float basis[sh_length] = { 1.0f, dy, dz, dx, dx * dy, dy * dz, 3.0f * dz * dz - 1.0f, dx * dz, dx * dx - dy * dy };
+        for (int i = 0; i < sh_length; ++i)
         {
-            std::vector<Vector3> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
+            float w = basis[i] * weight * sh_weights[i];
+            sums.coeffs[i][0] += value[0] * w;
+            sums.coeffs[i][1] += value[1] * w;
+            sums.coeffs[i][2] += value[2] * w;
+        }
+    }
+
+    void projectRow(FloatImage& image, int face, int y, const float* solid_angles, bool degamma, sSHRowSums& sums)
+    {
+        int size = image.width;
+        int channels = image.num_channels;
+        const float* pixels = image.data + y * size * channels;
+        memset(&sums, 0, sizeof(sums));
+
+        //4 texels at once, the colors go to SoA first (with the degamma if needed)
+        int x = 0;
+#ifdef SH_SSE
+        const Vector3* axis = cubemapFaceNormals[face];
+        float fV = (2.0f * y / (size - 1.0f)) - 1.0f;
+        float to_u = 2.0f / (size - 1.0f);
+        __m128 acc[sh_length][3];
+        for (int i = 0; i < sh_length; ++i)
+            acc[i][0] = acc[i][1] = acc[i][2] = _mm_setzero_ps();
+        for (; x + 4 <= size; x += 4)
+        {
+            float rgb[3][4];
+            for (int lane = 0; lane < 4; ++lane)
+                for (int c = 0; c < 3; ++c)
                 {
-                    float fU = (2.0 * u / (size - 1.0)) - 1.0;
-                    float fV = (2.0 * v / (size - 1.0)) - 1.0;
+                    float v = pixels[(x + lane) * channels + c];
+                    rgb[c][lane] = degamma ? powf(v, 2.2f) : v;
+                }
 
-                    Vector3 vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3 vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3 vecZ = cubemapFaceNormals[index][2];
+            __m128 fU = _mm_sub_ps(_mm_mul_ps(_mm_setr_ps((float)x, (float)x + 1, (float)x + 2, (float)x + 3), _mm_set1_ps(to_u)), _mm_set1_ps(1.0f));
+            __m128 v = _mm_set1_ps(fV);
+            __m128 dx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fU, _mm_set1_ps(axis[0].x)), _mm_mul_ps(v, _mm_set1_ps(axis[1].x))), _mm_set1_ps(axis[2].x));
+            __m128 dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fU, _mm_set1_ps(axis[0].y)), _mm_mul_ps(v, _mm_set1_ps(axis[1].y))), _mm_set1_ps(axis[2].y));
+            __m128 dz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fU, _mm_set1_ps(axis[0].z)), _mm_mul_ps(v, _mm_set1_ps(axis[1].z))), _mm_set1_ps(axis[2].z));
+            __m128 inv_length = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz))));
+            dx = _mm_mul_ps(dx, inv_length);
+            dy = _mm_mul_ps(dy, inv_length);
+            dz = _mm_mul_ps(dz, inv_length);
+
+            __m128 weight = _mm_loadu_ps(solid_angles + y * size + x);
+            __m128 basis[sh_length];
+            basis[0] = _mm_set1_ps(1.0f);
+            basis[1] = dy;
+            basis[2] = dz;
+            basis[3] = dx;
+            basis[4] = _mm_mul_ps(dx, dy);
+            basis[5] = _mm_mul_ps(dy, dz);
+            basis[6] = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(dz, dz)), _mm_set1_ps(1.0f));
+            basis[7] = _mm_mul_ps(dx, dz);
+            basis[8] = _mm_sub_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+
+            __m128 r = _mm_loadu_ps(rgb[0]), g = _mm_loadu_ps(rgb[1]), b = _mm_loadu_ps(rgb[2]);
+            for (int i = 0; i < sh_length; ++i)
+            {
+                __m128 w = _mm_mul_ps(_mm_mul_ps(basis[i], weight), _mm_set1_ps(sh_weights[i]));
+                acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(r, w));
+                acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(g, w));
+                acc[i][2] = _mm_add_ps(acc[i][2], _mm_mul_ps(b, w));
+            }
+        }
+        for (int i = 0; i < sh_length; ++i)
+            for (int c = 0; c < 3; ++c)
+            {
+                float lanes[4];
+                _mm_storeu_ps(lanes, acc[i][c]);
+                sums.coeffs[i][c] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            }
+#endif
 
-                    Vector3 res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
-                }
+        //the rest of the row (or all of it without SSE)
+        for (; x < size; ++x)
+        {
+            Vector3 dir = cubemapTexelDirection(face, x, y, size);
+            float value[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                float v = pixels[x * channels + c];
+                value[c] = degamma ? powf(v, 2.2f) : v;
             }
-            cubeMapVecs.push_back(faceVecs);
+            addTexel(sums, dir.x, dir.y, dir.z, solid_angles[y * size + x], value);
         }
     }
+}
 
-    // generate spherical harmonics
-    float weightAccum = 0;
+// the direction of the texel as computeSH always did it (not from the texel center)
+Vector3 cubemapTexelDirection(int face, int x, int y, int size)
+{
+    float fU = (2.0f * x / (size - 1.0f)) - 1.0f;
+    float fV = (2.0f * y / (size - 1.0f)) - 1.0f;
+    return normalize(cubemapFaceNormals[face][0] * fU + cubemapFaceNormals[face][1] * fV + cubemapFaceNormals[face][2]);
+}
 
-    for (int index = 0; index < 6; ++index)
-    {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3 texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3 value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
-            }
+// give me a cubemap, its size and number of channels
+// and i'll give you spherical harmonics
+// it can be called from several threads at once, the rows of the faces are split between the workers
+SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+    int size = images[0].width;
+    SphericalHarmonics sh;
+
+    // solid angle of every texel, the same for the six faces
+    std::vector<float> solid_angles(size * size);
+    float weightAccum = 0;
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            float weight = texelSolidAngle(x, y, size, size);
+            solid_angles[y * size + x] = weight;
+            weightAccum += weight * 3.0f * 6.0f;
         }
-    };
+
+    // generate spherical harmonics
+    std::vector<sSHRowSums> rows(6 * size);
+    JobSystem::parallelFor(6 * size, [&](int row) {
+        int face = row / size;
+        projectRow(images[face], face, row % size, &solid_angles[0], degamma, rows[row]);
+    });
+
+    for (const sSHRowSums& sums : rows)
+        for (int i = 0; i < sh_length; i++)
+            sh.coeffs[i] += Vector3(sums.coeffs[i][0], sums.coeffs[i][1], sums.coeffs[i][2]);
 
     SphericalHarmonics linear_sh;
     for (int i = 0; i < sh_length; i++)
         linear_sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
     return linear_sh;
 }
+
+Vector3 evaluateSH(const SphericalHarmonics& sh, const Vector3& n)
+{
+    float basis[sh_length] = { 1.0f, n.y, n.z, n.x, n.x * n.y, n.y * n.z, 3.0f * n.z * n.z - 1.0f, n.x * n.z, n.x * n.x - n.y * n.y };
+    Vector3 result;
+    for (int i = 0; i < sh_length; i++)
+        result += sh.coeffs[i] * basis[i];
+    return result;
+}
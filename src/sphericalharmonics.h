@@ -4,9 +4,11 @@
 #include "texture.h"
 
 extern Vector3 cubemapFaceNormals[6][3]; //(x,y,z)
+Vector3 cubemapTexelDirection(int face, int x, int y, int size); //the one computeSH uses for every texel
 
 struct SphericalHarmonics {
 	Vector3 coeffs[9];
 };
 
-SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+SphericalHarmonics computeSH( FloatImage images[], bool degamma = false); //the six faces, reentrant and split between the workers
+Vector3 evaluateSH(const SphericalHarmonics& sh, const Vector3& normal); //irradiance in the units of the images (a constant image gives its color)
@@ -0,0 +1,131 @@
+#include "ssao.h"
+
+#include "includes.h"
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "mesh.h"
+#include "profiler.h"
+
+#include <algorithm>
+
+SSAO::SSAO()
+{
+	enabled = true;
+	samples = 16;
+	resolution_divider = 2;
+	radius = 15.0f;
+	intensity = 1.0f;
+	bias = 0.5f;
+	blur_passes = 1;
+	depth_tolerance = 0.05f;
+	texture = NULL;
+	size[0] = size[1] = 0;
+}
+
+void SSAO::compute(FBO* gbuffers, Camera* camera, int width, int height)
+{
+	texture = NULL;
+	if (!enabled)
+		return;
+	Shader* ao_shader = Shader::Get("ssao");
+	Shader* blur_shader = Shader::Get("ssao_blur");
+	if (!ao_shader || !blur_shader)
+		return;
+
+	int divider = std::max(resolution_divider, 1);
+	int target_width = std::max(gbuffers->width / divider, 1);
+	int target_height = std::max(gbuffers->height / divider, 1);
+	if (ao_fbo.width != target_width || ao_fbo.height != target_height)
+	{
+		//the depth needs more than 8 bits, and RGBA16F is always renderable
+		ao_fbo.create(target_width, target_height, 1, GL_RGBA, GL_HALF_FLOAT, false);
+		blur_fbo.create(target_width, target_height, 1, GL_RGBA, GL_HALF_FLOAT, false);
+	}
+	size[0] = std::min(std::max(width / divider, 1), target_width);
+	size[1] = std::min(std::max(height / divider, 1), target_height);
+
+	PROFILE_GPU_SCOPE("SSAO");
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	ao_fbo.bind();
+	glViewport(0, 0, size[0], size[1]);
+	ao_shader->enable();
+	ao_shader->setUniform("u_depth_texture", gbuffers->depth_texture, 0);
+	ao_shader->setUniform("u_normal_texture", gbuffers->color_textures[1], 1);
+	ao_shader->setUniform("u_inverse_viewprojection", inv_vp);
+	ao_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	ao_shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+	ao_shader->setUniform("u_uv_scale", Vector2(width / (float)gbuffers->width, height / (float)gbuffers->height));
+	ao_shader->setUniform("u_divider", divider);
+	ao_shader->setUniform("u_samples", std::min(std::max(samples, 1), SSAO_MAX_SAMPLES));
+	ao_shader->setUniform("u_radius", radius);
+	ao_shader->setUniform("u_bias", bias);
+	ao_shader->setUniform("u_intensity", intensity);
+	quad->render(GL_TRIANGLES);
+	ao_shader->disable();
+	ao_fbo.unbind();
+
+	//horizontal into blur_fbo and vertical back into ao_fbo
+	blur_shader->enable();
+	blur_shader->setUniform("u_depth_tolerance", depth_tolerance);
+	blur_shader->setUniform2("u_size", size[0], size[1]);
+	for (int i = 0; i < blur_passes; ++i)
+	{
+		blur_fbo.bind();
+		glViewport(0, 0, size[0], size[1]);
+		blur_shader->setUniform("u_texture", ao_fbo.color_textures[0], 0);
+		blur_shader->setUniform("u_direction", Vector2(1.0f, 0.0f));
+		quad->render(GL_TRIANGLES);
+		blur_fbo.unbind();
+
+		ao_fbo.bind();
+		glViewport(0, 0, size[0], size[1]);
+		blur_shader->setUniform("u_texture", blur_fbo.color_textures[0], 0);
+		blur_shader->setUniform("u_direction", Vector2(0.0f, 1.0f));
+		quad->render(GL_TRIANGLES);
+		ao_fbo.unbind();
+	}
+	blur_shader->disable();
+	glEnable(GL_DEPTH_TEST);
+
+	texture = ao_fbo.color_textures[0];
+}
+
+void SSAO::setUniforms(Shader* shader) const
+{
+	if (!texture)
+	{
+		shader->setUniform("u_ssao_enabled", 0);
+		return;
+	}
+	shader->setUniform("u_ssao_enabled", 1);
+	shader->setUniform("u_ssao_texture", texture, SSAO_SLOT);
+	shader->setUniform("u_ssao_size", Vector2((float)size[0], (float)size[1]));
+	shader->setUniform("u_ssao_depth_tolerance", depth_tolerance);
+}
+
+void SSAO::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode(this, "SSAO"))
+		return;
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::Text("%dx%d", size[0], size[1]);
+	int resolution_option = resolution_divider >= 4 ? 1 : 0;
+	if (ImGui::Combo("Resolution", &resolution_option, "Half\0" "Quarter\0"))
+		resolution_divider = resolution_option ? 4 : 2;
+	ImGui::SliderInt("Samples", &samples, 4, SSAO_MAX_SAMPLES);
+	ImGui::DragFloat("Radius", &radius, 0.1f, 0.1f, 1000.0f);
+	ImGui::SliderFloat("Intensity", &intensity, 0.0f, 4.0f);
+	ImGui::DragFloat("Bias", &bias, 0.01f, 0.0f, 100.0f);
+	ImGui::SliderInt("Blur passes", &blur_passes, 0, 4);
+	ImGui::SliderFloat("Depth tolerance", &depth_tolerance, 0.001f, 0.5f);
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,44 @@
+/*  Screen space ambient occlusion for the deferred pipeline, computed from the depth and normals of the gbuffers.
+	The occlusion is done at half or quarter resolution: a hemisphere of samples around the normal of every pixel,
+	rotated per pixel and projected against the depth buffer. Then a separable blur that doesn't cross the depth
+	discontinuities, and add_ambient upsamples it with the same rule, taking the low resolution texels at its depth.
+	The texture keeps the linear depth of every texel next to the occlusion for that.
+*/
+#pragma once
+
+#include "framework.h"
+#include "fbo.h"
+
+class Shader;
+class Camera;
+
+#define SSAO_SLOT 12 //texture slot used by u_ssao_texture
+#define SSAO_MAX_SAMPLES 64 //it must match the one in ssao.fs
+
+class SSAO
+{
+public:
+	bool enabled;
+	int samples; //per pixel, the main cost with the resolution
+	int resolution_divider; //2 half resolution, 4 quarter
+	float radius; //of the hemisphere in world units
+	float intensity; //power of the occlusion
+	float bias; //depth difference ignored, avoids the self occlusion of flat surfaces
+	int blur_passes; //pairs of horizontal and vertical passes, 0 doesn't blur
+	float depth_tolerance; //relative depth difference of the texels blurred together
+
+	Texture* texture; //occlusion in x and linear depth in y, NULL if it wasn't computed this frame
+	int size[2]; //of the part of the texture used, the targets are allocated for the whole gbuffers
+
+	SSAO();
+
+	//after the gbuffers, before the composite. width and height are the part of the gbuffers rendered (dynamic resolution)
+	void compute(FBO* gbuffers, Camera* camera, int width, int height);
+	void setUniforms(Shader* shader) const; //u_ssao_enabled is 0 if it wasn't computed
+
+	void renderInMenu();
+
+private:
+	FBO ao_fbo;
+	FBO blur_fbo; //ping pong with ao_fbo
+};
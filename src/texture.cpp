@@ -2,9 +2,12 @@
 #include "texture.h"
 #include "fbo.h"
 #include "utils.h"
+#include "texturestreamer.h"
+#include "texturecache.h"
 
 #include <iostream> //to output
 #include <cmath>
+#include <algorithm>
 
 #include "mesh.h"
 #include "shader.h"
@@ -16,6 +19,11 @@
 //#include "extra/stb_image.h"
 //#include "engine/application.h"
 
+//stb_image uses SSE2 for the JPEG IDCT and YCbCr conversion on x86/x64, NEON has to be requested
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define STBI_NEON
+#endif
+
 #include "extra/stb_image.h"
 
 #ifdef USE_SKIA
@@ -62,6 +70,8 @@ std::map<std::string, Texture*> Texture::sTexturesLoaded;
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
+bool Texture::use_cooked_cache = true;
+int Texture::cooked_compression = TC_NONE;
 
 Texture::Texture()
 {
@@ -89,6 +99,7 @@ Texture::Texture(Image* img)
 
 Texture::~Texture()
 {
+	TextureStreamer::remove(this);
 	clear();
 }
 
@@ -214,6 +225,61 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
+void Texture::createArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
+{
+	assert(width && height && layers && "texture must have a size");
+
+	//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
+	if (this->texture_id != 0)
+		clear();
+
+	this->width = (float)width;
+	this->height = (float)height;
+	this->depth = (float)layers;
+	this->format = format;
+	this->type = type;
+	this->texture_type = GL_TEXTURE_2D_ARRAY;
+	this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT;
+	this->wrapS = GL_CLAMP_TO_EDGE;
+	this->wrapT = GL_CLAMP_TO_EDGE;
+
+	if (internal_format == 0)
+	{
+		if (type == GL_FLOAT)
+			internal_format = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
+		else if (type == GL_HALF_FLOAT)
+			internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	}
+	this->internal_format = internal_format;
+
+	glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
+	glBindTexture(this->texture_type, texture_id);
+
+	//every level is allocated now, the layers are rendered later
+	int levels = getNumLevels();
+	for (int level = 0; level < levels; ++level)
+		glTexImage3D(this->texture_type, level, internal_format == 0 ? format : internal_format, std::max(1, (int)width >> level), std::max(1, (int)height >> level), layers, 0, format, type, NULL);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(this->texture_type, 0);
+	assert(glGetError() == GL_NO_ERROR && "Error creating texture array");
+}
+
+int Texture::getNumLevels() const
+{
+	if (!mipmaps)
+		return 1;
+	int levels = 1;
+	for (int size = std::max((int)width, (int)height); size > 1; size >>= 1)
+		levels++;
+	return levels;
+}
+
 Texture* Texture::Find(const char* filename)
 {
 	assert(filename);
@@ -223,15 +289,19 @@ Texture* Texture::Find(const char* filename)
 	return NULL;
 }
 
-Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
+Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap, bool srgb)
 {
 	//load it
 	Texture* texture = Find(filename);
 	if (texture)
 		return texture;
 
+	//starts with a placeholder and the mips arrive in the next frames
+	if (TextureStreamer::enabled && mipmaps && wrap)
+		return TextureStreamer::Get(filename, srgb);
+
 	texture = new Texture();
-	if (!texture->load(filename, mipmaps, wrap))
+	if (!texture->load(filename, mipmaps, wrap, GL_UNSIGNED_BYTE, srgb))
 	{
 		delete texture;
 		return NULL;
@@ -240,37 +310,36 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 	return texture;
 }
 
-bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
+bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type, bool srgb)
 {
-	std::string str = filename;
-	std::string ext = str.substr(str.size() - 4, 4);
 	Image* image = NULL;
 	double time = getTime();
 
 	std::cout << " + Texture loading: " << filename << " ... ";
 
-	image = new Image();
-	bool found = false;
-
-	if (ext == ".tga" || ext == ".TGA")
-		found = image->loadTGA(filename);
-	else if (ext == ".png" || ext == ".PNG")
-		found = image->loadPNG(filename);
-	else if (ext == ".jpg" || ext == ".JPG" || ext == "JPEG" || ext == "jpeg")
-		found = image->loadJPG(filename);
-	else
+	//cooked version with all the mips, no decoding when it is already in the cache
+	sCookedTexture cooked;
+	if (use_cooked_cache && mipmaps && type == GL_UNSIGNED_BYTE && getCookedTexture(filename, srgb, cooked))
 	{
-		std::cout << "[ERROR]: unsupported format" << std::endl;
-		return false; //unsupported file type
+		if (cooked_compression != TC_NONE && !cooked.compressed)
+			compressCookedTexture(cooked, (eTextureCompression)cooked_compression, (std::string(filename) + ".ktx").c_str());
+		loadFromCooked(&cooked, wrap);
+		this->filename = filename;
+		setName(filename);
+		std::cout << "[COOKED] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		return true;
 	}
 
-	if (!found) //file not found
+	image = new Image();
+	if (!image->load(filename)) //file not found or unsupported
 	{
 		std::cout << " [ERROR]: Texture not found " << std::endl;
+		delete image;
 		return false;
 	}
 
 	loadFromImage(image,mipmaps,wrap,type);
+	delete image;
 	this->filename = filename;
 	setName(filename);
 
@@ -300,6 +369,42 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+void Texture::loadFromCooked(const sCookedTexture* cooked, bool wrap)
+{
+	assert(cooked && cooked->getNumLevels() && "cooked texture is empty");
+
+	if (this->texture_id != 0)
+		clear();
+	glGenTextures(1, &texture_id);
+
+	this->texture_type = GL_TEXTURE_2D;
+	this->width = (float)cooked->levels[0].width;
+	this->height = (float)cooked->levels[0].height;
+	this->depth = 0;
+	this->format = cooked->format;
+	this->internal_format = cooked->internal_format;
+	this->type = GL_UNSIGNED_BYTE;
+	this->mipmaps = cooked->getNumLevels() > 1;
+
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4); //cooked rows are aligned to 4
+	for (unsigned int i = 0; i < cooked->getNumLevels(); ++i)
+	{
+		const sCookedLevel& level = cooked->levels[i];
+		if (cooked->compressed)
+			glCompressedTexImage2D(GL_TEXTURE_2D, i, cooked->internal_format, level.width, level.height, 0, (GLsizei)level.size, cooked->getLevelData(i));
+		else
+			glTexImage2D(GL_TEXTURE_2D, i, cooked->internal_format, level.width, level.height, 0, cooked->format, GL_UNSIGNED_BYTE, cooked->getLevelData(i));
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, cooked->getNumLevels() - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	assert(checkGLErrors() && "Error uploading cooked texture");
+}
+
 void Texture::upload(Image* img)
 {
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
@@ -673,6 +778,24 @@ void Image::fromTexture(Texture* texture)
 
 //TGA format from: http://www.paulbourke.net/dataformats/tga/
 //also on https://gshaw.ca/closecombat/formats/tga.html
+bool Image::load(const char* filename)
+{
+	std::string str = filename;
+	if (str.size() < 4)
+		return false;
+	std::string ext = str.substr(str.size() - 4, 4);
+
+	if (ext == ".tga" || ext == ".TGA")
+		return loadTGA(filename);
+	else if (ext == ".png" || ext == ".PNG")
+		return loadPNG(filename);
+	else if (ext == ".jpg" || ext == ".JPG" || ext == "JPEG" || ext == "jpeg")
+		return loadJPG(filename);
+
+	std::cout << "[ERROR]: unsupported format " << filename << std::endl;
+	return false; //unsupported file type
+}
+
 bool Image::loadTGA(const char* filename)
 {
 	GLubyte TGAheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
@@ -751,8 +874,18 @@ bool Image::loadTGA(const char* filename)
 #include <iostream>
 #include <fstream>
 
+bool Image::use_legacy_decoders = false;
+
 bool Image::loadPNG(const char* filename, bool flip_y)
 {
+	if (!use_legacy_decoders)
+	{
+		//decode straight from the mapped file, no copy
+		MappedFile file;
+		if (!file.open(filename))
+			return false;
+		return loadFromMemory(file.data, file.size);
+	}
 	std::vector<unsigned char> buffer;
 	if (!readFileBin(filename, buffer))
 		return false;
@@ -761,6 +894,8 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 {
+	if (!use_legacy_decoders)
+		return loadFromMemory(buffer.empty() ? NULL : &buffer[0], buffer.size(), flip_y);
 #ifdef USE_SKIA
     sk_sp<SkData> skData = SkData::MakeWithoutCopy(&buffer[0], buffer.size());
     std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(skData));
@@ -802,6 +937,13 @@ bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 
 bool Image::loadJPG(const char* filename, bool flip_y)
 {
+	if (!use_legacy_decoders)
+	{
+		MappedFile file;
+		if (!file.open(filename))
+			return false;
+		return loadFromMemory(file.data, file.size, flip_y);
+	}
 	std::vector<unsigned char> buffer;
 	if (!readFileBin(filename, buffer))
 		return false;
@@ -812,6 +954,25 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 {
 	std::vector<unsigned char> out_image;
 
+	//jpgd, scalar IDCT
+	if (use_legacy_decoders)
+	{
+		int w, h, actual_comps;
+		assert(data == NULL); //image must be empty
+		unsigned char* image_data = jpgd::decompress_jpeg_image_from_memory(&buffer[0], (int)buffer.size(), &w, &h, &actual_comps, 3);
+		if (!image_data)
+			return false;
+		width = (unsigned int)w;
+		height = (unsigned int)h;
+		num_channels = 3;
+		data = new unsigned char[w * h * 3];
+		memcpy(data, image_data, w * h * 3);
+		free(image_data);
+		if (flip_y)
+			flipY();
+		return true;
+	}
+
 	int width;
 	int height;
 	int actual_comps;
@@ -872,6 +1033,35 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 	return true;
 }
 
+bool Image::loadFromMemory(const unsigned char* buffer, size_t size, bool flip_y)
+{
+	if (!buffer || !size)
+		return false;
+
+	//keep RGB when there is no alpha, gray is expanded
+	int w, h, channels;
+	if (!stbi_info_from_memory(buffer, (int)size, &w, &h, &channels))
+		return false;
+	int req_channels = (channels == 3 || channels == 1) ? 3 : 4;
+
+	unsigned char* image_data = stbi_load_from_memory(buffer, (int)size, &w, &h, &channels, req_channels);
+	if (!image_data)
+		return false;
+
+	if (data)
+		delete[] data;
+	width = (unsigned int)w;
+	height = (unsigned int)h;
+	num_channels = req_channels;
+	data = new unsigned char[w * h * req_channels];
+	memcpy(data, image_data, w * h * req_channels);
+	stbi_image_free(image_data);
+
+	if (flip_y)
+		flipY();
+	return true;
+}
+
 // Saves the image to a TGA file
 bool Image::saveTGA(const char* filename, bool flip_y)
 {
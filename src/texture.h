@@ -13,6 +13,7 @@
 class Shader;
 class FBO;
 class Texture;
+struct sCookedTexture;
 
 #ifndef OPENGL_ES3
 #define GL_RGBA32F 0x8814
@@ -48,6 +49,8 @@ public:
 class Image : public tImage<uint8>
 {
 public:
+	static bool use_legacy_decoders; //picopng and jpgd instead of stb_image, only to compare
+
 	Color getPixel(int x, int y) {
 		assert(x >= 0 && x < (int)width && y >= 0 && y < (int)height && "reading of memory");
 		int pos = y*width* num_channels + x* num_channels;
@@ -65,11 +68,13 @@ public:
 	void fromTexture(Texture* texture);
 	void fromScreen(int width, int height);
 
+	bool load(const char* filename); //picks the decoder from the extension, it can be called from any thread
 	bool loadTGA(const char* filename);
 	bool loadPNG(const char* filename, bool flip_y = true);
 	bool loadPNG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadFromMemory(const unsigned char* buffer, size_t size, bool flip_y = false); //PNG or JPG (stb_image, SIMD IDCT and color conversion)
 	bool saveTGA(const char* filename, bool flip_y = false);
 };
 
@@ -103,6 +108,8 @@ public:
 	static int default_mag_filter;
 	static int default_min_filter;
 	static FBO* global_fbo;
+	static bool use_cooked_cache; //load and store image.png.ktx with the mips already generated
+	static int cooked_compression; //eTextureCompression applied by the driver when cooking (only once, it is stored in the .ktx), not while streaming
 
 	//a general struct to store all the information about a TGA file
 
@@ -140,6 +147,8 @@ public:
 	void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
+	void createArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0); //empty GL_TEXTURE_2D_ARRAY with all its mips, filled by rendering to it
+	int getNumLevels() const; //mips allocated (1 without mipmaps)
 
 	void upload(Image* img);
 	void upload(FloatImage* img);
@@ -157,12 +166,13 @@ public:
 
 	void operator = (const Texture& tex) { assert("textures cannot be cloned like this!");  }
 
-	//load without using the manager
-	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	//load without using the manager (srgb means the mips are filtered in linear space, for color textures)
+	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE, bool srgb = false);
 	void loadFromImage(Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	void loadFromCooked(const sCookedTexture* cooked, bool wrap = true); //uploads all the levels, no decoding
 
 	//load using the manager (caching loaded ones to avoid reloading them)
-	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
+	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true, bool srgb = false);
 	static Texture* Find(const char* filename);
 	void setName(const char* name) {
 		filename = name;
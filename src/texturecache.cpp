@@ -0,0 +1,400 @@
+#include "texturecache.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+	#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+//KTX 1.1 header, all the fields are uint32
+struct sKTXHeader {
+	unsigned char identifier[12];
+	unsigned int endianness;
+	unsigned int gl_type;
+	unsigned int gl_type_size;
+	unsigned int gl_format;
+	unsigned int gl_internal_format;
+	unsigned int gl_base_internal_format;
+	unsigned int pixel_width;
+	unsigned int pixel_height;
+	unsigned int pixel_depth;
+	unsigned int num_array_elements;
+	unsigned int num_faces;
+	unsigned int num_mips;
+	unsigned int bytes_of_key_value_data;
+};
+
+const unsigned char ktx_identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+inline size_t align4(size_t v) { return (v + 3) & ~(size_t)3; }
+
+sCookedTexture::sCookedTexture()
+{
+	format = internal_format = 0;
+	compressed = srgb = false;
+	file = NULL;
+}
+
+sCookedTexture::~sCookedTexture()
+{
+	clear();
+}
+
+void sCookedTexture::clear()
+{
+	levels.clear();
+	storage.clear();
+	if (file)
+		delete file;
+	file = NULL;
+}
+
+const unsigned char* sCookedTexture::getLevelData(unsigned int level) const
+{
+	assert(level < levels.size());
+	return (file ? file->data : &storage[0]) + levels[level].offset;
+}
+
+size_t sCookedTexture::getLevelVRAM(unsigned int level) const
+{
+	const sCookedLevel& l = levels[level];
+	return compressed ? l.size : (size_t)l.width * l.height * 4;
+}
+
+//sRGB <-> linear tables, the encode one has enough precision for 8 bits
+struct sSRGBTables {
+	float to_linear[256];
+	unsigned char to_srgb[4096];
+	sSRGBTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			float c = i / 255.0f;
+			to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+		}
+		for (int i = 0; i < 4096; ++i)
+		{
+			float l = i / 4095.0f;
+			float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+			to_srgb[i] = (unsigned char)clamp(c * 255.0f + 0.5f, 0.0f, 255.0f);
+		}
+	}
+};
+
+const sSRGBTables& getSRGBTables()
+{
+	static sSRGBTables tables; //thread safe init
+	return tables;
+}
+
+//box filter, odd sizes repeat the last row/column. Color channels of srgb images are averaged in linear space
+void downsampleImage(Image* src, Image* dst, bool srgb)
+{
+	const sSRGBTables& tables = getSRGBTables();
+	int pw = src->width;
+	int ph = src->height;
+	int c = src->num_channels;
+	dst->resize(std::max(1, pw / 2), std::max(1, ph / 2), c);
+	for (int y = 0; y < (int)dst->height; ++y)
+	{
+		const uint8* row0 = src->data + std::min(y * 2, ph - 1) * pw * c;
+		const uint8* row1 = src->data + std::min(y * 2 + 1, ph - 1) * pw * c;
+		uint8* dest = dst->data + y * dst->width * c;
+		for (int x = 0; x < (int)dst->width; ++x)
+		{
+			int x0 = std::min(x * 2, pw - 1) * c;
+			int x1 = std::min(x * 2 + 1, pw - 1) * c;
+			for (int k = 0; k < c; ++k)
+			{
+				if (srgb && k < 3)
+				{
+					float l = (tables.to_linear[row0[x0 + k]] + tables.to_linear[row0[x1 + k]] + tables.to_linear[row1[x0 + k]] + tables.to_linear[row1[x1 + k]]) * 0.25f;
+					dest[x * c + k] = tables.to_srgb[(int)(l * 4095.0f + 0.5f)];
+				}
+				else
+					dest[x * c + k] = (uint8)((row0[x0 + k] + row0[x1 + k] + row1[x0 + k] + row1[x1 + k] + 2) / 4);
+			}
+		}
+	}
+}
+
+//copies the image to the storage with the rows aligned to 4 bytes
+void addCookedLevel(sCookedTexture& cooked, Image* image)
+{
+	sCookedLevel level;
+	level.width = image->width;
+	level.height = image->height;
+	size_t row = (size_t)image->width * image->num_channels;
+	size_t pitch = align4(row);
+	level.size = pitch * image->height;
+	level.offset = cooked.storage.size();
+	cooked.storage.resize(level.offset + level.size);
+	for (unsigned int y = 0; y < image->height; ++y)
+		memcpy(&cooked.storage[level.offset + y * pitch], image->data + y * row, row);
+	cooked.levels.push_back(level);
+}
+
+bool cookImage(Image* image, bool srgb, sCookedTexture& cooked)
+{
+	if (!image || !image->width || !image->height || (image->num_channels != 3 && image->num_channels != 4))
+		return false;
+
+	cooked.clear();
+	cooked.format = image->num_channels == 3 ? GL_RGB : GL_RGBA;
+	cooked.internal_format = image->num_channels == 3 ? GL_RGB8 : GL_RGBA8;
+	cooked.compressed = false;
+	cooked.srgb = srgb;
+
+	addCookedLevel(cooked, image);
+	Image mips[2]; //ping pong
+	Image* prev = image;
+	for (int i = 0; prev->width > 1 || prev->height > 1; ++i)
+	{
+		Image* mip = &mips[i % 2];
+		downsampleImage(prev, mip, srgb);
+		addCookedLevel(cooked, mip);
+		prev = mip;
+	}
+	return true;
+}
+
+bool readCookedTexture(const char* filename, bool srgb, sCookedTexture& cooked)
+{
+	cooked.clear();
+	MappedFile* file = new MappedFile();
+	if (!file->open(filename) || file->size < sizeof(sKTXHeader))
+	{
+		delete file;
+		return false;
+	}
+
+	sKTXHeader header;
+	memcpy(&header, file->data, sizeof(header));
+	if (memcmp(header.identifier, ktx_identifier, 12) != 0 || header.endianness != 0x04030201 || header.num_faces != 1 || header.pixel_depth > 1 || header.num_array_elements)
+	{
+		delete file;
+		return false;
+	}
+
+	//our key/values: version and srgb
+	int version = 0;
+	bool file_srgb = false;
+	size_t pos = sizeof(sKTXHeader);
+	size_t kv_end = pos + header.bytes_of_key_value_data;
+	while (pos + 4 <= kv_end && kv_end <= file->size)
+	{
+		unsigned int kv_size;
+		memcpy(&kv_size, file->data + pos, 4);
+		std::string key((const char*)file->data + pos + 4);
+		std::string value = key.size() + 1 < kv_size ? std::string((const char*)file->data + pos + 4 + key.size() + 1) : "";
+		if (key == "GTRversion")
+			version = atoi(value.c_str());
+		else if (key == "GTRsrgb")
+			file_srgb = value == "1";
+		pos += 4 + align4(kv_size);
+	}
+	if (version != TEXTURE_CACHE_VERSION || file_srgb != srgb)
+	{
+		delete file;
+		return false;
+	}
+
+	cooked.format = header.gl_base_internal_format;
+	cooked.internal_format = header.gl_internal_format;
+	cooked.compressed = header.gl_type == 0;
+	cooked.srgb = file_srgb;
+
+	pos = kv_end;
+	unsigned int w = header.pixel_width;
+	unsigned int h = std::max(header.pixel_height, 1u);
+	for (unsigned int i = 0; i < std::max(header.num_mips, 1u); ++i)
+	{
+		if (pos + 4 > file->size)
+			break;
+		unsigned int size;
+		memcpy(&size, file->data + pos, 4);
+		if (pos + 4 + size > file->size)
+			break;
+		sCookedLevel level;
+		level.width = std::max(w >> i, 1u);
+		level.height = std::max(h >> i, 1u);
+		level.offset = pos + 4;
+		level.size = size;
+		cooked.levels.push_back(level);
+		pos = align4(pos + 4 + size);
+	}
+	if (!cooked.levels.size())
+	{
+		delete file;
+		return false;
+	}
+	cooked.file = file;
+	return true;
+}
+
+void writeKeyValue(FILE* f, const char* key, const char* value)
+{
+	unsigned int size = (unsigned int)(strlen(key) + 1 + strlen(value) + 1);
+	fwrite(&size, 4, 1, f);
+	fwrite(key, strlen(key) + 1, 1, f);
+	fwrite(value, strlen(value) + 1, 1, f);
+	const unsigned char zeros[4] = { 0 };
+	fwrite(zeros, align4(size) - size, 1, f);
+}
+
+size_t getKeyValueSize(const char* key, const char* value)
+{
+	return 4 + align4(strlen(key) + 1 + strlen(value) + 1);
+}
+
+bool writeCookedTexture(const char* filename, const sCookedTexture& cooked)
+{
+	if (!cooked.levels.size())
+		return false;
+
+	//written to a temporary file and renamed, the old one could be mapped
+	std::string tmp_filename = std::string(filename) + ".tmp";
+	FILE* f = fopen(tmp_filename.c_str(), "wb");
+	if (!f)
+		return false;
+
+	std::string version = std::to_string(TEXTURE_CACHE_VERSION);
+	const char* srgb = cooked.srgb ? "1" : "0";
+
+	sKTXHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.identifier, ktx_identifier, 12);
+	header.endianness = 0x04030201;
+	header.gl_type = cooked.compressed ? 0 : GL_UNSIGNED_BYTE;
+	header.gl_type_size = 1;
+	header.gl_format = cooked.compressed ? 0 : cooked.format;
+	header.gl_internal_format = cooked.internal_format;
+	header.gl_base_internal_format = cooked.format;
+	header.pixel_width = cooked.levels[0].width;
+	header.pixel_height = cooked.levels[0].height;
+	header.num_faces = 1;
+	header.num_mips = cooked.getNumLevels();
+	header.bytes_of_key_value_data = (unsigned int)(getKeyValueSize("GTRversion", version.c_str()) + getKeyValueSize("GTRsrgb", srgb));
+	fwrite(&header, sizeof(header), 1, f);
+	writeKeyValue(f, "GTRversion", version.c_str());
+	writeKeyValue(f, "GTRsrgb", srgb);
+
+	const unsigned char zeros[4] = { 0 };
+	for (unsigned int i = 0; i < cooked.getNumLevels(); ++i)
+	{
+		unsigned int size = (unsigned int)cooked.levels[i].size;
+		fwrite(&size, 4, 1, f);
+		fwrite(cooked.getLevelData(i), size, 1, f);
+		fwrite(zeros, align4(size) - size, 1, f);
+	}
+	bool ok = ferror(f) == 0;
+	fclose(f);
+
+	remove(filename);
+	if (!ok || rename(tmp_filename.c_str(), filename) != 0)
+	{
+		remove(tmp_filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool getCookedTexture(const char* filename, bool srgb, sCookedTexture& cooked)
+{
+	std::string cooked_filename = std::string(filename) + ".ktx";
+	if (!isCacheOutdated(cooked_filename, filename) && readCookedTexture(cooked_filename.c_str(), srgb, cooked))
+		return true;
+
+	Image image;
+	if (!image.load(filename))
+		return false;
+	if (!cookImage(&image, srgb, cooked))
+		return false;
+	if (!writeCookedTexture(cooked_filename.c_str(), cooked))
+		stdlog("[WARN] cannot write cooked texture " + cooked_filename);
+	return true;
+}
+
+bool isCompressedFormatSupported(unsigned int internal_format)
+{
+	GLint num_formats = 0;
+	glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &num_formats);
+	if (num_formats <= 0)
+		return false;
+	std::vector<GLint> formats(num_formats);
+	glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+	return std::find(formats.begin(), formats.end(), (GLint)internal_format) != formats.end();
+}
+
+bool compressCookedTexture(sCookedTexture& cooked, eTextureCompression compression, const char* save_to)
+{
+	if (cooked.compressed)
+		return true;
+	if (compression == TC_NONE || !cooked.levels.size())
+		return false;
+
+	GLenum target_format = cooked.format == GL_RGBA ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	if (compression == TC_BC7)
+		target_format = GL_COMPRESSED_RGBA_BPTC_UNORM;
+	if (!isCompressedFormatSupported(target_format))
+		return false;
+
+	//the driver compresses when uploading, then we read it back
+	GLuint texture_id = 0;
+	glGenTextures(1, &texture_id);
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	for (unsigned int i = 0; i < cooked.getNumLevels(); ++i)
+		glTexImage2D(GL_TEXTURE_2D, i, target_format, cooked.levels[i].width, cooked.levels[i].height, 0, cooked.format, GL_UNSIGNED_BYTE, cooked.getLevelData(i));
+
+	std::vector<unsigned char> storage;
+	std::vector<sCookedLevel> levels;
+	bool ok = true;
+	for (unsigned int i = 0; i < cooked.getNumLevels() && ok; ++i)
+	{
+		GLint is_compressed = 0;
+		GLint size = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED, &is_compressed);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+		if (!is_compressed || size <= 0)
+		{
+			ok = false;
+			break;
+		}
+		sCookedLevel level = cooked.levels[i];
+		level.offset = storage.size();
+		level.size = size;
+		storage.resize(level.offset + size);
+		glGetCompressedTexImage(GL_TEXTURE_2D, i, &storage[level.offset]);
+		levels.push_back(level);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDeleteTextures(1, &texture_id);
+	if (!ok)
+		return false;
+
+	bool srgb = cooked.srgb;
+	unsigned int format = cooked.format;
+	cooked.clear(); //releases the mapped file
+	cooked.format = format;
+	cooked.internal_format = target_format;
+	cooked.compressed = true;
+	cooked.srgb = srgb;
+	cooked.levels.swap(levels);
+	cooked.storage.swap(storage);
+
+	if (save_to && !writeCookedTexture(save_to, cooked))
+		stdlog(std::string("[WARN] cannot write cooked texture ") + save_to);
+	return true;
+}
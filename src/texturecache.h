@@ -0,0 +1,61 @@
+/*  Cooked textures: the mip chain already filtered (and optionally block compressed) stored in a KTX 1.1 file
+	next to the original image (image.png -> image.png.ktx) so next runs upload it without decoding anything.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+class Image;
+class MappedFile;
+
+#define TEXTURE_CACHE_VERSION 1 //stored in the .ktx, cooked files with another version are regenerated
+
+enum eTextureCompression {
+	TC_NONE = 0,
+	TC_BC1_BC3,		//DXT1 for RGB, DXT5 for RGBA
+	TC_BC7			//BPTC, better quality but the driver is slow compressing it
+};
+
+struct sCookedLevel {
+	unsigned int width;
+	unsigned int height;
+	size_t offset; //from the start of the data
+	size_t size; //bytes, uncompressed rows are aligned to 4 bytes (like GL_UNPACK_ALIGNMENT)
+};
+
+//a texture ready to upload, the levels point to its own storage or to the mapped .ktx
+struct sCookedTexture
+{
+	unsigned int format; //GL_RGB or GL_RGBA
+	unsigned int internal_format; //GL_RGB8, GL_RGBA8 or a compressed format
+	bool compressed;
+	bool srgb; //mips were filtered in linear space (color textures)
+	std::vector<sCookedLevel> levels;
+	std::vector<unsigned char> storage;
+	MappedFile* file;
+
+	sCookedTexture();
+	~sCookedTexture();
+
+	unsigned int getNumLevels() const { return (unsigned int)levels.size(); }
+	const unsigned char* getLevelData(unsigned int level) const;
+	size_t getLevelVRAM(unsigned int level) const; //drivers store RGB8 as RGBA8
+	void clear();
+};
+
+//ANY THREAD: generates the mips of the image (in linear space if srgb) without compression
+bool cookImage(Image* image, bool srgb, sCookedTexture& cooked);
+
+//ANY THREAD: reads the .ktx (mapped), returns false if it doesnt exist, it is from another version or srgb doesnt match
+bool readCookedTexture(const char* filename, bool srgb, sCookedTexture& cooked);
+bool writeCookedTexture(const char* filename, const sCookedTexture& cooked);
+
+//ANY THREAD: reads filename.ktx (unless the image is newer) or decodes the image, cooks it and writes filename.ktx
+bool getCookedTexture(const char* filename, bool srgb, sCookedTexture& cooked);
+
+//MAIN THREAD: compresses using the driver (glGetCompressedTexImage), returns false if the format is not supported
+//if save_to is set the compressed version is written there so it is only done once
+bool compressCookedTexture(sCookedTexture& cooked, eTextureCompression compression, const char* save_to = NULL);
+bool isCompressedFormatSupported(unsigned int internal_format);
@@ -0,0 +1,325 @@
+#include "texturestreamer.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "utils.h"
+#include "jobs.h"
+#include "texturecache.h"
+#include "profiler.h"
+
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+bool TextureStreamer::enabled = true;
+float TextureStreamer::upload_budget_mb = 4.0f;
+float TextureStreamer::vram_budget_mb = 512.0f;
+
+namespace {
+	std::map< Texture*, std::shared_ptr<sStreamedTexture> > streamed_textures;
+	GLuint pbos[TEXTURE_STREAMING_NUM_PBOS] = { 0 };
+	int next_pbo = 0;
+	long streamer_frame = 0;
+	size_t uploaded_last_frame = 0;
+
+	size_t getChainVRAM(sStreamedTexture* st, int first_mip)
+	{
+		size_t total = 0;
+		for (int i = first_mip; i < st->getNumMips(); ++i)
+			total += st->cooked->getLevelVRAM(i);
+		return total;
+	}
+
+	//creates a new GL texture with the mips from first_mip to the end and replaces the old one, returns the bytes uploaded
+	size_t uploadMips(sStreamedTexture* st, int first_mip)
+	{
+		sCookedTexture* cooked = st->cooked.get();
+		const sCookedLevel& top = cooked->levels[first_mip];
+
+		size_t total = 0;
+		for (int i = first_mip; i < st->getNumMips(); ++i)
+			total += cooked->levels[i].size;
+
+		//copy all the levels to a PBO so the driver can transfer them without stalling us
+		GLuint& pbo = pbos[next_pbo];
+		next_pbo = (next_pbo + 1) % TEXTURE_STREAMING_NUM_PBOS;
+		if (!pbo)
+			glGenBuffers(1, &pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, total, NULL, GL_STREAM_DRAW); //orphans the previous storage
+		uint8* ptr = (uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!ptr)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			std::cout << "[ERROR] cannot map PBO to stream " << st->name << std::endl;
+			return 0;
+		}
+		size_t offset = 0;
+		for (int i = first_mip; i < st->getNumMips(); ++i)
+		{
+			memcpy(ptr + offset, cooked->getLevelData(i), cooked->levels[i].size);
+			offset += cooked->levels[i].size;
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		GLuint texture_id = 0;
+		glGenTextures(1, &texture_id);
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4); //cooked rows are aligned to 4
+		offset = 0;
+		for (int i = first_mip; i < st->getNumMips(); ++i)
+		{
+			const sCookedLevel& level = cooked->levels[i];
+			if (cooked->compressed)
+				glCompressedTexImage2D(GL_TEXTURE_2D, i - first_mip, cooked->internal_format, level.width, level.height, 0, (GLsizei)level.size, (void*)offset);
+			else
+				glTexImage2D(GL_TEXTURE_2D, i - first_mip, cooked->internal_format, level.width, level.height, 0, cooked->format, GL_UNSIGNED_BYTE, (void*)offset);
+			offset += level.size;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, st->getNumMips() - 1 - first_mip);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		//swap it, materials keep pointing to the same Texture
+		Texture* texture = st->texture;
+		if (texture->texture_id)
+			glDeleteTextures(1, &texture->texture_id);
+		texture->texture_id = texture_id;
+		texture->texture_type = GL_TEXTURE_2D;
+		texture->width = (float)top.width;
+		texture->height = (float)top.height;
+		texture->format = cooked->format;
+		texture->internal_format = cooked->internal_format;
+		texture->type = GL_UNSIGNED_BYTE;
+		texture->mipmaps = true;
+
+		st->resident_mip = first_mip;
+		st->vram_size = getChainVRAM(st, first_mip);
+		return total;
+	}
+
+	std::shared_ptr<sStreamedTexture> createStreamedTexture(const char* name)
+	{
+		std::shared_ptr<sStreamedTexture> st = std::make_shared<sStreamedTexture>();
+		st->name = name;
+		st->texture = new Texture();
+
+		//solid gray until the worker has the mips
+		Uint8 placeholder[4] = { 128, 128, 128, 255 };
+		st->texture->create(1, 1, GL_RGBA, GL_UNSIGNED_BYTE, false, placeholder);
+		st->vram_size = 4;
+		if (st->name.size())
+			st->texture->setName(name);
+
+		streamed_textures[st->texture] = st;
+		return st;
+	}
+}
+
+int sStreamedTexture::getNumMips()
+{
+	return cooked ? (int)cooked->getNumLevels() : 0;
+}
+
+int sStreamedTexture::getTailMip()
+{
+	for (int i = 0; i < getNumMips(); ++i)
+		if (cooked->levels[i].width <= TEXTURE_STREAMING_TAIL_SIZE && cooked->levels[i].height <= TEXTURE_STREAMING_TAIL_SIZE)
+			return i;
+	return getNumMips() - 1;
+}
+
+Texture* TextureStreamer::Get(const char* filename, bool srgb)
+{
+	Texture* texture = Texture::Find(filename);
+	if (texture)
+		return texture;
+
+	//a missing file would keep the placeholder forever, like Texture::load it is NULL
+	std::string path = filename;
+	size_t size;
+	long long modified;
+	if (!getFileInfo(path, size, modified) && !(Texture::use_cooked_cache && getFileInfo(path + ".ktx", size, modified)))
+	{
+		stdlog(" [ERROR]: Texture not found " + path);
+		return NULL;
+	}
+
+	std::shared_ptr<sStreamedTexture> st = createStreamedTexture(filename);
+	if (Texture::use_cooked_cache)
+		st->cache_filename = path + ".ktx";
+	JobSystem::enqueue([st, path, srgb]() {
+		std::shared_ptr<sCookedTexture> cooked = std::make_shared<sCookedTexture>();
+		bool found = false;
+		if (Texture::use_cooked_cache)
+			found = getCookedTexture(path.c_str(), srgb, *cooked);
+		else
+		{
+			Image image;
+			found = image.load(path.c_str()) && cookImage(&image, srgb, *cooked);
+		}
+		if (!found)
+		{
+			stdlog(" [ERROR]: Texture not found " + path);
+			return; //keeps the placeholder
+		}
+		st->cooked = cooked;
+		st->ready = true;
+	});
+	return st->texture;
+}
+
+Texture* TextureStreamer::Create(const char* name, std::shared_ptr<sCookedTexture> cooked, const char* cache_filename)
+{
+	assert(cooked && cooked->getNumLevels());
+	std::shared_ptr<sStreamedTexture> st = createStreamedTexture(name);
+	if (cache_filename)
+		st->cache_filename = cache_filename;
+	st->cooked = cooked;
+	st->ready = true;
+	return st->texture;
+}
+
+bool TextureStreamer::isStreamed(Texture* texture)
+{
+	return streamed_textures.find(texture) != streamed_textures.end();
+}
+
+void TextureStreamer::remove(Texture* texture)
+{
+	auto it = streamed_textures.find(texture);
+	if (it != streamed_textures.end())
+		streamed_textures.erase(it); //if the worker is still generating mips it keeps its own reference
+}
+
+void TextureStreamer::requestScreenSize(Texture* texture, float pixels)
+{
+	if (!texture)
+		return;
+	auto it = streamed_textures.find(texture);
+	if (it == streamed_textures.end())
+		return;
+	sStreamedTexture* st = it->second.get();
+	if (st->last_request_frame != streamer_frame)
+	{
+		st->last_request_frame = streamer_frame;
+		st->wanted_pixels = 0;
+	}
+	st->wanted_pixels = std::max(st->wanted_pixels, pixels);
+}
+
+size_t TextureStreamer::getVRAMUsed()
+{
+	size_t total = 0;
+	for (auto it : streamed_textures)
+		total += it.second->vram_size;
+	return total;
+}
+
+void TextureStreamer::update()
+{
+	PROFILE_FUNCTION();
+	size_t upload_budget = (size_t)(upload_budget_mb * 1024 * 1024);
+	size_t vram_budget = (size_t)(vram_budget_mb * 1024 * 1024);
+	size_t uploaded = 0;
+	std::vector<sStreamedTexture*> textures;
+
+	for (auto it : streamed_textures)
+	{
+		sStreamedTexture* st = it.second.get();
+		if (!st->ready)
+			continue;
+		int tail = st->getTailMip();
+
+		//just decoded, the tail is small so it goes without budget
+		//(not compressed here, the driver would do it on this thread, streamed textures stay as cooked)
+		if (st->resident_mip < 0)
+		{
+			uploaded += uploadMips(st, tail);
+			st->wanted_mip = tail;
+		}
+
+		//mip sampled when the whole texture covers wanted_pixels on screen
+		if (st->last_request_frame == streamer_frame)
+		{
+			float size = (float)std::max(st->cooked->levels[0].width, st->cooked->levels[0].height);
+			int mip = (int)floor(log2(size / std::max(st->wanted_pixels, 1.0f)));
+			st->wanted_mip = std::min(std::max(mip, 0), tail);
+		}
+		else if (streamer_frame - st->last_request_frame > TEXTURE_STREAMING_UNUSED_FRAMES)
+			st->wanted_mip = tail;
+		textures.push_back(st);
+	}
+
+	//evict: first the ones not used for a while and the mips finer than needed
+	size_t vram_used = getVRAMUsed();
+	if (vram_used > vram_budget)
+	{
+		std::sort(textures.begin(), textures.end(), [](sStreamedTexture* a, sStreamedTexture* b) { return a->last_request_frame < b->last_request_frame; });
+		for (size_t i = 0; i < textures.size() && vram_used > vram_budget; ++i)
+		{
+			sStreamedTexture* st = textures[i];
+			if (st->resident_mip >= st->wanted_mip)
+				continue;
+			vram_used -= st->vram_size;
+			uploaded += uploadMips(st, st->wanted_mip);
+			vram_used += st->vram_size;
+		}
+
+		//still over budget, everybody loses one mip starting with the biggest
+		std::sort(textures.begin(), textures.end(), [](sStreamedTexture* a, sStreamedTexture* b) { return a->vram_size > b->vram_size; });
+		for (size_t i = 0; i < textures.size() && vram_used > vram_budget; ++i)
+		{
+			sStreamedTexture* st = textures[i];
+			if (st->resident_mip >= st->getTailMip())
+				continue;
+			vram_used -= st->vram_size;
+			uploaded += uploadMips(st, st->resident_mip + 1);
+			vram_used += st->vram_size;
+			st->wanted_mip = std::max(st->wanted_mip, st->resident_mip); //dont bring it back this frame
+		}
+	}
+
+	//upload: one mip per texture, the ones missing more mips first
+	std::sort(textures.begin(), textures.end(), [](sStreamedTexture* a, sStreamedTexture* b) { return (a->resident_mip - a->wanted_mip) > (b->resident_mip - b->wanted_mip); });
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		sStreamedTexture* st = textures[i];
+		if (st->resident_mip <= st->wanted_mip)
+			break; //sorted, the rest dont need anything
+		int mip = st->resident_mip - 1;
+		size_t vram = getChainVRAM(st, mip);
+		if (vram_used - st->vram_size + vram > vram_budget)
+			continue;
+		size_t bytes = 0;
+		for (int j = mip; j < st->getNumMips(); ++j)
+			bytes += st->cooked->levels[j].size;
+		if (uploaded && uploaded + bytes > upload_budget)
+			break; //next frame (the first upload always goes, so big mips are not blocked forever)
+		vram_used -= st->vram_size;
+		uploaded += uploadMips(st, mip);
+		vram_used += st->vram_size;
+	}
+
+	uploaded_last_frame = uploaded;
+	streamer_frame++;
+}
+
+void TextureStreamer::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode("Texture Streaming"))
+		return;
+	ImGui::Checkbox("Enabled (new textures)", &enabled);
+	ImGui::SliderFloat("Upload MB/frame", &upload_budget_mb, 0.25f, 64.0f);
+	ImGui::SliderFloat("VRAM budget MB", &vram_budget_mb, 16.0f, 4096.0f);
+	ImGui::Text("Textures: %d  VRAM: %.1f MB  Uploaded: %.2f MB", (int)streamed_textures.size(), getVRAMUsed() / (1024.0f * 1024.0f), uploaded_last_frame / (1024.0f * 1024.0f));
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,60 @@
+/*  Texture streaming: textures start with a placeholder and their mips arrive progressively.
+	The mip chain is read from the cooked .ktx (or generated) by a worker and kept in RAM, the main thread uploads the mips through PBOs
+	with a budget of MB per frame, and a VRAM budget evicts the mips that the renderer is not sampling.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstddef>
+
+class Texture;
+struct sCookedTexture;
+
+#define TEXTURE_STREAMING_TAIL_SIZE 32 //mips of this size or smaller are always in VRAM once decoded
+#define TEXTURE_STREAMING_NUM_PBOS 4 //ring of pixel buffers used for the uploads
+#define TEXTURE_STREAMING_UNUSED_FRAMES 60 //frames without requests before a texture can be evicted to the tail
+
+struct sStreamedTexture
+{
+	Texture* texture;
+	std::string name;
+	std::string cache_filename; //.ktx of the cooked version, empty if it doesnt come from a file
+	std::shared_ptr<sCookedTexture> cooked; //mip chain filled by the worker, level 0 is the full size
+	std::atomic<bool> ready; //the worker finished the mip chain
+	int resident_mip; //first mip in VRAM, -1 while there is only the placeholder
+	int wanted_mip; //finest mip requested by the renderer (computed from wanted_pixels)
+	float wanted_pixels; //biggest size on screen requested this frame
+	long last_request_frame;
+	size_t vram_size; //bytes in VRAM
+
+	sStreamedTexture() { texture = NULL; ready = false; resident_mip = -1; wanted_mip = 0; wanted_pixels = 0; last_request_frame = -1; vram_size = 0; }
+	int getNumMips();
+	int getTailMip(); //first mip that is always resident
+};
+
+class TextureStreamer
+{
+public:
+	static bool enabled;
+	static float upload_budget_mb; //max MB uploaded per frame
+	static float vram_budget_mb; //max MB of VRAM used by the streamed textures
+
+	//return a texture with a placeholder, the content arrives in the next frames
+	static Texture* Get(const char* filename, bool srgb = false); //reads the cooked file (or decodes and cooks it) in a worker
+	static Texture* Create(const char* name, std::shared_ptr<sCookedTexture> cooked, const char* cache_filename = NULL); //already cooked
+
+	static bool isStreamed(Texture* texture);
+	static void remove(Texture* texture); //called when the texture is destroyed
+
+	//the renderer tells how many pixels on screen the texture covers, it decides the mip to stream
+	static void requestScreenSize(Texture* texture, float pixels);
+
+	//main thread, once per frame: evicts mips when over budget and uploads the requested ones
+	static void update();
+
+	static size_t getVRAMUsed();
+	static void renderInMenu();
+};
@@ -4,10 +4,20 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <dirent.h>
 #endif
+#include <sys/stat.h>
 
 #include "includes.h"
 
+#ifdef USE_EGL
+	#include <EGL/egl.h>
+#endif
+
 #include "application.h"
 #include "camera.h"
 #include "shader.h"
@@ -15,6 +25,8 @@
 
 #include "extra/stb_easy_font.h"
 
+#include <mutex>
+
 long getTime()
 {
 	#ifdef WIN32
@@ -50,7 +62,25 @@ float * snapshot()
 //this function is used to access OpenGL Extensions (special features not supported by all cards)
 void* getGLProcAddress(const char* name)
 {
-	return SDL_GL_GetProcAddress(name);
+	void* proc = SDL_GL_GetProcAddress(name);
+#ifdef USE_EGL
+	if (!proc)
+		proc = (void*)eglGetProcAddress(name); //headless context created without SDL (scene benchmark)
+#endif
+	return proc;
+}
+
+bool checkGLExtension(const char* name)
+{
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (GLint i = 0; i < num_extensions; ++i)
+	{
+		const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, name) == 0)
+			return true;
+	}
+	return false;
 }
 
 //Retrieve the current path of the application
@@ -137,6 +167,152 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+bool getFileInfo(const std::string& filename, size_t& size, long long& modified)
+{
+	struct stat stbuffer;
+	if (stat(filename.c_str(), &stbuffer) != 0)
+		return false;
+	size = (size_t)stbuffer.st_size;
+	modified = (long long)stbuffer.st_mtime;
+	return true;
+}
+
+bool isCacheOutdated(const std::string& cache_filename, const std::string& source_filename)
+{
+	size_t cache_size, source_size;
+	long long cache_time, source_time;
+	if (!getFileInfo(source_filename, source_size, source_time)) //nothing to compare with, like when it comes from memory
+		return false;
+	return !getFileInfo(cache_filename, cache_size, cache_time) || cache_time < source_time;
+}
+
+uint64_t hashFNV64(const void* data, size_t size, uint64_t seed)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		seed = (seed ^ bytes[i]) * 1099511628211ull;
+	return seed;
+}
+
+void listFiles(const std::string& folder, std::vector<std::string>& files, bool recursive)
+{
+#ifdef WIN32
+	WIN32_FIND_DATAA find_data;
+	HANDLE handle = FindFirstFileA((folder + "/*").c_str(), &find_data);
+	if (handle == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		std::string name = find_data.cFileName;
+		if (name == "." || name == "..")
+			continue;
+		std::string path = folder + "/" + name;
+		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (recursive)
+				listFiles(path, files, recursive);
+		}
+		else
+			files.push_back(path);
+	} while (FindNextFileA(handle, &find_data));
+	FindClose(handle);
+#else
+	DIR* dir = opendir(folder.c_str());
+	if (!dir)
+		return;
+	while (struct dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name == "." || name == "..")
+			continue;
+		std::string path = folder + "/" + name;
+		struct stat stbuffer;
+		if (stat(path.c_str(), &stbuffer) != 0)
+			continue;
+		if (S_ISDIR(stbuffer.st_mode))
+		{
+			if (recursive)
+				listFiles(path, files, recursive);
+		}
+		else
+			files.push_back(path);
+	}
+	closedir(dir);
+#endif
+}
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	mapping_handle = NULL;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); //the mapping keeps the file open
+	if (!mapping)
+		return false;
+	data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+	mapping_handle = mapping;
+	size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0 || stbuffer.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void* ptr = mmap(NULL, stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); //the mapping keeps the file open
+	if (ptr == MAP_FAILED)
+		return false;
+	data = (const unsigned char*)ptr;
+	size = (size_t)stbuffer.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data);
+	CloseHandle((HANDLE)mapping_handle);
+	mapping_handle = NULL;
+#else
+	munmap((void*)data, size);
+#endif
+	data = NULL;
+	size = 0;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -158,8 +334,11 @@ bool checkGLErrors()
 	return true;
 }
 
+std::mutex stdlog_mutex; //workers also log
+
 void stdlog(std::string str)
 {
+	std::lock_guard<std::mutex> lock(stdlog_mutex);
 	std::cout << str << std::endl;
 }
 
@@ -310,6 +489,8 @@ std::string getGPUStats()
 	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
 	Mesh::num_meshes_rendered = 0;
 	Mesh::num_triangles_rendered = 0;
+	Shader::num_program_changes = 0;
+	Shader::num_texture_binds = 0;
 	return str;
 }
 
@@ -18,6 +18,26 @@ long getTime();
 float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
+void listFiles(const std::string& folder, std::vector<std::string>& files, bool recursive = true); //paths include the folder
+bool getFileInfo(const std::string& filename, size_t& size, long long& modified); //modified in seconds, false if it doesn't exist
+bool isCacheOutdated(const std::string& cache_filename, const std::string& source_filename); //true if the source is newer
+uint64_t hashFNV64(const void* data, size_t size, uint64_t seed = 14695981039346656037ull); //FNV-1a, chain the calls with the seed
+
+//maps a file in memory (read only), the OS loads the pages when accessed so there is no copy
+class MappedFile
+{
+public:
+	const unsigned char* data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+	bool open(const char* filename);
+	void close();
+
+private:
+	void* mapping_handle; //only used in windows
+};
 
 //generic purposes fuctions
 void drawGrid();
@@ -26,6 +46,10 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);
 //check opengl errors
 bool checkGLErrors();
 
+//opengl extensions
+void* getGLProcAddress(const char* name);
+bool checkGLExtension(const char* name);
+
 //returns the current path
 std::string getPath();
 